@@ -31,6 +31,7 @@ public:
     _vcpu->saved_state = L4_VCPU_F_FPU_ENABLED | L4_VCPU_F_USER_MODE;
 
     _vcpu.reset();
+    apply_restored_state();
   }
 
   void show_state_registers(FILE *f)
@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <l4/re/error_helper>
+
+#include "cpuid.h"
+#include "debug.h"
+
+namespace {
+
+Dbg warn(Dbg::Cpu, Dbg::Warn, "cpuid");
+Dbg info(Dbg::Cpu, Dbg::Info, "cpuid");
+
+void
+host_cpuid(l4_uint32_t leaf, l4_uint32_t subleaf, Vmm::Cpuid_table::Regs *r)
+{
+  asm("cpuid"
+      : "=a"(r->a), "=b"(r->b), "=c"(r->c), "=d"(r->d)
+      : "0"(leaf), "2"(subleaf));
+}
+
+/// Leaves whose result depends on the subleaf in ECX.
+bool
+is_indexed(l4_uint32_t leaf)
+{
+  switch (leaf)
+    {
+    case 0x4: case 0x7: case 0xb: case 0xd: case 0xf: case 0x10:
+    case 0x12: case 0x14: case 0x17: case 0x18: case 0x1f:
+      return true;
+    default:
+      return false;
+    }
+}
+
+/// Number of bits needed to enumerate `n` IDs.
+unsigned
+id_bits(unsigned n)
+{
+  unsigned bits = 0;
+  while ((1U << bits) < n)
+    ++bits;
+  return bits;
+}
+
+}
+
+namespace Vmm {
+
+void
+Cpuid_table::configure(Vdev::Dt_node const &node)
+{
+  int size;
+
+  auto const *model = node.get_prop<fdt32_t>("l4vmm,cpuid-model", &size);
+  if (model)
+    {
+      if (size != 3)
+        L4Re::chksys(-L4_EINVAL,
+                     "l4vmm,cpuid-model has the form <family model stepping>.");
+
+      _family = fdt32_to_cpu(model[0]);
+      _model = fdt32_to_cpu(model[1]);
+      _stepping = fdt32_to_cpu(model[2]);
+      if (_family > 0xff + 0xf || _model > 0xff || _stepping > 0xf
+          || (_model > 0xf && _family != 0x6 && _family < 0xf))
+        L4Re::chksys(-L4_EINVAL, "Invalid CPU model in l4vmm,cpuid-model.");
+
+      _set_model = true;
+    }
+
+  auto const *brand = node.get_prop<char>("l4vmm,cpuid-brand", &size);
+  if (brand)
+    {
+      if (size < 1 || size > (int)sizeof(_brand))
+        L4Re::chksys(-L4_EINVAL, "l4vmm,cpuid-brand has at most 47 characters.");
+      memcpy(_brand, brand, size);
+    }
+
+  auto const *masks = node.get_prop<fdt32_t>("l4vmm,cpuid-mask", &size);
+  if (masks)
+    {
+      if (size % 4)
+        L4Re::chksys(-L4_EINVAL,
+                     "l4vmm,cpuid-mask has the form <leaf subleaf reg bits>*.");
+
+      for (int i = 0; i < size; i += 4)
+        {
+          Mask m{fdt32_to_cpu(masks[i]), fdt32_to_cpu(masks[i + 1]),
+                 fdt32_to_cpu(masks[i + 2]), fdt32_to_cpu(masks[i + 3])};
+          if (m.reg > 3)
+            L4Re::chksys(-L4_EINVAL,
+                         "Register in l4vmm,cpuid-mask is 0 (EAX) to 3 (EDX).");
+          _masks.push_back(m);
+        }
+    }
+
+  auto const *threads = node.get_prop<fdt32_t>("l4vmm,threads-per-core", &size);
+  if (threads)
+    {
+      _threads_per_core = node.get_prop_val(threads, size, false);
+      if (!_threads_per_core
+          || (_threads_per_core & (_threads_per_core - 1)))
+        L4Re::chksys(-L4_EINVAL, "l4vmm,threads-per-core is a power of two.");
+    }
+}
+
+void
+Cpuid_table::build(unsigned num_cpus)
+{
+  Regs r;
+
+  host_cpuid(Basic_base, 0, &r);
+  fill_range(&_basic, Basic_base, r.a);
+
+  host_cpuid(Extended_base, 0, &r);
+  fill_range(&_extended, Extended_base, r.a);
+
+  enum Cpuid_kvm_constants
+  {
+    Kvm_feature_clocksource = 1UL, // clock at msr 0x11 & 0x12
+    Kvm_feature_clocksource2 = 1UL << 3, // clock at msrs 0x4b564d00 & 01;
+    Kvm_feature_steal_time = 1UL << 5, // steal time at msr 0x4b564d03
+    Kvm_feature_pv_eoi = 1UL << 6, // EOI flag at msr 0x4b564d04
+    // PVCLOCK_TSC_STABLE_BIT may be set in the kvmclock areas
+    Kvm_feature_clocksource_stable_bit = 1UL << 24,
+
+    Edx_invariant_tsc_bit = 1UL << 8, // 0x8000'0007
+  };
+
+  l4_uint32_t kvm_features = Kvm_feature_clocksource2
+                             | Kvm_feature_steal_time | Kvm_feature_pv_eoi;
+  if (Regs const *r = regs(0x80000007, 0))
+    if (r->d & Edx_invariant_tsc_bit)
+      kvm_features |= Kvm_feature_clocksource_stable_bit;
+
+  _hypervisor.resize(2);
+  // max CPUID leaf in the 0x4000'0000 range and "KVMKVMKVM\0\0\0"
+  _hypervisor[0].sub.push_back(
+    Regs{Hypervisor_base + 1, 0x4b4d564b, 0x564b4d56, 0x4d});
+  _hypervisor[1].sub.push_back(Regs{kvm_features, 0, 0, 0});
+
+  filter();
+  set_topology(num_cpus);
+  apply_config();
+
+  info.printf("CPUID table: basic leaves up to 0x%zx, extended up to 0x%zx\n",
+              _basic.size() - 1, Extended_base + _extended.size() - 1);
+}
+
+Cpuid_table::Regs *
+Cpuid_table::regs(l4_uint32_t leaf, l4_uint32_t subleaf)
+{
+  std::vector<Leaf> *range;
+  l4_uint32_t idx;
+
+  if (leaf >= Extended_base)
+    {
+      range = &_extended;
+      idx = leaf - Extended_base;
+    }
+  else if (leaf >= Hypervisor_base)
+    {
+      range = &_hypervisor;
+      idx = leaf - Hypervisor_base;
+    }
+  else
+    {
+      range = &_basic;
+      idx = leaf;
+    }
+
+  if (idx >= range->size() || subleaf >= (*range)[idx].sub.size())
+    return nullptr;
+
+  return &(*range)[idx].sub[subleaf];
+}
+
+void
+Cpuid_table::fill_range(std::vector<Leaf> *range, l4_uint32_t base,
+                        l4_uint32_t max)
+{
+  // The maximum leaf is not valid on hosts without the range.
+  if (max < base || max - base >= 0x100)
+    max = base;
+
+  range->resize(max - base + 1);
+  for (l4_uint32_t i = 0; i <= max - base; ++i)
+    {
+      Leaf &l = (*range)[i];
+      l.indexed = base == Basic_base && is_indexed(i);
+
+      unsigned n = l.indexed ? unsigned{Max_subleaf} : 1U;
+      l.sub.resize(n);
+      for (unsigned s = 0; s < n; ++s)
+        host_cpuid(base + i, s, &l.sub[s]);
+
+      // Subleaves beyond the last valid one return zeros anyway.
+      while (l.sub.size() > 1)
+        {
+          Regs const &last = l.sub.back();
+          if (last.a || last.b || last.c || last.d)
+            break;
+          l.sub.pop_back();
+        }
+    }
+}
+
+void
+Cpuid_table::filter()
+{
+  enum : unsigned long
+  {
+    // 0x1
+    Ecx_monitor_bit = (1UL << 3),
+    Ecx_vmx_bit = (1UL << 5),
+    Ecx_smx_bit = (1UL << 6),
+    Ecx_speed_step_tech_bit = (1UL << 7),
+    Ecx_pcid_bit = (1UL << 17),
+    Ecx_x2apic_bit = (1UL << 21),
+    Ecx_xsave_bit = (1UL << 26),
+    // used to indicate the hypervisor presence to linux -- no hardware bit.
+    Ecx_hypervisor_bit = (1UL << 31),
+
+    Edx_mtrr_bit = (1UL << 12),
+    Edx_mca = (1UL << 14),
+    Edx_pat = (1UL << 16),
+    Edx_acpi_bit = (1UL << 22),
+
+    // 0x6 EAX
+    Power_limit_notification = (1UL << 4),
+    Hwp_feature_mask = (0x1f << 7),
+    // 0x6 ECX
+    Performance_energy_bias_preference = (1UL << 3),
+
+    // 0x7
+    Tsc_adjust = (1UL << 1),
+    Invpcid_bit = (1UL << 10),
+
+    // 0xd
+    Xsave_opt = 1,
+    Xsave_c = (1UL << 1),
+    Xget_bv = (1UL << 2),
+    Xsave_s = (1UL << 3),
+
+    // 0x8000'0001
+    Rdtscp_bit = (1UL << 27),
+  };
+
+  if (Regs *r = regs(0x1, 0))
+    {
+      // hide some CPU features
+      r->c &= ~(  Ecx_monitor_bit
+                | Ecx_vmx_bit
+                | Ecx_smx_bit
+                | Ecx_speed_step_tech_bit
+                | Ecx_pcid_bit
+               );
+      r->c |= Ecx_hypervisor_bit;
+
+      r->d &= ~(Edx_mtrr_bit | Edx_mca | Edx_pat | Edx_acpi_bit);
+    }
+
+  if (Regs *r = regs(0x6, 0))
+    {
+      r->a &= ~(Power_limit_notification | Hwp_feature_mask);
+      // filter IA32_ENERGEY_PERF_BIAS
+      r->c &= ~(Performance_energy_bias_preference);
+    }
+
+  // filter, as it leads to unhandled VMM-entries.
+  if (Regs *r = regs(0x7, 0))
+    r->b &= ~(Invpcid_bit | Tsc_adjust);
+
+  if (Regs *r = regs(0xa, 0))
+    r->a &= ~0xffU;  // disable perfmon
+
+  if (Regs *r = regs(0xd, 0))
+    {
+      // Check the host-enabled XCR0 bits and report these to the guest,
+      // instead of the physical hardware features.
+      // XXX If we report other than the host-enabled XCR0 bits, we need
+      // to adapt the size returned in ECX!
+      l4_uint32_t ax = 0, dx = 0;
+      asm volatile ("xgetbv" : "=a"(ax), "=d"(dx) : "c"(0));
+      info.printf("Get XCR0 host state: 0x%x:0x%x\n", dx, ax);
+
+      r->a = ax;
+    }
+
+  if (Regs *r = regs(0xd, 1))
+    {
+      r->a &= ~(  Xsave_opt
+                | Xsave_c
+                | Xget_bv // with ECX=1
+                | Xsave_s   // XSAVES/XRSTORS and IA32_XSS MSR
+               );
+      r->b = 0; // Size of the state of the enabled feature bits.
+    }
+
+  if (Regs *r = regs(0x80000001, 0))
+    r->d &= ~( Rdtscp_bit );
+}
+
+void
+Cpuid_table::set_topology(unsigned num_cpus)
+{
+  enum : l4_uint32_t
+  {
+    Edx_htt_bit = (1UL << 28),
+    Level_type_smt = 1,
+    Level_type_core = 2,
+  };
+
+  unsigned threads = _threads_per_core;
+  if (num_cpus % threads)
+    {
+      warn.printf("%u vCPUs cannot be split into cores of %u threads. "
+                  "Using one thread per core.\n", num_cpus, threads);
+      threads = 1;
+    }
+
+  // All vCPUs are part of one package, the APIC ID is the vCPU number.
+  unsigned smt_bits = id_bits(threads);
+  unsigned core_bits = id_bits(num_cpus / threads);
+  unsigned pkg_bits = smt_bits + core_bits;
+
+  if (Regs *r = regs(0x1, 0))
+    {
+      r->b = (r->b & ~0x00ff0000U) | (((1U << pkg_bits) & 0xff) << 16);
+      if (num_cpus > 1)
+        r->d |= Edx_htt_bit;
+      else
+        r->d &= ~Edx_htt_bit;
+    }
+
+  // Deterministic cache parameters: caches up to L2 are private to a
+  // core, the last level cache is shared by the whole package.
+  if (_basic.size() > 0x4)
+    {
+      unsigned llc = 0;
+      for (auto const &s : _basic[0x4].sub)
+        if (s.a & 0x1f)
+          llc = std::max(llc, (s.a >> 5) & 7);
+
+      for (auto &s : _basic[0x4].sub)
+        {
+          if (!(s.a & 0x1f))
+            continue;
+
+          unsigned level = (s.a >> 5) & 7;
+          unsigned sharing = level == llc && level > 2 ? pkg_bits : smt_bits;
+          s.a = (s.a & 0x3fff) | (((1U << sharing) - 1) << 14)
+                | (((1U << core_bits) - 1) << 26);
+        }
+    }
+
+  // Extended topology enumeration; the level number in ECX[7:0] and the
+  // x2APIC ID in EDX are added at lookup.
+  for (l4_uint32_t leaf : { 0xbU, 0x1fU })
+    {
+      if (_basic.size() <= leaf)
+        continue;
+
+      auto &sub = _basic[leaf].sub;
+      sub.clear();
+      sub.push_back(Regs{smt_bits, threads, Level_type_smt << 8, 0});
+      sub.push_back(Regs{pkg_bits, num_cpus, Level_type_core << 8, 0});
+    }
+}
+
+void
+Cpuid_table::apply_config()
+{
+  if (_set_model)
+    {
+      if (Regs *r = regs(0x1, 0))
+        {
+          l4_uint32_t sig = _stepping | (_model & 0xf) << 4;
+          if (_family >= 0xf)
+            sig |= 0xf << 8 | (_family - 0xf) << 20;
+          else
+            sig |= _family << 8;
+          sig |= (_model >> 4) << 16;
+
+          r->a = (r->a & ~0x0fff0fffU) | sig;
+        }
+    }
+
+  if (_brand[0])
+    {
+      if (_extended.size() > 4)
+        {
+          l4_uint32_t words[12];
+          memcpy(words, _brand, sizeof(words));
+          for (unsigned i = 0; i < 3; ++i)
+            _extended[2 + i].sub[0] = Regs{words[4 * i], words[4 * i + 1],
+                                           words[4 * i + 2], words[4 * i + 3]};
+        }
+      else
+        warn.printf("Host does not support a brand string. Ignored.\n");
+    }
+
+  for (auto const &m : _masks)
+    {
+      Regs *r = regs(m.leaf, m.subleaf);
+      if (!r)
+        {
+          warn.printf("CPUID leaf 0x%x/0x%x to mask does not exist. Ignored.\n",
+                      m.leaf, m.subleaf);
+          continue;
+        }
+
+      l4_uint32_t *reg[] = { &r->a, &r->b, &r->c, &r->d };
+      *reg[m.reg] &= ~m.bits;
+    }
+}
+
+} // namespace
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+#include <vector>
+
+#include "device.h"
+
+namespace Vmm {
+
+/**
+ * CPUID view of the guest.
+ *
+ * The table is computed once from the host CPUID before the vCPUs start.
+ * Host features the VMM cannot virtualize are filtered, the topology
+ * leaves describe the vCPUs of the VM and the device tree may override the
+ * CPU model and mask further features. A guest CPUID exit is answered by a
+ * lookup in the table.
+ */
+class Cpuid_table
+{
+public:
+  struct Regs
+  {
+    l4_uint32_t a, b, c, d;
+  };
+
+  /**
+   * Read the CPUID configuration from the `/cpus` node of the device tree.
+   */
+  void configure(Vdev::Dt_node const &node);
+
+  /**
+   * Compute the table.
+   *
+   * \param num_cpus  Number of vCPUs of the VM.
+   */
+  void build(unsigned num_cpus);
+
+  /**
+   * Look up the CPUID result for a leaf and subleaf as seen by a vCPU.
+   */
+  void lookup(l4_uint32_t leaf, l4_uint32_t subleaf, unsigned vcpu_id,
+              Regs *r) const
+  {
+    Leaf const *l = find(leaf);
+    if (!l)
+      {
+        *r = Regs{0, 0, 0, 0};
+        return;
+      }
+
+    if (!l->indexed)
+      subleaf = 0;
+
+    if (subleaf < l->sub.size())
+      *r = l->sub[subleaf];
+    else
+      *r = Regs{0, 0, 0, 0};
+
+    // Per-vCPU fields. The APIC ID of a vCPU is its vCPU number.
+    switch (leaf)
+      {
+      case 0x1:
+        r->b = (r->b & 0x00ffffffU) | (vcpu_id << 24);
+        break;
+      case 0xb:
+      case 0x1f:
+        r->c |= subleaf & 0xffU;
+        r->d = vcpu_id;
+        break;
+      }
+  }
+
+private:
+  enum : l4_uint32_t
+  {
+    Basic_base = 0,
+    Hypervisor_base = 0x40000000,
+    Extended_base = 0x80000000,
+    Max_subleaf = 64,
+  };
+
+  struct Leaf
+  {
+    bool indexed = false;
+    std::vector<Regs> sub;
+  };
+
+  struct Mask
+  {
+    l4_uint32_t leaf;
+    l4_uint32_t subleaf;
+    unsigned reg;
+    l4_uint32_t bits;
+  };
+
+  Leaf const *find(l4_uint32_t leaf) const
+  {
+    std::vector<Leaf> const *range;
+    l4_uint32_t idx;
+
+    if (leaf >= Extended_base)
+      {
+        range = &_extended;
+        idx = leaf - Extended_base;
+      }
+    else if (leaf >= Hypervisor_base)
+      {
+        // Leaves of the hypervisor range that are not defined return zeros.
+        idx = leaf - Hypervisor_base;
+        return idx < _hypervisor.size() ? &_hypervisor[idx] : nullptr;
+      }
+    else
+      {
+        range = &_basic;
+        idx = leaf;
+      }
+
+    if (idx < range->size())
+      return &(*range)[idx];
+
+    // Leaves beyond the maximum report the highest basic leaf (like Intel).
+    return _basic.empty() ? nullptr : &_basic.back();
+  }
+
+  Regs *regs(l4_uint32_t leaf, l4_uint32_t subleaf);
+
+  void fill_range(std::vector<Leaf> *range, l4_uint32_t base,
+                  l4_uint32_t max);
+  void filter();
+  void set_topology(unsigned num_cpus);
+  void apply_config();
+
+  std::vector<Leaf> _basic;
+  std::vector<Leaf> _hypervisor;
+  std::vector<Leaf> _extended;
+
+  // Configuration from the device tree
+  bool _set_model = false;
+  unsigned _family = 0;
+  unsigned _model = 0;
+  unsigned _stepping = 0;
+  char _brand[48] = { 0 };
+  unsigned _threads_per_core = 1;
+  std::vector<Mask> _masks;
+};
+
+} // namespace
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/types.h>
+
+#include "device.h"
+#include "vcpu_ptr.h"
+#include "vm_state_vmx.h"
+
+namespace Vmm {
+
+/**
+ * VMCS fields of a VM exit, read once before the exit is dispatched.
+ */
+struct Vmx_exit
+{
+  Vmx_state::Exit reason;
+  /// Exit qualification, zero unless the handler of the exit requested it.
+  l4_uint64_t qual;
+};
+
+/**
+ * Interface for devices handling VM exits.
+ *
+ * A device is registered for the exit reasons it handles and only receives
+ * these exits.
+ */
+struct Exit_handler : virtual Vdev::Dev_ref
+{
+  virtual ~Exit_handler() = 0;
+
+  /**
+   * Handle a VM exit.
+   *
+   * \param vcpu  vCPU that exited.
+   * \param vms   VMX state of the vCPU.
+   * \param exit  Exit reason and, if requested, exit qualification.
+   *
+   * \retval Jump_instr  The exit was handled, skip the exiting instruction.
+   * \retval L4_EOK      The exit was handled, resume at the current IP.
+   * \retval <0          The exit cannot be handled, the VM is stopped.
+   */
+  virtual int handle_exit(Vcpu_ptr vcpu, Vmx_state *vms,
+                          Vmx_exit const &exit) = 0;
+};
+
+inline Exit_handler::~Exit_handler() = default;
+
+} // namespace
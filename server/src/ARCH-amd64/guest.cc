@@ -7,9 +7,12 @@
  * License, version 2.  Please see the COPYING-GPL-2 file for details.
  */
 
+#include <cstring>
+
 #include <l4/cxx/static_container>
 #include <l4/sys/kdebug.h>
 #include <l4/sys/debugger.h>
+#include <l4/util/rdtsc.h>
 
 #include "binary_loader.h"
 #include "guest.h"
@@ -47,10 +50,46 @@ void Guest::register_io_device(Io_region const &region,
                  region.start, region.end);
 }
 
-void Guest::register_msr_device(cxx::Ref_ptr<Msr_device> const &dev)
+void
+Guest::setup_device_tree(Vdev::Device_tree dt)
 {
-  _msr_devices.push_back(dev);
-  trace().printf("New MSR device %p\n", dev.get());
+  // The CPU model of the guest is configured in the optional /cpus node.
+  for (auto node = dt.first_node().first_child_node(); node.is_valid();
+       node = node.sibling_node())
+    if (!strcmp(node.get_name(), "cpus"))
+      _cpuid.configure(node);
+}
+
+void Guest::register_msr_device(cxx::Ref_ptr<Msr_device> const &dev,
+                                unsigned first, unsigned last)
+{
+  if (last < first || last - first >= Max_msr_range)
+    L4Re::chksys(-L4_EINVAL, "Invalid MSR range.");
+
+  for (unsigned msr = first; msr <= last; ++msr)
+    if (msr_device(msr))
+      {
+        info().printf("MSR overlap: 0x%x in [0x%x, 0x%x]\n", msr, first, last);
+        L4Re::chksys(-L4_EINVAL, "MSR range overlapping.");
+      }
+
+  // Devices with several ranges are only kept once.
+  bool known = false;
+  for (auto const &d : _msr_devices)
+    if (d.get() == dev.get())
+      known = true;
+  if (!known)
+    _msr_devices.push_back(dev);
+
+  for (unsigned msr = first; msr <= last; ++msr)
+    {
+      if (msr - X2apic_msr_first <= X2apic_msr_last - X2apic_msr_first)
+        _x2apic_msrs[msr - X2apic_msr_first] = dev.get();
+      else
+        _msrs[msr] = dev.get();
+    }
+
+  trace().printf("New MSR device %p @ [0x%x, 0x%x]\n", dev.get(), first, last);
 }
 
 l4_addr_t
@@ -103,6 +142,11 @@ void Guest::prepare_linux_run(Vcpu_ptr vcpu, l4_addr_t entry, Vm_ram *ram,
                               char const * /* kernel */, char const *cmd_line,
                               l4_addr_t dt_boot_addr)
 {
+  _ptw.set_ram(ram);
+  _steal_time->set_ram(ram);
+  _hypcall_ring.set_ram(ram);
+  _apics->set_ram(ram);
+
   // use second memory page as zeropage location
   Zeropage zpage(Vmm::Guest_addr(L4_PAGESIZE), entry);
 
@@ -174,161 +218,19 @@ Guest::handle_io_access(unsigned port, bool is_in, Mem_access::Width op_width,
 }
 
 int
-Guest::handle_cpuid(l4_vcpu_regs_t *regs)
+Guest::handle_cpuid(l4_vcpu_regs_t *regs, unsigned vcpu_no)
 {
-  unsigned int a,b,c,d;
-  auto rax = regs->ax;
-  auto rcx = regs->cx;
-
-  if (rax >= 0x40000000 && rax < 0x40010000)
-    {
-      switch (rax)
-        {
-        case 0x40000000:
-          a = 0x40000001;   // max CPUID leaf in the 0x4000'0000 range.
-          b = 0x4b4d564b;   // "KVMK"
-          c = 0x564b4d56;   // "VMKV"
-          d = 0x4d;         // "M\0\0\0"
-          break;
-
-        case 0x40000001:
-          enum Cpuid_kvm_constants
-          {
-            Kvm_feature_clocksource = 1UL, // clock at msr 0x11 & 0x12
-            Kvm_feature_clocksource2 = 1UL << 3, // clock at msrs 0x4b564d00 & 01;
-          };
-          a = Kvm_feature_clocksource2;
-          d = 0;
-          b = c = 0;
-          break;
-
-        default:
-          a = b = c = d = 0;
-        }
-    }
-  else
-    asm("cpuid"
-      : "=a"(a), "=b"(b), "=c"(c), "=d"(d)
-      : "0"(rax), "2"(rcx));
+  Cpuid_table::Regs r;
+  _cpuid.lookup(regs->ax, regs->cx, vcpu_no, &r);
 
   if (0)
-    trace().printf("CPUID as read 0x%lx/0x%lx: a: 0x%x, b: 0x%x, c: 0x%x, d: 0x%x\n",
-                   rax, rcx, a, b, c, d);
+    trace().printf("CPUID 0x%lx/0x%lx: a: 0x%x, b: 0x%x, c: 0x%x, d: 0x%x\n",
+                   regs->ax, regs->cx, r.a, r.b, r.c, r.d);
 
-  enum : unsigned long
-  {
-    // 0x1
-    Ecx_monitor_bit = (1UL << 3),
-    Ecx_vmx_bit = (1UL << 5),
-    Ecx_smx_bit = (1UL << 6),
-    Ecx_speed_step_tech_bit = (1UL << 7),
-    Ecx_pcid_bit = (1UL << 17),
-    Ecx_x2apic_bit = (1UL << 21),
-    Ecx_xsave_bit = (1UL << 26),
-    // used to indicate the hypervisor presence to linux -- no hardware bit.
-    Ecx_hypervisor_bit = (1UL << 31),
-
-    Edx_mtrr_bit = (1UL << 12),
-    Edx_mca = (1UL << 14),
-    Edx_pat = (1UL << 16),
-    Edx_acpi_bit = (1UL << 22),
-
-    // 0x6 EAX
-    Power_limit_notification = (1UL << 4),
-    Hwp_feature_mask = (0x1f << 7),
-    // 0x6 ECX
-    Performance_energy_bias_preference = (1UL << 3),
-
-    // 0x7
-    Tsc_adjust = (1UL << 1),
-    Invpcid_bit = (1UL << 10),
-
-    // 0xd
-    Xsave_opt = 1,
-    Xsave_c = (1UL << 1),
-    Xget_bv = (1UL << 2),
-    Xsave_s = (1UL << 3),
-
-    // 0x8000'0001
-    Rdtscp_bit = (1UL << 27),
-  };
-
-  switch (rax)
-    {
-    case 0x1:
-      // hide some CPU features
-      c &= ~(  Ecx_monitor_bit
-             | Ecx_vmx_bit
-             | Ecx_smx_bit
-             | Ecx_speed_step_tech_bit
-             | Ecx_pcid_bit
-            );
-      c |= Ecx_hypervisor_bit;
-
-      d &= ~(Edx_mtrr_bit | Edx_mca | Edx_pat | Edx_acpi_bit);
-      break;
-
-    case 0x6:
-      a &= ~(Power_limit_notification | Hwp_feature_mask);
-      // filter IA32_ENERGEY_PERF_BIAS
-      c &= ~(Performance_energy_bias_preference);
-      break;
-
-    case 0x7:
-      if (!rcx)
-        b &= ~(Invpcid_bit | Tsc_adjust); // filter, as it leads to unhandled VMM-entries.
-      break;
-
-    case 0xa:
-      a &= ~0xffULL;  // disable perfmon
-      break;
-
-    case 0xd:
-      switch(rcx)
-        {
-        case 0:
-          {
-            // Check the host-enabled XCR0 bits and report these to the guest,
-            // instead of the physical hardware features.
-            // XXX If we report other than the host-enabled XCR0 bits, we need
-            // to adapt the size returned in ECX!
-            l4_uint32_t ax = 0, dx = 0;
-            asm volatile ("xgetbv" : "=a"(ax), "=d"(dx) : "c"(0));
-            trace().printf("Get XCR0 host state: 0x%x:0x%x\n", dx, ax);
-
-            a = ax;
-            break;
-          }
-
-        case 1:
-          trace().printf("Filtering out xsave capabilities\n");
-          a &= ~(  Xsave_opt
-                   | Xsave_c
-                   | Xget_bv // with ECX=1
-                   | Xsave_s   // XSAVES/XRSTORS and IA32_XSS MSR
-                );
-          b = 0; // Size of the state of the enabled feature bits.
-          break;
-
-        default: break;
-        }
-      break;
-
-    case 0x80000001:
-      {
-        d &= ~( Rdtscp_bit );
-        break;
-      }
-    }
-
-  if (0)
-    trace().printf("CPUID as modified: a: 0x%x, b: 0x%x, c: 0x%x, d: 0x%x\n",
-                   a, b, c, d);
-
-  regs->ax = a;
-  regs->bx = b;
-  regs->cx = c;
-  regs->dx = d;
+  regs->ax = r.a;
+  regs->bx = r.b;
+  regs->cx = r.c;
+  regs->dx = r.d;
 
   return Jump_instr;
 }
@@ -336,9 +238,27 @@ Guest::handle_cpuid(l4_vcpu_regs_t *regs)
 int
 Guest::handle_vm_call(l4_vcpu_regs_t *regs)
 {
-  if (regs->ax == 0)
+  // The console ring calls use the function numbers of Arm (see
+  // handle_uvmm_call()), which do not collide with KVM hypercalls.
+  enum : l4_umword_t
+  {
+    Print_char = 0,
+    Console_ring_setup = 0x86000001,
+    Console_ring_doorbell = 0x86000002,
+  };
+
+  switch (regs->ax)
     {
-       _hypcall_print.print_char(regs->cx);
+    case Print_char:
+      _hypcall_print.print_char(regs->cx);
+      return Jump_instr;
+
+    case Console_ring_setup:
+      regs->ax = _hypcall_ring.setup(regs->bx, regs->cx);
+      return Jump_instr;
+
+    case Console_ring_doorbell:
+      regs->ax = _hypcall_ring.doorbell();
       return Jump_instr;
     }
 
@@ -353,185 +273,345 @@ Guest::msr_devices_rwmsr(l4_vcpu_regs_t *regs, bool write, unsigned vcpu_no)
 {
   auto msr = regs->cx;
 
-  for (auto &dev : _msr_devices)
+  Msr_device *dev = msr_device(msr);
+  if (!dev)
+    return false;
+
+  if (write)
     {
-      if (write)
-        {
-          l4_uint64_t value = (l4_uint64_t(regs->ax) & 0xFFFFFFFF)
-                              | (l4_uint64_t(regs->dx) << 32);
-          if (dev->write_msr(msr, value, vcpu_no))
-            return true;
-        }
-      else
+      l4_uint64_t value = (l4_uint64_t(regs->ax) & 0xFFFFFFFF)
+                          | (l4_uint64_t(regs->dx) << 32);
+      return dev->write_msr(msr, value, vcpu_no);
+    }
+
+  l4_uint64_t result = 0;
+  if (!dev->read_msr(msr, &result, vcpu_no))
+    return false;
+
+  regs->ax = (l4_uint32_t)result;
+  regs->dx = (l4_uint32_t)(result >> 32);
+  return true;
+}
+
+void
+Guest::wait_for_timer_or_irq(Vcpu_ptr vcpu)
+{
+  auto *apic = lapic(vcpu);
+
+  apic->check_timer();
+  if (apic->is_irq_pending())
+    return;
+
+  l4_timeout_t to = L4_IPC_NEVER;
+  auto *utcb = l4_utcb();
+  auto *kip = l4re_kip();
+  auto start = l4_kip_clock(kip);
+
+  // Sleep until the next timer deadline, which is then handled in this
+  // thread instead of the clock thread.
+  l4_uint64_t deadline = apic->timer_deadline();
+  if (deadline)
+    {
+      l4_uint64_t now = l4_rdtsc();
+      if (deadline <= now)
         {
-          l4_uint64_t result = 0;
-          if (dev->read_msr(msr, &result, vcpu_no))
-            {
-              regs->ax = (l4_uint32_t)result;
-              regs->dx = (l4_uint32_t)(result >> 32);
-              return true;
-            }
+          apic->check_timer();
+          return;
         }
+
+      // Round up so that the timer has expired when the thread wakes up.
+      l4_uint64_t diff = l4_tsc_to_us(deadline - now) + 1;
+      l4_rcv_timeout(l4_timeout_abs_u(start + diff, 8, utcb), &to);
+    }
+
+  wait_for_ipc(utcb, to);
+
+  // Time spent halted is idle time, not steal time.
+  _steal_time->halted(vcpu.get_vcpu_id(), l4_kip_clock(kip) - start);
+
+  apic->check_timer();
+}
+
+void
+Guest::init_exit_handlers()
+{
+  using Exit = Vmx_state::Exit;
+
+  for (auto &e : _exit_handlers)
+    e = Exit_entry{&Guest::handle_exit_unknown, true};
+
+  set_exit_handler(Exit::Cpuid, &Guest::handle_exit_cpuid);
+  set_exit_handler(Exit::Exec_vmcall, &Guest::handle_exit_vmcall);
+  set_exit_handler(Exit::Io_access, &Guest::handle_exit_io, true);
+  set_exit_handler(Exit::Ept_violation, &Guest::handle_exit_ept, true);
+  set_exit_handler(Exit::Exception_or_nmi, &Guest::handle_exit_exception);
+  set_exit_handler(Exit::External_int, &Guest::handle_exit_exception);
+  set_exit_handler(Exit::Interrupt_window, &Guest::handle_exit_nop);
+  set_exit_handler(Exit::Exec_halt, &Guest::handle_exit_halt);
+  set_exit_handler(Exit::Cr_access, &Guest::handle_exit_cr);
+  set_exit_handler(Exit::Exec_rdmsr, &Guest::handle_exit_rdmsr);
+  set_exit_handler(Exit::Exec_wrmsr, &Guest::handle_exit_wrmsr);
+  set_exit_handler(Exit::Virtualized_eoi, &Guest::handle_exit_virt_eoi, true);
+  set_exit_handler(Exit::Exec_xsetbv, &Guest::handle_exit_xsetbv);
+  set_exit_handler(Exit::Apic_write, &Guest::handle_exit_apic_write);
+}
+
+void
+Guest::set_exit_handler(Vmx_state::Exit reason, Exit_fn fn, bool qual)
+{
+  _exit_handlers[static_cast<unsigned>(reason)] = Exit_entry{fn, qual};
+}
+
+void
+Guest::register_exit_handler(Vmx_state::Exit reason,
+                             cxx::Ref_ptr<Exit_handler> const &dev, bool qual)
+{
+  unsigned r = static_cast<unsigned>(reason);
+  assert(r < Num_exit_reasons);
+
+  if (_exit_devs[r])
+    {
+      Err().printf("Exit reason %u already handled by a device\n", r);
+      throw L4::Runtime_error(-L4_EEXIST);
     }
 
-  return false;
+  _exit_devs[r] = dev;
+  set_exit_handler(reason, &Guest::handle_exit_device, qual);
 }
 
 int
-Guest::handle_exit_vmx(Vmm::Vcpu_ptr vcpu)
+Guest::handle_exit_vmx(Vcpu_ptr vcpu, Vmx_state *vms)
 {
-  Vmx_state *vms = dynamic_cast<Vmx_state *>(vcpu.vm_state());
-  assert(vms);
+  Vmx_exit exit;
+  exit.reason = vms->exit_reason();
 
-  using Exit = Vmx_state::Exit;
-  auto reason = vms->exit_reason();
-  auto *regs = &vcpu->r;
+  unsigned r = static_cast<unsigned>(exit.reason);
+  if (r >= Num_exit_reasons)
+    {
+      exit.qual = vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION);
+      return handle_exit_unknown(vcpu, vms, exit);
+    }
 
-  if (reason != Vmx_state::Exit::Exec_vmcall)
-    Dbg(Dbg::Guest, Dbg::Trace)
-      .printf("Exit at guest IP 0x%lx with 0x%llx (Qual: 0x%llx)\n", vms->ip(),
-              vms->vmx_read(L4VCPU_VMCS_EXIT_REASON),
-              vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION));
+  // The exit qualification is read once for the handlers that use it.
+  Exit_entry const &e = _exit_handlers[r];
+  exit.qual = e.qual ? vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION) : 0;
 
-  switch (reason)
+  if (exit.reason != Vmx_state::Exit::Exec_vmcall)
     {
-    case Exit::Cpuid: return handle_cpuid(regs);
+      Dbg trace(Dbg::Guest, Dbg::Trace);
+      if (trace.is_active())
+        trace.printf("Exit at guest IP 0x%lx with 0x%x (Qual: 0x%llx)\n",
+                     vms->ip(), r,
+                     vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION));
+    }
 
-    case Exit::Exec_vmcall: return handle_vm_call(regs);
+  return (this->*e.fn)(vcpu, vms, exit);
+}
 
-    case Exit::Io_access:
-      {
-        auto qual = vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION);
-        int qw = qual & 7;
+int
+Guest::handle_exit_device(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit)
+{
+  return _exit_devs[static_cast<unsigned>(exit.reason)]
+           ->handle_exit(vcpu, vms, exit);
+}
+
+int
+Guest::handle_exit_cpuid(Vcpu_ptr vcpu, Vmx_state *, Vmx_exit const &)
+{
+  return handle_cpuid(&vcpu->r, vcpu.get_vcpu_id());
+}
 
-        Dbg(Dbg::Dev, Dbg::Trace).printf("IO @ guest with qual 0x%llx\n", qual);
-        if (((qual >> 16) & 0xFFFF) == 0xcfb)
-          Dbg(Dbg::Dev, Dbg::Trace)
-            .printf(" 0xcfb access from ip: %lx\n", vms->ip());
+int
+Guest::handle_exit_vmcall(Vcpu_ptr vcpu, Vmx_state *, Vmx_exit const &)
+{
+  return handle_vm_call(&vcpu->r);
+}
 
-        Mem_access::Width wd = Mem_access::Wd32;
-        switch(qw)
-          {
-          // only 0,1,3 are valid values in the exit qualification.
-          case 0: wd = Mem_access::Wd8; break;
-          case 1: wd = Mem_access::Wd16; break;
-          case 3: wd = Mem_access::Wd32; break;
-          }
+int
+Guest::handle_exit_io(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit)
+{
+  auto qual = exit.qual;
+  int qw = qual & 7;
 
-        return handle_io_access((qual >> 16) & 0xFFFF, qual & 8, wd, regs);
-      }
+  Dbg(Dbg::Dev, Dbg::Trace).printf("IO @ guest with qual 0x%llx\n", qual);
+  if (((qual >> 16) & 0xFFFF) == 0xcfb)
+    Dbg(Dbg::Dev, Dbg::Trace)
+      .printf(" 0xcfb access from ip: %lx\n", vms->ip());
 
-    // Ept_violation needs to be checked here, as handle_mmio needs a vCPU ptr,
-    // which cannot be passed to Vm_state/Vmx_state due to dependency reasons.
-    case Exit::Ept_violation:
-      {
-        auto guest_phys_addr =
-          vms->vmx_read(L4VCPU_VMCS_GUEST_PHYSICAL_ADDRESS);
-        auto qual = vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION);
+  Mem_access::Width wd = Mem_access::Wd32;
+  switch(qw)
+    {
+    // only 0,1,3 are valid values in the exit qualification.
+    case 0: wd = Mem_access::Wd8; break;
+    case 1: wd = Mem_access::Wd16; break;
+    case 3: wd = Mem_access::Wd32; break;
+    }
 
-        trace().printf("Exit reason due to EPT violation %i;  gp_addr 0x%llx, "
-                       "qualification 0x%llx\n",
-                       static_cast<unsigned>(reason), guest_phys_addr, qual);
+  return handle_io_access((qual >> 16) & 0xFFFF, qual & 8, wd, &vcpu->r);
+}
 
-        switch(handle_mmio(guest_phys_addr, vcpu))
-          {
-          case Retry: return L4_EOK;
-          case Jump_instr: return Jump_instr;
-          default: break;
-          }
+// Ept_violation needs to be handled here, as handle_mmio needs a vCPU ptr,
+// which cannot be passed to Vm_state/Vmx_state due to dependency reasons.
+int
+Guest::handle_exit_ept(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit)
+{
+  auto guest_phys_addr = vms->vmx_read(L4VCPU_VMCS_GUEST_PHYSICAL_ADDRESS);
+  auto qual = exit.qual;
 
-        warn().printf("Unhandled pagefault @ 0x%lx\n", vms->ip());
-        warn().printf("Read: %llu, Write: %llu, Inst.: %llu Phys addr: 0x%llx\n",
-                     qual & 1, qual & 2, qual & 4, guest_phys_addr);
+  trace().printf("Exit reason due to EPT violation %i;  gp_addr 0x%llx, "
+                 "qualification 0x%llx\n",
+                 static_cast<unsigned>(exit.reason), guest_phys_addr, qual);
 
-        if (qual & 0x80)
-          warn().printf("Linear address: 0x%llx\n",
-                       vms->vmx_read(L4VCPU_VMCS_GUEST_LINEAR_ADDRESS));
-        return -L4_EINVAL;
-      }
+  switch(handle_mmio(guest_phys_addr, vcpu))
+    {
+    case Retry: return L4_EOK;
+    case Jump_instr: return Jump_instr;
+    default: break;
+    }
 
-    // VMX specific exits
-    case Exit::Exception_or_nmi:
-    case Exit::External_int:
-      return vms->handle_exception_nmi_ext_int();
+  warn().printf("Unhandled pagefault @ 0x%lx\n", vms->ip());
+  warn().printf("Read: %llu, Write: %llu, Inst.: %llu Phys addr: 0x%llx\n",
+               qual & 1, qual & 2, qual & 4, guest_phys_addr);
 
-    case Exit::Interrupt_window:
-      return L4_EOK;
+  if (qual & 0x80)
+    warn().printf("Linear address: 0x%llx\n",
+                 vms->vmx_read(L4VCPU_VMCS_GUEST_LINEAR_ADDRESS));
+  return -L4_EINVAL;
+}
 
-    case Exit::Exec_halt:
-      trace().printf("HALT 0x%llx!\n", vms->vmx_read(L4VCPU_VMCS_GUEST_RIP));
-      vms->vmx_write(L4VCPU_VMCS_GUEST_ACTIVITY_STATE, 1);
+// VMX specific exits
+int
+Guest::handle_exit_exception(Vcpu_ptr, Vmx_state *vms, Vmx_exit const &)
+{
+  return vms->handle_exception_nmi_ext_int();
+}
 
-      if (!lapic(vcpu)->is_irq_pending())
-        wait_for_ipc(l4_utcb(), L4_IPC_NEVER);
+int
+Guest::handle_exit_nop(Vcpu_ptr, Vmx_state *, Vmx_exit const &)
+{
+  return L4_EOK;
+}
 
-      vms->unhalt();
-      return L4_EOK;
+int
+Guest::handle_exit_halt(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &)
+{
+  trace().printf("HALT 0x%lx!\n", vms->ip());
+  vms->vmx_write(L4VCPU_VMCS_GUEST_ACTIVITY_STATE, 1);
+  wait_for_timer_or_irq(vcpu);
+  vms->unhalt();
+  return L4_EOK;
+}
 
-    case Exit::Cr_access:
-      return vms->handle_cr_access(regs);
+int
+Guest::handle_exit_cr(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &)
+{
+  return vms->handle_cr_access(&vcpu->r);
+}
 
-    case Exit::Exec_rdmsr:
-      if (!msr_devices_rwmsr(regs, false, vcpu.get_vcpu_id()))
-        {
-          warn().printf("Reading unsupported MSR 0x%lx\n", regs->cx);
-          regs->ax = 0;
-          regs->dx = 0;
-        }
+int
+Guest::handle_exit_rdmsr(Vcpu_ptr vcpu, Vmx_state *, Vmx_exit const &)
+{
+  auto *regs = &vcpu->r;
+  if (!msr_devices_rwmsr(regs, false, vcpu.get_vcpu_id()))
+    {
+      warn().printf("Reading unsupported MSR 0x%lx\n", regs->cx);
+      regs->ax = 0;
+      regs->dx = 0;
+    }
 
-      return Jump_instr;
+  return Jump_instr;
+}
 
-    case Exit::Exec_wrmsr:
-      if (msr_devices_rwmsr(regs, true, vcpu.get_vcpu_id()))
-        return Jump_instr;
-      else
-        {
-          warn().printf("Writing unsupported MSR 0x%lx\n", regs->cx);
-          return -L4_ENOSYS;
-        }
+int
+Guest::handle_exit_wrmsr(Vcpu_ptr vcpu, Vmx_state *, Vmx_exit const &)
+{
+  auto *regs = &vcpu->r;
+  if (msr_devices_rwmsr(regs, true, vcpu.get_vcpu_id()))
+    return Jump_instr;
 
-    case Exit::Virtualized_eoi:
-      Dbg().printf("INFO: EOI virtualized for vector 0x%llx\n",
-                   vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION));
-      // Trap like exit: IP already on next instruction
-      return L4_EOK;
+  warn().printf("Writing unsupported MSR 0x%lx\n", regs->cx);
+  return -L4_ENOSYS;
+}
 
-    case Exit::Exec_xsetbv:
-      if (regs->cx == 0)
-        {
-          l4_uint64_t value = (l4_uint64_t(regs->ax) & 0xFFFFFFFF)
-                              | (l4_uint64_t(regs->dx) << 32);
-          vms->vmx_write(L4_VM_VMX_VMCS_XCR0, value);
-          trace().printf("Setting xcr0 to 0x%llx\n", value);
-          return Jump_instr;
-        }
-      Dbg().printf("Writing unknown extended control register %ld\n", regs->cx);
-      return -L4_EINVAL;
-
-    case Exit::Apic_write:
-      // Trap like exit: IP already on next instruction
-      assert(0); // Not supported
-      return L4_EOK;
-
-    default:
-      Dbg().printf("Exit at guest IP 0x%lx with 0x%llx (Qual: 0x%llx)\n",
-                   vms->ip(), vms->vmx_read(L4VCPU_VMCS_EXIT_REASON),
-                   vms->vmx_read(L4VCPU_VMCS_EXIT_QUALIFICATION));
-      if (reason <= Exit::Exit_reason_max)
-        Dbg().printf("Unhandled exit reason: %s (%d)\n",
-                     str_exit_reason[(int)reason],
-                     static_cast<unsigned>(reason));
-      else
-        Dbg().printf("Unknown exit reason: 0x%x\n",
-                     static_cast<unsigned>(reason));
-      return -L4_ENOSYS;
+int
+Guest::handle_exit_virt_eoi(Vcpu_ptr, Vmx_state *, Vmx_exit const &exit)
+{
+  Dbg().printf("INFO: EOI virtualized for vector 0x%llx\n", exit.qual);
+  // Trap like exit: IP already on next instruction
+  return L4_EOK;
+}
+
+int
+Guest::handle_exit_xsetbv(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &)
+{
+  auto *regs = &vcpu->r;
+  if (regs->cx == 0)
+    {
+      l4_uint64_t value = (l4_uint64_t(regs->ax) & 0xFFFFFFFF)
+                          | (l4_uint64_t(regs->dx) << 32);
+      vms->vmx_write(L4_VM_VMX_VMCS_XCR0, value);
+      trace().printf("Setting xcr0 to 0x%llx\n", value);
+      return Jump_instr;
     }
+
+  Dbg().printf("Writing unknown extended control register %ld\n", regs->cx);
+  return -L4_EINVAL;
+}
+
+int
+Guest::handle_exit_apic_write(Vcpu_ptr, Vmx_state *, Vmx_exit const &)
+{
+  // Trap like exit: IP already on next instruction
+  assert(0); // Not supported
+  return L4_EOK;
+}
+
+int
+Guest::handle_exit_unknown(Vcpu_ptr, Vmx_state *vms, Vmx_exit const &exit)
+{
+  unsigned reason = static_cast<unsigned>(exit.reason);
+
+  Dbg().printf("Exit at guest IP 0x%lx with 0x%llx (Qual: 0x%llx)\n",
+               vms->ip(), vms->vmx_read(L4VCPU_VMCS_EXIT_REASON), exit.qual);
+  if (exit.reason <= Vmx_state::Exit::Exit_reason_max)
+    Dbg().printf("Unhandled exit reason: %s (%d)\n",
+                 str_exit_reason[reason], reason);
+  else
+    Dbg().printf("Unknown exit reason: 0x%x\n", reason);
+  return -L4_ENOSYS;
+}
+
+void
+Guest::save_state(Snapshot_writer &w)
+{
+  _apics->get(0)->save_state(w);
+  _steal_time->save_state(w);
+  _hypcall_ring.save_state(w);
+}
+
+void
+Guest::restore_state(Snapshot_reader &r, Vm_ram *ram)
+{
+  _ptw.set_ram(ram);
+  _steal_time->set_ram(ram);
+
+  _apics->register_core(0);
+  _apics->get(0)->restore_state(r);
+  _apics->set_ram(ram);
+  _steal_time->restore_state(r);
+  _hypcall_ring.restore_state(r);
+  _hypcall_ring.set_ram(ram);
 }
 
 void L4_NORETURN
 Guest::run(cxx::Ref_ptr<Cpu_dev_array> const &cpus)
 {
   unsigned const max_cpuid = cpus->max_cpuid();
+  _cpuid.build(max_cpuid + 1);
+
+  // Needed to convert timer deadlines into timeouts.
+  l4_calibrate_tsc(l4re_kip());
+
   for (unsigned id = 0; id <= max_cpuid; ++id)
     {
       auto cpu = cpus->cpu(id);
@@ -543,12 +623,20 @@ Guest::run(cxx::Ref_ptr<Cpu_dev_array> const &cpus)
       vcpu.register_pt_walker(&_ptw);
 
       unsigned vcpu_id = vcpu.get_vcpu_id();
-      _apics->register_core(vcpu_id);
+      // The local APIC already exists when restored from a snapshot.
+      if (!_apics->get(vcpu_id))
+        _apics->register_core(vcpu_id);
       register_timer_device(_apics->get(vcpu_id));
       _apics->get(vcpu_id)->attach_cpu_thread(cpu->thread_cap());
     }
 
-  register_msr_device(Vdev::make_device<Vcpu_msr_handler>(cpus.get()));
+  auto vcpu_msrs = Vdev::make_device<Vcpu_msr_handler>(cpus.get());
+  register_msr_device(vcpu_msrs, 0x8b, 0x8b);             // IA32_BIOS_SIGN_ID
+  register_msr_device(vcpu_msrs, 0x140, 0x140);           // MISC_FEATURE
+  register_msr_device(vcpu_msrs, 0x174, 0x176);           // SYSENTER
+  register_msr_device(vcpu_msrs, 0xe01, 0xe01);           // UNC_PERF_GLOBAL_CTRL
+  register_msr_device(vcpu_msrs, 0xc0000080, 0xc0000084); // EFER, SYSCALL
+  register_msr_device(vcpu_msrs, 0xc0000100, 0xc0000102); // FS/GS base
 
   Dbg(Dbg::Guest, Dbg::Info).printf("Starting VMM @ 0x%lx\n", cpus->vcpu(0)->r.ip);
 
@@ -571,6 +659,8 @@ Guest::run_vmx(cxx::Ref_ptr<Cpu_dev> const &cpu_dev)
     {
       l4_msgtag_t tag = myself->vcpu_resume_commit(myself->vcpu_resume_start());
       auto e = l4_error(tag);
+      // Before anything looks at the interrupts in service.
+      lapic(vcpu)->sync_pv_eoi();
 
       if (e == 1)
       // Fiasco indicates pending IRQs (IPCs); see fiasco: resume_vcpu()
@@ -588,7 +678,12 @@ Guest::run_vmx(cxx::Ref_ptr<Cpu_dev> const &cpu_dev)
         }
       else
         {
-          int ret = handle_exit_vmx(vcpu);
+          int ret;
+          {
+            // Port I/O and hypercalls may use guest RAM as well.
+            Grace_period::Reader reader(_memmap.grace_period());
+            ret = handle_exit_vmx(vcpu, vm);
+          }
           if (ret < 0)
             {
               trace().printf("Failure in VMM %i\n", ret);
@@ -603,6 +698,9 @@ Guest::run_vmx(cxx::Ref_ptr<Cpu_dev> const &cpu_dev)
             }
         }
 
+      _steal_time->update(vcpu.get_vcpu_id());
+      lapic(vcpu)->check_timer();
+
       if (vm->interrupts_enabled())
         {
           vm->disable_interrupt_window();
@@ -617,10 +715,13 @@ Guest::run_vmx(cxx::Ref_ptr<Cpu_dev> const &cpu_dev)
                   vcpu->r.si, vcpu->r.di, vm->ip());
 
               vm->inject_interrupt(irq);
+              lapic(vcpu)->irq_injected(irq);
             }
         }
       else
         vm->enable_interrupt_window();
+
+      lapic(vcpu)->offer_pv_eoi();
     }
 
 }
@@ -13,9 +13,12 @@
 #include <l4/l4virtio/l4virtio>
 
 #include <map>
+#include <unordered_map>
 #include <vector>
 
 #include "cpu_dev_array.h"
+#include "cpuid.h"
+#include "exit_handler.h"
 #include "generic_guest.h"
 #include "io_device.h"
 #include "msr_device.h"
@@ -26,6 +29,7 @@
 #include "vmprint.h"
 #include "zeropage.h"
 #include "pt_walker.h"
+#include "steal_time.h"
 #include "vm_ram.h"
 
 namespace Vmm {
@@ -36,29 +40,49 @@ public:
   enum { Default_rambase = 0, Boot_offset = 0 };
 
   Guest()
-  : _ptw(&_memmap, get_max_physical_address_bit()),
-    _apics(Vdev::make_device<Gic::Lapic_array>(get_max_physical_address_bit()))
+  : _ptw(get_max_physical_address_bit()),
+    _apics(Vdev::make_device<Gic::Lapic_array>(get_max_physical_address_bit())),
+    _steal_time(Vdev::make_device<Steal_time>())
   {
+    init_exit_handlers();
+
     add_mmio_device(_apics->mmio_region(), _apics);
 
-    register_msr_device(_apics);
+    register_msr_device(_apics, 0x1b, 0x1b);       // APIC base
+    register_msr_device(_apics, 0x6e0, 0x6e0);     // TSC deadline
+    register_msr_device(_apics, X2apic_msr_first, X2apic_msr_last);
+    register_msr_device(_apics, 0x4b564d04, 0x4b564d04); // PV EOI
+    register_msr_device(_steal_time, Steal_time::Msr_kvm_steal_time,
+                        Steal_time::Msr_kvm_steal_time);
   }
 
   static Guest *create_instance();
 
-  void setup_device_tree(Vdev::Device_tree) {}
+  void setup_device_tree(Vdev::Device_tree dt);
 
   void show_state_interrupts(FILE *, Vcpu_ptr) {}
 
   void register_io_device(Io_region const &region,
                           cxx::Ref_ptr<Io_device> const &dev);
 
-  void register_msr_device(cxx::Ref_ptr<Msr_device> const &dev);
-
-  void register_timer_device(cxx::Ref_ptr<Vdev::Timer> const &dev)
-  {
-    _clock.add_timer(dev);
-  }
+  /**
+   * Register a device handling the MSRs `first` to `last` (inclusive).
+   *
+   * A device handling several ranges is registered once per range.
+   */
+  void register_msr_device(cxx::Ref_ptr<Msr_device> const &dev,
+                           unsigned first, unsigned last);
+
+  /**
+   * Register a device handling VM exits with the given reason.
+   *
+   * \param qual  The device uses the exit qualification.
+   *
+   * The device replaces the built-in handling of the exit.
+   */
+  void register_exit_handler(Vmx_state::Exit reason,
+                             cxx::Ref_ptr<Exit_handler> const &dev,
+                             bool qual = false);
 
   l4_addr_t load_linux_kernel(Vm_ram *ram, char const *kernel,
                               Ram_free_list *free_list);
@@ -69,6 +93,9 @@ public:
 
   void run(cxx::Ref_ptr<Cpu_dev_array> const &cpus) L4_NORETURN;
 
+  void save_state(Snapshot_writer &w);
+  void restore_state(Snapshot_reader &r, Vm_ram *ram);
+
   void handle_entry(Vcpu_ptr vcpu);
 
   Gic::Virt_lapic *lapic(Vcpu_ptr vcpu)
@@ -76,7 +103,7 @@ public:
 
   cxx::Ref_ptr<Gic::Lapic_array> apic_array() { return _apics; }
 
-  int handle_cpuid(l4_vcpu_regs_t *regs);
+  int handle_cpuid(l4_vcpu_regs_t *regs, unsigned vcpu_no);
   int handle_vm_call(l4_vcpu_regs_t *regs);
   int handle_io_access(unsigned port, bool is_in, Mem_access::Width op_width,
                        l4_vcpu_regs_t *regs);
@@ -89,8 +116,54 @@ private:
     Max_phys_addr_bits_mask = 0xff,
   };
 
+  // MSRs of the x2APIC, dispatched by a direct lookup.
+  enum : unsigned
+  {
+    X2apic_msr_first = 0x800,
+    X2apic_msr_last = 0x8ff,
+    Max_msr_range = 0x100,
+  };
+
+  enum : unsigned
+  {
+    Num_exit_reasons = unsigned(Vmx_state::Exit::Exit_reason_max) + 1,
+  };
+
+  typedef int (Guest::*Exit_fn)(Vcpu_ptr vcpu, Vmx_state *vms,
+                                Vmx_exit const &exit);
+
+  /// Entry of the exit dispatch table.
+  struct Exit_entry
+  {
+    Exit_fn fn;
+    bool qual; ///< Read the exit qualification before calling `fn`.
+  };
+
+  void init_exit_handlers();
+  void set_exit_handler(Vmx_state::Exit reason, Exit_fn fn, bool qual = false);
+
   void run_vmx(cxx::Ref_ptr<Cpu_dev> const &cpu_dev) L4_NORETURN;
-  int handle_exit_vmx(Vcpu_ptr vcpu);
+  int handle_exit_vmx(Vcpu_ptr vcpu, Vmx_state *vms);
+  int handle_exit_device(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_cpuid(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_vmcall(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_io(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_ept(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_exception(Vcpu_ptr vcpu, Vmx_state *vms,
+                            Vmx_exit const &exit);
+  int handle_exit_nop(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_halt(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_cr(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_rdmsr(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_wrmsr(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_virt_eoi(Vcpu_ptr vcpu, Vmx_state *vms,
+                           Vmx_exit const &exit);
+  int handle_exit_xsetbv(Vcpu_ptr vcpu, Vmx_state *vms, Vmx_exit const &exit);
+  int handle_exit_apic_write(Vcpu_ptr vcpu, Vmx_state *vms,
+                             Vmx_exit const &exit);
+  int handle_exit_unknown(Vcpu_ptr vcpu, Vmx_state *vms,
+                          Vmx_exit const &exit);
+  void wait_for_timer_or_irq(Vcpu_ptr vcpu);
 
   unsigned get_max_physical_address_bit() const
   {
@@ -112,18 +185,36 @@ private:
     return ax & Max_phys_addr_bits_mask;
   }
 
+  Msr_device *msr_device(unsigned msr) const
+  {
+    if (msr - X2apic_msr_first <= X2apic_msr_last - X2apic_msr_first)
+      return _x2apic_msrs[msr - X2apic_msr_first];
+
+    auto it = _msrs.find(msr);
+    return it != _msrs.end() ? it->second : nullptr;
+  }
+
   bool msr_devices_rwmsr(l4_vcpu_regs_t *regs, bool write, unsigned vcpu_no);
 
   typedef std::map<Io_region, cxx::Ref_ptr<Io_device>> Io_mem;
   Io_mem _iomap;
 
   std::vector<cxx::Ref_ptr<Msr_device>> _msr_devices;
+  Msr_device *_x2apic_msrs[X2apic_msr_last - X2apic_msr_first + 1] = {};
+  std::unordered_map<unsigned, Msr_device *> _msrs;
+
+  Cpuid_table _cpuid;
+
+  // VM exits are dispatched by their reason, resolved once per exit.
+  Exit_entry _exit_handlers[Num_exit_reasons];
+  cxx::Ref_ptr<Exit_handler> _exit_devs[Num_exit_reasons];
 
   // devices
-  Vdev::Clock_source _clock;
   Guest_print_buffer _hypcall_print;
+  Guest_console_ring _hypcall_ring;
   Pt_walker _ptw;
   cxx::Ref_ptr<Gic::Lapic_array> _apics;
+  cxx::Ref_ptr<Steal_time> _steal_time;
   Binary_type _guest_t;
 };
 
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include "device_factory.h"
+#include "guest.h"
+#include "ioapic.h"
+
+namespace Gic {
+
+void
+Io_apic::set(unsigned irq)
+{
+  if (irq >= Num_pins)
+    return;
+
+  cxx::Ref_ptr<Irq_source> src;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    Pin &p = _pins[irq];
+    if (p.entry.level_triggered())
+      {
+        p.asserted = true;
+        deliver_level(&p);
+        return;
+      }
+
+    if (!p.entry.masked())
+      deliver(p.entry);
+
+    src = p.source;
+  }
+
+  // Edge-triggered interrupts are not acknowledged by an EOI.
+  if (src)
+    src->eoi();
+}
+
+void
+Io_apic::clear(unsigned irq)
+{
+  if (irq >= Num_pins)
+    return;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _pins[irq].asserted = false;
+}
+
+void
+Io_apic::bind_irq_source(unsigned irq, cxx::Ref_ptr<Irq_source> const &src)
+{
+  assert(irq < Num_pins);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_pins[irq].source)
+    throw L4::Runtime_error(-L4_EEXIST);
+
+  _pins[irq].source = src;
+}
+
+cxx::Ref_ptr<Irq_source>
+Io_apic::get_irq_source(unsigned irq) const
+{
+  assert(irq < Num_pins);
+  return _pins[irq].source;
+}
+
+void
+Io_apic::eoi(unsigned vector)
+{
+  cxx::Ref_ptr<Irq_source> srcs[Num_pins];
+  l4_uint32_t pending = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (unsigned i = 0; i < Num_pins; ++i)
+      {
+        Redir_entry &e = _pins[i].entry;
+        if (e.level_triggered() && e.remote_irr() && e.vector() == vector)
+          {
+            e.remote_irr() = 0;
+            srcs[i] = _pins[i].source;
+            pending |= 1U << i;
+          }
+      }
+  }
+
+  if (!pending)
+    return;
+
+  // Bound sources deassert the line when they are acknowledged.
+  for (auto const &src : srcs)
+    if (src)
+      src->eoi();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (unsigned i = 0; i < Num_pins; ++i)
+    if (pending & (1U << i))
+      deliver_level(&_pins[i]);
+}
+
+l4_umword_t
+Io_apic::read(unsigned reg, char, unsigned)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  switch (reg)
+    {
+    case Ioregsel: return _ioregsel;
+    case Iowin: return read_reg(_ioregsel);
+    default: return 0;
+    }
+}
+
+void
+Io_apic::write(unsigned reg, char, l4_umword_t value, unsigned)
+{
+  switch (reg)
+    {
+    case Ioregsel:
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _ioregsel = value & 0xff;
+        break;
+      }
+
+    case Iowin:
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        write_reg(_ioregsel, value);
+        break;
+      }
+
+    case Eoi_reg:
+      eoi(value & 0xff);
+      break;
+
+    default:
+      warn().printf("Write to unknown register 0x%x ignored\n", reg);
+    }
+}
+
+void
+Io_apic::save_state(Vmm::Snapshot_writer &w)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  w.put(_ioregsel);
+  w.put(_id);
+  for (auto const &p : _pins)
+    {
+      w.put(p.entry.raw);
+      w.put(p.asserted);
+    }
+}
+
+void
+Io_apic::restore_state(Vmm::Snapshot_reader &r)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  r.get(&_ioregsel);
+  r.get(&_id);
+  for (auto &p : _pins)
+    {
+      r.get(&p.entry.raw);
+      r.get(&p.asserted);
+    }
+}
+
+/// Must be called with _mutex held.
+l4_uint32_t
+Io_apic::read_reg(unsigned idx) const
+{
+  switch (idx)
+    {
+    case Id_reg:
+    case Arbitration_reg:
+      return _id << 24;
+    case Version_reg:
+      return Version | ((Num_pins - 1) << 16);
+    }
+
+  if (idx < Redir_tbl_base || idx >= Redir_tbl_end)
+    return 0;
+
+  l4_uint64_t raw = _pins[(idx - Redir_tbl_base) / 2].entry.raw;
+  return (idx & 1) ? raw >> 32 : raw;
+}
+
+/// Must be called with _mutex held.
+void
+Io_apic::write_reg(unsigned idx, l4_uint32_t value)
+{
+  if (idx == Id_reg)
+    {
+      _id = (value >> 24) & 0xf;
+      return;
+    }
+
+  if (idx < Redir_tbl_base || idx >= Redir_tbl_end)
+    {
+      trace().printf("Write to read-only register 0x%x ignored\n", idx);
+      return;
+    }
+
+  Pin &p = _pins[(idx - Redir_tbl_base) / 2];
+  l4_uint64_t raw = p.entry.raw;
+
+  if (idx & 1)
+    raw = (raw & 0xffffffffULL) | (l4_uint64_t(value) << 32);
+  else
+    {
+      l4_uint64_t ro = Redir_entry::read_only_mask();
+      raw = (raw & ~0xffffffffULL) | (raw & ro) | (value & ~ro);
+    }
+
+  p.entry.raw = raw;
+  trace().printf("Redirection entry %u: 0x%llx\n",
+                 (idx - Redir_tbl_base) / 2, raw);
+
+  if (!p.entry.level_triggered())
+    p.entry.remote_irr() = 0;
+
+  // Unmasking a level-triggered pin delivers an asserted line.
+  deliver_level(&p);
+}
+
+/**
+ * Deliver the interrupt of an asserted level-triggered pin unless the
+ * previous one awaits its EOI.
+ *
+ * Must be called with _mutex held.
+ */
+void
+Io_apic::deliver_level(Pin *p)
+{
+  Redir_entry &e = p->entry;
+  if (!e.level_triggered() || !p->asserted || e.masked() || e.remote_irr())
+    return;
+
+  if (deliver(e))
+    e.remote_irr() = 1;
+}
+
+/**
+ * Send the interrupt of a redirection entry to its destination.
+ *
+ * \return True if a local APIC accepted the interrupt.
+ */
+bool
+Io_apic::deliver(Redir_entry const &e)
+{
+  unsigned vec = e.vector();
+  bool level = e.level_triggered();
+
+  switch (e.delivery_mode())
+    {
+    case Lowest_prio:
+      // Arbitrate among the local APICs of the destination only.
+      if (Virt_lapic *lapic = _apics->get_lowest_prio(e.dest_id(),
+                                                      e.logical_dest()))
+        {
+          lapic->irq_trigger(vec, level);
+          return true;
+        }
+      break;
+
+    case Fixed:
+      if (e.logical_dest()
+          ? _apics->send_to_logical_dest_id(e.dest_id(), vec, level)
+          : _apics->send_to_phys_dest_id(e.dest_id(), vec, level))
+        return true;
+      break;
+
+    default:
+      warn().printf("Delivery mode %u not supported; IRQ dropped\n",
+                    (unsigned)e.delivery_mode());
+      return false;
+    }
+
+  trace().printf("No local APIC for destination 0x%x; IRQ dropped\n",
+                 (unsigned)e.dest_id());
+  return false;
+}
+
+} // namespace Gic
+
+namespace {
+
+struct F : Vdev::Factory
+{
+  cxx::Ref_ptr<Vdev::Device> create(Vdev::Device_lookup *devs,
+                                    Vdev::Dt_node const &node) override
+  {
+    auto apics = devs->vmm()->apic_array();
+    auto dev = Vdev::make_device<Gic::Io_apic>(apics);
+
+    apics->set_eoi_handler(dev.get());
+    devs->vmm()->register_mmio_device(dev, node);
+
+    return dev;
+  }
+}; // struct F
+
+static F f;
+static Vdev::Device_type t = {"intel,ioapic", nullptr, &f};
+
+} // namespace
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <mutex>
+
+#include <l4/cxx/bitfield>
+
+#include "debug.h"
+#include "irq.h"
+#include "mmio_device.h"
+#include "snapshot.h"
+#include "virt_lapic.h"
+
+namespace Gic {
+
+/**
+ * IO-APIC with 24 pins.
+ *
+ * Each pin is routed to the local APICs by its entry in the redirection
+ * table, which the guest programs through the register window
+ * (IOREGSEL/IOWIN). Edge-triggered pins deliver an interrupt on every
+ * assertion. A level-triggered pin delivers an interrupt and sets its
+ * remote IRR bit, which blocks further deliveries until the local APIC
+ * broadcasts the EOI of the vector. A pin still asserted at that point
+ * delivers its interrupt again.
+ *
+ * Interrupt specifiers in the device tree consist of two cells, the pin
+ * number and a trigger type, which is ignored as the guest programs the
+ * trigger mode.
+ */
+class Io_apic
+: public Ic,
+  public Eoi_handler,
+  public Vmm::Mmio_device_t<Io_apic>,
+  public Vdev::Snapshot_state
+{
+  enum
+  {
+    Irq_cells = 2, // keep in sync with virt-pc.dts
+    Num_pins = 24,
+    Version = 0x20,
+
+    // Memory-mapped registers
+    Ioregsel = 0x00,
+    Iowin = 0x10,
+    Eoi_reg = 0x40,
+
+    // Indirect registers
+    Id_reg = 0x00,
+    Version_reg = 0x01,
+    Arbitration_reg = 0x02,
+    Redir_tbl_base = 0x10,
+    Redir_tbl_end = Redir_tbl_base + 2 * Num_pins,
+  };
+
+  enum Delivery_mode
+  {
+    Fixed = 0,
+    Lowest_prio = 1,
+  };
+
+  struct Redir_entry
+  {
+    l4_uint64_t raw;
+    CXX_BITFIELD_MEMBER(56, 63, dest_id, raw);
+    CXX_BITFIELD_MEMBER(16, 16, masked, raw);
+    CXX_BITFIELD_MEMBER(15, 15, level_triggered, raw);
+    CXX_BITFIELD_MEMBER(14, 14, remote_irr, raw);
+    CXX_BITFIELD_MEMBER(13, 13, active_low, raw);
+    CXX_BITFIELD_MEMBER(12, 12, delivery_status, raw);
+    CXX_BITFIELD_MEMBER(11, 11, logical_dest, raw);
+    CXX_BITFIELD_MEMBER( 8, 10, delivery_mode, raw);
+    CXX_BITFIELD_MEMBER( 0,  7, vector, raw);
+
+    /// Bits the guest cannot write.
+    static l4_uint64_t read_only_mask()
+    { return remote_irr_bfm_t::Mask | delivery_status_bfm_t::Mask; }
+
+    Redir_entry() : raw(masked_bfm_t::Mask) {}
+  };
+
+  struct Pin
+  {
+    Redir_entry entry;
+    bool asserted = false;
+    cxx::Ref_ptr<Irq_source> source;
+  };
+
+public:
+  explicit Io_apic(cxx::Ref_ptr<Lapic_array> apics) : _apics(apics) {}
+
+  // Ic interface
+  void set(unsigned irq) override;
+  void clear(unsigned irq) override;
+
+  void bind_irq_source(unsigned irq,
+                       cxx::Ref_ptr<Irq_source> const &src) override;
+  cxx::Ref_ptr<Irq_source> get_irq_source(unsigned irq) const override;
+
+  int dt_get_interrupt(fdt32_t const *prop, int propsz, int *read) const override
+  {
+    if (propsz < Irq_cells)
+      return -L4_ERANGE;
+
+    if (read)
+      *read = Irq_cells;
+
+    unsigned pin = fdt32_to_cpu(prop[0]);
+    return pin < Num_pins ? int(pin) : -L4_EINVAL;
+  }
+
+  // Eoi_handler interface
+  void eoi(unsigned vector) override;
+
+  // Mmio device interface
+  l4_umword_t read(unsigned reg, char size, unsigned cpu_id);
+  void write(unsigned reg, char size, l4_umword_t value, unsigned cpu_id);
+
+  // Snapshot interface
+  void save_state(Vmm::Snapshot_writer &w) override;
+  void restore_state(Vmm::Snapshot_reader &r) override;
+
+private:
+  l4_uint32_t read_reg(unsigned idx) const;
+  void write_reg(unsigned idx, l4_uint32_t value);
+  bool deliver(Redir_entry const &e);
+  void deliver_level(Pin *p);
+
+  static Dbg trace() { return Dbg(Dbg::Irq, Dbg::Trace, "IO-APIC"); }
+  static Dbg warn() { return Dbg(Dbg::Irq, Dbg::Warn, "IO-APIC"); }
+
+  cxx::Ref_ptr<Lapic_array> _apics;
+  std::mutex _mutex;
+  l4_uint32_t _ioregsel = 0;
+  l4_uint32_t _id = 0;
+  Pin _pins[Num_pins];
+}; // class Io_apic
+
+} // namespace Gic
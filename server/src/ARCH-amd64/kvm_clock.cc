@@ -5,6 +5,10 @@
  * This file is distributed under the terms of the GNU General Public
  * License, version 2.  Please see the COPYING-GPL-2 file for details.
  */
+#include <atomic>
+
+#include <l4/util/cpu.h>
+
 #include "device_factory.h"
 #include "guest.h"
 #include "kvm_clock.h"
@@ -12,16 +16,47 @@
 
 namespace {
 
+/**
+ * Compute multiplier and shift of a pvclock to convert `base_hz` ticks
+ * into `scaled_hz` ticks (see Linux kvm_get_time_scale()).
+ */
+void
+time_scale(l4_uint64_t scaled_hz, l4_uint64_t base_hz, l4_int8_t *shift,
+           l4_uint32_t *mul)
+{
+  l4_uint64_t scaled64 = scaled_hz;
+  l4_uint64_t tps64 = base_hz;
+  l4_int8_t s = 0;
+
+  while (tps64 > scaled64 * 2 || tps64 & 0xffffffff00000000ULL)
+    {
+      tps64 >>= 1;
+      --s;
+    }
+
+  l4_uint32_t tps32 = tps64;
+  while (tps32 <= scaled64 || scaled64 & 0xffffffff00000000ULL)
+    {
+      if (scaled64 & 0xffffffff00000000ULL || tps32 & 0x80000000)
+        scaled64 >>= 1;
+      else
+        tps32 <<= 1;
+      ++s;
+    }
+
+  *shift = s;
+  *mul = (scaled64 << 32) / tps32;
+}
+
 struct F : Vdev::Factory
 {
   cxx::Ref_ptr<Vdev::Device> create(Vdev::Device_lookup *devs,
                                     Vdev::Dt_node const &) override
   {
     auto *vmm = devs->vmm();
-    auto dev = Vdev::make_device<Vdev::Kvm_clock>(vmm->memmap());
+    auto dev = Vdev::make_device<Vdev::Kvm_clock>(devs->ram().get());
 
-    vmm->register_timer_device(dev);
-    vmm->register_msr_device(dev);
+    vmm->register_msr_device(dev, 0x4b564d00, 0x4b564d02);
 
     return dev;
   }
@@ -31,3 +66,195 @@ static F f;
 static Vdev::Device_type t = {"kvm-clock", nullptr, &f};
 
 } // namespace
+
+namespace Vdev {
+
+Kvm_clock::Kvm_clock(Vmm::Vm_ram const *ram)
+: _ref_tsc(l4_rdtsc()),
+  _ref_ns(0),
+  _ram(ram)
+{
+  l4_calibrate_tsc(l4re_kip());
+
+  // l4_tsc_to_ns() computes (tsc * l4_scaler_tsc_to_ns) >> 27.
+  l4_uint64_t tsc_hz = (1000000000ULL << 27) / l4_scaler_tsc_to_ns;
+  time_scale(1000000000ULL, tsc_hz, &_tsc_shift, &_tsc_to_system_mul);
+  _flags = tsc_invariant() ? Pvclock_tsc_stable_bit : 0;
+
+  trace().printf("TSC frequency %llu Hz, scaler 0x%x, shift %d, %s TSC\n",
+                 tsc_hz, _tsc_to_system_mul, _tsc_shift,
+                 _flags ? "stable" : "unstable");
+}
+
+bool
+Kvm_clock::tsc_invariant()
+{
+  l4_umword_t ax, bx, cx, dx;
+  l4util_cpu_cpuid(0x80000000, &ax, &bx, &cx, &dx);
+  if (ax < 0x80000007)
+    return false;
+
+  l4util_cpu_cpuid(0x80000007, &ax, &bx, &cx, &dx);
+  return dx & (1UL << 8);
+}
+
+bool
+Kvm_clock::read_msr(unsigned msr, l4_uint64_t *value, unsigned vcpu_no)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  switch (msr)
+    {
+    case 0x4b564d00: // MSR_KVM_WALL_CLOCK_NEW
+      *value = _wall_clock_msr;
+      return true;
+
+    case 0x4b564d01: // MSR_KVM_SYSTEM_TIME_NEW
+      *value = vcpu_no < _system_time_msrs.size()
+               ? _system_time_msrs[vcpu_no] : 0;
+      return true;
+
+    default:
+      return false;
+    }
+}
+
+bool
+Kvm_clock::write_msr(unsigned msr, l4_uint64_t value, unsigned vcpu_no)
+{
+  switch (msr)
+    {
+    case 0x4b564d00: // MSR_KVM_WALL_CLOCK_NEW
+      trace().printf("KVMclock: write to msr 0x4b564d00 0x%llx\n", value);
+      set_wall_clock(value);
+      break;
+
+    case 0x4b564d01: // MSR_KVM_SYSTEM_TIME_NEW
+      trace().printf("KVMclock: write to msr 0x4b564d01 0x%llx (vCPU %u)\n",
+                     value, vcpu_no);
+      setup_vcpu_time(vcpu_no, value);
+      break;
+
+    // NOTE: below function is disabled via CPUID leave 0x4000'0001 and
+    // shouldn't be invoked by a guest.
+    case 0x4b564d02: // MSR_KVM_ASYNC_PF_EN
+      printf("WARNING: KVM async pf not implemented.\n");
+      break;
+
+    default: return false;
+    }
+
+  return true;
+}
+
+void
+Kvm_clock::save_state(Vmm::Snapshot_writer &w)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  w.put(system_time(l4_rdtsc()));
+  w.put(_wall_clock_msr);
+  w.put(l4_uint32_t(_system_time_msrs.size()));
+  for (auto m : _system_time_msrs)
+    w.put(m);
+}
+
+void
+Kvm_clock::restore_state(Vmm::Snapshot_reader &r)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // The guest time continues where it was saved, based on the TSC of the
+  // restoring host.
+  r.get(&_ref_ns);
+  _ref_tsc = l4_rdtsc();
+  r.get(&_wall_clock_msr);
+
+  l4_uint32_t num;
+  r.get(&num);
+  _system_time_msrs.resize(num);
+  for (auto &m : _system_time_msrs)
+    {
+      r.get(&m);
+      // The areas still contain the TSC reference of the saved VM.
+      if (m & 1)
+        publish(host_addr<Vcpu_time_info>(Vmm::Guest_addr(m & (-1ULL << 2))),
+                _ref_tsc);
+    }
+}
+
+l4_uint64_t
+Kvm_clock::system_time(l4_uint64_t tsc) const
+{
+  l4_uint64_t delta = tsc - _ref_tsc;
+  if (_tsc_shift < 0)
+    delta >>= -_tsc_shift;
+  else
+    delta <<= _tsc_shift;
+
+  return _ref_ns
+         + ((unsigned __int128)delta * _tsc_to_system_mul >> 32);
+}
+
+void
+Kvm_clock::set_wall_clock(l4_uint64_t msr_val)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _wall_clock_msr = msr_val;
+
+  // address must be 4-byte aligned
+  auto *cs = host_addr<Wall_clock>(Vmm::Guest_addr(msr_val & (-1ULL << 2)));
+  trace().printf("set wall clock address: %p \n", cs);
+
+  // Wall clock time at system time 0.
+  l4_uint64_t ns = l4_tsc_to_ns(_ref_tsc) - _ref_ns;
+
+  l4_uint32_t version = cs->version | 1;
+  cs->version = version;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  cs->sec = ns / 1000000000ULL;
+  cs->nsec = ns % 1000000000ULL;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  cs->version = version + 1;
+}
+
+void
+Kvm_clock::setup_vcpu_time(unsigned vcpu_no, l4_uint64_t msr_val)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (vcpu_no >= _system_time_msrs.size())
+    _system_time_msrs.resize(vcpu_no + 1);
+  _system_time_msrs[vcpu_no] = msr_val;
+
+  if (!(msr_val & 1))
+    return;
+
+  // address must be 4-byte aligned
+  auto *vti =
+    host_addr<Vcpu_time_info>(Vmm::Guest_addr(msr_val & (-1ULL << 2)));
+  trace().printf("set system time address of vCPU %u: %p\n", vcpu_no, vti);
+
+  publish(vti, l4_rdtsc());
+}
+
+void
+Kvm_clock::publish(Vcpu_time_info *vti, l4_uint64_t tsc) const
+{
+  // An odd version tells the guest that the area is being updated.
+  l4_uint32_t version = vti->version | 1;
+  vti->version = version;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  vti->tsc_timestamp = tsc;
+  vti->system_time = system_time(tsc);
+  vti->tsc_to_system_mul = _tsc_to_system_mul;
+  vti->tsc_shift = _tsc_shift;
+  vti->flags = _flags;
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  vti->version = version + 1;
+}
+
+} // namespace
@@ -11,15 +11,31 @@
 #include <l4/sys/types.h>
 #include <l4/util/rdtsc.h>
 
+#include <mutex>
+#include <vector>
+
 #include "debug.h"
 #include "mem_types.h"
 #include "msr_device.h"
-#include "vm_memmap.h"
-#include "ds_mmio_mapper.h"
+#include "snapshot.h"
+#include "vm_ram.h"
 
 namespace Vdev {
 
-class Kvm_clock : public Vdev::Timer, public Vmm::Msr_device, public Device
+/**
+ * Paravirtualized KVM clock.
+ *
+ * Every vCPU registers its own pvclock area. An area is written when the
+ * vCPU enables it and afterwards only when the TSC reference of the clock
+ * changes, i.e. when a VM is restored from a snapshot. The guest computes
+ * the time from the TSC and the scale factors in the area. If the host TSC
+ * is invariant, the areas carry PVCLOCK_TSC_STABLE_BIT and the guest may
+ * use the clock without synchronizing the vCPUs.
+ */
+class Kvm_clock
+: public Vmm::Msr_device,
+  public Device,
+  public Snapshot_state
 {
   struct Wall_clock
   {
@@ -39,130 +55,51 @@ class Kvm_clock : public Vdev::Timer, public Vmm::Msr_device, public Device
     l4_uint8_t    pad[2];
   } __attribute__((__packed__));
 
-public:
-  Kvm_clock(Vmm::Vm_mem const *memmap)
-  : _boottime(l4_rdtsc()),
-    _vcpu_time(nullptr),
-    _vcpu_time_enable(false),
-    _memmap(memmap)
-  {
-    l4_calibrate_tsc(l4re_kip());
-  }
-
-  bool read_msr(unsigned, l4_uint64_t *, unsigned) override
+  enum : l4_uint8_t
   {
-    // Nothing to read, above structures are memory mapped in the guest.
-    return false;
-  }
+    Pvclock_tsc_stable_bit = 1,
+  };
 
-  bool write_msr(unsigned msr, l4_uint64_t addr, unsigned) override
-  {
-    switch (msr)
-    {
-      case 0x4b564d00: // MSR_KVM_WALL_CLOCK_NEW
-        {
-          trace().printf("KVMclock: write to msr 0x4b564d00 0x%llx\n", addr);
-
-          // address must be 4-byte aligned
-          auto gaddr = Vmm::Guest_addr(addr & (-1UL << 2));
-          set_wall_clock(static_cast<Wall_clock *>(host_addr(gaddr)));
-          break;
-        }
-
-      case 0x4b564d01: // MSR_KVM_SYSTEM_TIME_NEW
-        {
-          trace().printf("KVMclock: write to msr 0x4b564d01 0x%llx\n", addr);
-
-          _vcpu_time_enable = addr & 1;
-
-          // address must be 4-byte aligned
-          auto gaddr = Vmm::Guest_addr(addr & (-1UL << 2));
-          setup_vcpu_time(static_cast<Vcpu_time_info *>(host_addr(gaddr)));
-          break;
-        }
-
-      // NOTE: below functions are disabled via CPUID leave 0x4000'0001 and
-      // shouldn't be invoked by a guest.
-      case 0x4b564d02: // MSR_KVM_ASYNC_PF_EN
-        printf("WARNING: KVM async pf not implemented.\n");
-        break;
-
-      case 0x4b564d03: // MSR_KVM_STEAL_TIME
-        printf("WARNING: KVM steal time not implemented.\n");
-        break;
-
-      case 0x4b564d04: // MSR_KVM_EOI_EN
-        printf("WARNING: KVM EIO not implemented.\n");
-        break;
-
-      default: return false;
-    }
-
-    return true;
-  }
+public:
+  explicit Kvm_clock(Vmm::Vm_ram const *ram);
 
-  void tick() override
-  {
-    if (_vcpu_time && _vcpu_time_enable)
-      {
-        auto now = l4_rdtsc();
+  bool read_msr(unsigned msr, l4_uint64_t *value, unsigned vcpu_no) override;
+  bool write_msr(unsigned msr, l4_uint64_t value, unsigned vcpu_no) override;
 
-        std::lock_guard<std::mutex> lock(_mutex);
+  void save_state(Vmm::Snapshot_writer &w) override;
+  void restore_state(Vmm::Snapshot_reader &r) override;
 
-        ++_vcpu_time->version;
-        _vcpu_time->tsc_timestamp = now;
-        _vcpu_time->system_time = l4_tsc_to_ns(now);
-        ++_vcpu_time->version; // XXX make atomic barrier
-      }
-  }
+  /**
+   * Check whether the TSC of the host runs at a constant rate.
+   */
+  static bool tsc_invariant();
 
 private:
-  void set_wall_clock(Wall_clock *cs) const
-  {
-    trace().printf("set wall clock address: %p \n", cs);
-
-    cs->version = 1;
-    l4_tsc_to_s_and_ns(_boottime, &(cs->sec), &(cs->nsec));
-    cs->version = 0;
-  }
-
-  void setup_vcpu_time(Vcpu_time_info *vti)
-  {
-    trace().printf("set system time address: %p: enable: %i, scaler 0x%x\n",
-                   vti, _vcpu_time_enable, l4_scaler_tsc_to_ns);
-
-    vti->version = 0;
-    vti->tsc_to_system_mul = l4_scaler_tsc_to_ns;
-    vti->tsc_shift = 5;
-    vti->flags = 0;
-    _vcpu_time = vti;
-  }
+  l4_uint64_t system_time(l4_uint64_t tsc) const;
+  void set_wall_clock(l4_uint64_t msr_val);
+  void setup_vcpu_time(unsigned vcpu_no, l4_uint64_t msr_val);
+  void publish(Vcpu_time_info *vti, l4_uint64_t tsc) const;
 
-  void *host_addr(Vmm::Guest_addr addr) const
+  template <typename T>
+  T *host_addr(Vmm::Guest_addr addr) const
   {
-    Vmm::Vm_mem::const_iterator f = _memmap->find(addr);
-    if (f == _memmap->end())
-      {
-        Dbg().printf("Fail: 0x%lx memory not found.\n", addr.get());
-        L4Re::chksys(-L4_EINVAL,
-                     "Guest passes a valid RAM address.");
-      }
-
-    Ds_handler const *ds = dynamic_cast<Ds_handler *>(f->second.get());
-    if (!ds)
-      L4Re::chksys(-L4_EINVAL,
-                   "Dataspace handler for guest RAM registered\n");
-
-    return reinterpret_cast<void *>(
-      (ds->local_start() + (addr.get() - f->first.start)).get());
+    // The structure must be completely in RAM.
+    return _ram->guest2host<T *>(Vmm::Region::ss(addr, sizeof(T)));
   }
 
   static Dbg trace() { return Dbg(Dbg::Dev, Dbg::Warn, "KVMclock"); }
 
-  l4_cpu_time_t _boottime;
-  Vcpu_time_info *_vcpu_time;
-  bool _vcpu_time_enable;
-  Vmm::Vm_mem const *_memmap;
+  // System time `_ref_ns` corresponds to TSC value `_ref_tsc`.
+  l4_uint64_t _ref_tsc;
+  l4_uint64_t _ref_ns;
+  l4_uint32_t _tsc_to_system_mul;
+  l4_int8_t _tsc_shift;
+  l4_uint8_t _flags;
+
+  l4_uint64_t _wall_clock_msr = 0;
+  // Value of MSR_KVM_SYSTEM_TIME_NEW per vCPU
+  std::vector<l4_uint64_t> _system_time_msrs;
+  Vmm::Vm_ram const *_ram;
   std::mutex _mutex;
 };
 
@@ -29,7 +29,7 @@ static const char *reg_names_x86_8h[] = {
 enum Reg_names_amd64 { Reg_rax, Reg_rcx, Reg_rdx, Reg_rbx, Reg_rsp, Reg_rbp,
                        Reg_rsi, Reg_rdi, Reg_r8, Reg_r9, Reg_r10, Reg_r11, Reg_r12,
                        Reg_r13, Reg_r14, Reg_r15,
-                       Reg_eax = Reg_rax
+                       Reg_eax = Reg_rax, Reg_esi = Reg_rsi, Reg_edi = Reg_rdi
                      };
 
 static const char *reg_names_x86_64[]
@@ -176,17 +176,93 @@ Decoder::l4mad_print_insn_info(l4_exc_regs_t *u, l4_addr_t pc)
   return 0;
 }
 
+/**
+ * Decode the ModRM byte at `pc` and the SIB byte and displacement following
+ * it.
+ *
+ * \param      u     Register state of the accessing CPU.
+ * \param      pc    Address of the ModRM byte.
+ * \param      rex   REX prefix of the instruction, 0 if none.
+ * \param[out] reg   Register operand (ModRM.reg extended by REX.R).
+ * \param[out] addr  Effective address of the memory operand.
+ * \param[out] len   Length of ModRM byte, SIB byte and displacement.
+ *
+ * \return False if the ModRM byte does not describe a memory operand.
+ *
+ * The address of a RIP-relative operand is reported as 0, as the register
+ * state lacks the instruction pointer of the guest.
+ */
+bool
+Decoder::decode_modrm(l4_exc_regs_t *u, l4_addr_t pc, unsigned char rex,
+                      unsigned char *reg, l4_addr_t *addr, unsigned char *len)
+{
+  unsigned char v = readval(pc, 1);
+  unsigned char rm  = v & 7;
+  unsigned char mod = v >> 6;
+  unsigned char l = 1;
+  l4_addr_t a = 0;
+
+  *reg = ((v >> 3) & 7) | (rex & REX_R ? 8 : 0);
+
+  trace().printf("reg=%d rm=%d mod=%d\n", *reg, rm, mod);
+
+  if (mod == 3)
+    return false;
+
+  if (rm == 4) // sib
+    {
+      unsigned char sibbyte = readval(pc + 1, 1);
+      unsigned char base = sibbyte & 7;
+      unsigned char index = ((sibbyte >> 3) & 7) | (rex & REX_X ? 8 : 0);
+      l += 1;
+
+      if (index != 4) // no index register
+        a = regval(u, index, 0, sizeof(long)) << (sibbyte >> 6);
+
+      if (mod == 0 && base == 5) // no base register
+        {
+          a += (int)readval(pc + l, 4);
+          l += 4;
+        }
+      else
+        a += regval(u, base | (rex & REX_B ? 8 : 0), 0, sizeof(long));
+    }
+  else if (mod == 0 && rm == 5)
+    {
+#ifdef ARCH_amd64
+      trace().printf("RIP-relative address not computed\n");
+#else
+      a = readval(pc + l, 4);
+#endif
+      l += 4;
+    }
+  else
+    a = regval(u, rm | (rex & REX_B ? 8 : 0), 0, sizeof(long));
+
+  if (mod == 1)
+    {
+      a += (signed char)readval(pc + l, 1);
+      l += 1;
+    }
+  else if (mod == 2)
+    {
+      a += (int)readval(pc + l, 4);
+      l += 4;
+    }
+
+  *addr = a;
+  *len = l;
+  return true;
+}
+
 bool
 Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
 {
-  enum {
-    REX_W = 8,
-    REX_R = 4,
-    REX_X = 2,
-    REX_B = 1,
-  };
   unsigned char ib;
   bool size_ovr = false;
+  bool addr_ovr = false;
+  bool seg_ovr = false;
+  bool rep = false;
   unsigned char pref_len = 0;
   bool segment_warned = false;
 
@@ -201,6 +277,7 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
         case 0x65:
           pc++;
           pref_len++;
+          seg_ovr = true;
           if (!segment_warned)
             Dbg().printf("Segment override not considered\n");
           segment_warned = true;
@@ -210,9 +287,23 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
           size_ovr = true;
           pref_len++;
           continue;
-        case 0xf0: // lock;
+        case 0x67:
+          pc++;
+          addr_ovr = true;
+          pref_len++;
+          continue;
+        case 0xf2: // repne; same as rep for MOVS/STOS
+        case 0xf3: // rep
+          pc++;
+          rep = true;
+          pref_len++;
+          continue;
         case 0x2e: // branch
         case 0x3e: // branch
+          // Also the CS and DS segment overrides.
+          seg_ovr = true;
+          // Falls through.
+        case 0xf0: // lock;
           pc++;
           pref_len++;
           continue;
@@ -232,6 +323,15 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
     }
 #endif
 
+  // Addresses are decoded with the default address size only.
+  if (addr_ovr)
+    {
+      Dbg().printf("Address-size override not supported\n");
+      return false;
+    }
+
+  // operand size of non-byte instructions
+  unsigned char opsize = (rex & REX_W) ? 8 : (size_ovr ? 2 : 4);
   bool byte = false;
   bool wr = false;
   switch (ib)
@@ -241,70 +341,21 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
       // Falls through.
     case 0xc7:
         {
-          unsigned char v = readval(pc + 1, 1);
-          unsigned char reg = (v >> 3) & 7;
-          unsigned char rm  = v & 7;
-          unsigned char mod = v >> 6;
-          unsigned char len = 2;
-          l4_addr_t a = 0;
-
-          if (mod == 3)
-            return false;
+          unsigned char reg, len;
+          l4_addr_t a;
 
-          if (reg)
+          if (!decode_modrm(u, pc + 1, rex, &reg, &a, &len))
             return false;
 
-          if (rm == 4) // sib
-            {
-              unsigned char sibbyte = readval(pc + 2, 1);
-              unsigned char mult = 1 << (sibbyte >> 6);
-              if (rex & REX_R)
-                reg |= 8;
-              a = regval(u, (sibbyte & 7) | (rex & REX_B ? 8 : 0) , 0, 4)
-                  + mult * regval(u, ((sibbyte >> 3) & 7) | (rex & REX_X ? 8 : 0), 0, 4);
-              len += 1;
-            }
-          else if (rex & REX_B)
-            rm |= 8;
-
-
-          trace().printf("reg=%d rm=%d mod=%d\n", reg, rm, mod);
-
-          if (mod == 0)
-            {
-              switch (rm)
-                {
-                case 4: break; // sib
-                case 5: len += 4;
-#ifdef ARCH_amd64
-                  // FIXME! RIP-relative addressing uses the next RIP not the
-                  // current one!
-                  // a = u->ip + (l4_mword_t)readval(pc + 2, 4);
-                  trace().printf("RIP-relative addressing not supported\n");
-                  return false;
-#else
-                  a = readval(pc + 2, 4);
-#endif
-                  break;
-                default: a = regval(u, rm, 0, 4); break;
-                }
-            }
-          else if (mod == 1 || mod == 2)
-            {
-              if (rm != 4)
-                a += regval(u, rm, 0, 4);
-
-              unsigned s = mod == 1 ? 1 : 4;
-              a += readval(pc + 2 + (rm == 4), s);
-              len += s;
-            }
-
+          if (reg & 7)
+            return false;
 
+          len += 1;
           unsigned char immlen = byte ? 1 : (size_ovr ? 2 : 4);
           trace().printf("len=%d imml=%d\n", len, immlen);
           l4_umword_t imm = readval(pc + len, immlen);
           len += immlen;
-          op->set(Write, (rex & REX_W) ? 8 : immlen, len + pref_len);
+          op->set(Write, byte ? 1 : opsize, len + pref_len);
 #ifdef ARCH_amd64
           if (rex & REX_W && imm & (1 << 31))
             imm |= 0xffffffffULL << 32;
@@ -345,6 +396,37 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
         }
       return true;
 
+    // Whether MOVS reads or writes the MMIO region depends on which of its
+    // operands is RAM, which the caller determines.
+    case 0xa4: // movs a, a
+      byte = true;
+      // Falls through.
+    case 0xa5:
+      // The source address is taken from %esi without its segment.
+      if (seg_ovr)
+        {
+          Dbg().printf("Segment override on MOVS source not supported\n");
+          return false;
+        }
+
+      op->set(Write, byte ? 1 : opsize, 1 + pref_len);
+      op->string = true;
+      op->rep = rep;
+      src->set_mem(regval(u, Reg_esi, 0, sizeof(long)));
+      tgt->set_mem(regval(u, Reg_edi, 0, sizeof(long)));
+      return true;
+
+    case 0xaa: // stos %al, a
+      byte = true;
+      // Falls through.
+    case 0xab: // stos %eax, a
+      op->set(Write, byte ? 1 : opsize, 1 + pref_len);
+      op->string = true;
+      op->rep = rep;
+      src->set_reg(Reg_eax);
+      tgt->set_mem(regval(u, Reg_edi, 0, sizeof(long)));
+      return true;
+
     // write
     case 0x88: // mov %, a
     case 0x89: // mov %, a
@@ -354,54 +436,16 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
     case 0x8a: // mov a, %
     case 0x8b: // mov a, %
         {
-          unsigned char v = readval(pc + 1, 1);
-          unsigned char reg = (v >> 3) & 7;
-          unsigned char rm  = v & 7;
-          unsigned char mod = v >> 6;
-          unsigned char len = 2;
+          unsigned char reg, len;
+          l4_addr_t a;
 
           if (!(ib & 1))
             byte = true;
 
-          //trace().printf("%08lx: reg=%d rm=%d mod=%d\n", pc, reg, rm, mod);
-
-          l4_addr_t a = 0;
-
-          if (mod == 3)
+          if (!decode_modrm(u, pc + 1, rex, &reg, &a, &len))
             return false;
 
-          if (rm == 4) // sib
-            {
-              unsigned char sibbyte = readval(pc + 2, 1);
-              unsigned char mult = 1 << (sibbyte >> 6);
-              a = regval(u, sibbyte & 7, 0, 4)
-                  + mult * regval(u, (sibbyte >> 3) & 7, 0, 4);;
-              len += 1;
-            }
-
-          if (mod == 0)
-            {
-              switch (rm)
-                {
-                case 4: break; // sib
-                case 5: len += 4; a = readval(pc + 2, 4); break;
-                default: a = regval(u, rm, 0, 4); break;
-                }
-            }
-          else if (mod == 1 || mod == 2)
-            {
-              if (rm != 4)
-                a += regval(u, rm, 0, 4);
-
-              unsigned s = mod == 1 ? 1 : 4;
-              unsigned tmp = readval(pc + 2 + (rm == 4), s);
-              a += s == 1 ? (signed char)tmp : (signed int)tmp;
-              len += s;
-            }
-
-          op->set(wr ? Write : Read,
-                  (rex & REX_W) ? 8 : (byte ? 1 : (size_ovr ? 2 : 4)),
-                  len + pref_len);
+          op->set(wr ? Write : Read, byte ? 1 : opsize, 1 + len + pref_len);
           unsigned shift = 0;
           if (!rex && byte && reg > 3)
             {
@@ -425,6 +469,61 @@ Decoder::decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src)
         }
       return true;
       break;
+
+#ifdef ARCH_amd64
+    case 0x63: // movsxd a, %
+        {
+          unsigned char reg, len;
+          l4_addr_t a;
+
+          if (!decode_modrm(u, pc + 1, rex, &reg, &a, &len))
+            return false;
+
+          // The source is as wide as the operand, but at most 32 bit.
+          op->set(Read, opsize < 4 ? opsize : 4, 1 + len + pref_len);
+          op->reg_width = opsize;
+          op->sign_extend = opsize == 8;
+          src->set_mem(a);
+          tgt->set_reg(reg);
+        }
+      return true;
+#endif
+
+    case 0x0f: // two-byte opcodes
+        {
+          unsigned char ib2 = getbyte(pc + 1);
+          unsigned char reg, len;
+          l4_addr_t a;
+
+          switch (ib2)
+            {
+            case 0xb6: // movzx a(8), %
+            case 0xb7: // movzx a(16), %
+            case 0xbe: // movsx a(8), %
+            case 0xbf: // movsx a(16), %
+              if (!decode_modrm(u, pc + 2, rex, &reg, &a, &len))
+                return false;
+
+              op->set(Read, (ib2 & 1) ? 2 : 1, 2 + len + pref_len);
+              op->reg_width = opsize;
+              op->sign_extend = ib2 & 8;
+              src->set_mem(a);
+              tgt->set_reg(reg);
+              return true;
+
+            case 0xc3: // movnti %, a
+              if (!decode_modrm(u, pc + 2, rex, &reg, &a, &len))
+                return false;
+
+              op->set(Write, (rex & REX_W) ? 8 : 4, 2 + len + pref_len);
+              src->set_reg(reg);
+              tgt->set_mem(a);
+              return true;
+            }
+
+          Dbg().printf("No valid 'ib': 0x0f 0x%x\n", ib2);
+        }
+      break;
     default:
       Dbg().printf("No valid 'ib': 0x%x\n", ib);
       break;
@@ -44,12 +44,24 @@ struct Op
   Access_type atype;
   unsigned char access_width;
   unsigned char insn_len;
+  /// Width of the target register of a read, larger for MOVZX/MOVSX.
+  unsigned char reg_width;
+  /// The value read is sign-extended to `reg_width` (MOVSX).
+  bool sign_extend;
+  /// String instruction (MOVS/STOS) addressing its operands via RSI/RDI.
+  bool string;
+  /// The string instruction is repeated RCX times (REP prefix).
+  bool rep;
 
   void set(Access_type t, unsigned char aw, unsigned char il)
   {
     atype        = t;
     access_width = aw;
     insn_len     = il;
+    reg_width    = aw;
+    sign_extend  = false;
+    string       = false;
+    rep          = false;
   }
 };
 
@@ -67,8 +79,19 @@ public:
   bool decode(l4_exc_regs_t *u, l4_addr_t pc, Op *op, Desc *tgt, Desc *src);
 
 private:
+  enum
+  {
+    REX_W = 8,
+    REX_R = 4,
+    REX_X = 2,
+    REX_B = 1,
+  };
+
   static Dbg trace() { return Dbg(Dbg::Core, Dbg::Trace); }
 
+  bool decode_modrm(l4_exc_regs_t *u, l4_addr_t pc, unsigned char rex,
+                    unsigned char *reg, l4_addr_t *addr, unsigned char *len);
+
   char *desc_s(l4_exc_regs_t *u, char *buf, unsigned buflen, Desc *d,
                unsigned aw);
   void regname_bm_snprintf(l4_exc_regs_t *u, char *buf, unsigned buflen,
@@ -11,24 +11,20 @@
 #include <l4/l4virtio/virtqueue>
 
 #include "debug.h"
-#include "ds_mmio_mapper.h"
-#include "vm_memmap.h"
+#include "vm_ram.h"
 
 namespace Vmm {
 
 class Pt_walker
 {
 public:
-  Pt_walker(Vm_mem const *mmap, unsigned max_phys_addr_bit)
-  : _mmap(mmap),
+  Pt_walker(unsigned max_phys_addr_bit)
+  : _ram(nullptr),
     _levels {{Pml4_shift, Pml4_mask},
              {Pdpt_shift, Pdpt_mask},
              {Pd_shift, Pd_mask},
              {Pt_shift, Pt_mask}
             },
-    cached_start(-1),
-    cached_end(0),
-    cached_ds_local_start(0),
     _max_phys_addr_mask((1UL << max_phys_addr_bit) - 1)
   {
     trace().printf("PT_walker: MAXPHYSADDR bits %i\n", max_phys_addr_bit);
@@ -38,7 +34,39 @@ public:
     _phys_addr_mask_1g = _max_phys_addr_mask & ~((1UL << Phys_addr_1g) - 1);
   }
 
+  /**
+   * Set the guest RAM the page tables are read from.
+   */
+  void set_ram(Vm_ram const *ram)
+  { _ram = ram; }
+
+  /**
+   * Get the guest RAM the page tables are read from.
+   */
+  Vm_ram const *ram() const
+  { return _ram; }
+
+  /**
+   * Translate a guest-virtual address into a VMM-virtual address.
+   *
+   * The range up to the end of the 4K page containing `virt_addr` is
+   * prepared for access.
+   */
   l4_uint64_t walk(l4_uint64_t cr3, l4_uint64_t virt_addr)
+  {
+    Guest_addr gpa = translate(cr3, virt_addr);
+    l4_size_t size = L4_PAGESIZE - (gpa.get() & ~L4_PAGEMASK);
+    return reinterpret_cast<l4_uint64_t>(
+             _ram->guest2host<char *>(Vmm::Region::ss(gpa, size)));
+  }
+
+  /**
+   * Translate a guest-virtual address into a guest-physical address.
+   *
+   * An exception is thrown if the address is not mapped by the page tables.
+   * The returned address is not necessarily backed by RAM.
+   */
+  Guest_addr translate(l4_uint64_t cr3, l4_uint64_t virt_addr)
   {
     trace().printf("cr3 0x%llx\n", cr3);
 
@@ -71,67 +99,28 @@ public:
         if (i < 3 && entry & Pagesize_bit)
           {
             if (i == 1)
-              return add_voffset(translate_to_table_base(entry & _phys_addr_mask_1g),
-                                 virt_addr & G1_offset_mask);
+              return Guest_addr((entry & _phys_addr_mask_1g)
+                                | (virt_addr & G1_offset_mask));
             if (i == 2)
-              return add_voffset(translate_to_table_base(entry & _phys_addr_mask_2m),
-                                 virt_addr & M2_offset_mask);
+              return Guest_addr((entry & _phys_addr_mask_2m)
+                                | (virt_addr & M2_offset_mask));
           }
       }
 
-    return add_voffset(translate_to_table_base(entry & _phys_addr_mask_4k),
-                       virt_addr & K4_offset_mask);
+    return Guest_addr((entry & _phys_addr_mask_4k)
+                      | (virt_addr & K4_offset_mask));
   }
 
 private:
-  Vm_mem::value_type const *addr_to_mem(Vmm::Guest_addr addr) const
-  {
-    Vm_mem::const_iterator f = _mmap->find(addr);
-    if (f == _mmap->end())
-      {
-        Dbg().printf("Fail: 0x%lx memory not found.\n", addr.get());
-        L4Re::chksys(-L4_EINVAL,
-                     "Memory used in page table walk is registered.");
-      }
-
-    return &*f;
-  }
-
-  Ds_handler const *mem_to_ds(Vm_mem::value_type const *mem) const
-  {
-    Ds_handler const *ds = dynamic_cast<Ds_handler *>(mem->second.get());
-    if (!ds)
-      L4Re::chksys(-L4_EINVAL,
-                   "Dataspace handler for page table memory registered\n");
-
-    return ds;
-  }
-
   l4_uint64_t *translate_to_table_base(l4_uint64_t addr)
   {
-    Vmm::Guest_addr ga(addr);
-    if (cached_start.get() == -1U || cached_start > ga || cached_end < ga)
-      {
-        auto const *cached_mem = addr_to_mem(ga);
-        cached_start = cached_mem->first.start;
-        cached_end = cached_mem->first.end;
-        cached_ds_local_start = mem_to_ds(cached_mem)->local_start();
-      }
-
-    if (ga + 512 * 8 > cached_end)
-      L4Re::chksys(-L4_EINVAL, "Page-table end within guest memory\n");
-
-    auto *ret = reinterpret_cast<l4_uint64_t *>(
-                  cached_ds_local_start + (ga - cached_start));
+    // The complete table must be in guest RAM.
+    auto *ret = _ram->guest2host<l4_uint64_t *>(
+                  Vmm::Region::ss(Vmm::Guest_addr(addr), 512 * 8));
     trace().printf("Ram_addr: addr 0x%llx --> %p\n", addr, ret);
     return ret;
   }
 
-  l4_uint64_t add_voffset(l4_uint64_t *addr, l4_uint64_t offset)
-  {
-    return reinterpret_cast<l4_uint64_t>(addr) + offset;
-  }
-
   void dump_level(l4_uint64_t *tbl)
   {
     trace().printf("Dumping page table %p\n", tbl);
@@ -213,13 +202,11 @@ private:
     Pt_levels = 4,
   };
 
-  Vm_mem const *_mmap;
+  Vm_ram const *_ram;
   Level const _levels[Pt_levels];
   l4_uint64_t _phys_addr_mask_4k;
   l4_uint64_t _phys_addr_mask_2m;
   l4_uint64_t _phys_addr_mask_1g;
-  Vmm::Guest_addr cached_start, cached_end;
-  l4_addr_t cached_ds_local_start;
   l4_uint64_t _max_phys_addr_mask;
 };
 
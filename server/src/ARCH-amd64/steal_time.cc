@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include <atomic>
+
+#include <l4/sys/thread>
+
+#include "steal_time.h"
+
+namespace {
+
+l4_kernel_clock_t
+thread_cpu_time()
+{
+  l4_kernel_clock_t us = 0;
+  // The invalid capability refers to the calling thread.
+  L4::Cap<L4::Thread> myself;
+  myself->stats_time(&us);
+  return us;
+}
+
+}
+
+namespace Vmm {
+
+bool
+Steal_time::write_msr(unsigned msr, l4_uint64_t value, unsigned vcpu_no)
+{
+  if (msr != Msr_kvm_steal_time || vcpu_no >= Cpu_dev::Max_cpus)
+    return false;
+
+  trace().printf("write to MSR_KVM_STEAL_TIME 0x%llx (vCPU %u)\n", value,
+                 vcpu_no);
+  enable(&_vcpus[vcpu_no], value);
+  return true;
+}
+
+void
+Steal_time::enable(Vcpu_steal *v, l4_uint64_t msr)
+{
+  v->msr = msr;
+  v->area = nullptr;
+  v->pin.reset();
+
+  if (!(msr & 1) || !_ram)
+    return;
+
+  // The area is 64-byte aligned, bits 1 to 5 are reserved.
+  auto addr = Guest_addr(msr & ~0x3fULL);
+  // Pinned before the lookup, so that the RAM cannot go meanwhile.
+  v->pin.set(_ram, addr, sizeof(Kvm_steal_time));
+  v->area = _ram->guest2host<Kvm_steal_time *>(
+    Region::ss(addr, sizeof(Kvm_steal_time)));
+
+  v->base = v->area->steal;
+  v->start_clock = l4_kip_clock(l4re_kip());
+  v->start_cpu = thread_cpu_time();
+  v->halted = 0;
+  v->steal = 0;
+  v->last_update = v->start_clock;
+}
+
+void
+Steal_time::publish(Vcpu_steal *v, l4_kernel_clock_t now)
+{
+  v->last_update = now;
+
+  l4_kernel_clock_t wall = now - v->start_clock;
+  l4_kernel_clock_t busy = thread_cpu_time() - v->start_cpu + v->halted;
+  // Steal time never decreases, though the clocks are not exact.
+  if (wall > busy && wall - busy > v->steal)
+    v->steal = wall - busy;
+
+  // An odd version tells the guest that the area is being updated.
+  auto *st = v->area;
+  l4_uint32_t version = st->version | 1;
+  st->version = version;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  st->steal = v->base + v->steal * 1000;
+  st->preempted = 0;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  st->version = version + 1;
+}
+
+void
+Steal_time::save_state(Snapshot_writer &w)
+{
+  for (auto const &v : _vcpus)
+    w.put(v.msr);
+}
+
+void
+Steal_time::restore_state(Snapshot_reader &r)
+{
+  // Accounting restarts from the steal time in the restored area.
+  for (auto &v : _vcpus)
+    {
+      l4_uint64_t msr;
+      r.get(&msr);
+      enable(&v, msr);
+    }
+}
+
+} // namespace
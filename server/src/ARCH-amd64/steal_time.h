@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/kip.h>
+#include <l4/sys/types.h>
+#include <l4/re/env>
+
+#include "cpu_dev.h"
+#include "debug.h"
+#include "msr_device.h"
+#include "snapshot.h"
+#include "vm_ram.h"
+
+namespace Vmm {
+
+/**
+ * Paravirtualized steal time (MSR_KVM_STEAL_TIME).
+ *
+ * The steal time of a vCPU is the time its thread was runnable but did not
+ * run. It is computed from the KIP clock and the CPU time of the vCPU
+ * thread, minus the time the vCPU was halted waiting for an interrupt, and
+ * published in the steal-time area the guest registered for the vCPU.
+ *
+ * All functions taking a vCPU number must run on the thread of that vCPU.
+ */
+class Steal_time : public Msr_device
+{
+  struct Kvm_steal_time
+  {
+    l4_uint64_t steal;
+    l4_uint32_t version;
+    l4_uint32_t flags;
+    l4_uint8_t preempted;
+    l4_uint8_t u8_pad[3];
+    l4_uint32_t pad[11];
+  } __attribute__((__packed__));
+
+  struct Vcpu_steal
+  {
+    Kvm_steal_time *area = nullptr;
+    /// Keeps the RAM of `area` plugged.
+    Ram_pin pin;
+    l4_uint64_t msr = 0;
+    /// Steal time in the area when it was enabled, in ns.
+    l4_uint64_t base = 0;
+    /// KIP clock and thread CPU time when the area was enabled, in us.
+    l4_kernel_clock_t start_clock = 0;
+    l4_kernel_clock_t start_cpu = 0;
+    l4_kernel_clock_t halted = 0;
+    l4_kernel_clock_t steal = 0;
+    l4_kernel_clock_t last_update = 0;
+  };
+
+public:
+  enum : unsigned
+  {
+    Msr_kvm_steal_time = 0x4b564d03,
+  };
+
+  void set_ram(Vm_ram const *ram) { _ram = ram; }
+
+  bool read_msr(unsigned msr, l4_uint64_t *value, unsigned vcpu_no) override
+  {
+    if (msr != Msr_kvm_steal_time || vcpu_no >= Cpu_dev::Max_cpus)
+      return false;
+
+    *value = _vcpus[vcpu_no].msr;
+    return true;
+  }
+
+  bool write_msr(unsigned msr, l4_uint64_t value, unsigned vcpu_no) override;
+
+  /**
+   * Account time the vCPU was halted, which is not steal time.
+   */
+  void halted(unsigned vcpu_no, l4_kernel_clock_t us)
+  {
+    if (vcpu_no < Cpu_dev::Max_cpus)
+      _vcpus[vcpu_no].halted += us;
+  }
+
+  /**
+   * Publish the steal time of the vCPU, at most once per update interval.
+   */
+  void update(unsigned vcpu_no)
+  {
+    Vcpu_steal &v = _vcpus[vcpu_no];
+    if (!v.area)
+      return;
+
+    l4_kernel_clock_t now = l4_kip_clock(l4re_kip());
+    if (now - v.last_update < Update_interval_us)
+      return;
+
+    publish(&v, now);
+  }
+
+  void save_state(Snapshot_writer &w);
+  void restore_state(Snapshot_reader &r);
+
+private:
+  enum : l4_kernel_clock_t
+  {
+    Update_interval_us = 1000,
+  };
+
+  void enable(Vcpu_steal *v, l4_uint64_t msr);
+  void publish(Vcpu_steal *v, l4_kernel_clock_t now);
+
+  static Dbg trace() { return Dbg(Dbg::Cpu, Dbg::Trace, "steal"); }
+
+  Vm_ram const *_ram = nullptr;
+  Vcpu_steal _vcpus[Cpu_dev::Max_cpus];
+};
+
+} // namespace
@@ -1,4 +1,6 @@
 
+#include <l4/cxx/bitfield>
+#include <l4/cxx/minmax>
 #include <l4/util/cpu.h>
 
 #include "vcpu_ptr.h"
@@ -6,6 +8,57 @@
 #include "mad.h"
 #include "pt_walker.h"
 
+namespace {
+
+/**
+ * Target of a decoded MMIO access, kept in the Reg_mmio_read user data
+ * register until writeback_mmio().
+ */
+struct Mmio_target
+{
+  l4_umword_t raw = 0;
+
+  Mmio_target() = default;
+  explicit Mmio_target(l4_umword_t r) : raw(r) {}
+
+  /// Register a load writes to, in MAD order.
+  CXX_BITFIELD_MEMBER( 0,  3, reg, raw);
+  /// The load writes to the second byte of the register (AH to BH).
+  CXX_BITFIELD_MEMBER( 4,  4, high_byte, raw);
+  /// The value loaded is sign-extended to the register width.
+  CXX_BITFIELD_MEMBER( 5,  5, sign_extend, raw);
+  /// Width of the register written (Mem_access::Width).
+  CXX_BITFIELD_MEMBER( 6,  7, reg_width, raw);
+  /// String access, RDI is advanced by the elements accessed.
+  CXX_BITFIELD_MEMBER( 8,  8, string, raw);
+  /// MOVS, RSI is advanced as well.
+  CXX_BITFIELD_MEMBER( 9,  9, movs, raw);
+  /// Repeated string access, RCX is decremented.
+  CXX_BITFIELD_MEMBER(10, 10, rep, raw);
+  /// The direction flag is set, addresses are decremented.
+  CXX_BITFIELD_MEMBER(11, 11, backwards, raw);
+};
+
+/**
+ * Translate an access width in bytes to Mem_access::Width.
+ *
+ * \return False if the width is not supported.
+ */
+bool
+mem_width(unsigned char bytes, char *width)
+{
+  switch (bytes)
+    {
+    case 1: *width = Vmm::Mem_access::Wd8; return true;
+    case 2: *width = Vmm::Mem_access::Wd16; return true;
+    case 4: *width = Vmm::Mem_access::Wd32; return true;
+    case 8: *width = Vmm::Mem_access::Wd64; return true;
+    default: return false;
+    }
+}
+
+}
+
 namespace Vmm {
 
 void
@@ -39,6 +92,30 @@ Vcpu_ptr::determine_vmm_type()
 /// Mem_access::Kind::Other symbolises failure to decode.
 Mem_access
 Vcpu_ptr::decode_mmio() const
+{
+  L4mad::Desc src;
+  return decode_insn(&src);
+}
+
+Mem_access
+Vcpu_ptr::decode_doorbell() const
+{
+  L4mad::Desc src;
+  Mem_access m = decode_insn(&src);
+  // String stores are no doorbell writes; they take the regular MMIO path.
+  if (m.string)
+    m.access = Mem_access::Other;
+
+  return m;
+}
+
+/**
+ * Decode the MMIO access of the instruction at the current guest IP.
+ *
+ * \param[out] src  Source operand of the instruction.
+ */
+Mem_access
+Vcpu_ptr::decode_insn(L4mad::Desc *src) const
 {
   Mem_access m;
   m.access = Mem_access::Other;
@@ -61,20 +138,20 @@ Vcpu_ptr::decode_mmio() const
   l4_exc_regs_t *reg = reinterpret_cast<l4_exc_regs_t *>(&_s->r);
   using namespace L4mad;
   Op op;
-  Desc tgt, src;
+  Desc tgt;
   if (0)
     Decoder().l4mad_print_insn_info(reg, opcode);
 
-  if (!Decoder().decode(reg, opcode, &op, &tgt, &src))
+  if (!Decoder().decode(reg, opcode, &op, &tgt, src))
     return m;
 
-  switch(op.access_width)
+  if (!mem_width(op.access_width, &m.width))
+    return m;
+
+  if (op.string)
     {
-    case 1: m.width = Mem_access::Wd8; break;
-    case 2: m.width = Mem_access::Wd16; break;
-    case 4: m.width = Mem_access::Wd32; break;
-    case 8: m.width = Mem_access::Wd64; break;
-    default: return m;
+      decode_string(op, *src, &m);
+      return m;
     }
 
   if (tgt.dtype != L4mad::Desc_reg && tgt.dtype != L4mad::Desc_mem)
@@ -91,21 +168,189 @@ Vcpu_ptr::decode_mmio() const
   // translate to Mem_access;
   if (op.atype == L4mad::Read)
     {
+      Mmio_target t;
+      char reg_width;
+      if (!mem_width(op.reg_width, &reg_width))
+        return m;
+
+      t.reg() = tgt.val;
+      t.high_byte() = tgt.shift == 8;
+      t.sign_extend() = op.sign_extend;
+      t.reg_width() = reg_width;
+
       m.access = Mem_access::Load;
-      _s->user_data[Reg_mmio_read] = tgt.val >> tgt.shift;
+      _s->user_data[Reg_mmio_read] = t.raw;
     }
   else if (op.atype == L4mad::Write)
     {
+      if (src->dtype != L4mad::Desc_reg && src->dtype != L4mad::Desc_imm)
+        return m;
+
       m.access = Mem_access::Store;
-      // src.val is the register number in MAD order; which is inverse to
-      // register order in l4_vcpu_regs_t.
-      m.value = *decode_reg_ptr(src.val) >> src.shift;
+      m.value = src_value(*src);
     }
   // else unknown; Other already set.
 
   return m;
 }
 
+/**
+ * Complete the decoding of a string instruction (MOVS/STOS).
+ *
+ * One access covers the elements within the current page of each operand,
+ * which are contiguous in the VMM as well as in the device region. A
+ * repeated instruction is executed again for the remaining elements. If the
+ * direction flag is set, the elements are accessed one at a time.
+ *
+ * Of the operands of MOVS, exactly one must be in guest RAM.
+ */
+void
+Vcpu_ptr::decode_string(L4mad::Op const &op, L4mad::Desc const &src,
+                        Mem_access *m) const
+{
+  auto *vms = vm_state();
+  auto *regs = reinterpret_cast<l4_exc_regs_t *>(&_s->r);
+  auto *ptw = reinterpret_cast<Pt_walker *>(_s->user_data[Reg_ptw_ptr]);
+
+  Mmio_target t;
+  t.string() = 1;
+  t.rep() = op.rep;
+  t.backwards() = (vms->flags() & Vmx_state::Direction_bit) ? 1 : 0;
+
+  Mem_access::Kind access = Mem_access::Store;
+  l4_umword_t mmio_addr = regs->rdi;
+  l4_umword_t ram_addr = 0;
+  Guest_addr ram_gpa(0);
+
+  // Check whether the operand at guest-virtual `addr` is in guest RAM.
+  auto in_ram = [&](l4_umword_t addr) -> bool
+    {
+      try
+        {
+          ram_gpa = ptw->translate(vms->cr3(), addr);
+        }
+      catch (L4::Runtime_error &)
+        {
+          return false;
+        }
+      return ptw->ram()->is_ram(ram_gpa, 1);
+    };
+
+  if (src.dtype == L4mad::Desc_mem) // MOVS
+    {
+      t.movs() = 1;
+      if (in_ram(regs->rdi))
+        {
+          ram_addr = regs->rdi;
+          mmio_addr = regs->rsi;
+          access = Mem_access::Load;
+        }
+      else if (in_ram(regs->rsi))
+        ram_addr = regs->rsi;
+      else
+        {
+          Dbg().printf("MOVS without operand in guest RAM\n");
+          return;
+        }
+    }
+  else
+    m->value = src_value(src);
+
+  l4_uint64_t total = op.rep ? regs->rcx : 1;
+  l4_uint64_t count = t.backwards() ? cxx::min<l4_uint64_t>(total, 1) : total;
+
+  // Number of elements until the end of the page containing `addr`
+  auto in_page = [&op](l4_umword_t addr) -> l4_uint64_t
+    { return (L4_PAGESIZE - (addr & ~L4_PAGEMASK)) / op.access_width; };
+
+  count = cxx::min(count, in_page(mmio_addr));
+  if (t.movs())
+    count = cxx::min(count, in_page(ram_addr));
+
+  if (!count && total)
+    {
+      Dbg().printf("String access crossing a page boundary not supported\n");
+      return;
+    }
+
+  // Prepare exactly the RAM range accessed, whatever the guest page size.
+  l4_addr_t buf = 0;
+  if (t.movs() && count)
+    buf = ptw->ram()->guest2host<l4_addr_t>(
+            Region::ss(ram_gpa, l4_size_t(count) << m->width));
+
+  m->access = access;
+  m->string = true;
+  m->partial = count < total;
+  m->count = count;
+  m->buf = buf;
+  _s->user_data[Reg_mmio_read] = t.raw;
+}
+
+void
+Vcpu_ptr::writeback_mmio(Mem_access const m)
+{
+  Mmio_target t(_s->user_data[Reg_mmio_read]);
+
+  if (t.string())
+    {
+      auto *regs = reinterpret_cast<l4_exc_regs_t *>(&_s->r);
+      l4_umword_t delta = l4_umword_t(m.count) << m.width;
+      if (t.backwards())
+        delta = -delta;
+
+      regs->rdi += delta;
+      if (t.movs())
+        regs->rsi += delta;
+      if (t.rep())
+        regs->rcx -= m.count;
+
+      return;
+    }
+
+  // used to write read value back to register it is read to.
+  l4_uint64_t value = m.value;
+  unsigned bits = 8U << m.width;
+  if (bits < 64)
+    {
+      value &= (1ULL << bits) - 1;
+      if (t.sign_extend() && (value & (1ULL << (bits - 1))))
+        value |= ~0ULL << bits;
+    }
+
+  l4_umword_t *reg = decode_reg_ptr(t.reg());
+  switch (t.reg_width())
+    {
+    case Mem_access::Wd8:
+      {
+        unsigned shift = t.high_byte() ? 8 : 0;
+        *reg = (*reg & ~(0xffUL << shift)) | ((value & 0xff) << shift);
+        break;
+      }
+    case Mem_access::Wd16:
+      *reg = (*reg & ~0xffffUL) | (value & 0xffff);
+      break;
+    case Mem_access::Wd32:
+      // A 32-bit register write clears the upper half of the register.
+      *reg = value & 0xffffffffUL;
+      break;
+    default:
+      *reg = value;
+      break;
+    }
+}
+
+l4_uint64_t
+Vcpu_ptr::src_value(L4mad::Desc const &src) const
+{
+  if (src.dtype == L4mad::Desc_imm)
+    return src.val;
+
+  // src.val is the register number in MAD order; which is inverse to
+  // register order in l4_vcpu_regs_t.
+  return *decode_reg_ptr(src.val) >> src.shift;
+}
+
 l4_umword_t *
 Vcpu_ptr::decode_reg_ptr(int value) const
 {
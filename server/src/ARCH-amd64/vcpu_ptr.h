@@ -12,6 +12,8 @@
 #include "mem_access.h"
 #include "vm_state.h"
 
+namespace L4mad { struct Desc; struct Op; }
+
 namespace Vmm {
 
 class Pt_walker;
@@ -48,11 +50,26 @@ public:
 
   Mem_access decode_mmio() const;
 
-  void writeback_mmio(Mem_access const m)
-  {
-    // used to write read value back to register it is read to.
-    *decode_reg_ptr(_s->user_data[Reg_mmio_read]) = m.value;
-  }
+  /**
+   * Decode a store to a doorbell register.
+   *
+   * Only needed for doorbells whose value matters. Stores that are
+   * identified by their address alone are handled by Mmio_doorbell_t
+   * without decoding the instruction.
+   *
+   * \return The store access including the value written or an access of
+   *         kind `Mem_access::Other` if the instruction is no store.
+   */
+  Mem_access decode_doorbell() const;
+
+  /**
+   * Complete an MMIO access decoded by decode_mmio().
+   *
+   * Writes the value of a load to its target register. Of a string access,
+   * the address registers and, if the instruction is repeated, the count
+   * register are advanced by the number of elements accessed.
+   */
+  void writeback_mmio(Mem_access const m);
 
   void reset()
   {
@@ -74,6 +91,10 @@ private:
 
   Vm_state_t determine_vmm_type();
   void create_state(Vm_state_t type);
+  Mem_access decode_insn(L4mad::Desc *src) const;
+  void decode_string(L4mad::Op const &op, L4mad::Desc const &src,
+                     Mem_access *m) const;
+  l4_uint64_t src_value(L4mad::Desc const &src) const;
   l4_umword_t *decode_reg_ptr(int value) const;
 
 }; // class Vcpu_ptr
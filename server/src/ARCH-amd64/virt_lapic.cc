@@ -31,7 +31,11 @@ Virt_lapic::Virt_lapic(unsigned id, l4_addr_t baseaddr)
   _lapic_x2_id(id),
   _lapic_version(Lapic_version),
   _last_ticks_tsc(0),
-  _x2apic_enabled(false)
+  _x2apic_enabled(false),
+  _pv_eoi_msr(0),
+  _pv_eoi(nullptr),
+  _pv_eoi_pending(false),
+  _eoi_handler(nullptr)
 {
   trace().printf("Virt_lapic ctor; ID 0x%x\n", id);
 
@@ -96,6 +100,59 @@ Virt_lapic::tick()
                   l4_rdtsc(), _timer.raw);
     }
 
+  int irq = timer_expired();
+  if (irq >= 0)
+    irq_trigger(irq);
+}
+
+void
+Virt_lapic::check_timer()
+{
+  int irq;
+  {
+    std::lock_guard<std::mutex> lock(_tmr_mutex);
+    irq = timer_expired();
+  }
+
+  // Called on the vCPU thread, which picks up the interrupt on its own.
+  if (irq >= 0)
+    {
+      std::lock_guard<std::mutex> lock(_int_mutex);
+      if (_irq_queued[irq] < UINT_MAX)
+        ++_irq_queued[irq];
+    }
+}
+
+l4_uint64_t
+Virt_lapic::timer_deadline()
+{
+  std::lock_guard<std::mutex> lock(_tmr_mutex);
+
+  if (_timer.masked())
+    return 0;
+
+  if (_timer.tsc_deadline())
+    return _tsc_deadline;
+
+  if (_regs.tmr_cur > 0)
+    return _last_ticks_tsc
+           + l4_uint64_t(_regs.tmr_cur) * _timer_div.divisor();
+
+  return 0;
+}
+
+/**
+ * Advance the timer to the current TSC.
+ *
+ * \return Vector to inject for an expired timer or -1.
+ *
+ * Must be called with _tmr_mutex held.
+ */
+int
+Virt_lapic::timer_expired()
+{
+  int irq = -1;
+
   if (_timer.tsc_deadline())
     {
       if (_tsc_deadline > 0 && _tsc_deadline <= l4_rdtsc())
@@ -103,7 +160,7 @@ Virt_lapic::tick()
           if (_timer.masked())
             _timer.pending() = 1;
           else
-            irq_trigger(_timer.vector());
+            irq = _timer.vector();
 
           _tsc_deadline = 0;
         }
@@ -112,9 +169,10 @@ Virt_lapic::tick()
     {
       l4_kernel_clock_t current_tsc = l4_rdtsc();
       l4_kernel_clock_t tsc_diff = current_tsc - _last_ticks_tsc;
-      _last_ticks_tsc = current_tsc;
 
       tsc_diff /= _timer_div.divisor();
+      // Keep the remainder for the next update.
+      _last_ticks_tsc += tsc_diff * _timer_div.divisor();
 
       if (_regs.tmr_cur < tsc_diff)
         _regs.tmr_cur = 0;
@@ -126,22 +184,26 @@ Virt_lapic::tick()
           if (_timer.masked())
             _timer.pending() = 1;
           else
-            irq_trigger(_timer.vector());
+            irq = _timer.vector();
 
           if (_timer.periodic())
             _regs.tmr_cur = _regs.tmr_init;
         }
     }
+
+  return irq;
 }
 
 /// Update the pending interrupt array and send an interrupt to the vCPU.
 void
-Virt_lapic::irq_trigger(l4_uint32_t irq)
+Virt_lapic::irq_trigger(l4_uint32_t irq, bool level)
 {
     {
       std::lock_guard<std::mutex> lock(_int_mutex);
       if (_irq_queued[irq] < UINT_MAX)
         ++_irq_queued[irq];
+      if (level)
+        _regs.tmr[irq / 32] |= 1U << (irq % 32);
     }
 
   _lapic_irq->trigger();
@@ -162,6 +224,110 @@ Virt_lapic::next_pending_irq()
   return -1;
 }
 
+void
+Virt_lapic::irq_injected(unsigned irq)
+{
+  std::lock_guard<std::mutex> lock(_int_mutex);
+
+  _regs.isr[irq / 32] |= 1U << (irq % 32);
+}
+
+void
+Virt_lapic::offer_pv_eoi()
+{
+  if (!_pv_eoi || _pv_eoi_pending)
+    return;
+
+  std::lock_guard<std::mutex> lock(_int_mutex);
+
+  int vector = -1;
+  for (int i = 0; i < 8; ++i)
+    if (_regs.isr[i])
+      {
+        // More than one interrupt in service.
+        if (vector >= 0 || (_regs.isr[i] & (_regs.isr[i] - 1)))
+          return;
+
+        vector = i * 32 + __builtin_ctz(_regs.isr[i]);
+      }
+
+  // An EOI in memory is only noticed at the next exit. Interrupts of
+  // devices waiting for the EOI therefore use the EOI register.
+  if (vector < 0 || _sources[vector]
+      || (_regs.tmr[vector / 32] & (1U << (vector % 32))))
+    return;
+
+  for (int i = 0; i < 256; ++i)
+    if (_irq_queued[i] > 0)
+      return;
+
+  *_pv_eoi |= Pv_eoi_bit;
+  _pv_eoi_pending = true;
+}
+
+void
+Virt_lapic::set_pv_eoi(l4_uint64_t msr, l4_uint32_t *flag)
+{
+  // The flag was looked up again, e.g. after restoring a snapshot.
+  if (flag && msr == _pv_eoi_msr && _pv_eoi_pending)
+    {
+      _pv_eoi = flag;
+      return;
+    }
+
+  if (_pv_eoi_pending && _pv_eoi)
+    {
+      // Complete an EOI signalled at the old location or withdraw the flag,
+      // so that the guest uses the EOI register.
+      if (*_pv_eoi & Pv_eoi_bit)
+        *_pv_eoi &= ~Pv_eoi_bit;
+      else
+        eoi();
+    }
+
+  _pv_eoi_pending = false;
+  _pv_eoi_msr = msr;
+  _pv_eoi = flag;
+}
+
+/**
+ * Clear the highest priority interrupt in service.
+ *
+ * The EOI of a level-triggered interrupt is broadcast to the EOI handler.
+ */
+void
+Virt_lapic::eoi()
+{
+  cxx::Ref_ptr<Irq_source> src;
+  unsigned vector = 0;
+  bool level = false;
+
+  {
+    std::lock_guard<std::mutex> lock(_int_mutex);
+
+    for (int i = 7; i >= 0; --i)
+      if (_regs.isr[i])
+        {
+          unsigned bit = 31 - __builtin_clz(_regs.isr[i]);
+          vector = i * 32 + bit;
+          _regs.isr[i] &= ~(1U << bit);
+          if (_regs.tmr[i] & (1U << bit))
+            {
+              _regs.tmr[i] &= ~(1U << bit);
+              level = true;
+            }
+          src = _sources[vector];
+          break;
+        }
+  }
+
+  if (src)
+    src->eoi();
+
+  if (level && _eoi_handler)
+    _eoi_handler->eoi(vector);
+}
+
 bool
 Virt_lapic::is_irq_pending()
 {
@@ -174,6 +340,44 @@ Virt_lapic::is_irq_pending()
   return false;
 }
 
+void
+Virt_lapic::save_state(Vmm::Snapshot_writer &w)
+{
+  std::lock_guard<std::mutex> tlock(_tmr_mutex);
+  std::lock_guard<std::mutex> ilock(_int_mutex);
+
+  w.put(_regs);
+  w.put(_timer.raw);
+  w.put(_timer_div.raw);
+  w.put(_tsc_deadline);
+  w.put(_x2apic_enabled);
+  w.put(_irq_queued);
+  w.put(_pv_eoi_msr);
+  w.put(_pv_eoi_pending);
+}
+
+void
+Virt_lapic::restore_state(Vmm::Snapshot_reader &r)
+{
+  std::lock_guard<std::mutex> tlock(_tmr_mutex);
+  std::lock_guard<std::mutex> ilock(_int_mutex);
+
+  r.get(&_regs);
+  r.get(&_timer.raw);
+  r.get(&_timer_div.raw);
+  r.get(&_tsc_deadline);
+  r.get(&_x2apic_enabled);
+  r.get(&_irq_queued);
+  r.get(&_pv_eoi_msr);
+  r.get(&_pv_eoi_pending);
+  // The flag is looked up when the RAM is set.
+  _pv_eoi = nullptr;
+
+  // The TSC is not part of the snapshot. A running timer continues from
+  // where it was stopped, a TSC deadline fires according to the new TSC.
+  _last_ticks_tsc = l4_rdtsc();
+}
+
 bool
 Virt_lapic::read_msr(unsigned msr, l4_uint64_t *value) const
 {
@@ -292,6 +496,7 @@ Virt_lapic::write_msr(unsigned msr, l4_uint64_t value)
         {
           Dbg().printf("WARNING: write to EOI not zero, 0x%llx\n", value);
         }
+      eoi();
       break;
     case 0x828: _regs.esr = 0; break;
     case 0x82f: _regs.cmci = value; break;
@@ -313,11 +518,16 @@ Virt_lapic::write_msr(unsigned msr, l4_uint64_t value)
     case 0x836: _regs.lint[1] = value; break;
     case 0x837: _regs.err = value; break;
     case 0x838:
-      _regs.tmr_init = value;
-      _regs.tmr_cur = value;
-      if (value == 0)
-        _timer.disarm();
-      break;
+      {
+        std::lock_guard<std::mutex> lock(_tmr_mutex);
+        _regs.tmr_init = value;
+        _regs.tmr_cur = value;
+        // The count starts now.
+        _last_ticks_tsc = l4_rdtsc();
+        if (value == 0)
+          _timer.disarm();
+        break;
+      }
     case 0x83e: _timer_div = value; break;
     case 0x83f:
       Dbg().printf("TODO: self IPI\n");
@@ -339,19 +549,6 @@ Virt_lapic::write_msr(unsigned msr, l4_uint64_t value)
 
 namespace {
 
-  struct G : Vdev::Factory
-  {
-    cxx::Ref_ptr<Vdev::Device> create(Vdev::Device_lookup *devs,
-                                      Vdev::Dt_node const &) override
-    {
-      auto apics = devs->vmm()->apic_array();
-      return Vdev::make_device<Gic::Io_apic>(apics);
-    }
-  };
-
-  static G g;
-  static Vdev::Device_type d = {"intel,ioapic", nullptr, &g};
-
   struct F : Vdev::Factory
   {
     cxx::Ref_ptr<Vdev::Device> create(Vdev::Device_lookup *devs,
@@ -25,11 +25,24 @@
 #include "msr_device.h"
 #include "mem_types.h"
 #include "mmio_device.h"
+#include "snapshot.h"
+#include "vm_ram.h"
 
 using L4Re::Rm;
 
 namespace Gic {
 
+/**
+ * Receiver of the EOI broadcast for level-triggered interrupts.
+ */
+struct Eoi_handler
+{
+  virtual void eoi(unsigned vector) = 0;
+
+protected:
+  ~Eoi_handler() = default;
+};
+
 class Virt_lapic : public Vdev::Timer, public Ic
 {
   struct LAPIC_registers
@@ -128,17 +141,89 @@ public:
   // Timer interface
   void tick() override;
 
-  // APIC soft Irq to force VCPU to handle IRQs
-  void irq_trigger(l4_uint32_t irq);
+  /**
+   * Queue the timer interrupt if the timer expired.
+   *
+   * Must be called on the vCPU thread.
+   */
+  void check_timer();
+
+  /**
+   * TSC value at which the timer expires next.
+   *
+   * \return TSC value or 0 if the timer is not armed.
+   */
+  l4_uint64_t timer_deadline();
+
+  /**
+   * Queue an interrupt and notify the vCPU.
+   *
+   * \param irq    Vector of the interrupt.
+   * \param level  The interrupt is level-triggered; its EOI is broadcast to
+   *               the EOI handler.
+   */
+  void irq_trigger(l4_uint32_t irq, bool level = false);
+
+  void set_eoi_handler(Eoi_handler *handler) { _eoi_handler = handler; }
 
   // vCPU expected interface
   int next_pending_irq();
   bool is_irq_pending();
 
+  /**
+   * Mark an interrupt injected into the vCPU as in service.
+   */
+  void irq_injected(unsigned irq);
+
+  /**
+   * Take back the paravirtualized EOI offered by offer_pv_eoi().
+   *
+   * Completes the EOI if the guest signalled it in memory. Otherwise the
+   * flag is withdrawn, so that the guest uses the EOI register. Must be
+   * called on the vCPU thread after every exit.
+   */
+  void sync_pv_eoi()
+  {
+    if (!_pv_eoi_pending || !_pv_eoi)
+      return;
+
+    _pv_eoi_pending = false;
+    if (*_pv_eoi & Pv_eoi_bit)
+      *_pv_eoi &= ~Pv_eoi_bit;
+    else
+      eoi();
+  }
+
+  /**
+   * Let the guest acknowledge the interrupt in service in memory.
+   *
+   * Like KVM, this is only done if a single edge-triggered interrupt is in
+   * service, no device waits for its EOI and no other interrupt is
+   * pending, so that the EOI can wait for the next exit. Must be called on
+   * the vCPU thread before the vCPU is resumed.
+   */
+  void offer_pv_eoi();
+
+  /// Value of MSR_KVM_PV_EOI_EN
+  l4_uint64_t pv_eoi_msr() const { return _pv_eoi_msr; }
+
+  /**
+   * Set up paravirtualized EOI.
+   *
+   * \param msr   Value of MSR_KVM_PV_EOI_EN.
+   * \param flag  Host address of the EOI flag of the guest or nullptr if
+   *              paravirtualized EOI is disabled.
+   */
+  void set_pv_eoi(l4_uint64_t msr, l4_uint32_t *flag);
+
   // X2APIC MSR interface
   bool read_msr(unsigned msr, l4_uint64_t *value) const;
   bool write_msr(unsigned msr, l4_uint64_t value);
 
+  // Snapshot interface
+  void save_state(Vmm::Snapshot_writer &w);
+  void restore_state(Vmm::Snapshot_reader &r);
+
   l4_addr_t apic_base() const { return _lapic_memory_address; }
 
   l4_uint32_t logical_apic_id() const
@@ -183,6 +268,14 @@ public:
   l4_uint32_t task_prio_class() const { return _regs.tpr & 0xf0; }
 
 private:
+  enum : l4_uint32_t
+  {
+    Pv_eoi_bit = 1, // KVM_PV_EOI_ENABLED
+  };
+
+  void eoi();
+  int timer_expired();
+
   static Dbg trace() { return Dbg(Dbg::Irq, Dbg::Trace, "LAPIC"); }
   static Dbg warn() { return Dbg(Dbg::Irq, Dbg::Warn, "LAPIC"); }
 
@@ -200,6 +293,10 @@ private:
   bool _x2apic_enabled;
   unsigned _irq_queued[256];
   cxx::Ref_ptr<Irq_source> _sources[256];
+  l4_uint64_t _pv_eoi_msr;
+  l4_uint32_t *_pv_eoi;
+  bool _pv_eoi_pending;
+  Eoi_handler *_eoi_handler;
 }; // class Virt_lapic
 
 
@@ -213,6 +310,7 @@ class Lapic_array
     // XXX sync with Max_cpus
     Max_cores = 1,
     X2apic_msr_base = 0x800,
+    Msr_kvm_pv_eoi_en = 0x4b564d04,
     Lapic_mem_addr = 0xfee00000,
     Lapic_mem_size = 0x1000,
   };
@@ -225,13 +323,33 @@ public:
     assert((Lapic_mem_addr & _max_phys_addr_mask) == Lapic_mem_addr);
   }
 
-  bool send_to_logical_dest_id(l4_uint32_t did, unsigned vec) const
+  bool send_to_logical_dest_id(l4_uint32_t did, unsigned vec,
+                               bool level = false) const
   {
     bool sent = false;
     for (auto &lapic : _lapics)
       if (lapic && lapic->match_ldr(did))
         {
-          lapic->set(vec);
+          lapic->irq_trigger(vec, level);
+          sent = true;
+        }
+
+    return sent;
+  }
+
+  /**
+   * Send an interrupt to the local APIC with the given ID.
+   *
+   * The ID 0xff addresses all local APICs.
+   */
+  bool send_to_phys_dest_id(l4_uint32_t id, unsigned vec,
+                            bool level = false) const
+  {
+    bool sent = false;
+    for (auto &lapic : _lapics)
+      if (lapic && (id == 0xff || lapic->id() == id))
+        {
+          lapic->irq_trigger(vec, level);
           sent = true;
         }
 
@@ -247,25 +365,24 @@ public:
   }
 
   Virt_lapic *get_lowest_prio() const
-  {
-    // init value greater 15, as task priority is between 1 and 15;
-    l4_uint32_t prio = 20;
-    Virt_lapic *lowest_prio_apic = nullptr;
+  { return lowest_prio([](Virt_lapic const *) { return true; }); }
 
-    for (auto &lapic : _lapics)
+  /**
+   * Find the local APIC with the lowest priority among a destination set.
+   *
+   * \param did      Destination ID.
+   * \param logical  `did` is a logical destination, otherwise the ID of a
+   *                 local APIC with 0xff addressing all local APICs.
+   *
+   * \return The local APIC or nullptr if none matches the destination.
+   */
+  Virt_lapic *get_lowest_prio(l4_uint32_t did, bool logical) const
+  {
+    return lowest_prio([did, logical](Virt_lapic const *lapic)
       {
-        if (!lapic)
-          continue;
-
-        auto apic_prio = lapic->task_prio_class();
-        if (apic_prio < prio)
-          {
-            prio = apic_prio;
-            lowest_prio_apic = lapic.get();
-          }
-      }
-
-    return lowest_prio_apic;
+        return logical ? lapic->match_ldr(did)
+                       : did == 0xff || lapic->id() == did;
+      });
   }
 
   void register_core(unsigned core_no)
@@ -277,6 +394,18 @@ public:
       }
 
     _lapics[core_no] = Vdev::make_device<Virt_lapic>(core_no, Lapic_mem_addr);
+    _lapics[core_no]->set_eoi_handler(_eoi_handler);
+  }
+
+  /**
+   * Set the receiver of the EOI broadcast of all local APICs.
+   */
+  void set_eoi_handler(Eoi_handler *handler)
+  {
+    _eoi_handler = handler;
+    for (auto &lapic : _lapics)
+      if (lapic)
+        lapic->set_eoi_handler(handler);
   }
 
   // Mmio device if
@@ -302,6 +431,12 @@ public:
   {
     assert(vcpu_no < Max_cores && _lapics[vcpu_no]);
 
+    if (msr == Msr_kvm_pv_eoi_en)
+      {
+        *value = _lapics[vcpu_no]->pv_eoi_msr();
+        return true;
+      }
+
     return _lapics[vcpu_no]->read_msr(msr, value);
   };
 
@@ -309,15 +444,82 @@ public:
   {
     assert(vcpu_no < Max_cores && _lapics[vcpu_no]);
 
+    if (msr == Msr_kvm_pv_eoi_en)
+      {
+        set_pv_eoi(vcpu_no, value);
+        return true;
+      }
+
     return _lapics[vcpu_no]->write_msr(msr, value);
   }
 
+  /**
+   * Set the guest RAM holding the paravirtualized EOI flags.
+   *
+   * Flags registered before, e.g. in a restored snapshot, are looked up
+   * again.
+   */
+  void set_ram(Vmm::Vm_ram const *ram)
+  {
+    _ram = ram;
+    for (unsigned i = 0; i < Max_cores; ++i)
+      if (_lapics[i])
+        set_pv_eoi(i, _lapics[i]->pv_eoi_msr());
+  }
+
 private:
+  template <typename MATCH>
+  Virt_lapic *lowest_prio(MATCH &&match) const
+  {
+    // init value greater than any task priority class (0x00 to 0xf0)
+    l4_uint32_t prio = ~0U;
+    Virt_lapic *lowest_prio_apic = nullptr;
+
+    for (auto &lapic : _lapics)
+      {
+        if (!lapic || !match(lapic.get()))
+          continue;
+
+        auto apic_prio = lapic->task_prio_class();
+        if (apic_prio < prio)
+          {
+            prio = apic_prio;
+            lowest_prio_apic = lapic.get();
+          }
+      }
+
+    return lowest_prio_apic;
+  }
+
   static unsigned reg2msr(unsigned reg)
   { return (reg >> 4) | X2apic_msr_base; }
 
+  void set_pv_eoi(unsigned vcpu_no, l4_uint64_t msr)
+  {
+    l4_uint32_t *flag = nullptr;
+    auto &pin = _pv_eoi_pins[vcpu_no];
+    // The old flag is still synced by the local APIC. Its RAM is kept
+    // until the exit is handled, see Vm_mem::grace_period().
+    pin.reset();
+    // The flag is 4-byte aligned, bit 0 enables paravirtualized EOI.
+    if ((msr & 1) && _ram)
+      {
+        auto addr = Vmm::Guest_addr(msr & ~3ULL);
+        // Pinned before the lookup, so that the RAM cannot go meanwhile.
+        pin.set(_ram, addr, sizeof(l4_uint32_t));
+        flag = _ram->guest2host<l4_uint32_t *>(
+          Vmm::Region::ss(addr, sizeof(l4_uint32_t)));
+      }
+
+    _lapics[vcpu_no]->set_pv_eoi(msr, flag);
+  }
+
+  Vmm::Vm_ram const *_ram = nullptr;
+  Eoi_handler *_eoi_handler = nullptr;
   l4_uint64_t _max_phys_addr_mask;
   cxx::Ref_ptr<Virt_lapic> _lapics[Max_cores];
+  /// Keep the RAM of the paravirtualized EOI flags plugged.
+  Vmm::Ram_pin _pv_eoi_pins[Max_cores];
 }; // class Lapic_array
 
 
@@ -428,59 +630,4 @@ private:
   cxx::Ref_ptr<Lapic_array> _apics;
 }; // class Msi_control
 
-/**
- * IO-APIC stub. WIP!
- *
- * TODO The Ic interface is a bit off, as there is no way to clear an IRQ, as
- * the IO-APIC sends an MSI to the MSI-controller when a device sends a legacy
- * IRQ.
- *  set: send an MSI instead of the legacy IRQ (programmed by OS)
- *  clear: nop
- *  bind_irq_source:  ?
- *  get_irq_source: ?
- *  dt_get_interrupt: parse DT
- *
- */
-class Io_apic : public Ic
-{
-  enum
-  {
-    Irq_cells = 1,// keep in sync with virt-pc.dts
-  };
-
-public:
-  Io_apic(cxx::Ref_ptr<Lapic_array> apics) : _apics(apics) {}
-
-  // IC interface
-  void set(unsigned irq) override
-  { _apics->get(0)->set(irq); }
-
-  void clear(unsigned irq) override
-  { _apics->get(0)->clear(irq); }
-
-  void bind_irq_source(unsigned irq, cxx::Ref_ptr<Irq_source> const &src) override
-  { _apics->get(0)->bind_irq_source(irq, src); }
-
-  cxx::Ref_ptr<Irq_source> get_irq_source(unsigned irq) const override
-  { return _apics->get(0)->get_irq_source(irq); }
-
-  int dt_get_interrupt(fdt32_t const *prop, int propsz, int *read) const override
-  {
-    if (propsz < Irq_cells)
-      return -L4_ERANGE;
-
-    if (read)
-      *read = Irq_cells;
-
-    return fdt32_to_cpu(prop[0]);
-  }
-
-private:
-  static Dbg trace() { return Dbg(Dbg::Irq, Dbg::Trace, "IO-APIC"); }
-  static Dbg info() { return Dbg(Dbg::Irq, Dbg::Info, "IO-APIC"); }
-  static Dbg warn() { return Dbg(Dbg::Irq, Dbg::Warn, "IO-APIC"); }
-
-  cxx::Ref_ptr<Lapic_array> _apics;
-}; // class Io_apic
-
 } // namespace Gic
@@ -22,6 +22,7 @@ public:
   virtual l4_umword_t ip() const = 0;
   virtual bool pf_write() const = 0;
   virtual l4_umword_t cr3() const = 0;
+  virtual l4_umword_t flags() const = 0;
   virtual bool interrupts_enabled() const = 0;
 
   virtual void jump_instruction() = 0;
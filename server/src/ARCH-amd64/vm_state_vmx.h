@@ -84,6 +84,7 @@ public:
   enum Flags_bits : unsigned long
   {
     Interrupt_enabled_bit = (1UL << 9),
+    Direction_bit = (1UL << 10),
     Virtual_8086_mode_bit = (1UL << 17),
   };
 
@@ -126,6 +127,9 @@ public:
   l4_umword_t cr3() const override
   { return l4_vm_vmx_read_nat(_vmcs, L4VCPU_VMCS_GUEST_CR3); }
 
+  l4_umword_t flags() const override
+  { return l4_vm_vmx_read_nat(_vmcs, L4VCPU_VMCS_GUEST_RFLAGS); }
+
   void jump_instruction() override
   {
     vmx_write(L4VCPU_VMCS_GUEST_RIP,
@@ -105,6 +105,13 @@ public:
 
   void run(cxx::Ref_ptr<Cpu_dev_array> const &cpus);
 
+  // Snapshots are not supported on MIPS.
+  void save_state(Snapshot_writer &)
+  { L4Re::chksys(-L4_ENOSYS, "Snapshots are not supported on MIPS."); }
+
+  void restore_state(Snapshot_reader &, Vm_ram *)
+  { L4Re::chksys(-L4_ENOSYS, "Snapshots are not supported on MIPS."); }
+
   int dispatch_hypcall(Hypcall_code hypcall_code, Vcpu_ptr vcpu);
   void handle_entry(Vcpu_ptr vcpu);
 
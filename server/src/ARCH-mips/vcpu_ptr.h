@@ -221,6 +221,15 @@ public:
     return m;
   }
 
+  /**
+   * Decode a store to a doorbell register.
+   *
+   * The faulting instruction is reported by the hardware, so this is the
+   * same as decode_mmio().
+   */
+  Mem_access decode_doorbell() const
+  { return decode_mmio(); }
+
   void writeback_mmio(Mem_access const &m) const
   {
     assert(m.access == Mem_access::Load);
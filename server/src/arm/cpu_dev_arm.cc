@@ -90,6 +90,8 @@ Cpu_dev::reset()
   // entry_sp is derived from thread local stack pointer
   asm volatile ("mov %0, sp" : "=r"(_vcpu->entry_sp));
 
+  apply_restored_state();
+
   Dbg().printf("Starting Cpu%d @ 0x%lx in %dBit mode (handler @ %lx,"
                " stack: %lx, task: %lx, mpidr: %llx (orig: %llx)\n",
                vmm_current_cpu_id, _vcpu->r.ip,
@@ -20,6 +20,7 @@
 #include "debug.h"
 #include "mmio_device.h"
 #include "irq.h"
+#include "snapshot.h"
 
 extern __thread unsigned vmm_current_cpu_id;
 
@@ -80,6 +81,9 @@ private:
     l4_uint32_t state() const
     { return _state; }
 
+    void restore(l4_uint32_t state)
+    { _state = state; }
+
     bool enable()
     { return set_pe(enabled_bfm_t::Mask); }
 
@@ -260,6 +264,25 @@ public:
     return hp_irq;
   }
 
+  void save_state(Vmm::Snapshot_writer &w, unsigned irqs) const
+  {
+    for (unsigned i = 0; i < irqs; ++i)
+      {
+        w.put(_pending.get()[i].state());
+        w.put(_irq.get()[i].lr);
+      }
+  }
+
+  void restore_state(Vmm::Snapshot_reader &r, unsigned irqs)
+  {
+    for (unsigned i = 0; i < irqs; ++i)
+      {
+        l4_uint32_t state;
+        r.get(&state);
+        _pending.get()[i].restore(state);
+        r.get(&_irq.get()[i].lr);
+      }
+  }
 };
 
 //////////////////////////////
@@ -563,6 +586,23 @@ public:
 
   void show(FILE *f, unsigned cpu);
 
+  /**
+   * Save the distributor state of the CPU's local interrupts.
+   *
+   * The list registers are part of the vCPU state.
+   */
+  void save_state(Vmm::Snapshot_writer &w) const
+  {
+    w.put(_sgi_pend);
+    _local_irq.save_state(w, Num_local);
+  }
+
+  void restore_state(Vmm::Snapshot_reader &r)
+  {
+    r.get(&_sgi_pend);
+    _local_irq.restore_state(r, Num_local);
+  }
+
   Vmm::Arm::Gic_h::Vmcr vmcr() const
   {
     using Vmm::Arm::Gic_h::Vmcr;
@@ -830,7 +870,10 @@ Cpu::handle_maintenance_irq(unsigned /*current_cpu*/)
 
 
 
-class Dist : public Vmm::Mmio_device_t<Dist>, public Ic
+class Dist
+: public Vmm::Mmio_device_t<Dist>,
+  public Ic,
+  public Vdev::Snapshot_state
 {
 private:
   Dbg gicd_trace;
@@ -1060,6 +1103,26 @@ public:
       }
   }
 
+  void save_state(Vmm::Snapshot_writer &w) override
+  {
+    w.put(ctlr);
+    w.put(_active_grp0_cpus);
+    w.put(_active_grp1_cpus);
+    _spis.save_state(w, tnlines * 32);
+    for (unsigned i = 0; i < cpus; ++i)
+      _cpu[i].save_state(w);
+  }
+
+  void restore_state(Vmm::Snapshot_reader &r) override
+  {
+    r.get(&ctlr);
+    r.get(&_active_grp0_cpus);
+    r.get(&_active_grp1_cpus);
+    _spis.restore_state(r, tnlines * 32);
+    for (unsigned i = 0; i < cpus; ++i)
+      _cpu[i].restore_state(r);
+  }
+
   void set_cpu(unsigned cpu, void *vcpu,
                L4::Cap<L4::Thread> thread)
   {
@@ -51,6 +51,19 @@ public:
 
   l4_msgtag_t handle_entry(Vcpu_ptr vcpu);
 
+  void save_state(Snapshot_writer &w)
+  {
+    w.put(guest_64bit);
+    _hypcall_ring.save_state(w);
+  }
+
+  void restore_state(Snapshot_reader &r, Vm_ram *ram)
+  {
+    r.get(&guest_64bit);
+    _hypcall_ring.restore_state(r);
+    _hypcall_ring.set_ram(ram);
+  }
+
   static Guest *create_instance();
 
   void show_state_interrupts(FILE *, Vcpu_ptr) {}
@@ -102,6 +115,7 @@ private:
   cxx::Ref_ptr<Vmm::Cpu_dev_array> _cpus;
   cxx::Ref_ptr<Vmm::Smc_device> _smc_handler;
   Guest_print_buffer _hypcall_print;
+  Guest_console_ring _hypcall_ring;
 };
 
 } // namespace
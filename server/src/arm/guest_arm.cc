@@ -250,9 +250,10 @@ Guest::prepare_vcpu_startup(Vcpu_ptr vcpu, l4_addr_t entry) const
 
 void
 Guest::prepare_linux_run(Vcpu_ptr vcpu, l4_addr_t entry,
-                         Vm_ram * /* ram */, char const * /* kernel */,
+                         Vm_ram *ram, char const * /* kernel */,
                          char const * /* cmd_line */, l4_addr_t dt_boot_addr)
 {
+  _hypcall_ring.set_ram(ram);
   prepare_vcpu_startup(vcpu, entry);
 
   // Set up the VCPU state as expected by Linux entry
@@ -511,6 +512,8 @@ Guest::handle_uvmm_call(Vcpu_ptr vcpu)
   enum Uvmm_functions
   {
     Print_char = 0,
+    Console_ring_setup = 1,
+    Console_ring_doorbell = 2,
   };
 
   if ((vcpu->r.r[0] & 0xbfffff00) != 0x86000000)
@@ -526,6 +529,14 @@ Guest::handle_uvmm_call(Vcpu_ptr vcpu)
       }
       break;
 
+    case Console_ring_setup:
+      vcpu->r.r[0] = _hypcall_ring.setup(vcpu->r.r[1], vcpu->r.r[2]);
+      break;
+
+    case Console_ring_doorbell:
+      vcpu->r.r[0] = _hypcall_ring.doorbell();
+      break;
+
     default:
       Err().printf("... Unknown l4 function 0x%x called\n", func);
       break;
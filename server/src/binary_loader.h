@@ -25,8 +25,7 @@ public:
   : _ds(L4Re::chkcap(L4Re::Util::Env_ns().query<L4Re::Dataspace>(name),
                      "Kernel binary not found", -L4_EIO))
   {
-    _loaded_range_start = 0;
-    _loaded_range_end = 0;
+    _loaded_ram = nullptr;
     // Map the first page which should contain all headers necessary
     // to interpret the binary.
     auto *e = L4Re::Env::env();
@@ -79,8 +78,8 @@ public:
         }
     });
 
-    _loaded_range_start = ram->guest2host<l4_addr_t>(img_start);
-    _loaded_range_end = ram->guest2host<l4_addr_t>(img_end);
+    if (img_start < img_end)
+      set_loaded_range(ram, img_start, img_end - img_start);
 
     return eh->entry();
   }
@@ -99,8 +98,7 @@ public:
 
     ram->load_file(_ds.get(), start, sz);
 
-    _loaded_range_start = ram->guest2host<l4_addr_t>(start);
-    _loaded_range_end = _loaded_range_start + sz;
+    set_loaded_range(ram, start, sz);
 
     return ram->guest_phys2boot(start);
   }
@@ -110,18 +108,35 @@ public:
 
   ~Binary_ds()
   {
-    if (_loaded_range_start != 0 && _loaded_range_end != 0)
-      l4_cache_coherent(_loaded_range_start, _loaded_range_end);
+    if (!_loaded_ram || !_loaded_ram->is_ram(_loaded_start, _loaded_size))
+      return;
+
+    // The image may span several RAM regions.
+    _loaded_ram->foreach_span(_loaded_start, _loaded_size,
+                              [](Vmm::Host_span span)
+      {
+        l4_addr_t start = reinterpret_cast<l4_addr_t>(span.addr);
+        l4_cache_coherent(start, start + span.size);
+      });
   }
 
 private:
+  void set_loaded_range(Vmm::Vm_ram const *ram, Vmm::Guest_addr start,
+                        l4_size_t size)
+  {
+    _loaded_ram = ram;
+    _loaded_start = start;
+    _loaded_size = size;
+  }
+
   Ldr::Elf_ehdr const *as_elf_header() const
   { return reinterpret_cast<Ldr::Elf_ehdr const*>(_header.get()); }
 
   L4Re::Util::Unique_cap<L4Re::Dataspace> _ds;
   L4Re::Rm::Unique_region<char *> _header;
-  l4_addr_t _loaded_range_start;
-  l4_addr_t _loaded_range_end;
+  Vmm::Vm_ram const *_loaded_ram;
+  Vmm::Guest_addr _loaded_start;
+  l4_size_t _loaded_size;
 };
 
 } // namespace
@@ -59,6 +59,16 @@ public:
     _devices.push_back({buf, phandle, dev});
   }
 
+  /**
+   * Call `func` with the device tree path and the device of each entry.
+   */
+  template <typename FUNC>
+  void foreach_device(FUNC &&func) const
+  {
+    for (auto const &d : _devices)
+      func(d.path.c_str(), d.dev);
+  }
+
 private:
   std::vector<Dt_device> _devices;
 };
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include <algorithm>
+
+#include <l4/cxx/minmax>
+
+#include "debug.h"
+#include "dirty_log.h"
+#include "mmio_device.h"
+
+static Dbg trace(Dbg::Mmio, Dbg::Trace, "dirty");
+
+namespace Vmm {
+
+Dirty_log::Dirty_log(L4::Cap<L4::Task> vm_task, Guest_addr start,
+                     l4_size_t size, Ram_access_hook *next)
+: _vm_task(vm_task), _start(start), _size(size), _next(next),
+  _num_chunks((size + (1UL << Chunk_shift) - 1) >> Chunk_shift),
+  _dirty_chunks((_num_chunks + Bits_per_word - 1) / Bits_per_word),
+  _dirty_pages(((size >> L4_PAGESHIFT) + Bits_per_word - 1) / Bits_per_word),
+  _refined((_num_chunks + Bits_per_word - 1) / Bits_per_word)
+{}
+
+void
+Dirty_log::start()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  std::fill(_dirty_chunks.begin(), _dirty_chunks.end(), 0);
+  std::fill(_dirty_pages.begin(), _dirty_pages.end(), 0);
+  _write_faults = 0;
+  // Mappings made after this store are checked with mark_dirty().
+  __atomic_store_n(&_active, true, __ATOMIC_SEQ_CST);
+
+  write_protect(0, _size, L4_FPAGE_W);
+}
+
+void
+Dirty_log::stop()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  __atomic_store_n(&_active, false, __ATOMIC_RELEASE);
+}
+
+void
+Dirty_log::mark(l4_addr_t offset, l4_size_t size)
+{
+  if (!size)
+    size = 1;
+
+  l4_addr_t last = cxx::min<l4_addr_t>(offset + size - 1, _size - 1);
+  for (l4_addr_t c = offset >> Chunk_shift; c <= last >> Chunk_shift; ++c)
+    {
+      set(_dirty_chunks, c);
+      if (!is_set(_refined, c))
+        continue;
+
+      l4_addr_t first = cxx::max<l4_addr_t>(offset, c << Chunk_shift);
+      l4_addr_t end = cxx::min<l4_addr_t>(last, ((c + 1) << Chunk_shift) - 1);
+      for (l4_addr_t p = first >> L4_PAGESHIFT; p <= end >> L4_PAGESHIFT; ++p)
+        set(_dirty_pages, p);
+    }
+}
+
+void
+Dirty_log::write_protect(l4_addr_t offset, l4_size_t size, unsigned rights)
+{
+  Mmio_device::unmap_guest_range(_vm_task, _start + offset, size, rights);
+}
+
+void
+Dirty_log::refine(l4_addr_t offset, l4_size_t size)
+{
+  if (!size)
+    return;
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  l4_addr_t last = cxx::min<l4_addr_t>(offset + size - 1, _size - 1);
+  for (l4_addr_t c = offset >> Chunk_shift; c <= last >> Chunk_shift; ++c)
+    {
+      if (is_set(_refined, c))
+        continue;
+
+      l4_addr_t coffs = c << Chunk_shift;
+      l4_size_t csize = cxx::min<l4_size_t>(1UL << Chunk_shift, _size - coffs);
+
+      trace.printf("refine chunk %lu\n", c);
+
+      set(_refined, c);
+      // The writes to a dirty chunk so far are not known page by page.
+      if (is_set(_dirty_chunks, c))
+        mark(coffs, csize);
+
+      write_protect(coffs, csize, L4_FPAGE_RWX);
+    }
+}
+
+void
+Dirty_log::fetch_and_clear(std::vector<l4_umword_t> *chunks,
+                           std::vector<l4_umword_t> *pages)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  for (unsigned long c = 0; c < _num_chunks; ++c)
+    {
+      if (!is_set(_dirty_chunks, c))
+        continue;
+
+      l4_addr_t coffs = c << Chunk_shift;
+      l4_size_t csize = cxx::min<l4_size_t>(1UL << Chunk_shift, _size - coffs);
+
+      if (!is_set(_refined, c))
+        {
+          write_protect(coffs, csize, L4_FPAGE_W);
+          continue;
+        }
+
+      for (l4_addr_t p = coffs >> L4_PAGESHIFT;
+           p < (coffs + csize) >> L4_PAGESHIFT; ++p)
+        if (is_set(_dirty_pages, p))
+          write_protect(p << L4_PAGESHIFT, L4_PAGESIZE, L4_FPAGE_W);
+    }
+
+  *chunks = _dirty_chunks;
+  *pages = _dirty_pages;
+  std::fill(_dirty_chunks.begin(), _dirty_chunks.end(), 0);
+  std::fill(_dirty_pages.begin(), _dirty_pages.end(), 0);
+}
+
+void
+Dirty_log::mark_dirty(l4_addr_t offset, l4_size_t size)
+{
+  // Pairs with start(), which activates the log before write-protecting.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!active())
+    return;
+
+  std::lock_guard<std::mutex> lock(_lock);
+  if (_active)
+    mark(offset, size);
+}
+
+void
+Dirty_log::prepare_access(l4_addr_t offset, l4_size_t size)
+{
+  if (_next)
+    _next->prepare_access(offset, size);
+
+  if (!active())
+    return;
+
+  std::lock_guard<std::mutex> lock(_lock);
+  if (_active)
+    mark(offset, size);
+}
+
+void
+Dirty_log::copy_out(L4::Cap<L4Re::Dataspace> dst, l4_addr_t dst_offset,
+                    L4::Cap<L4Re::Dataspace> ram, l4_addr_t ram_offset,
+                    l4_addr_t offset, l4_size_t size)
+{
+  if (_next)
+    _next->copy_out(dst, dst_offset, ram, ram_offset, offset, size);
+  else
+    L4Re::chksys(dst->copy_in(dst_offset, ram, ram_offset + offset, size),
+                 "Copying guest RAM into dataspace.");
+}
+
+} // namespace Vmm
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include <l4/sys/task>
+
+#include "mem_types.h"
+#include "ram_ds.h"
+
+namespace Vmm {
+
+/**
+ * Log of the guest writes to a RAM region.
+ *
+ * The region is tracked in chunks of a superpage. While the log is active,
+ * the guest mappings of the region are write-protected. The first write to
+ * a chunk faults, marks the chunk dirty and maps it writable again. The
+ * mappings keep their size, so that tracking costs at most one fault per
+ * chunk and round. Chunks can be refined on demand, they are then mapped
+ * and tracked with page granularity.
+ *
+ * Accesses of the VMM are announced through the access hook of the region
+ * and mark the accessed range dirty, whether it is written or not. Memory
+ * the VMM writes through pointers it keeps is marked with mark_dirty() in
+ * every round, see Vm_ram::fetch_dirty_log().
+ */
+class Dirty_log : public Ram_access_hook
+{
+public:
+  enum : unsigned { Chunk_shift = L4_SUPERPAGESHIFT };
+
+  /**
+   * Create a log for a RAM region.
+   *
+   * \param vm_task  Guest task the region is mapped to.
+   * \param start    Guest-physical start address of the region.
+   * \param size     Size of the region.
+   * \param next     Access hook the region had before, called first.
+   */
+  Dirty_log(L4::Cap<L4::Task> vm_task, Guest_addr start, l4_size_t size,
+            Ram_access_hook *next);
+
+  /**
+   * Start logging.
+   *
+   * Write-protects all guest mappings of the region and clears the log.
+   */
+  void start();
+
+  /**
+   * Stop logging.
+   *
+   * Written chunks are not recorded any more. Mappings stay
+   * write-protected until the guest writes to them.
+   */
+  void stop();
+
+  bool active() const
+  { return __atomic_load_n(&_active, __ATOMIC_ACQUIRE); }
+
+  /**
+   * Log2 of the largest page to map at the given offset.
+   */
+  unsigned char map_shift(l4_addr_t offset) const
+  { return is_set(_refined, offset >> Chunk_shift) ? L4_PAGESHIFT : Chunk_shift; }
+
+  /**
+   * Record a guest write fault.
+   *
+   * \param offset  Offset of the fault relative to the region.
+   * \param map     Called with the log2 size of the area to map writable.
+   *
+   * `map` runs with the log locked, so that fetch_and_clear() cannot
+   * write-protect the area between recording and mapping.
+   *
+   * \return The result of `map`.
+   */
+  template <typename MAP>
+  long write_fault(l4_addr_t offset, MAP &&map)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    ++_write_faults;
+    mark(offset, 1);
+    return map(map_shift(offset));
+  }
+
+  /**
+   * Track a range with page granularity from now on.
+   *
+   * \param offset  Start of the range relative to the region.
+   * \param size    Size of the range.
+   *
+   * The chunks covering the range are unmapped from the guest so that
+   * they are remapped with small pages. All pages of a chunk that is
+   * already dirty are reported dirty in the current round.
+   */
+  void refine(l4_addr_t offset, l4_size_t size);
+
+  /**
+   * Fetch and clear the log.
+   *
+   * \param[out] chunks  Bitmap of the dirty chunks.
+   * \param[out] pages   Bitmap of the dirty pages. Only the bits of
+   *                     refined chunks are meaningful.
+   *
+   * The written chunks are write-protected again before the log is
+   * cleared, so no write gets lost.
+   */
+  void fetch_and_clear(std::vector<l4_umword_t> *chunks,
+                       std::vector<l4_umword_t> *pages);
+
+  /**
+   * Mark a range dirty that was written without the log noticing.
+   *
+   * \param offset  Start of the range relative to the region.
+   * \param size    Size of the range.
+   *
+   * Used for mappings made while the log seemed inactive and for memory
+   * the VMM writes through pointers it keeps. Does nothing if the log is
+   * inactive.
+   */
+  void mark_dirty(l4_addr_t offset, l4_size_t size);
+
+  void prepare_access(l4_addr_t offset, l4_size_t size) override;
+
+  /// Reading a range does not dirty it.
+  void copy_out(L4::Cap<L4Re::Dataspace> dst, l4_addr_t dst_offset,
+                L4::Cap<L4Re::Dataspace> ram, l4_addr_t ram_offset,
+                l4_addr_t offset, l4_size_t size) override;
+
+  unsigned long num_chunks() const
+  { return _num_chunks; }
+
+  /// Number of guest write faults caused by the log.
+  unsigned long write_faults() const
+  { return _write_faults; }
+
+  enum : unsigned { Bits_per_word = sizeof(l4_umword_t) * 8 };
+
+  static bool is_set(std::vector<l4_umword_t> const &bm, unsigned long i)
+  {
+    return __atomic_load_n(&bm[i / Bits_per_word], __ATOMIC_RELAXED)
+           & (1UL << (i % Bits_per_word));
+  }
+
+private:
+  static void set(std::vector<l4_umword_t> &bm, unsigned long i)
+  { bm[i / Bits_per_word] |= 1UL << (i % Bits_per_word); }
+
+  void mark(l4_addr_t offset, l4_size_t size);
+  void write_protect(l4_addr_t offset, l4_size_t size, unsigned rights);
+
+  L4::Cap<L4::Task> _vm_task;
+  Guest_addr _start;
+  l4_size_t _size;
+  Ram_access_hook *_next;
+  unsigned long _num_chunks;
+  bool _active = false;
+  unsigned long _write_faults = 0;
+  std::mutex _lock;
+  std::vector<l4_umword_t> _dirty_chunks;
+  std::vector<l4_umword_t> _dirty_pages;
+  /// Chunks tracked with page granularity.
+  std::vector<l4_umword_t> _refined;
+};
+
+} // namespace Vmm
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include <cstring>
+
+#include <l4/cxx/minmax>
+#include <l4/re/env>
+#include <l4/re/error_helper>
+
+#include "debug.h"
+#include "ds_cow_mapper.h"
+
+static Dbg trace(Dbg::Mmio, Dbg::Trace, "cow");
+
+Cow_ds_handler::Cow_ds_handler(L4::Cap<L4Re::Dataspace> rom,
+                               l4_addr_t rom_offset, l4_size_t rom_size,
+                               l4_addr_t priv_local, l4_size_t size)
+: _rom(rom), _rom_offset(rom_offset),
+  _priv_local(reinterpret_cast<char *>(priv_local)),
+  _rom_size(rom_size),
+  _num_pages(size >> L4_PAGESHIFT),
+  _private((_num_pages + Bits_per_word - 1) / Bits_per_word)
+{
+  auto *e = L4Re::Env::env();
+  L4Re::chksys(e->rm()->attach(&_rom_local, l4_round_page(rom_size),
+                               L4Re::Rm::Search_addr | L4Re::Rm::Read_only,
+                               L4::Ipc::make_cap(_rom, L4_CAP_FPAGE_RO),
+                               _rom_offset, L4_SUPERPAGESHIFT),
+               "Attach read-only dataspace of copy-on-write region.");
+
+  // Pages not completely covered by the read-only dataspace are private
+  // from the beginning, so that the guest never sees what follows the
+  // contents in the dataspace.
+  for (unsigned long p = _rom_size >> L4_PAGESHIFT; p < _num_pages; ++p)
+    copy_page(p);
+}
+
+void
+Cow_ds_handler::copy_page(unsigned long page)
+{
+  l4_addr_t offs = page << L4_PAGESHIFT;
+  char *rom = _rom_local.get() + offs;
+
+  // Revoke the read-only mapping of the shared page from the guest. It
+  // refaults and gets the private copy.
+  if (offs < l4_round_page(_rom_size))
+    L4Re::Env::env()->task()->unmap(l4_fpage(reinterpret_cast<l4_addr_t>(rom),
+                                             L4_PAGESHIFT, L4_FPAGE_RWX),
+                                    L4_FP_OTHER_SPACES);
+
+  l4_size_t n = 0;
+  if (offs < _rom_size)
+    {
+      n = _rom_size - offs;
+      if (n > L4_PAGESIZE)
+        n = L4_PAGESIZE;
+      memcpy(_priv_local + offs, rom, n);
+    }
+  memset(_priv_local + offs + n, 0, L4_PAGESIZE - n);
+
+  _private[page / Bits_per_word] |= 1UL << (page % Bits_per_word);
+  ++_num_private;
+}
+
+int
+Cow_ds_handler::access(l4_addr_t pfa, l4_addr_t offset, Vmm::Vcpu_ptr vcpu,
+                       L4::Cap<L4::Task> vm_task, l4_addr_t, l4_addr_t)
+{
+  unsigned long page = offset >> L4_PAGESHIFT;
+  l4_addr_t offs = l4_trunc_page(offset);
+  l4_fpage_t fp;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (!is_private(page) && vcpu.pf_write())
+      {
+        trace.printf("copy page @ 0x%lx\n", pfa);
+        copy_page(page);
+      }
+
+    if (is_private(page))
+      fp = l4_fpage(reinterpret_cast<l4_addr_t>(_priv_local + offs),
+                    L4_PAGESHIFT, L4_FPAGE_RWX);
+    else
+      fp = l4_fpage(reinterpret_cast<l4_addr_t>(_rom_local.get() + offs),
+                    L4_PAGESHIFT, L4_FPAGE_RX);
+
+    // Make sure that the page is currently mapped.
+    long res = page_in(l4_fpage_memaddr(fp), is_private(page));
+    if (res >= 0)
+      res = l4_error(vm_task->map(L4Re::This_task, fp, l4_trunc_page(pfa)));
+
+    if (res < 0)
+      {
+        Err().printf("cannot handle VM memory access @ %lx ip=%lx r=%ld\n",
+                     pfa, vcpu->r.ip, res);
+        return res;
+      }
+  }
+
+  count_mapping(L4_PAGESHIFT);
+  return Vmm::Retry;
+}
+
+void
+Cow_ds_handler::map_eager(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr start,
+                          Vmm::Guest_addr)
+{
+#ifndef MAP_OTHER
+  // Only the shared part can be mapped without knowing the access type.
+  // Mappings of pages copied later are revoked in copy_page().
+  std::lock_guard<std::mutex> lock(_lock);
+  map_guest_range(vm_task, start,
+                  reinterpret_cast<l4_addr_t>(_rom_local.get()),
+                  l4_trunc_page(_rom_size), L4_FPAGE_RX);
+#else
+  (void)vm_task; (void)start;
+#endif
+}
+
+void
+Cow_ds_handler::unshare(l4_addr_t offset, l4_size_t size)
+{
+  if (!size)
+    size = 1;
+
+  unsigned long first = offset >> L4_PAGESHIFT;
+  unsigned long last = (offset + size - 1) >> L4_PAGESHIFT;
+
+  std::lock_guard<std::mutex> lock(_lock);
+  for (unsigned long p = first; p <= last && p < _num_pages; ++p)
+    if (!is_private(p))
+      copy_page(p);
+}
+
+void
+Cow_ds_handler::copy_out(L4::Cap<L4Re::Dataspace> dst, l4_addr_t dst_offset,
+                         L4::Cap<L4Re::Dataspace> ram, l4_addr_t ram_offset,
+                         l4_addr_t offset, l4_size_t size)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  while (size)
+    {
+      // Copy runs of pages that are all shared or all private at once.
+      unsigned long page = offset >> L4_PAGESHIFT;
+      bool priv = page >= _num_pages || is_private(page);
+      l4_size_t n = cxx::min<l4_size_t>(size,
+                                        L4_PAGESIZE - (offset & ~L4_PAGEMASK));
+      while (n < size)
+        {
+          unsigned long p = (offset + n) >> L4_PAGESHIFT;
+          if ((p >= _num_pages || is_private(p)) != priv)
+            break;
+          n += cxx::min<l4_size_t>(size - n, L4_PAGESIZE);
+        }
+
+      long res = priv ? dst->copy_in(dst_offset, ram, ram_offset + offset, n)
+                      : dst->copy_in(dst_offset, _rom, _rom_offset + offset, n);
+      L4Re::chksys(res, "Copying guest RAM into dataspace.");
+
+      offset += n;
+      dst_offset += n;
+      size -= n;
+    }
+}
+
+char const *
+Cow_ds_handler::dev_info(char *buf, size_t size) const
+{
+  snprintf(buf, size, "cow ds: [%lx:%lx:%zx] shared %lu private %lu",
+           _rom.cap(), _rom_offset, _rom_size, shared_pages(),
+           private_pages());
+  return buf;
+}
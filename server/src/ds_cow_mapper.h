@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include <l4/re/dataspace>
+#include <l4/re/rm>
+
+#include "mmio_device.h"
+#include "ram_ds.h"
+
+/**
+ * Guest memory backed copy-on-write by a read-only dataspace.
+ *
+ * The guest initially sees the contents of the read-only dataspace, which
+ * is mapped directly without copying. A page is copied into a private
+ * dataspace when the guest writes to it for the first time. From then on
+ * the private copy is mapped writable instead.
+ *
+ * Accesses of the VMM go to the private dataspace and must be announced
+ * with unshare() beforehand.
+ *
+ * The handler does not own the dataspaces. The caller must keep them
+ * alive as long as the handler exists.
+ */
+class Cow_ds_handler : public Vmm::Mmio_device, public Vmm::Ram_access_hook
+{
+public:
+  /**
+   * Create a copy-on-write region.
+   *
+   * \param rom         Dataspace with the initial contents.
+   * \param rom_offset  Page-aligned offset of the contents in `rom`.
+   * \param rom_size    Size of the initial contents.
+   * \param priv_local  Address where the private dataspace for copied
+   *                    pages is attached in the VMM.
+   * \param size        Size of the region, a multiple of the page size.
+   */
+  Cow_ds_handler(L4::Cap<L4Re::Dataspace> rom, l4_addr_t rom_offset,
+                 l4_size_t rom_size, l4_addr_t priv_local, l4_size_t size);
+
+  int access(l4_addr_t pfa, l4_addr_t offset, Vmm::Vcpu_ptr vcpu,
+             L4::Cap<L4::Task> vm_task, l4_addr_t min, l4_addr_t max) override;
+
+  void map_eager(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr start,
+                 Vmm::Guest_addr end) override;
+
+  char const *dev_info(char *buf, size_t size) const override;
+
+  /**
+   * Copy all shared pages of a range into the private dataspace.
+   *
+   * \param offset  Start of the range relative to the region.
+   * \param size    Size of the range.
+   */
+  void unshare(l4_addr_t offset, l4_size_t size);
+
+  void prepare_access(l4_addr_t offset, l4_size_t size) override
+  { unshare(offset, size); }
+
+  /// Shared pages are copied from the read-only dataspace.
+  void copy_out(L4::Cap<L4Re::Dataspace> dst, l4_addr_t dst_offset,
+                L4::Cap<L4Re::Dataspace> ram, l4_addr_t ram_offset,
+                l4_addr_t offset, l4_size_t size) override;
+
+  /// Number of pages still shared with the read-only dataspace.
+  unsigned long shared_pages() const
+  { return _num_pages - _num_private; }
+
+  /// Number of pages copied into the private dataspace.
+  unsigned long private_pages() const
+  { return _num_private; }
+
+private:
+  enum { Bits_per_word = sizeof(l4_umword_t) * 8 };
+
+  bool is_private(unsigned long page) const
+  { return _private[page / Bits_per_word] & (1UL << (page % Bits_per_word)); }
+
+  void copy_page(unsigned long page);
+
+  L4::Cap<L4Re::Dataspace> _rom;
+  l4_addr_t _rom_offset;
+  L4Re::Rm::Unique_region<char *> _rom_local;
+  char *_priv_local;
+  l4_size_t _rom_size;
+  unsigned long _num_pages;
+  unsigned long _num_private = 0;
+  /// Bitmap of the pages that have been copied.
+  std::vector<l4_umword_t> _private;
+  std::mutex _lock;
+};
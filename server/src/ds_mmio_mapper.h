@@ -12,13 +12,48 @@
 #include <l4/util/util.h>
 #include <cstdio>
 
+#include "dirty_log.h"
 #include "mmio_device.h"
+#include "ram_ds.h"
 #include "vcpu_ptr.h"
 
 class Ds_handler : public Vmm::Mmio_device
 {
   L4::Cap<L4Re::Dataspace> _ds;
   l4_addr_t _offset;
+  /// Map the region in map_eager().
+  bool _map_eager = true;
+  /// log2 of the area mapped on a fault, 0 for the largest page only.
+  unsigned char _prefault_shift = 0;
+  /// Hook to call before a part of the region is mapped to the guest.
+  Vmm::Ram_access_hook *_access_hook = nullptr;
+  /// Log of guest writes to the region.
+  Vmm::Dirty_log *_dirty_log = nullptr;
+  /// The region has been removed from the guest, see remove().
+  bool _removed = false;
+
+  Vmm::Dirty_log *dirty_log() const
+  { return __atomic_load_n(&_dirty_log, __ATOMIC_SEQ_CST); }
+
+  bool logging() const
+  {
+    auto *log = dirty_log();
+    return log && log->active();
+  }
+
+  /**
+   * Check a writable mapping made while the region was not logged.
+   *
+   * Logging may have started before the mapping was established, after
+   * the region was write-protected. The range is then reported dirty, so
+   * that the next round write-protects it.
+   */
+  void mapped_unlogged(l4_addr_t offset, l4_size_t size) const
+  {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (auto *log = dirty_log())
+      log->mark_dirty(offset, size);
+  }
 
   bool _mergable(cxx::Ref_ptr<Mmio_device> other,
                  Vmm::Guest_addr start_other, Vmm::Guest_addr start_this) override
@@ -36,19 +71,76 @@ class Ds_handler : public Vmm::Mmio_device
                  Vmm::Guest_addr end) override
   {
 #ifndef MAP_OTHER
-    map_guest_range(vm_task, start, local_start(), end - start + 1,
-                    L4_FPAGE_RWX);
+    if (_map_eager)
+      map_guest_range(vm_task, start, local_start(), end - start + 1,
+                      L4_FPAGE_RWX);
 #endif
   }
 
   int access(l4_addr_t pfa, l4_addr_t offset, Vmm::Vcpu_ptr vcpu,
              L4::Cap<L4::Task> vm_task, l4_addr_t min, l4_addr_t max) override
   {
+    // A vCPU may have found the handler before it was removed.
+    if (removed())
+      return Vmm::Retry;
+
     long res;
+    bool log = logging();
+#ifndef MAP_OTHER
+    // Prefaulting would map the window writable behind the log's back.
+    if (_prefault_shift && !log)
+      {
+        // Map the whole window around the fault, clipped to the region.
+        l4_addr_t wstart = l4_trunc_size(pfa, _prefault_shift);
+        l4_addr_t wend = wstart + (1UL << _prefault_shift) - 1;
+        if (wstart < min)
+          wstart = min;
+        if (wend > max)
+          wend = max;
+
+        res = map_part(vm_task, Vmm::Guest_addr(wstart),
+                       offset - (pfa - wstart), wend - wstart + 1);
+        if (res >= 0)
+          {
+            mapped_unlogged(offset - (pfa - wstart), wend - wstart + 1);
+            return Vmm::Retry;
+          }
+      }
+#endif
+
 #ifdef MAP_OTHER
-    res = _ds->map(offset + _offset,
-                   vcpu.pf_write() ? L4Re::Dataspace::Map_rw : 0,
-                   pfa, min, max, vm_task);
+    if (_access_hook)
+      {
+        // Map only the page that has been prepared.
+        min = l4_trunc_page(pfa);
+        max = min + L4_PAGESIZE - 1;
+        _access_hook->prepare_access(l4_trunc_page(offset), L4_PAGESIZE);
+      }
+
+    if (log)
+      {
+        // Keep the mapping within one chunk of the log.
+        unsigned char shift = _dirty_log->map_shift(offset);
+        if (min < l4_trunc_size(pfa, shift))
+          min = l4_trunc_size(pfa, shift);
+        if (max > l4_trunc_size(pfa, shift) + (1UL << shift) - 1)
+          max = l4_trunc_size(pfa, shift) + (1UL << shift) - 1;
+      }
+
+    if (log && vcpu.pf_write())
+      res = _dirty_log->write_fault(offset, [=](unsigned char)
+        {
+          return _ds->map(offset + _offset, L4Re::Dataspace::Map_rw,
+                          pfa, min, max, vm_task);
+        });
+    else
+      {
+        res = _ds->map(offset + _offset,
+                       vcpu.pf_write() ? L4Re::Dataspace::Map_rw : 0,
+                       pfa, min, max, vm_task);
+        if (res >= 0 && !log && vcpu.pf_write())
+          mapped_unlogged(offset - (pfa - min), max - min + 1);
+      }
 #else
     // Make sure that the page is currently mapped.
     res = page_in(_local_start + offset, true);
@@ -60,11 +152,46 @@ class Ds_handler : public Vmm::Mmio_device
         // client.
         unsigned char ps = get_page_shift(pfa, min, max, offset, _local_start);
 
-        res = l4_error(
-                vm_task->map(L4Re::This_task,
-                             l4_fpage(l4_trunc_size(_local_start + offset, ps),
-                                      ps, L4_FPAGE_RWX),
-                             l4_trunc_size(pfa, ps)));
+        if (_access_hook)
+          {
+            // Keep the part prepared at once small.
+            if (ps > L4_SUPERPAGESHIFT)
+              ps = L4_SUPERPAGESHIFT;
+
+            l4_addr_t page = l4_trunc_size(_local_start + offset, ps);
+            _access_hook->prepare_access(page - _local_start, 1UL << ps);
+          }
+
+        if (log && ps > _dirty_log->map_shift(offset))
+          ps = _dirty_log->map_shift(offset);
+
+        auto map = [=](unsigned char shift, unsigned rights)
+          {
+            long r = l4_error(
+                       vm_task->map(L4Re::This_task,
+                                    l4_fpage(l4_trunc_size(_local_start + offset,
+                                                           shift),
+                                             shift, rights),
+                                    l4_trunc_size(pfa, shift)));
+            if (r >= 0)
+              count_mapping(shift);
+            return r;
+          };
+
+        if (!log)
+          {
+            res = map(ps, L4_FPAGE_RWX);
+            if (res >= 0)
+              mapped_unlogged(l4_trunc_size(_local_start + offset, ps)
+                                - _local_start,
+                              1UL << ps);
+          }
+        else if (vcpu.pf_write())
+          // Record the write before the mapping becomes writable.
+          res = _dirty_log->write_fault(offset, [=](unsigned char shift)
+                  { return map(shift < ps ? shift : ps, L4_FPAGE_RWX); });
+        else
+          res = map(ps, L4_FPAGE_RX);
       }
 #endif
 
@@ -123,4 +250,89 @@ public:
   }
 
   l4_addr_t local_start() const { return _local_start; }
+
+  /**
+   * Stop mapping the region to the guest.
+   *
+   * Called when the region is removed from the memory map. vCPUs that
+   * found the handler before do not map anything afterwards. What they
+   * mapped meanwhile is unmapped again by Vm_ram::reclaim().
+   */
+  void remove()
+  { __atomic_store_n(&_removed, true, __ATOMIC_SEQ_CST); }
+
+  bool removed() const
+  { return __atomic_load_n(&_removed, __ATOMIC_SEQ_CST); }
+
+  /**
+   * Enable or disable mapping of the region in map_eager().
+   *
+   * When disabled, the region is mapped on demand or by the owner of the
+   * handler via map_part().
+   */
+  void set_map_eager(bool eager)
+  { _map_eager = eager; }
+
+  /**
+   * Set the size of the area that is mapped on a guest fault.
+   *
+   * \param shift  log2 of the window size. The window is aligned to its
+   *               size and clipped to the region. 0 maps the largest page
+   *               around the fault only.
+   */
+  void set_prefault_window(unsigned char shift)
+  { _prefault_shift = shift; }
+
+  /**
+   * Set a hook to call before parts of the region are mapped to the guest.
+   *
+   * Regions with a hook are never mapped in map_eager().
+   */
+  void set_access_hook(Vmm::Ram_access_hook *hook)
+  {
+    _access_hook = hook;
+    _map_eager = false;
+  }
+
+  /**
+   * Set the log to record guest writes to the region in.
+   *
+   * While the log is active, guest mappings are established read-only and
+   * only upgraded on a write fault, after the log recorded the write.
+   */
+  void set_dirty_log(Vmm::Dirty_log *log)
+  { __atomic_store_n(&_dirty_log, log, __ATOMIC_SEQ_CST); }
+
+  /**
+   * Populate a part of the region and map it into the guest.
+   *
+   * \param vm_task  Guest task to map to.
+   * \param dest     Guest-physical address of the part.
+   * \param offset   Offset of the part relative to the start of the region.
+   * \param size     Size of the part.
+   *
+   * \return L4_EOK on success, a negative error code otherwise.
+   */
+  long map_part(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr dest,
+                l4_addr_t offset, l4_size_t size)
+  {
+    if (_access_hook)
+      _access_hook->prepare_access(offset, size);
+
+#ifndef MAP_OTHER
+    // Only memory present in the VMM can be mapped on to the guest.
+    l4_addr_t local = _local_start + offset;
+    long res = _ds->map_region(_offset + offset, L4Re::Dataspace::Map_rw,
+                               l4_trunc_page(local), l4_round_page(local + size));
+    if (res < 0)
+      return res;
+
+    // While writes are logged, a later write fault makes the part writable.
+    map_guest_range(vm_task, dest, local, size,
+                    logging() ? L4_FPAGE_RX : L4_FPAGE_RWX);
+#else
+    (void)vm_task; (void)dest; (void)offset; (void)size;
+#endif
+    return L4_EOK;
+  }
 };
@@ -22,6 +22,21 @@ namespace Virtio {
  */
 class Event_connector_msix
 {
+  class Moderation : public Event_moderation
+  {
+  public:
+    Moderation(Event_connector_msix *con, char const *name, unsigned frames,
+               unsigned usecs)
+    : Event_moderation(name, frames, usecs), _con(con)
+    {}
+
+  private:
+    void flush() override
+    { _con->send_pending(); }
+
+    Event_connector_msix *_con;
+  };
+
 public:
   Event_connector_msix(cxx::Ref_ptr<Gic::Msi_controller> const &distr,
                        unsigned max_msix_entries)
@@ -31,15 +46,38 @@ public:
     _msix_tbl(_msix_mem->local_start(), max_msix_entries)
   {}
 
-  void send_events(Virtio::Event_set &&ev)
+  ~Event_connector_msix()
   {
-    for (unsigned i = 0; ev.e != 0; ev.e >>= 1, ++i)
-      if (ev.e & 1)
-        send_event(i);
+    if (_moderation)
+      _moderation->detach();
+  }
+
+  /**
+   * Send the MSIs for all events marked in `ev`.
+   *
+   * \see Event_connector_irq::send_events()
+   */
+  template <unsigned N>
+  void send_events(Virtio::Event_set_t<N> &&ev, unsigned frames = 1,
+                   bool queue_dry = true)
+  {
+    if (!_moderation)
+      ev.foreach_event([this](l4_uint16_t idx) { send_event(idx); });
+    else if (!ev.empty())
+      _moderation->submit(frames, queue_dry, [this, &ev]()
+        {
+          ev.foreach_event([this](l4_uint16_t idx) { mark_pending(idx); });
+        });
+
+    ev.reset();
   }
 
   void send_event(l4_uint16_t const idx)
   {
+    // The guest may program vectors beyond the table size.
+    if (L4_UNLIKELY(idx >= _msix_tbl.size()))
+      return;
+
     auto entry = _msix_tbl.entry(idx);
     if (!entry.disabled())
       _distr->send(entry.msg);
@@ -59,13 +97,47 @@ public:
     devs->vmm()->add_mmio_device(Vmm::Region::ss(Vmm::Guest_addr(dt_msi_base),
                                             Vdev::Msix_mem_need),
                                  _msix_mem);
+
+    unsigned frames, usecs;
+    if (Event_moderation::dt_config(node, &frames, &usecs))
+      {
+        _pending.resize((_msix_tbl.size() + 63) / 64);
+        _moderation = Vdev::make_device<Moderation>(this, node.get_name(),
+                                                    frames, usecs);
+      }
+
     return 0;
   }
 
 private:
+  void mark_pending(l4_uint16_t idx)
+  {
+    if (idx < _msix_tbl.size())
+      __atomic_or_fetch(&_pending[idx / 64], 1ULL << (idx % 64),
+                        __ATOMIC_RELAXED);
+  }
+
+  /**
+   * Send all vectors marked pending.
+   *
+   * Called without the moderation lock held, so vectors are taken from the
+   * pending set atomically.
+   */
+  void send_pending()
+  {
+    for (unsigned i = 0; i < _pending.size(); ++i)
+      for (l4_uint64_t w = __atomic_exchange_n(&_pending[i], 0ULL,
+                                               __ATOMIC_RELAXED);
+           w; w &= w - 1)
+        send_event(i * 64 + __builtin_ctzll(w));
+  }
+
   cxx::Ref_ptr<Gic::Msi_controller> _distr;
   cxx::Ref_ptr<Ds_handler> _msix_mem;
   Vdev::Msix_table _msix_tbl;
+  cxx::Ref_ptr<Moderation> _moderation;
+  /// Vectors held back by interrupt moderation.
+  std::vector<l4_uint64_t> _pending;
 
   cxx::Ref_ptr<Ds_handler> make_ram_ds_handler(l4_size_t size,
                                                unsigned long flags)
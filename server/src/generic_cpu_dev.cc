@@ -10,6 +10,7 @@
 #include "generic_cpu_dev.h"
 
 #include <cstdio>
+#include <cstring>
 
 #include <l4/sys/debugger.h>
 #include <l4/sys/scheduler>
@@ -70,4 +71,51 @@ Generic_cpu_dev::reschedule()
   L4Re::chksys(sched->run_thread(Pthread::L4::cap(_thread), sp));
 }
 
+namespace {
+
+/**
+ * Extended vCPU state (the VMCS on x86, the vGIC and system registers on
+ * ARM) that follows the generic state in the vCPU page.
+ */
+char *ext_state(Vcpu_ptr vcpu)
+{
+  return reinterpret_cast<char *>(*vcpu) + L4_VCPU_OFFSET_EXT_STATE;
+}
+
+enum : l4_size_t { Ext_state_size = L4_PAGESIZE - L4_VCPU_OFFSET_EXT_STATE };
+
+}
+
+void
+Generic_cpu_dev::save_state(Snapshot_writer &w) const
+{
+  w.put(_vcpu->r);
+  w.put(ext_state(_vcpu), Ext_state_size);
+}
+
+void
+Generic_cpu_dev::restore_state(Snapshot_reader &r)
+{
+  _restore_state.resize(sizeof(_vcpu->r) + Ext_state_size);
+  r.get(_restore_state.data(), _restore_state.size());
+
+  // The registers are also needed before reset(), which sets up the vCPU
+  // mode according to them on some architectures.
+  memcpy(&_vcpu->r, _restore_state.data(), sizeof(_vcpu->r));
+}
+
+void
+Generic_cpu_dev::apply_restored_state()
+{
+  if (_restore_state.empty())
+    return;
+
+  memcpy(&_vcpu->r, _restore_state.data(), sizeof(_vcpu->r));
+  memcpy(ext_state(_vcpu), _restore_state.data() + sizeof(_vcpu->r),
+         Ext_state_size);
+
+  _restore_state.clear();
+  _restore_state.shrink_to_fit();
+}
+
 }
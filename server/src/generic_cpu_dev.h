@@ -11,12 +11,14 @@
 
 #include <pthread.h>
 #include <pthread-l4.h>
+#include <vector>
 
 #include <l4/re/error_helper>
 #include <l4/re/util/kumem_alloc>
 
 #include <debug.h>
 #include <device.h>
+#include <snapshot.h>
 #include <vcpu_ptr.h>
 
 namespace Vmm {
@@ -54,11 +56,34 @@ public:
   L4::Cap<L4::Thread> thread_cap() const
   { return L4::Cap<L4::Thread>(pthread_l4_cap(_thread)); }
 
+  /**
+   * Save the register state of the vCPU.
+   *
+   * Must be called from the thread of the vCPU while it is stopped.
+   */
+  void save_state(Snapshot_writer &w) const;
+
+  /**
+   * Restore the register state of the vCPU.
+   *
+   * The extended state is applied by reset().
+   */
+  void restore_state(Snapshot_reader &r);
+
 protected:
+  /**
+   * Overwrite the vCPU state with the state recorded by restore_state().
+   *
+   * Called at the end of reset(), before the vCPU enters the guest.
+   */
+  void apply_restored_state();
+
   Vcpu_ptr _vcpu;
   /// physical CPU to run on (offset into scheduling mask)
   unsigned _phys_cpu_id;
   pthread_t _thread;
+  /// vCPU state to be applied on the next reset
+  std::vector<char> _restore_state;
 };
 
 
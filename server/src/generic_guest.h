@@ -20,6 +20,7 @@
 #include "ram_ds.h"
 #include "vm_memmap.h"
 #include "pm.h"
+#include "timer.h"
 #include "vbus_event.h"
 #include "consts.h"
 
@@ -46,6 +47,9 @@ public:
   Vm_mem *memmap()
   { return &_memmap; }
 
+  L4::Cap<L4::Vm> vm_task() const
+  { return _task.get(); }
+
   void L4_NORETURN halt_vm()
   {
     // XXX Only halts the current CPU. For the SMP case some
@@ -71,12 +75,14 @@ public:
 
   int handle_mmio(l4_addr_t pfa, Vcpu_ptr vcpu)
   {
-    Vm_mem::const_iterator f = _memmap.find(Guest_addr(pfa));
+    // The device may be removed meanwhile, see Vm_mem.
+    Grace_period::Reader reader(_memmap.grace_period());
+    Region region;
+    auto dev = _memmap.find_device(Guest_addr(pfa), &region);
 
-    if (f != _memmap.end())
-      return f->second->access(pfa, pfa - f->first.start.get(),
-                               vcpu, _task.get(),
-                               f->first.start.get(), f->first.end.get());
+    if (dev)
+      return dev->access(pfa, pfa - region.start.get(), vcpu, _task.get(),
+                         region.start.get(), region.end.get());
 
     if (!_mmio_fallback)
        return -L4_EFAULT;
@@ -157,6 +163,11 @@ public:
     _memmap.add_mmio_device(region, dev);
   }
 
+  void register_timer_device(cxx::Ref_ptr<Vdev::Timer> const &dev)
+  {
+    _clock.add_timer(dev);
+  }
+
 protected:
   void process_pending_ipc(Vcpu_ptr vcpu, l4_utcb_t *utcb)
   {
@@ -166,7 +177,10 @@ protected:
         _bm.setup_wait(utcb, L4::Ipc_svr::Reply_separate);
         l4_msgtag_t res = l4_ipc_wait(utcb, &src, L4_IPC_BOTH_TIMEOUT_0);
         if (!res.has_error())
-          handle_ipc(res, src, utcb);
+          {
+            Grace_period::Reader reader(_memmap.grace_period());
+            handle_ipc(res, src, utcb);
+          }
       }
   }
 
@@ -186,6 +200,7 @@ protected:
   Pm _pm;
   Vbus_event _vbus_event;
   L4::Cap<L4Re::Dataspace> _mmio_fallback;
+  Vdev::Clock_source _clock;
 };
 
 } // namespace
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <l4/sys/l4int.h>
+
+namespace Vmm {
+
+/**
+ * Tracks the readers of a shared structure, so that objects removed from it
+ * are only freed when no reader can use them anymore.
+ *
+ * Readers enclose their use of the structure and of the objects found in it
+ * in a Reader section. A writer removes an object from the structure, calls
+ * retire() and keeps the object until expired() returns true for the token.
+ * Writers never wait for readers.
+ *
+ * Readers are counted per epoch, and only the two latest epochs may have
+ * readers. An object retired in epoch `e` expires when the epoch `e + 2`
+ * has been reached, which requires all readers of epoch `e` to have left.
+ */
+class Grace_period
+{
+public:
+  class Reader
+  {
+  public:
+    explicit Reader(Grace_period &gp) : _gp(gp), _idx(gp.enter()) {}
+    ~Reader() { _gp.leave(_idx); }
+
+    Reader(Reader const &) = delete;
+    Reader &operator = (Reader const &) = delete;
+
+  private:
+    Grace_period &_gp;
+    unsigned _idx;
+  };
+
+  /**
+   * Get the token for an object that has just been removed.
+   *
+   * Must be called after the object is no longer reachable by new readers.
+   */
+  l4_umword_t retire()
+  {
+    advance();
+    return __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+  }
+
+  /**
+   * Check whether all readers that may have used a removed object left.
+   *
+   * \param token  Token returned by retire() for the object.
+   */
+  bool expired(l4_umword_t token)
+  {
+    // The epoch advances by at most one step per call.
+    advance();
+    advance();
+    return static_cast<long>(__atomic_load_n(&_epoch, __ATOMIC_SEQ_CST)
+                             - token) >= 2;
+  }
+
+private:
+  unsigned enter()
+  {
+    for (;;)
+      {
+        l4_umword_t e = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&_readers[e & 1], 1, __ATOMIC_SEQ_CST);
+
+        // The epoch advanced meanwhile, the count may already be checked.
+        if (__atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) == e)
+          return e & 1;
+
+        __atomic_sub_fetch(&_readers[e & 1], 1, __ATOMIC_SEQ_CST);
+      }
+  }
+
+  void leave(unsigned idx)
+  { __atomic_sub_fetch(&_readers[idx], 1, __ATOMIC_SEQ_CST); }
+
+  /**
+   * Start the next epoch if the readers of the one before the current left.
+   *
+   * Calls must be serialized by the writers.
+   */
+  void advance()
+  {
+    l4_umword_t e = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_readers[(e + 1) & 1], __ATOMIC_SEQ_CST) == 0)
+      __atomic_store_n(&_epoch, e + 1, __ATOMIC_SEQ_CST);
+  }
+
+  l4_umword_t _epoch = 0;
+  unsigned long _readers[2] = { 0, 0 };
+};
+
+} // namespace Vmm
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+namespace Vdev {
+
+/**
+ * List of all live objects of a class, for example to reach the devices of
+ * a kind from the monitor console.
+ *
+ * \tparam T  Class deriving from Instance_list<T>.
+ */
+template <typename T>
+class Instance_list
+{
+protected:
+  Instance_list()
+  {
+    std::lock_guard<std::mutex> lock(list_lock());
+    list().push_back(static_cast<T *>(this));
+  }
+
+  ~Instance_list()
+  {
+    std::lock_guard<std::mutex> lock(list_lock());
+    auto &l = list();
+    for (auto it = l.begin(); it != l.end(); ++it)
+      if (*it == static_cast<T *>(this))
+        {
+          l.erase(it);
+          break;
+        }
+  }
+
+public:
+  /**
+   * Call `func` with every live object.
+   *
+   * \return False if there is no object.
+   */
+  template <typename FUNC>
+  static bool foreach_instance(FUNC &&func)
+  {
+    std::lock_guard<std::mutex> lock(list_lock());
+    for (auto *i : list())
+      func(i);
+
+    return !list().empty();
+  }
+
+private:
+  static std::vector<T *> &list()
+  {
+    static std::vector<T *> l;
+    return l;
+  }
+
+  static std::mutex &list_lock()
+  {
+    static std::mutex m;
+    return m;
+  }
+};
+
+}
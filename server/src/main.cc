@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -25,11 +26,13 @@
 #include <getopt.h>
 
 #include <l4/re/env>
+#include <l4/sys/kip.h>
 
 #include "debug.h"
 #include "guest.h"
 #include "host_dt.h"
 #include "monitor_console.h"
+#include "snapshot.h"
 #include "vm_ram.h"
 #include "vm.h"
 
@@ -122,6 +125,77 @@ set_verbosity(char const *str)
     }
 }
 
+static int
+ram_populate_from_string(char const *str, Vmm::Vm_ram::Populate *mode)
+{
+  if (strcmp("eager", str) == 0)
+    *mode = Vmm::Vm_ram::Populate::Eager;
+  else if (strcmp("parallel", str) == 0)
+    *mode = Vmm::Vm_ram::Populate::Parallel;
+  else if (strcmp("lazy", str) == 0)
+    *mode = Vmm::Vm_ram::Populate::Lazy;
+  else
+    return -L4_EINVAL;
+
+  return 0;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix and return its log2,
+ * rounded up to the next power of two.
+ */
+static int
+page_shift_from_string(char const *str, unsigned char *shift)
+{
+  char *end;
+  unsigned long long size = strtoull(str, &end, 0);
+
+  switch (*end)
+    {
+    case 'G': size <<= 10; // fall through
+    case 'M': size <<= 10; // fall through
+    case 'K': size <<= 10; ++end; break;
+    default: break;
+    }
+
+  if (*end || size < L4_PAGESIZE)
+    return -L4_EINVAL;
+
+  unsigned char s = L4_PAGESHIFT;
+  while ((1ULL << s) < size)
+    ++s;
+
+  *shift = s;
+  return 0;
+}
+
+/**
+ * Records the time spent in the phases of the VM startup.
+ */
+class Boot_timer
+{
+public:
+  Boot_timer() : _start(now()), _last(_start) {}
+
+  /// Finish the current phase.
+  void phase(char const *name)
+  {
+    l4_cpu_time_t t = now();
+    info.printf("Boot phase %-16s %8llu us\n", name, t - _last);
+    _last = t;
+  }
+
+  void done()
+  { info.printf("Boot total %-16s %8llu us\n", "", _last - _start); }
+
+private:
+  static l4_cpu_time_t now()
+  { return l4_kip_clock(l4re_kip()); }
+
+  l4_cpu_time_t _start;
+  l4_cpu_time_t _last;
+};
+
 static int run(int argc, char *argv[])
 {
   unsigned long verbosity = Dbg::Warn;
@@ -148,6 +222,12 @@ static int run(int argc, char *argv[])
       { "verbose",                 no_argument,       NULL, 'v' },
       { "quiet",                   no_argument,       NULL, 'q' },
       { "wakeup-on-system-resume", no_argument,       NULL, 'W' },
+      { "ram-populate",            required_argument, NULL, 'P' },
+      { "prefault-window",         required_argument, NULL, 'F' },
+      { "ramdisk-cow",             no_argument,       NULL, 'R' },
+      { "snapshot",                required_argument, NULL, 'S' },
+      { "restore",                 required_argument, NULL, 'L' },
+      { "template",                no_argument,       NULL, 'T' },
       { 0, 0, 0, 0}
     };
 
@@ -155,6 +235,11 @@ static int run(int argc, char *argv[])
   char const *kernel_image = "rom/zImage";
   char const *ram_disk     = nullptr;
   l4_addr_t rambase = Vmm::Guest::Default_rambase;
+  auto populate = Vmm::Vm_ram::Populate::Eager;
+  unsigned char prefault_shift = 0;
+  bool ram_disk_cow = false;
+  char const *restore = nullptr;
+  bool restore_shared = false;
 
   int opt;
   while ((opt = getopt_long(argc, argv, options, loptions, NULL)) != -1)
@@ -193,19 +278,84 @@ static int run(int argc, char *argv[])
         case 'W':
           vmm->use_wakeup_inhibitor(true);
           break;
+        case 'P':
+          if (ram_populate_from_string(optarg, &populate) < 0)
+            {
+              Err().printf("invalid RAM population mode: %s\n", optarg);
+              return 1;
+            }
+          break;
+        case 'R':
+          ram_disk_cow = true;
+          break;
+        case 'S':
+          {
+            auto ds = L4Re::Env::env()->get_cap<L4Re::Dataspace>(optarg);
+            if (!ds)
+              {
+                Err().printf("snapshot capability '%s' not found\n", optarg);
+                return 1;
+              }
+            if (mon)
+              mon->enable_snapshots(&vm_instance, ds);
+            else
+              warn.printf("Snapshots need the monitor console, ignoring.\n");
+            break;
+          }
+        case 'L': restore = optarg; break;
+        case 'T': restore_shared = true; break;
+        case 'F':
+          if (page_shift_from_string(optarg, &prefault_shift) < 0)
+            {
+              Err().printf("invalid prefault window: %s\n", optarg);
+              return 1;
+            }
+          break;
         default:
           Err().printf("unknown command-line option\n");
           return 1;
         }
     }
 
+  if (restore_shared)
+    {
+      if (!restore)
+        {
+          Err().printf("--template requires --restore\n");
+          return 1;
+        }
+
+      // Populating the RAM would allocate the memory the template is
+      // meant to save.
+      populate = Vmm::Vm_ram::Populate::Lazy;
+    }
+
   warn.printf("Hello out there.\n");
 
+  Boot_timer timer;
+
+  ram->set_populate(populate, prefault_shift);
   Vmm::Ram_free_list ram_free_list
     = ram->setup_from_device_tree(dt, vmm->memmap(), Vmm::Guest_addr(rambase));
+  timer.phase("RAM setup");
 
-  info.printf("Loading kernel...\n");
-  l4_addr_t entry = vmm->load_linux_kernel(ram, kernel_image, &ram_free_list);
+  // When restoring, the guest RAM comes from the snapshot instead of the
+  // kernel and ramdisk images.
+  std::unique_ptr<Vmm::Snapshot> snapshot;
+  l4_addr_t entry = 0;
+  if (restore)
+    {
+      info.printf("Restoring snapshot %s...\n", restore);
+      snapshot.reset(new Vmm::Snapshot(restore));
+      snapshot->restore_ram(ram, vmm->memmap(), restore_shared);
+      timer.phase("snapshot RAM");
+    }
+  else
+    {
+      info.printf("Loading kernel...\n");
+      entry = vmm->load_linux_kernel(ram, kernel_image, &ram_free_list);
+      timer.phase("kernel load");
+    }
 
   if (dt.valid())
     {
@@ -219,6 +369,7 @@ static int run(int argc, char *argv[])
 
       vm_instance.scan_device_tree(dt.get());
     }
+  timer.phase("device setup");
 
   if (!vm_instance.cpus()->vcpu_exists(0))
     {
@@ -235,14 +386,22 @@ static int run(int argc, char *argv[])
       vm_instance.cpus()->create_vcpu(nullptr);
     }
 
-  if (ram_disk)
+  if (ram_disk && !restore)
     {
-      info.printf("Loading ram disk...\n");
       Vmm::Guest_addr rd_start;
       l4_size_t rd_size;
-      L4Re::chksys(ram_free_list.load_file_to_back(ram, ram_disk, &rd_start,
-                                                   &rd_size),
-                   "Copy ram disk into RAM.");
+      if (ram_disk_cow)
+        {
+          info.printf("Mapping ram disk...\n");
+          ram->map_file_cow(ram_disk, vmm->memmap(), dt, &rd_start, &rd_size);
+        }
+      else
+        {
+          info.printf("Loading ram disk...\n");
+          L4Re::chksys(ram_free_list.load_file_to_back(ram, ram_disk,
+                                                       &rd_start, &rd_size),
+                       "Copy ram disk into RAM.");
+        }
 
       if (dt.valid() && rd_size > 0)
         {
@@ -254,18 +413,34 @@ static int run(int argc, char *argv[])
 
       info.printf("Loaded ramdisk image %s to %lx (size: %08zx)\n",
                   ram_disk, rd_start.get(), rd_size);
+      timer.phase("ramdisk load");
     }
 
-  // finally copy in the device tree
-  l4_addr_t dt_boot_addr = 0;
-  if (dt.valid())
-    dt_boot_addr = ram->move_in_device_tree(&ram_free_list, cxx::move(dt));
-
-  vmm->prepare_linux_run(vm_instance.cpus()->vcpu(0), entry, ram, kernel_image,
-                         cmd_line, dt_boot_addr);
+  if (snapshot)
+    {
+      snapshot->restore_state(&vm_instance);
+      timer.phase("snapshot state");
+    }
+  else
+    {
+      // finally copy in the device tree
+      l4_addr_t dt_boot_addr = 0;
+      if (dt.valid())
+        dt_boot_addr = ram->move_in_device_tree(&ram_free_list, cxx::move(dt));
+
+      vmm->prepare_linux_run(vm_instance.cpus()->vcpu(0), entry, ram,
+                             kernel_image, cmd_line, dt_boot_addr);
+      timer.phase("boot setup");
+    }
 
   info.printf("Populating RAM of virtual machine\n");
   vmm->map_eager();
+  ram->populate(vmm->vm_task());
+  timer.phase("RAM population");
+  timer.done();
+
+  if (info.is_active())
+    Vmm::Mmio_device::show_mapping_stats(stdout);
 
   vmm->run(vm_instance.cpus());
 
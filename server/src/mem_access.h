@@ -36,6 +36,22 @@ struct Mem_access
   Kind access;
   char width;
 
+  /**
+   * The access consists of `count` elements of `width` at ascending
+   * addresses (amd64 MOVS/STOS, possibly repeated).
+   */
+  bool string = false;
+  /// Elements remain after this access, the instruction is executed again.
+  bool partial = false;
+  /// Number of elements of a string access.
+  l4_uint32_t count = 1;
+  /**
+   * VMM-virtual address of the guest RAM a string access takes its elements
+   * from (Store) or puts them to (Load), 0 if all elements of a store are
+   * `value`.
+   */
+  l4_addr_t buf = 0;
+
   static l4_uint64_t read_width(l4_addr_t addr, char width)
   {
     // only naturally aligned accesses are allowed
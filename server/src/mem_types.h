@@ -12,6 +12,21 @@
 
 namespace Vmm {
 
+enum : unsigned char
+{
+  /**
+   * log2 of the largest page size used to map guest memory.
+   *
+   * The kernel splits larger flexpages into the page sizes supported by
+   * the host and the guest page tables, so this is an upper bound only.
+   */
+#if L4_MWORD_BITS == 64
+  Max_page_shift = 30,
+#else
+  Max_page_shift = L4_SUPERPAGESHIFT,
+#endif
+};
+
 /**
  * A guest-physical address.
  */
@@ -6,9 +6,36 @@
  * License, version 2.  Please see the COPYING-GPL-2 file for details.
  */
 
+#include <atomic>
+
 #include "mmio_device.h"
 #include "debug.h"
 
+namespace {
+
+/// Number of guest mappings by size: small pages, superpages, huge pages.
+std::atomic<unsigned long> map_count[3];
+
+}
+
+void Vmm::Mmio_device::count_mapping(unsigned char shift)
+{
+  unsigned idx = shift >= Max_page_shift && Max_page_shift > L4_SUPERPAGESHIFT
+                 ? 2 : shift >= L4_SUPERPAGESHIFT ? 1 : 0;
+  ++map_count[idx];
+}
+
+void Vmm::Mmio_device::show_mapping_stats(FILE *f)
+{
+  fprintf(f, "Guest mappings: %lu x %luK, %lu x %luM",
+          map_count[0].load(), L4_PAGESIZE >> 10,
+          map_count[1].load(), L4_SUPERPAGESIZE >> 20);
+  if (Max_page_shift > L4_SUPERPAGESHIFT)
+    fprintf(f, ", %lu x %luG", map_count[2].load(),
+            (1UL << Max_page_shift) >> 30);
+  fprintf(f, "\n");
+}
+
 void Vmm::Mmio_device::map_guest_range(L4::Cap<L4::Task> vm_task,
                                        Vmm::Guest_addr dest, l4_addr_t src,
                                        l4_size_t size, unsigned attr)
@@ -31,6 +58,28 @@ void Vmm::Mmio_device::map_guest_range(L4::Cap<L4::Task> vm_task,
       if (res < 0)
         Err().printf("Could not map (%lx, %c) to (%lx, %c)\n", src + offs, ps,
                      doffs, ps);
-      offs += 1 << ps;
+      else
+        count_mapping(ps);
+      offs += 1UL << ps;
+    }
+}
+
+void Vmm::Mmio_device::unmap_guest_range(L4::Cap<L4::Task> vm_task,
+                                         Vmm::Guest_addr dest, l4_size_t size,
+                                         unsigned rights)
+{
+  l4_addr_t addr = dest.get();
+  l4_addr_t end = addr + size;
+
+  while (addr < end)
+    {
+      unsigned char ps = L4_PAGESHIFT;
+      while (ps < Max_page_shift
+             && !(addr & ((2UL << ps) - 1))
+             && addr + (2UL << ps) <= end)
+        ++ps;
+
+      vm_task->unmap(l4_fpage(addr, ps, rights), L4_FP_ALL_SPACES);
+      addr += 1UL << ps;
     }
 }
@@ -7,6 +7,8 @@
  * Please see the COPYING-GPL-2 file for details.
  */
 #pragma once
+#include <cstdio>
+#include <cstring>
 #include <typeinfo>
 
 #include <l4/cxx/ref_ptr>
@@ -43,20 +45,22 @@ struct Mmio_device : public virtual Vdev::Dev_ref
   };
 
   /**
-   * Check whether a superpage containing address is inside a region
+   * Check whether a naturally aligned page containing address is inside
+   * a region.
    *
    * \param addr     address to check
    * \param start    start of region.
    * \param end      end of region; do not check end of region if end is zero.
-   * \return true if there is a superpage containing the address
+   * \param shift    log2 of the page size.
+   * \return true if there is a page of the given size containing the address
    *                 inside the region
    */
-  inline bool sp_in_range(l4_addr_t addr, l4_addr_t start, l4_addr_t end)
-
+  static bool page_in_range(l4_addr_t addr, l4_addr_t start, l4_addr_t end,
+                            unsigned char shift)
   {
-    auto superpage = l4_trunc_size(addr, L4_SUPERPAGESHIFT);
-    return    (start <= superpage)
-           && (!end || ((superpage + L4_SUPERPAGESIZE - 1) <= end));
+    auto page = l4_trunc_size(addr, shift);
+    return    (start <= page)
+           && (!end || ((page + (1UL << shift) - 1) <= end));
   }
 
   /**
@@ -68,25 +72,37 @@ struct Mmio_device : public virtual Vdev::Dev_ref
    * \param offset   Accessed address relative to the beginning of the region.
    * \param l_start  Local address of start of memory region.
    * \param l_end    Local address of end of memory region, default 0.
-   * \return largest possible pageshift (currently either L4_PAGESHIFT
-   *                 or L4_SUPERPAGESHIFT)
+   * \return largest possible pageshift, up to Max_page_shift. The page must
+   *         be inside both regions and both regions must have the same
+   *         alignment relative to the page size.
    */
-  inline char get_page_shift(l4_addr_t addr, l4_addr_t start, l4_addr_t end,
-                                 l4_addr_t offset, l4_addr_t l_start,
-                                 l4_addr_t l_end = 0)
+  static char get_page_shift(l4_addr_t addr, l4_addr_t start, l4_addr_t end,
+                             l4_addr_t offset, l4_addr_t l_start,
+                             l4_addr_t l_end = 0)
   {
-    // Check whether a superpage is inside the regions
-    if (   !sp_in_range(addr, start, end)
-        || !sp_in_range(l_start + offset, l_start, l_end))
-      return L4_PAGESHIFT;
+    static unsigned char const shifts[] = { Max_page_shift, L4_SUPERPAGESHIFT };
 
-    // Check whether both regions have a compatible alignment
-    if ((start & (L4_SUPERPAGESIZE - 1)) != (l_start & (L4_SUPERPAGESIZE - 1)))
-      return L4_PAGESHIFT;
+    for (unsigned char ps : shifts)
+      {
+        if (   page_in_range(addr, start, end, ps)
+            && page_in_range(l_start + offset, l_start, l_end, ps)
+            && !((start ^ l_start) & ((1UL << ps) - 1)))
+          return ps;
+      }
 
-    return L4_SUPERPAGESHIFT;
+    return L4_PAGESHIFT;
   }
 
+  /**
+   * Account a mapping into the guest for the page size statistics.
+   */
+  static void count_mapping(unsigned char shift);
+
+  /**
+   * Print how many mappings of each page size have been made.
+   */
+  static void show_mapping_stats(FILE *f);
+
   /**
    * Map address range into guest.
    *
@@ -101,6 +117,20 @@ struct Mmio_device : public virtual Vdev::Dev_ref
   void map_guest_range(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr dest,
                        l4_addr_t src, l4_size_t size, unsigned attr);
 
+  /**
+   * Revoke rights from the guest for an address range.
+   *
+   * \param dest    Guest physical start address of the range
+   * \param size    Size of the range
+   * \param rights  Rights to revoke, L4_FPAGE_RWX removes the mappings
+   *
+   * The range is split into naturally aligned pieces that are as large as
+   * possible, so that large mappings are affected by a single unmap.
+   */
+  static void unmap_guest_range(L4::Cap<L4::Task> vm_task,
+                                Vmm::Guest_addr dest, l4_size_t size,
+                                unsigned rights);
+
 
   /**
    * Map address range into the guest.
@@ -168,6 +198,86 @@ struct Mmio_device : public virtual Vdev::Dev_ref
     return buf;
   };
 
+protected:
+  /**
+   * Emulate a string access by a single call of DEV::write_multi() or
+   * DEV::read_multi().
+   *
+   * \param dev     Device the access is forwarded to.
+   * \param pfa     Guest-physical address of the first element.
+   * \param offset  Offset of the first element in the device region.
+   * \param end     Guest-physical end address of the device region.
+   * \param vcpu    Virtual CPU from which the memory was accessed.
+   * \param insn    Decoded string access.
+   *
+   * Elements beyond the end of the device region are left to the next
+   * execution of the instruction.
+   *
+   * \retval Retry       Elements remain, the instruction is executed again.
+   * \retval Jump_instr  The instruction is complete.
+   */
+  template<typename DEV>
+  static int string_access(DEV *dev, l4_addr_t pfa, l4_addr_t offset,
+                           l4_addr_t end, Vcpu_ptr vcpu, Mem_access insn)
+  {
+    Dbg(Dbg::Mmio, Dbg::Trace, "mmio")
+      .printf("MMIO string access @ 0x%lx (0x%lx) %s, width: %u, count: %u\n",
+              pfa, offset,
+              insn.access == Vmm::Mem_access::Load ? "LOAD" : "STORE",
+              (unsigned) insn.width, insn.count);
+
+    l4_addr_t max = ((end - pfa) >> insn.width) + 1;
+    if (insn.count > max)
+      {
+        insn.count = max;
+        insn.partial = true;
+      }
+
+    if (insn.access == Vmm::Mem_access::Store)
+      dev->write_multi(offset, insn, vcpu.get_vcpu_id());
+    else
+      dev->read_multi(offset, insn, vcpu.get_vcpu_id());
+
+    vcpu.writeback_mmio(insn);
+    return insn.partial ? Retry : Jump_instr;
+  }
+
+  /**
+   * Write the elements of a string store one by one with DEV::write().
+   */
+  template<typename DEV>
+  static void write_elements(DEV *dev, unsigned reg, Mem_access const &m,
+                             unsigned cpu_id)
+  {
+    unsigned step = 1U << m.width;
+    for (l4_uint32_t i = 0; i < m.count; ++i, reg += step)
+      {
+        l4_uint64_t value = m.value;
+        if (m.buf)
+          {
+            value = 0;
+            memcpy(&value, reinterpret_cast<void *>(m.buf + i * step), step);
+          }
+
+        dev->write(reg, m.width, value, cpu_id);
+      }
+  }
+
+  /**
+   * Read the elements of a string load one by one with DEV::read().
+   */
+  template<typename DEV>
+  static void read_elements(DEV *dev, unsigned reg, Mem_access const &m,
+                            unsigned cpu_id)
+  {
+    unsigned step = 1U << m.width;
+    for (l4_uint32_t i = 0; i < m.count; ++i, reg += step)
+      {
+        l4_uint64_t value = dev->read(reg, m.width, cpu_id);
+        memcpy(reinterpret_cast<void *>(m.buf + i * step), &value, step);
+      }
+  }
+
 private:
   virtual bool _mergable(cxx::Ref_ptr<Mmio_device> /* other */,
                          Guest_addr /* start_other */,
@@ -189,12 +299,24 @@ private:
  * `reg` is the address offset into the devices memory region. `size`
  * describes the width of the access (see Vmm::Mem_access::Width) and
  * `cpu_id` the accessing CPU (currently unused).
+ *
+ * String accesses consisting of several elements are passed in one call to
+ *
+ *     void write_multi(unsigned reg, Vmm::Mem_access const &m, unsigned cpu_id);
+ *
+ *     void read_multi(unsigned reg, Vmm::Mem_access const &m, unsigned cpu_id);
+ *
+ * The elements are located at ascending offsets starting with `reg`, their
+ * values are found in or have to be stored to `m.buf` (see
+ * Vmm::Mem_access). DEV may provide these functions to handle bulk
+ * transfers efficiently; by default, the elements are passed to read() and
+ * write() one by one.
  */
 template<typename DEV>
 struct Mmio_device_t : Mmio_device
 {
   int access(l4_addr_t pfa, l4_addr_t offset, Vcpu_ptr vcpu,
-             L4::Cap<L4::Task>, l4_addr_t, l4_addr_t) override
+             L4::Cap<L4::Task>, l4_addr_t, l4_addr_t e) override
   {
     auto insn = vcpu.decode_mmio();
 
@@ -206,6 +328,9 @@ struct Mmio_device_t : Mmio_device
         return -L4_ENXIO;
       }
 
+    if (L4_UNLIKELY(insn.string))
+      return string_access(dev(), pfa, offset, e, vcpu, insn);
+
     Dbg(Dbg::Mmio, Dbg::Trace, "mmio")
       .printf("MMIO access @ 0x%lx (0x%lx) %s, width: %u\n",
               pfa, offset,
@@ -226,6 +351,61 @@ struct Mmio_device_t : Mmio_device
   void map_eager(L4::Cap<L4::Task>, Vmm::Guest_addr, Vmm::Guest_addr) override
   {} // nothing to map
 
+  /// Write the elements of a string access one by one by default.
+  void write_multi(unsigned reg, Mem_access const &m, unsigned cpu_id)
+  { write_elements(dev(), reg, m, cpu_id); }
+
+  /// Read the elements of a string access one by one by default.
+  void read_multi(unsigned reg, Mem_access const &m, unsigned cpu_id)
+  { read_elements(dev(), reg, m, cpu_id); }
+
+private:
+  DEV *dev()
+  { return static_cast<DEV *>(this); }
+};
+
+/**
+ * Mixin for devices whose memory region consists of write-only doorbells.
+ *
+ * The target of a doorbell is identified by the faulting guest-physical
+ * address alone. Writes are therefore handled without decoding the
+ * faulting instruction, the instruction pointer is advanced by the length
+ * reported by the hardware. The base class DEV needs to provide
+ *
+ *     void doorbell(unsigned reg, unsigned cpu_id);
+ *
+ * `reg` is the address offset into the devices memory region. Read
+ * accesses are fully decoded and return 0.
+ */
+template<typename DEV>
+struct Mmio_doorbell_t : Mmio_device
+{
+  int access(l4_addr_t pfa, l4_addr_t offset, Vcpu_ptr vcpu,
+             L4::Cap<L4::Task>, l4_addr_t, l4_addr_t) override
+  {
+    if (L4_LIKELY(vcpu.pf_write()))
+      {
+        dev()->doorbell(offset, vcpu.get_vcpu_id());
+        return Jump_instr;
+      }
+
+    auto insn = vcpu.decode_mmio();
+    if (insn.access != Vmm::Mem_access::Load || insn.string)
+      {
+        Dbg(Dbg::Mmio, Dbg::Warn, "mmio")
+          .printf("Doorbell access @ 0x%lx: unknown instruction. Ignored.\n",
+                  pfa);
+        return -L4_ENXIO;
+      }
+
+    insn.value = 0;
+    vcpu.writeback_mmio(insn);
+    return Jump_instr;
+  }
+
+  void map_eager(L4::Cap<L4::Task>, Vmm::Guest_addr, Vmm::Guest_addr) override
+  {} // nothing to map
+
 private:
   DEV *dev()
   { return static_cast<DEV *>(this); }
@@ -241,6 +421,18 @@ private:
  * mapped into the guest memory for reading. The device needs to take care
  * to keep the region up-to-date. Write access to the region still traps
  * into the VMM and needs to be handled programmatically.
+ *
+ * Before a write access is decoded, the device is offered to handle it as
+ * a doorbell write:
+ *
+ *     bool mmio_doorbell(unsigned reg, Vcpu_ptr vcpu);
+ *
+ * It returns true if `reg` is a doorbell register and the write has been
+ * handled. The value written can be obtained via
+ * Vcpu_ptr::decode_doorbell().
+ *
+ * String accesses are handled as described for Mmio_device_t, without
+ * mapping the region.
  */
 template<typename BASE>
 struct Ro_ds_mapper_t : Mmio_device
@@ -248,6 +440,10 @@ struct Ro_ds_mapper_t : Mmio_device
   int access(l4_addr_t pfa, l4_addr_t offset, Vcpu_ptr vcpu,
              L4::Cap<L4::Task> vm_task, l4_addr_t min, l4_addr_t max) override
   {
+    // Writes to doorbell registers do not need a full decode.
+    if (vcpu.pf_write() && dev()->mmio_doorbell(offset, vcpu))
+      return Jump_instr;
+
     auto insn = vcpu.decode_mmio();
 
     if (insn.access == Vmm::Mem_access::Other)
@@ -258,6 +454,9 @@ struct Ro_ds_mapper_t : Mmio_device
         return -L4_ENXIO;
       }
 
+    if (L4_UNLIKELY(insn.string))
+      return string_access(dev(), pfa, offset, max, vcpu, insn);
+
     Dbg(Dbg::Mmio, Dbg::Trace, "mmio")
       .printf("MMIO access @ 0x%lx (0x%lx) %s, width: %u\n",
               pfa, offset,
@@ -317,6 +516,14 @@ struct Ro_ds_mapper_t : Mmio_device
     return Mem_access::read_width(local_addr() + offset, width);
   }
 
+  /// Write the elements of a string access one by one by default.
+  void write_multi(unsigned reg, Mem_access const &m, unsigned cpu_id)
+  { write_elements(dev(), reg, m, cpu_id); }
+
+  /// Read the elements of a string access one by one by default.
+  void read_multi(unsigned reg, Mem_access const &m, unsigned cpu_id)
+  { read_elements(dev(), reg, m, cpu_id); }
+
   void map_mmio(l4_addr_t pfa, l4_addr_t offset, L4::Cap<L4::Task> vm_task,
                 l4_addr_t min, l4_addr_t max)
   {
@@ -341,6 +548,8 @@ struct Ro_ds_mapper_t : Mmio_device
         res = l4_error(vm_task->map(L4Re::This_task,
                                     l4_fpage(base, ps, L4_FPAGE_RX),
                                     l4_trunc_size(pfa, ps)));
+        if (res >= 0)
+          count_mapping(ps);
       }
 #endif
 
@@ -417,6 +626,10 @@ struct Read_mapped_mmio_device_t : Ro_ds_mapper_t<BASE>
   T *mmio_local_addr() const
   { return _mmio_region.get(); }
 
+  /// No doorbell registers by default.
+  bool mmio_doorbell(unsigned, Vcpu_ptr)
+  { return false; }
+
 private:
   L4Re::Util::Unique_del_cap<L4Re::Dataspace> _ds;
 
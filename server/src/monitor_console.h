@@ -14,14 +14,25 @@
 
 #include "cpu_dev_array.h"
 #include "device.h"
+#include "ds_cow_mapper.h"
 #include "guest.h"
+#include "snapshot.h"
+#include "virtio_balloon.h"
+#include "virtio_mem.h"
+#include "vm.h"
 
+#include "virtio_event_connector.h"
 #include "virtio_input_power.h"
 
 class Monitor_console
 : public L4::Irqep_t<Monitor_console>,
   public cxx::Ref_obj
 {
+  /// Pages the balloon target changes by with the '+' and '-' commands.
+  enum : long { Balloon_step = (64UL << 20) >> 12 };
+  /// Bytes the hotplug memory changes by with the '>' and '<' commands.
+  enum : long long { Hotplug_step = 128LL << 20 };
+
   FILE *_f;
 
 public:
@@ -62,6 +73,18 @@ public:
     prompt();
   }
 
+  /**
+   * Allow saving snapshots of the VM with the 's' command.
+   *
+   * \param vm  VM to save.
+   * \param ds  Dataspace to save the snapshot to.
+   */
+  void enable_snapshots(Vmm::Vm *vm, L4::Cap<L4Re::Dataspace> ds)
+  {
+    _snapshot_vm = vm;
+    _snapshot_ds = ds;
+  }
+
   void prompt()
   {
     fprintf(_f, "monitor> ");
@@ -111,6 +134,47 @@ public:
                       _devices->vmm()->show_state_interrupts(_f, cpu->vcpu());
                   break;
                 }
+              case 'c':
+                fputc('\n', _f);
+                Virtio::Event_moderation::show_all_stats(_f);
+                break;
+              case 'm':
+                fputc('\n', _f);
+                Vmm::Mmio_device::show_mapping_stats(_f);
+                show_cow_stats();
+                break;
+              case 's':
+                fputc('\n', _f);
+                save_snapshot();
+                break;
+              case 'd':
+                fputc('\n', _f);
+                show_dirty_log();
+                break;
+              case 'D':
+                fputc('\n', _f);
+                _devices->ram()->stop_dirty_log();
+                break;
+              case 'b':
+                fputc('\n', _f);
+                Vdev::Balloon_control::show_all(_f);
+                break;
+              case '+':
+                Vdev::Balloon_control::change_all(Balloon_step);
+                break;
+              case '-':
+                Vdev::Balloon_control::change_all(-Balloon_step);
+                break;
+              case 'h':
+                fputc('\n', _f);
+                Vdev::Mem_hotplug_control::show_all(_f);
+                break;
+              case '>':
+                Vdev::Mem_hotplug_control::resize_all(Hotplug_step);
+                break;
+              case '<':
+                Vdev::Mem_hotplug_control::resize_all(-Hotplug_step);
+                break;
               case 't': Dbg::set_verbosity(Dbg::Trace | Dbg::Info | Dbg::Warn); break;
               case 'T': Dbg::set_verbosity(Dbg::Info | Dbg::Warn); break;
               case '\r':
@@ -132,7 +196,84 @@ public:
   }
 
 private:
+  void show_cow_stats()
+  {
+    unsigned long shared = 0, priv = 0;
+    unsigned regions = 0;
+
+    for (auto const &m : *_devices->vmm()->memmap())
+      {
+        auto *cow = dynamic_cast<Cow_ds_handler *>(m.second.get());
+        if (!cow)
+          continue;
+
+        fprintf(_f, "Copy-on-write [%lx-%lx]: %lu shared, %lu private pages\n",
+                m.first.start.get(), m.first.end.get(),
+                cow->shared_pages(), cow->private_pages());
+        shared += cow->shared_pages();
+        priv += cow->private_pages();
+        ++regions;
+      }
+
+    if (regions > 1)
+      fprintf(_f, "Copy-on-write total: %lu shared, %lu private pages\n",
+              shared, priv);
+  }
+
+  /**
+   * Start logging guest writes or show and clear the log of the current
+   * round.
+   */
+  void show_dirty_log()
+  {
+    auto ram = _devices->ram();
+    if (!ram->dirty_log_active())
+      {
+        ram->start_dirty_log(_devices->vmm()->vm_task());
+        fprintf(_f, "Dirty logging started\n");
+        return;
+      }
+
+    ram->fetch_dirty_log([this](Vmm::Ram_ds const &r, Vmm::Dirty_log const &log,
+                                std::vector<l4_umword_t> const &chunks,
+                                std::vector<l4_umword_t> const &pages)
+      {
+        unsigned long dchunks = 0, dpages = 0;
+        for (auto w : chunks)
+          dchunks += __builtin_popcountl(w);
+        for (auto w : pages)
+          dpages += __builtin_popcountl(w);
+
+        fprintf(_f, "Dirty [%lx-%lx]: %lu of %lu chunks, %lu pages in refined "
+                    "chunks, %lu write faults\n",
+                r.vm_start().get(), r.vm_start().get() + r.size() - 1,
+                dchunks, log.num_chunks(), dpages, log.write_faults());
+      });
+  }
+
+  void save_snapshot()
+  {
+    if (!_snapshot_ds)
+      {
+        fprintf(_f, "Snapshots not enabled, see --snapshot\n");
+        return;
+      }
+
+    try
+      {
+        Vmm::Snapshot::save(_snapshot_vm, _snapshot_ds);
+        fprintf(_f, "Snapshot saved\n");
+      }
+    catch (L4::Runtime_error &e)
+      {
+        fprintf(_f, "Snapshot failed: %s: %s\n",
+                e.extra_str() ? e.extra_str() : "", e.str());
+      }
+  }
+
   bool brk = false;
   L4::Cap<L4::Vcon> _con;
   Vdev::Device_lookup *_devices;
+  Vmm::Vm *_snapshot_vm = nullptr;
+  L4::Cap<L4Re::Dataspace> _snapshot_ds;
 };
@@ -15,6 +15,9 @@ namespace Vmm {
 
 /**
  * Interface for devices containing MSRs visible to the VM.
+ *
+ * A device is registered with the MSR ranges it handles and only receives
+ * accesses to these MSRs.
  */
 struct Msr_device : virtual Vdev::Dev_ref
 {
@@ -29,6 +29,7 @@ enum Pci_status_register
 enum Pci_command_register : l4_uint16_t
 {
   Io_space_bit = 1U,
+  Memory_space_bit = 1U << 1,
   Bus_master_bit = 1U << 2,
   Interrupt_disable_bit = 1U << 10,
 };
@@ -578,6 +579,9 @@ public:
     return _table[idx];
   }
 
+  /// Number of entries in the table.
+  unsigned size() const { return _table.size(); }
+
   /// Print all table entries.
   void dump() const
   {
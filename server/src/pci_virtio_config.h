@@ -32,6 +32,57 @@ namespace Vdev {
     Virtio_pci_cap_pci_cfg     = 5,
   };
 
+  /// Layout of the virtio structures in an I/O port BAR.
+  enum Virtio_pci_io_layout
+  {
+    Virtio_pci_io_common_cfg_offset = 0,
+    Virtio_pci_io_notify_offset     = 56,
+    Virtio_pci_io_isr_offset        = 58,
+    Virtio_pci_io_pci_cfg_offset    = 60,
+  };
+
+  /**
+   * Layout of the virtio structures in a memory BAR.
+   *
+   * The first page holds the common configuration and is mapped read-only
+   * into the guest. The ISR status follows on a page of its own, which
+   * traps, because reading it acknowledges the interrupt. Next is the
+   * configuration page of the device, which is mapped read-only as well and
+   * contains the device-specific configuration at
+   * `Virtio_pci_mem_dev_cfg_start`. The notification region comes last;
+   * each queue has its own doorbell at
+   * `queue_index * Virtio_pci_notify_off_multiplier`.
+   */
+  enum Virtio_pci_mem_layout
+  {
+    Virtio_pci_mem_common_cfg_offset = 0,
+    Virtio_pci_mem_isr_offset        = L4_PAGESIZE,
+    Virtio_pci_mem_dev_cfg_offset    = 2 * L4_PAGESIZE,
+    Virtio_pci_mem_dev_cfg_start     = 0x100,
+    Virtio_pci_notify_off_multiplier = 4,
+  };
+
+  /**
+   * Offset of the notification region in a virtio memory BAR.
+   *
+   * \param dev_cfg_size  Size of the configuration page of the device.
+   */
+  inline l4_uint32_t virtio_pci_mem_notify_offset(l4_size_t dev_cfg_size)
+  { return Virtio_pci_mem_dev_cfg_offset + l4_round_page(dev_cfg_size); }
+
+  /**
+   * Minimum size of a virtio memory BAR.
+   *
+   * \param dev_cfg_size  Size of the configuration page of the device.
+   * \param num_queues    Number of virtqueues of the device.
+   */
+  inline l4_size_t virtio_pci_mem_bar_size(l4_size_t dev_cfg_size,
+                                           unsigned num_queues)
+  {
+    return virtio_pci_mem_notify_offset(dev_cfg_size)
+           + l4_round_page(num_queues * Virtio_pci_notify_off_multiplier);
+  }
+
   struct Virtio_pci_cap_base
   {
     l4_uint8_t  cap_len;
@@ -62,7 +113,7 @@ namespace Vdev {
     l4_uint16_t queue_select;
     l4_uint16_t queue_size;
     l4_uint16_t queue_msix_vector;
-    l4_uint16_t quene_enable;
+    l4_uint16_t queue_enable;
     l4_uint16_t queue_notify_off;
     l4_uint64_t queue_desc;
     l4_uint64_t queue_avail;
@@ -69,11 +69,14 @@ private:
     hdr->revision_id = Non_transitional_device_pci_revision_id;
     hdr->subsystem_id = dev_cfg->device;
     // hdr->subsystem_id && hdr->subsystem_vendor: virtio spec 1.0 cs4: optional
-    hdr->command = Io_space_bit;
+    hdr->command = 0;
     hdr->status = Interrupt_status_bit | Capability_list_bit;
     hdr->header_type = Multi_func_bit;
 
-    unsigned io_bar = -1U;
+    // The first memory BAR holds the MSI-X table, the following BAR the
+    // virtio structures. The latter may be either an IO or a memory BAR.
+    unsigned msix_bar = -1U;
+    unsigned vio_bar = -1U;
     for (unsigned i = 0; i < regs.size(); ++i)
       {
         auto &reg = regs[i];
@@ -83,98 +86,130 @@ private:
         if (reg.base & (io_space ? 0x3 : 0xf))
           L4Re::chksys(-L4_EINVAL, "Aligned BAR memory.");
 
-        // XXX assumption one IO-Port bar and one MMIO MSIX bar
-        if (!io_space)
+        set_space(i, reg.base, reg.size, io_space);
+        hdr->command |= io_space ? Io_space_bit : Memory_space_bit;
+        Dbg().printf("Virtio pci config BAR%i: 0x%x\n", i,
+                     hdr->base_addr_regs[i]);
+
+        if (!io_space && msix_bar == -1U)
           {
             reg.print();
             assert(reg.size >= Msix_mem_need);
+            create_msix_cap(num_msix_entries, i);
+            msix_bar = i;
           }
+        else if (vio_bar == -1U)
+          vio_bar = i;
+      }
 
-        set_space(i, reg.base, reg.size, io_space);
-        Dbg().printf("Virtio pci config BAR%i: 0x%x\n", i,
-                     hdr->base_addr_regs[i]);
+    if (vio_bar == -1U)
+      L4Re::chksys(-L4_EINVAL,
+                   "Expected a configuration BAR for a VirtIO-PCI device.");
 
-        if (!io_space)
-          create_msix_cap(num_msix_entries, i);
-        else
-          io_bar = i;
+    if (regs[vio_bar].flags & Dt_pci_flags_io)
+      {
+        create_vio_pci_cap_common_entry(vio_bar,
+                                        Virtio_pci_io_common_cfg_offset);
+        create_vio_pci_cap_notify_entry(vio_bar, Virtio_pci_io_notify_offset,
+                                        2, 0);
+        create_vio_pci_cap_isr_entry(vio_bar, Virtio_pci_io_isr_offset, 2);
+        create_vio_pci_cap_pci_entry(vio_bar, Virtio_pci_io_pci_cfg_offset);
+        return;
       }
 
-    if (io_bar == -1U)
-      L4Re::chksys(-L4_EINVAL, "Expected one IO BAR for a VirtIO-PCI device.");
-
-    Virtio_pci_cap_base *cap = create_vio_pci_cap_common_entry(nullptr, io_bar);
-    cap = create_vio_pci_cap_notify_entry(cap, io_bar);
-    cap = create_vio_pci_cap_isr_entry(cap, io_bar);
-    // TODO implement create_vio_pci_cap_device_entry
-    // cap = create_vio_pci_cap_device_entry(cap, io_bar);
-    cap = create_vio_pci_cap_pci_entry(cap, io_bar);
+    l4_size_t cfg_size = dev()->mapped_mmio_size();
+    unsigned num_queues = dev_cfg->num_queues ? dev_cfg->num_queues : 1;
+    l4_uint32_t notify_offset = virtio_pci_mem_notify_offset(cfg_size);
+
+    if (regs[vio_bar].size < virtio_pci_mem_bar_size(cfg_size, num_queues))
+      L4Re::chksys(-L4_EINVAL, "VirtIO-PCI memory BAR too small.");
+
+    create_vio_pci_cap_common_entry(vio_bar, Virtio_pci_mem_common_cfg_offset);
+    create_vio_pci_cap_notify_entry(vio_bar, notify_offset,
+                                    num_queues
+                                    * Virtio_pci_notify_off_multiplier,
+                                    Virtio_pci_notify_off_multiplier);
+    create_vio_pci_cap_isr_entry(vio_bar, Virtio_pci_mem_isr_offset, 1);
+    create_vio_pci_cap_device_entry(vio_bar,
+                                    Virtio_pci_mem_dev_cfg_offset
+                                    + Virtio_pci_mem_dev_cfg_start,
+                                    cfg_size - Virtio_pci_mem_dev_cfg_start);
+    create_vio_pci_cap_pci_entry(vio_bar, notify_offset);
   }
 
   Virtio_pci_cap_base *
-  create_vio_pci_cap_common_entry(Virtio_pci_cap_base *prev, unsigned io_bar)
+  create_vio_pci_cap_common_entry(unsigned bar, l4_uint32_t offset)
   {
     auto *entry = allocate_pci_cap<Virtio_pci_cap>();
     entry->id.cap_type  = Virtio_pci_cap_vndr;
     entry->vio.cap_len  = sizeof(Virtio_pci_cap);
     entry->vio.cfg_type = Virtio_pci_cap_common_cfg;
-    entry->vio.bar      = io_bar;
-    // Start the IObar with the PCI common config
-    entry->vio.offset   = prev ? prev->offset + prev->length : 0;
+    entry->vio.bar      = bar;
+    entry->vio.offset   = offset;
     entry->vio.length   = sizeof(Virtio_pci_common_cfg);
 
     return &entry->vio;
   }
 
   Virtio_pci_cap_base *
-  create_vio_pci_cap_notify_entry(Virtio_pci_cap_base *prev, unsigned io_bar)
+  create_vio_pci_cap_notify_entry(unsigned bar, l4_uint32_t offset,
+                                  l4_uint32_t length, l4_uint32_t multiplier)
   {
     auto *entry = allocate_pci_cap<Virtio_pci_notify_cap>();
     entry->id.cap_type  = Virtio_pci_cap_vndr;
     entry->vio.cap_len  = sizeof(Virtio_pci_notify_cap);
     entry->vio.cfg_type = Virtio_pci_cap_notify_cfg;
-    entry->vio.bar      = io_bar;
+    entry->vio.bar      = bar;
     // offset must be 2 byte aligned
-    entry->vio.offset =
-      prev ? l4_round_size(prev->offset + prev->length, 1) : 0;
-    entry->vio.length   = 2; // smallest possible length
+    entry->vio.offset   = l4_round_size(offset, 1);
+    entry->vio.length   = length;
 
-    entry->notify_off_multiplier = 0;
+    // With a multiplier of 0 all queues share the same notification address.
+    entry->notify_off_multiplier = multiplier;
 
     return &entry->vio;
   }
 
-  Virtio_pci_cap_base *create_vio_pci_cap_isr_entry(Virtio_pci_cap_base *prev,
-                                                    unsigned io_bar)
+  Virtio_pci_cap_base *create_vio_pci_cap_isr_entry(unsigned bar,
+                                                    l4_uint32_t offset,
+                                                    l4_uint32_t length)
   {
     auto *entry = allocate_pci_cap<Virtio_pci_cap>();
     entry->id.cap_type  = Virtio_pci_cap_vndr;
     entry->vio.cap_len  = sizeof(Virtio_pci_cap);
     entry->vio.cfg_type = Virtio_pci_cap_isr_cfg;
-    entry->vio.bar      = io_bar;
-    entry->vio.offset   = prev ? prev->offset + prev->length : 0;
-    entry->vio.length   = 2;
+    entry->vio.bar      = bar;
+    entry->vio.offset   = offset;
+    entry->vio.length   = length;
 
     return &entry->vio;
   }
 
   Virtio_pci_cap_base *
-  create_vio_pci_cap_device_entry(Virtio_pci_cap_base *prev, unsigned io_bar)
+  create_vio_pci_cap_device_entry(unsigned bar, l4_uint32_t offset,
+                                  l4_uint32_t length)
   {
-    // 4 byte align offset to find device specific config
-    // Should probably be set up by the device separately?
-    return prev;
+    auto *entry = allocate_pci_cap<Virtio_pci_cap>();
+    entry->id.cap_type  = Virtio_pci_cap_vndr;
+    entry->vio.cap_len  = sizeof(Virtio_pci_cap);
+    entry->vio.cfg_type = Virtio_pci_cap_device_cfg;
+    entry->vio.bar      = bar;
+    // offset must be 4 byte aligned
+    entry->vio.offset   = l4_round_size(offset, 2);
+    entry->vio.length   = length;
+
+    return &entry->vio;
   }
 
-  Virtio_pci_cap_base *create_vio_pci_cap_pci_entry(Virtio_pci_cap_base *prev,
-                                                    unsigned io_bar)
+  Virtio_pci_cap_base *create_vio_pci_cap_pci_entry(unsigned bar,
+                                                    l4_uint32_t offset)
   {
     auto *entry = allocate_pci_cap<Virtio_pci_cfg_cap>();
     entry->id.cap_type  = Virtio_pci_cap_vndr;
     entry->vio.cap_len  = sizeof(Virtio_pci_cfg_cap);
     entry->vio.cfg_type = Virtio_pci_cap_pci_cfg;
-    entry->vio.bar      = io_bar;
-    entry->vio.offset   = prev ? prev->offset + prev->length : 0;
+    entry->vio.bar      = bar;
+    entry->vio.offset   = offset;
     entry->vio.length   = sizeof(Virtio_pci_cfg_cap);
 
     // TODO This is not fully implemented. But the spec forces me to provide
@@ -19,7 +19,7 @@ static Dbg trace(Dbg::Mmio, Dbg::Warn, "trace");
 namespace Vmm {
 
 long
-Ram_ds::setup(Vmm::Guest_addr vm_base)
+Ram_ds::setup(Vmm::Guest_addr vm_base, bool eager)
 {
   Dbg info(Dbg::Mmio, Dbg::Info, "ram");
 
@@ -78,11 +78,32 @@ Ram_ds::setup(Vmm::Guest_addr vm_base)
               cont ? 'c' : '-',
               ident ? 'i' : '-');
 
+  // The region can only be mapped to the guest with large pages, if the
+  // VMM mapping has the same alignment as the guest-physical address
+  // relative to the page size. Align to the largest page that fits.
+  unsigned char align = _size >= (1UL << Max_page_shift) ? Max_page_shift
+                                                         : L4_SUPERPAGESHIFT;
+  l4_addr_t misalign = _vm_start.get() & ((1UL << align) - 1);
+
   _local_start = 0;
-  L4Re::chksys(env->rm()->attach(&_local_start, _size,
-                                 L4Re::Rm::Search_addr | L4Re::Rm::Eager_map,
+  unsigned long flags = L4Re::Rm::Search_addr;
+  if (eager)
+    flags |= L4Re::Rm::Eager_map;
+
+  if (misalign)
+    {
+      l4_addr_t area = 0;
+      L4Re::chksys(env->rm()->reserve_area(&area, _size + (1UL << align),
+                                           L4Re::Rm::Search_addr, align),
+                   "Reserve VMM area for RAM.");
+      _local_start = area + misalign;
+      _area = area;
+      flags = (flags & ~L4Re::Rm::Search_addr) | L4Re::Rm::In_area;
+    }
+
+  L4Re::chksys(env->rm()->attach(&_local_start, _size, flags,
                                  L4::Ipc::make_cap_rw(_ds), _ds_offset,
-                                 L4_SUPERPAGESHIFT));
+                                 misalign ? L4_PAGESHIFT : align));
   info.printf("RAM: VMM mapping @ 0x%lx size=0x%lx\n", _local_start, (l4_addr_t)_size);
 
   _offset = _local_start - _vm_start.get();
@@ -97,31 +118,13 @@ Ram_ds::setup(Vmm::Guest_addr vm_base)
   return L4_EOK;
 }
 
-
 void
-Ram_ds::load_file(L4::Cap<L4Re::Dataspace> const &file,
-                  Vmm::Guest_addr addr, l4_size_t sz) const
+Ram_ds::detach()
 {
-  Dbg info(Dbg::Mmio, Dbg::Info, "file");
-
-  info.printf("load: @ 0x%lx\n", addr.get());
-  if (!file)
-    L4Re::chksys(-L4_EINVAL);
-
-  l4_addr_t offset = addr - _vm_start;
-
-  if (addr < _vm_start || sz > size() || offset > size() - sz)
-    {
-      Err().printf("File does not fit into ram. "
-                   "(Loading [0x%lx - 0x%lx] into area [0x%lx - 0x%lx])\n",
-                   addr.get(), addr.get() + sz,
-                   _vm_start.get(), _vm_start.get() + size());
-      L4Re::chksys(-L4_EINVAL);
-    }
-
-  info.printf("copy in: to offset 0x%lx-0x%lx\n", offset, offset + sz);
-
-  L4Re::chksys(_ds->copy_in(offset + _ds_offset, file, 0, sz), "copy in");
+  auto *rm = L4Re::Env::env()->rm();
+  rm->detach(_local_start, 0);
+  if (_area)
+    rm->free_area(_area);
 }
 
 } // namespace
@@ -9,6 +9,7 @@
 
 #include <l4/re/dataspace>
 #include <l4/re/dma_space>
+#include <l4/re/error_helper>
 #include <l4/re/util/cap_alloc>
 #include <l4/re/util/unique_cap>
 #include <l4/util/util.h>
@@ -23,6 +24,52 @@
 
 namespace Vmm {
 
+/**
+ * Hook for RAM whose contents are provided on demand.
+ *
+ * prepare_access() is called with a range of a region before the range is
+ * accessed by the VMM or mapped into the guest. The hook must make sure
+ * that the backing dataspace of the region holds the contents of the range
+ * when it returns.
+ */
+struct Ram_access_hook
+{
+  virtual ~Ram_access_hook() = 0;
+
+  /**
+   * Prepare a range for access.
+   *
+   * \param offset  Start of the range relative to the region.
+   * \param size    Size of the range.
+   */
+  virtual void prepare_access(l4_addr_t offset, l4_size_t size) = 0;
+
+  /**
+   * Copy a range into a dataspace without modifying it.
+   *
+   * \param dst         Dataspace to copy to.
+   * \param dst_offset  Offset into `dst` where to start copying.
+   * \param ram         RAM dataspace of the region.
+   * \param ram_offset  Offset of the region in `ram`.
+   * \param offset      Start of the range relative to the region.
+   * \param size        Size of the range.
+   *
+   * By default, the range is prepared with prepare_access() and copied
+   * from the RAM dataspace. Hooks that can provide the contents of a range
+   * without preparing it override this.
+   */
+  virtual void copy_out(L4::Cap<L4Re::Dataspace> dst, l4_addr_t dst_offset,
+                        L4::Cap<L4Re::Dataspace> ram, l4_addr_t ram_offset,
+                        l4_addr_t offset, l4_size_t size)
+  {
+    prepare_access(offset, size);
+    L4Re::chksys(dst->copy_in(dst_offset, ram, ram_offset + offset, size),
+                 "Copying guest RAM into dataspace.");
+  }
+};
+
+inline Ram_access_hook::~Ram_access_hook() = default;
+
 /**
  * A continuous piece of RAM backed by a part of an L4 dataspace.
  */
@@ -44,6 +91,7 @@ public:
 
   Ram_ds(Vmm::Ram_ds const &) = delete;
   Ram_ds(Vmm::Ram_ds &&) = default;
+  Ram_ds &operator = (Vmm::Ram_ds &&) = default;
   ~Ram_ds() = default;
 
   /**
@@ -52,18 +100,16 @@ public:
    * \param vm_base  Guest physical address where the RAM should be mapped.
    *                 If `Ram_base_identity_mapped`, use the host physical address
    *                 of the backing memory (required for DMA without IOMMU).
+   * \param eager    Populate the VMM mapping of the RAM immediately.
    */
-  long setup(Vmm::Guest_addr vm_base);
+  long setup(Vmm::Guest_addr vm_base, bool eager = true);
 
   /**
-   * Load the contents of the given dataspace into guest RAM.
+   * Remove the VMM mapping of the RAM.
    *
-   * \param file  Dataspace to load from.
-   * \param addr  Guest physical address to load the data space to.
-   * \param sz    Number of bytes to copy.
+   * The region must not be accessed afterwards.
    */
-  void load_file(L4::Cap<L4Re::Dataspace> const &file,
-                 Vmm::Guest_addr addr, l4_size_t sz) const;
+  void detach();
 
   /**
    * Get a VMM-virtual pointer from a guest-physical address
@@ -89,11 +135,24 @@ public:
 
   bool has_phys_addr() const noexcept { return _phys_size > 0; }
 
+  /**
+   * Hook for regions whose contents are provided on demand.
+   *
+   * This is the case for copy-on-write regions, where the dataspace of the
+   * region holds the private copies of the pages only, and for regions
+   * restored lazily from a snapshot. The hook must be asked to prepare
+   * memory before the VMM accesses it.
+   */
+  Ram_access_hook *access_hook() const noexcept { return _access_hook; }
+  void set_access_hook(Ram_access_hook *hook) noexcept { _access_hook = hook; }
+
 private:
   /// Offset between guest-physical and host-virtual address.
   l4_mword_t _offset;
   /// uvmm local address where the dataspace has been mapped.
   l4_addr_t _local_start;
+  /// Area reserved to align the VMM mapping, 0 if none.
+  l4_addr_t _area = 0;
   /// Guest-physical address of the mapped dataspace.
   Vmm::Guest_addr _vm_start;
   /// Size of the mapped area.
@@ -109,6 +168,8 @@ private:
   L4Re::Dma_space::Dma_addr _phys_ram;
   /// Size of the continiously mapped area from the beginning of the area.
   l4_size_t _phys_size;
+  /// Hook for contents provided on demand, if any.
+  Ram_access_hook *_access_hook = nullptr;
 };
 
 } // namespace
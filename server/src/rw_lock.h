@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <pthread.h>
+
+namespace Vmm {
+
+/**
+ * Lock that is shared by readers and held exclusively by writers.
+ *
+ * Writers use it with std::lock_guard, readers with Shared_guard. A thread
+ * must not take the lock again while it holds it.
+ */
+class Rw_lock
+{
+public:
+  Rw_lock() { pthread_rwlock_init(&_lock, nullptr); }
+  ~Rw_lock() { pthread_rwlock_destroy(&_lock); }
+
+  Rw_lock(Rw_lock const &) = delete;
+  Rw_lock &operator = (Rw_lock const &) = delete;
+
+  void lock() { pthread_rwlock_wrlock(&_lock); }
+  void unlock() { pthread_rwlock_unlock(&_lock); }
+
+  void lock_shared() { pthread_rwlock_rdlock(&_lock); }
+  void unlock_shared() { pthread_rwlock_unlock(&_lock); }
+
+  /**
+   * Holds an Rw_lock shared for its lifetime.
+   */
+  class Shared_guard
+  {
+  public:
+    explicit Shared_guard(Rw_lock &l) : _l(l) { _l.lock_shared(); }
+    ~Shared_guard() { _l.unlock_shared(); }
+
+    Shared_guard(Shared_guard const &) = delete;
+    Shared_guard &operator = (Shared_guard const &) = delete;
+
+  private:
+    Rw_lock &_l;
+  };
+
+private:
+  pthread_rwlock_t _lock;
+};
+
+} // namespace Vmm
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include <cstring>
+
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/util/env_ns>
+
+#include "debug.h"
+#include "snapshot.h"
+#include "vm.h"
+
+static Dbg warn(Dbg::Core, Dbg::Warn, "snapshot");
+static Dbg info(Dbg::Core, Dbg::Info, "snapshot");
+
+namespace Vmm {
+
+void
+Snapshot_writer::begin(char const *name)
+{
+  l4_uint32_t len = strlen(name);
+  l4_uint32_t size = 0;
+
+  _buf.insert(_buf.end(), reinterpret_cast<char const *>(&len),
+              reinterpret_cast<char const *>(&len) + sizeof(len));
+  _buf.insert(_buf.end(), name, name + len);
+
+  _record = _buf.size();
+  _buf.insert(_buf.end(), reinterpret_cast<char const *>(&size),
+              reinterpret_cast<char const *>(&size) + sizeof(size));
+}
+
+void
+Snapshot_writer::put(void const *data, l4_size_t size)
+{
+  auto const *d = static_cast<char const *>(data);
+  _buf.insert(_buf.end(), d, d + size);
+
+  l4_uint32_t rsize = _buf.size() - _record - sizeof(rsize);
+  memcpy(_buf.data() + _record, &rsize, sizeof(rsize));
+}
+
+bool
+Snapshot_reader::find(char const *name)
+{
+  l4_size_t len = strlen(name);
+  l4_size_t pos = 0;
+
+  while (pos + sizeof(l4_uint32_t) <= _size)
+    {
+      l4_uint32_t nlen, rsize;
+      memcpy(&nlen, _data + pos, sizeof(nlen));
+
+      l4_size_t size_pos = pos + sizeof(nlen) + nlen;
+      if (size_pos + sizeof(rsize) > _size)
+        break;
+
+      memcpy(&rsize, _data + size_pos, sizeof(rsize));
+
+      l4_size_t start = size_pos + sizeof(rsize);
+      if (start + rsize > _size)
+        break;
+
+      if (nlen == len && memcmp(_data + pos + sizeof(nlen), name, len) == 0)
+        {
+          _pos = start;
+          _end = start + rsize;
+          return true;
+        }
+
+      pos = start + rsize;
+    }
+
+  return false;
+}
+
+void
+Snapshot_reader::get(void *data, l4_size_t size)
+{
+  if (size > _end - _pos)
+    L4Re::chksys(-L4_EINVAL, "Snapshot record too short.");
+
+  memcpy(data, _data + _pos, size);
+  _pos += size;
+}
+
+void
+Snapshot::save(Vm *vm, L4::Cap<L4Re::Dataspace> ds)
+{
+  auto cpus = vm->cpus();
+  if (cpus->max_cpuid() > 0)
+    L4Re::chksys(-L4_ENOSYS, "Snapshot of a VM with more than one vCPU.");
+
+  Snapshot_writer w;
+
+  w.begin("cpu0");
+  cpus->cpu(0)->save_state(w);
+
+  w.begin("guest");
+  vm->vmm()->save_state(w);
+
+  vm->foreach_device(
+    [&w](char const *path, cxx::Ref_ptr<Vdev::Device> const &dev)
+      {
+        // The vCPUs have been saved above.
+        if (dynamic_cast<Generic_cpu_dev *>(dev.get()))
+          return;
+
+        auto *s = dynamic_cast<Vdev::Snapshot_state *>(dev.get());
+        if (!s)
+          {
+            warn.printf("%s: device state not saved\n", path);
+            return;
+          }
+
+        w.begin(path);
+        s->save_state(w);
+      });
+
+  std::vector<Region> regions;
+  vm->ram()->foreach_region([&regions](Ram_ds const &r)
+    { regions.push_back(Region{r.vm_start().get(), r.size(), 0}); });
+
+  l4_size_t state_offset = sizeof(Header) + regions.size() * sizeof(Region);
+  l4_size_t head_size = l4_round_page(state_offset + w.data().size());
+
+  l4_uint64_t size = head_size;
+  for (auto &r : regions)
+    {
+      r.offset = size;
+      size += l4_round_page(r.size);
+    }
+
+  long ds_size = L4Re::chksys(ds->size(), "Get size of snapshot dataspace.");
+  if (static_cast<l4_uint64_t>(ds_size) < size)
+    {
+      Err().printf("Snapshot needs 0x%llx bytes, dataspace has 0x%lx.\n",
+                   size, ds_size);
+      L4Re::chksys(-L4_ENOMEM, "Snapshot dataspace too small.");
+    }
+
+  L4Re::Rm::Unique_region<char *> head;
+  L4Re::chksys(L4Re::Env::env()->rm()->attach(&head, head_size,
+                                              L4Re::Rm::Search_addr,
+                                              L4::Ipc::make_cap_rw(ds)),
+               "Attach snapshot dataspace.");
+
+  // The header is completed last, so that a snapshot that failed halfway
+  // is never taken for a valid one.
+  auto *hdr = reinterpret_cast<Header *>(head.get());
+  hdr->magic = 0;
+
+  memcpy(head.get() + sizeof(Header), regions.data(),
+         regions.size() * sizeof(Region));
+  memcpy(head.get() + state_offset, w.data().data(), w.data().size());
+
+  for (auto const &r : regions)
+    vm->ram()->copy_to_ds(ds, r.offset, Guest_addr(r.start), r.size);
+
+  hdr->version = Version;
+  hdr->num_regions = regions.size();
+  hdr->state_size = w.data().size();
+  hdr->size = size;
+  hdr->magic = Magic;
+
+  info.printf("Saved snapshot: %zu bytes of state, %u RAM regions, "
+              "0x%llx bytes total\n",
+              w.data().size(), hdr->num_regions, size);
+}
+
+Snapshot::Snapshot(char const *name)
+: _ds(L4Re::chkcap(L4Re::Util::Env_ns().query<L4Re::Dataspace>(name),
+                   "Find snapshot."))
+{
+  long size = L4Re::chksys(_ds->size(), "Get size of snapshot.");
+  if (size < L4_PAGESIZE)
+    L4Re::chksys(-L4_EINVAL, "Invalid snapshot.");
+
+  auto *rm = L4Re::Env::env()->rm();
+  auto ro_ds = L4::Ipc::make_cap(_ds, L4_CAP_FPAGE_RO);
+  L4Re::chksys(rm->attach(&_hdr, L4_PAGESIZE,
+                          L4Re::Rm::Search_addr | L4Re::Rm::Read_only, ro_ds),
+               "Attach snapshot.");
+
+  Header const *h = header();
+  if (h->magic != Magic || h->version != Version
+      || h->size > static_cast<l4_uint64_t>(size))
+    L4Re::chksys(-L4_EINVAL, "Invalid snapshot.");
+
+  l4_size_t head_size = l4_round_page(sizeof(Header)
+                                      + h->num_regions * sizeof(Region)
+                                      + h->state_size);
+  if (head_size > h->size)
+    L4Re::chksys(-L4_EINVAL, "Invalid snapshot.");
+
+  if (head_size > L4_PAGESIZE)
+    {
+      L4Re::Rm::Unique_region<char *> head;
+      L4Re::chksys(rm->attach(&head, head_size,
+                              L4Re::Rm::Search_addr | L4Re::Rm::Read_only,
+                              ro_ds),
+                   "Attach snapshot.");
+      _hdr = cxx::move(head);
+    }
+
+  info.printf("Snapshot %s: %u RAM regions, %llu bytes of state\n",
+              name, header()->num_regions, header()->state_size);
+}
+
+void
+Snapshot::restore_ram(Vm_ram *ram, Vm_mem *memmap, bool shared) const
+{
+  Region const *r = regions();
+
+  for (unsigned i = 0; i < header()->num_regions; ++i)
+    {
+      if (r[i].offset + r[i].size > header()->size)
+        L4Re::chksys(-L4_EINVAL, "Invalid snapshot.");
+
+      ram->restore_region(_ds, r[i].offset, Guest_addr(r[i].start), r[i].size,
+                          memmap, shared);
+    }
+}
+
+void
+Snapshot::restore_state(Vm *vm) const
+{
+  l4_size_t state_offset = sizeof(Header)
+                           + header()->num_regions * sizeof(Region);
+  Snapshot_reader r(_hdr.get() + state_offset, header()->state_size);
+
+  auto cpus = vm->cpus();
+  if (cpus->max_cpuid() > 0)
+    L4Re::chksys(-L4_ENOSYS, "Restore of a VM with more than one vCPU.");
+
+  if (!r.find("cpu0"))
+    L4Re::chksys(-L4_EINVAL, "Snapshot without vCPU state.");
+  cpus->cpu(0)->restore_state(r);
+
+  if (!r.find("guest"))
+    L4Re::chksys(-L4_EINVAL, "Snapshot without guest state.");
+  vm->vmm()->restore_state(r, vm->ram().get());
+
+  vm->foreach_device(
+    [&r](char const *path, cxx::Ref_ptr<Vdev::Device> const &dev)
+      {
+        auto *s = dynamic_cast<Vdev::Snapshot_state *>(dev.get());
+        if (!s)
+          return;
+
+        if (!r.find(path))
+          {
+            warn.printf("%s: no state in snapshot\n", path);
+            return;
+          }
+
+        s->restore_state(r);
+      });
+}
+
+} // namespace Vmm
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <vector>
+
+#include <l4/re/dataspace>
+#include <l4/re/rm>
+#include <l4/sys/l4int.h>
+
+namespace Vmm {
+
+class Vm;
+class Vm_mem;
+class Vm_ram;
+
+/**
+ * Collects the state records of a snapshot.
+ *
+ * A record consists of a name, usually the device tree path of the device
+ * the state belongs to, followed by the raw state data. Records are only
+ * read back by the same build of the VMM, so no care is taken to make the
+ * data portable.
+ */
+class Snapshot_writer
+{
+public:
+  /**
+   * Start a new record.
+   *
+   * \param name  Name of the record.
+   */
+  void begin(char const *name);
+
+  /**
+   * Append data to the current record.
+   */
+  void put(void const *data, l4_size_t size);
+
+  template <typename T>
+  void put(T const &v)
+  { put(&v, sizeof(v)); }
+
+  std::vector<char> const &data() const
+  { return _buf; }
+
+private:
+  std::vector<char> _buf;
+  /// Offset of the size field of the current record.
+  l4_size_t _record = 0;
+};
+
+/**
+ * Reads the state records of a snapshot.
+ */
+class Snapshot_reader
+{
+public:
+  Snapshot_reader(char const *data, l4_size_t size)
+  : _data(data), _size(size)
+  {}
+
+  /**
+   * Continue reading at the beginning of a record.
+   *
+   * \param name  Name of the record.
+   *
+   * \retval true   The record was found.
+   * \retval false  The snapshot does not contain such a record.
+   */
+  bool find(char const *name);
+
+  /**
+   * Read data from the current record.
+   *
+   * An exception is thrown if the record does not contain enough data.
+   */
+  void get(void *data, l4_size_t size);
+
+  template <typename T>
+  void get(T *v)
+  { get(v, sizeof(*v)); }
+
+private:
+  char const *_data;
+  l4_size_t _size;
+  /// Current read position and end of the current record.
+  l4_size_t _pos = 0;
+  l4_size_t _end = 0;
+};
+
+/**
+ * Snapshot of a complete VM in a dataspace.
+ *
+ * The snapshot starts with a header, followed by a table of the RAM
+ * regions and the state records of the vCPUs and devices. The contents of
+ * the RAM regions follow page aligned, so that they can be copied directly
+ * between the snapshot and the RAM dataspaces.
+ */
+class Snapshot
+{
+public:
+  /**
+   * Save the state of a VM.
+   *
+   * \param vm  VM to save.
+   * \param ds  Dataspace to save to. It must be large enough to hold the
+   *            state and all RAM of the VM.
+   *
+   * Must be called from the thread of vCPU 0 while it is stopped. Only
+   * VMs with a single vCPU are supported.
+   */
+  static void save(Vm *vm, L4::Cap<L4Re::Dataspace> ds);
+
+  /**
+   * Open a snapshot for restoring.
+   *
+   * \param name  Name of a file or a dataspace capability holding the
+   *              snapshot.
+   */
+  explicit Snapshot(char const *name);
+
+  /**
+   * Set up the guest RAM to be filled from the snapshot on demand.
+   *
+   * \param ram     Guest RAM.
+   * \param memmap  Guest memory map.
+   * \param shared  Use the snapshot as a template: map its RAM
+   *                copy-on-write instead of copying it, so that VMs
+   *                started from the same snapshot share all pages they do
+   *                not write to.
+   *
+   * Must be called after the RAM configured in the device tree has been
+   * set up, before anything is loaded into it.
+   */
+  void restore_ram(Vm_ram *ram, Vm_mem *memmap, bool shared) const;
+
+  /**
+   * Restore the state of the vCPUs and devices.
+   *
+   * Must be called after all devices have been created, before the VM
+   * starts.
+   */
+  void restore_state(Vm *vm) const;
+
+private:
+  enum : l4_uint64_t { Magic = 0x70616e736d6d7675ULL }; // "uvmmsnap"
+  enum : l4_uint32_t { Version = 1 };
+
+  struct Header
+  {
+    l4_uint64_t magic;
+    l4_uint32_t version;
+    l4_uint32_t num_regions;
+    /// Size of the state records following the region table.
+    l4_uint64_t state_size;
+    /// Total size of the snapshot.
+    l4_uint64_t size;
+  };
+
+  struct Region
+  {
+    l4_uint64_t start;
+    l4_uint64_t size;
+    /// Offset of the contents in the snapshot.
+    l4_uint64_t offset;
+  };
+
+  Region const *regions() const
+  { return reinterpret_cast<Region const *>(_hdr.get() + sizeof(Header)); }
+
+  Header const *header() const
+  { return reinterpret_cast<Header const *>(_hdr.get()); }
+
+  L4::Cap<L4Re::Dataspace> _ds;
+  L4Re::Rm::Unique_region<char *> _hdr;
+};
+
+} // namespace Vmm
+
+namespace Vdev {
+
+/**
+ * Interface for devices whose state can be saved in a snapshot.
+ *
+ * Devices not implementing the interface come up in their reset state
+ * when a snapshot is restored.
+ */
+struct Snapshot_state
+{
+  virtual ~Snapshot_state() = 0;
+
+  /**
+   * Append the device state to the current record.
+   *
+   * Devices that cannot be saved throw an exception.
+   */
+  virtual void save_state(Vmm::Snapshot_writer &w) = 0;
+
+  /**
+   * Restore the device state from the current record.
+   */
+  virtual void restore_state(Vmm::Snapshot_reader &r) = 0;
+};
+
+inline Snapshot_state::~Snapshot_state() = default;
+
+} // namespace Vdev
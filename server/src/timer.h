@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <mutex>
 #include <vector>
 #include <thread>
 
@@ -27,16 +28,23 @@ struct Timer : virtual Vdev::Dev_ref
 
 inline Timer::~Timer() = default;
 
+/**
+ * Periodic clock driving all registered timer devices.
+ *
+ * The clock thread is only started when the first timer is registered, so
+ * that configurations without timer devices do not pay for it.
+ */
 class Clock_source
 {
 public:
-  Clock_source()
-  : _thread(&Clock_source::run_timer, this)
-  {}
-
   void add_timer(cxx::Ref_ptr<Timer> timer)
   {
+    std::lock_guard<std::mutex> lock(_mutex);
+
     _consumers.push_back(timer);
+
+    if (!_thread.joinable())
+      _thread = std::thread(&Clock_source::run_timer, this);
   }
 
   void run_timer()
@@ -49,6 +57,7 @@ public:
       {
         l4_sleep(27);
 
+        std::lock_guard<std::mutex> lock(_mutex);
         for (auto t : _consumers)
           t->tick();
       }
@@ -56,6 +65,7 @@ public:
 
 private:
   std::thread _thread;
+  std::mutex _mutex;
   std::vector<cxx::Ref_ptr<Timer>> _consumers;
 };
 
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <l4/sys/debugger.h>
+#include <l4/sys/vcon>
+#include <pthread-l4.h>
+
+namespace Vdev {
+
+/**
+ * Buffered output to a Vcon.
+ *
+ * Data is collected in a staging buffer and written to the Vcon with as few
+ * IPCs as possible when the buffer is flushed or full. Optionally, a
+ * separate output thread does the writing, so that the caller only copies
+ * the data and never waits for the log server.
+ */
+class Vcon_output
+{
+  enum { Buffer_size = 4096 };
+
+public:
+  explicit Vcon_output(L4::Cap<L4::Vcon> con) : _con(con) {}
+
+  Vcon_output(Vcon_output const &) = delete;
+  Vcon_output &operator = (Vcon_output const &) = delete;
+
+  ~Vcon_output()
+  {
+    if (!_thread.joinable())
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _data.notify_one();
+    _thread.join();
+  }
+
+  /**
+   * Hand all output over to a separate thread.
+   *
+   * \param name  Name of the thread for the kernel debugger.
+   */
+  void start_thread(char const *name)
+  {
+    if (_thread.joinable())
+      return;
+
+    _thread = std::thread(&Vcon_output::run, this);
+    l4_debugger_set_object_name(pthread_l4_cap(_thread.native_handle()),
+                                name);
+  }
+
+  /**
+   * Append data to the staging buffer.
+   *
+   * The buffer is written out when it runs full.
+   */
+  void write(char const *data, unsigned len)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (len)
+      {
+        if (_fill == Buffer_size)
+          {
+            if (_thread.joinable())
+              {
+                _data.notify_one();
+                _space.wait(lock, [this]{ return _fill < Buffer_size; });
+              }
+            else
+              {
+                write_out(_buf, _fill);
+                _fill = 0;
+              }
+          }
+
+        unsigned n = Buffer_size - _fill;
+        if (n > len)
+          n = len;
+
+        memcpy(_buf + _fill, data, n);
+        _fill += n;
+        data += n;
+        len -= n;
+      }
+  }
+
+  /**
+   * Write out the staging buffer.
+   *
+   * With an output thread, the thread is only woken up.
+   */
+  void flush()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_fill)
+      return;
+
+    if (_thread.joinable())
+      _data.notify_one();
+    else
+      {
+        write_out(_buf, _fill);
+        _fill = 0;
+      }
+  }
+
+private:
+  void write_out(char const *p, unsigned len)
+  {
+    while (len)
+      {
+        // Each call transfers at most L4_VCON_WRITE_SIZE bytes.
+        long r = _con->write(p, len);
+        if (r <= 0)
+          break;
+
+        p += r;
+        len -= r;
+      }
+  }
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (;;)
+      {
+        _data.wait(lock, [this]{ return _fill || _stop; });
+        if (!_fill)
+          return;
+
+        // Take the staging buffer, so that the producer can continue
+        // while the output is written.
+        unsigned len = _fill;
+        memcpy(_out, _buf, len);
+        _fill = 0;
+        _space.notify_one();
+
+        lock.unlock();
+        write_out(_out, len);
+        lock.lock();
+      }
+  }
+
+  L4::Cap<L4::Vcon> _con;
+  std::mutex _mutex;
+  std::condition_variable _data;
+  std::condition_variable _space;
+  std::thread _thread;
+  bool _stop = false;
+  unsigned _fill = 0;
+  char _buf[Buffer_size];
+  char _out[Buffer_size];
+};
+
+} // namespace Vdev
@@ -51,22 +51,17 @@ struct F_rcv : Factory
 static F_rcv f_rcv;
 static Device_type t_rcv = { "l4vmm,virq-rcv", nullptr, &f_rcv };
 
-class Irq_snd : public Device, public Vmm::Mmio_device_t<Irq_snd>
+class Irq_snd : public Device, public Vmm::Mmio_doorbell_t<Irq_snd>
 {
 public:
   explicit Irq_snd(L4::Cap<L4::Irq> irq) : _irq(irq) {}
 
-  void write(unsigned /*reg*/, char /*size*/, l4_uint64_t /*value*/, unsigned)
+  void doorbell(unsigned /*reg*/, unsigned /*cpu_id*/)
   {
     /* address does no matter */
     _irq->trigger();
   }
 
-  l4_uint32_t read(unsigned /*reg*/, char /*size*/, unsigned /*cpu_id*/)
-  {
-    return 0;
-  }
-
 private:
   L4::Cap<L4::Irq> _irq;
 };
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include "virtio_balloon.h"
+#include "device_factory.h"
+#include "guest.h"
+
+namespace {
+
+using namespace Vdev;
+
+struct F : Factory
+{
+  cxx::Ref_ptr<Device> create(Device_lookup *devs, Dt_node const &node) override
+  {
+    Dbg(Dbg::Dev, Dbg::Info).printf("Create virtual memory balloon\n");
+
+    auto c = make_device<Virtio_balloon_mmio>(devs->ram().get(),
+                                              devs->vmm()->vm_task());
+    if (c->init_irqs(devs, node) < 0)
+      return nullptr;
+
+    devs->vmm()->register_mmio_device(c, node);
+    return c;
+  }
+};
+
+static F f;
+static Device_type t = { "virtio,mmio", "balloon", &f };
+
+}
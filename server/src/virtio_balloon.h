@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+#include <l4/sys/task>
+
+#include "debug.h"
+#include "instance_list.h"
+#include "mmio_device.h"
+#include "virtio_dev.h"
+#include "virtio_event_connector.h"
+
+namespace Vdev {
+
+/**
+ * Control interface of the memory balloons, used by the monitor console.
+ */
+class Balloon_control : public Instance_list<Balloon_control>
+{
+public:
+  virtual ~Balloon_control() = default;
+
+  /// Print the state of the balloon and request fresh guest statistics.
+  virtual void show_state(FILE *f) = 0;
+
+  /**
+   * Change the number of pages the guest shall give back.
+   *
+   * \param delta  Number of pages to add to the target, negative to
+   *               return pages to the guest.
+   */
+  virtual void change_target(long delta) = 0;
+
+  static void show_all(FILE *f)
+  {
+    if (!foreach_instance([f](Balloon_control *b) { b->show_state(f); }))
+      fprintf(f, "No balloon configured.\n");
+  }
+
+  static void change_all(long delta)
+  { foreach_instance([delta](Balloon_control *b) { b->change_target(delta); }); }
+};
+
+/**
+ * Virtio memory balloon device.
+ *
+ * The guest gives pages it does not need back to the host by putting them
+ * into the balloon (inflate queue) and by reporting free pages (reporting
+ * queue). The memory of these pages is released with Vm_ram::release() and
+ * faulted in again when the guest touches the pages later. The guest
+ * inflates the balloon until it holds the number of pages set as target,
+ * see change_target().
+ *
+ * Guest memory statistics are received on the statistics queue. The device
+ * keeps the buffer of the guest and returns it to request an update.
+ */
+template <typename DEV>
+class Virtio_balloon : public Virtio::Dev, public Balloon_control
+{
+  typedef L4virtio::Svr::Virtqueue::Desc Desc;
+  typedef L4virtio::Svr::Request_processor Request_processor;
+
+  struct Payload
+  {
+    Vmm::Host_iovec iov;
+    bool writable;
+  };
+
+  /// Guest-physical buffer, used for reported pages that are not accessed.
+  struct Guest_buffer
+  {
+    l4_uint64_t addr;
+    l4_uint32_t len;
+  };
+
+  enum
+  {
+    Balloon_queue_length = 0x100,
+    Num_queues = 4,
+    Pfn_shift = 12,
+  };
+
+  enum Queue
+  {
+    Inflate_queue,
+    Deflate_queue,
+    Stats_queue,
+    Reporting_queue,
+    No_queue,
+  };
+
+  /// Device-specific configuration, located at offset 0x100 of the config page.
+  struct Balloon_config
+  {
+    l4_uint32_t num_pages;
+    l4_uint32_t actual;
+    l4_uint32_t free_page_hint_cmd_id;
+    l4_uint32_t poison_val;
+  };
+
+  /// Statistics entry, see virtio 1.1, section 5.5.6.3.
+  struct Stat
+  {
+    l4_uint16_t tag;
+    l4_uint64_t val;
+  } __attribute__((packed));
+
+  enum { Num_stats = 10 };
+
+public:
+  struct Features : Virtio::Dev::Features
+  {
+    CXX_BITFIELD_MEMBER(0, 0, must_tell_host, raw);
+    CXX_BITFIELD_MEMBER(1, 1, stats_vq, raw);
+    CXX_BITFIELD_MEMBER(2, 2, deflate_on_oom, raw);
+    CXX_BITFIELD_MEMBER(3, 3, free_page_hint, raw);
+    CXX_BITFIELD_MEMBER(4, 4, page_poison, raw);
+    CXX_BITFIELD_MEMBER(5, 5, page_reporting, raw);
+
+    explicit Features(l4_uint32_t v)
+    : Virtio::Dev::Features(v)
+    {}
+  };
+
+  Virtio_balloon(Vmm::Vm_ram *ram, L4::Cap<L4::Task> vm_task)
+  : Virtio::Dev(ram, 0x44, L4VIRTIO_ID_BALLOON), _ram(ram), _vm_task(vm_task)
+  {
+    Features feat(0);
+    feat.stats_vq() = true;
+    feat.deflate_on_oom() = true;
+    feat.page_reporting() = true;
+    _cfg_header->dev_features_map[0] = feat.raw;
+    _cfg_header->num_queues = Num_queues;
+
+    for (auto &q : _vqs)
+      q.config.num_max = Balloon_queue_length;
+  }
+
+  int init_irqs(Vdev::Device_lookup *devs, Vdev::Dt_node const &self)
+  { return dev()->event_connector()->init_irqs(devs, self); }
+
+  void virtio_queue_ready(unsigned ready)
+  {
+    auto *q = current_virtqueue();
+    if (!q)
+      return;
+
+    auto *qc = &q->config;
+
+    if (ready == 0 && q->ready())
+      {
+        q->disable();
+        qc->ready = 0;
+      }
+    else if (ready == 1 && !q->ready())
+      {
+        qc->ready = 0;
+        l4_uint16_t num = qc->num;
+        // num must be: a power of two in range [1,num_max].
+        if (!num || (num & (num - 1)) || num > qc->num_max)
+          return;
+
+        dev()->attach_queue(q);
+        qc->ready = 1;
+      }
+  }
+
+  void reset() override
+  {
+    for (auto &q : _vqs)
+      {
+        q.disable();
+        q.config.num_max = Balloon_queue_length;
+      }
+
+    _stats_req = L4virtio::Svr::Virtqueue::Request();
+  }
+
+  void virtio_queue_notify(unsigned qn)
+  {
+    Virtio::Event_set ev;
+    unsigned frames = 0;
+
+    switch (queue_type(qn))
+      {
+      case Inflate_queue:
+        frames = handle_balloon(&_vqs[qn], true, &ev);
+        break;
+      case Deflate_queue:
+        frames = handle_balloon(&_vqs[qn], false, &ev);
+        break;
+      case Stats_queue:
+        handle_stats(&_vqs[qn]);
+        break;
+      case Reporting_queue:
+        frames = handle_reporting(&_vqs[qn], &ev);
+        break;
+      default:
+        return;
+      }
+
+    if (_cfg_header->irq_status != _irq_status_shadow)
+      dev()->set_irq_status(_irq_status_shadow);
+
+    dev()->event_connector()->send_events(cxx::move(ev), frames);
+  }
+
+  void virtio_device_config_written(unsigned reg)
+  {
+    if (reg == offsetof(Balloon_config, actual))
+      Dbg(Dbg::Dev, Dbg::Info, "balloon")
+        .printf("Guest balloon holds %u pages\n", balloon_config()->actual);
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *, Payload *p)
+  {
+    devaddr_to_iov(desc.addr.get(), desc.len, &p->iov);
+    p->writable = desc.flags.write();
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *, Guest_buffer *b)
+  {
+    b->addr = desc.addr.get();
+    b->len = desc.len;
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *,
+                 Desc const **table)
+  {
+    *table = devaddr_to_virt<Desc const>(desc.addr.get(), sizeof(Desc));
+  }
+
+  void virtio_irq_ack(unsigned val)
+  {
+    _irq_status_shadow &= ~val;
+    if (_cfg_header->irq_status != _irq_status_shadow)
+      dev()->set_irq_status(_irq_status_shadow);
+
+    dev()->event_connector()->clear_events(val);
+  }
+
+  Virtio::Virtqueue *virtqueue(unsigned qn) override
+  { return qn < Num_queues ? &_vqs[qn] : nullptr; }
+
+  void change_target(long delta) override
+  {
+    long target = (long)balloon_config()->num_pages + delta;
+    if (target < 0)
+      target = 0;
+
+    balloon_config()->num_pages = target;
+    update_virtio_config();
+
+    _irq_status_shadow |= 2;
+    dev()->set_irq_status(_irq_status_shadow);
+    dev()->event_connector()->send_event(_config_event_index);
+  }
+
+  void show_state(FILE *f) override
+  {
+    static char const *const names[Num_stats] =
+      { "swap in", "swap out", "major faults", "minor faults", "free",
+        "total", "available", "caches", "hugetlb allocs", "hugetlb fails" };
+
+    auto const *cfg = balloon_config();
+    fprintf(f, "Balloon: target %u, actual %u pages; "
+               "released %lu inflated, %lu reported pages, %lu deflated\n",
+            cfg->num_pages, cfg->actual, _inflated, _reported, _deflated);
+
+    for (unsigned i = 0; i < Num_stats; ++i)
+      if (_stats_valid & (1U << i))
+        fprintf(f, "  %s: %llu\n", names[i], _stats[i]);
+
+    request_stats();
+  }
+
+private:
+  Balloon_config *balloon_config() const
+  {
+    return reinterpret_cast<Balloon_config *>(
+      reinterpret_cast<char *>(_cfg_header.get()) + 0x100);
+  }
+
+  /**
+   * Role of a queue.
+   *
+   * Queues of features the driver did not accept are left out of the
+   * numbering.
+   */
+  Queue queue_type(unsigned qn) const
+  {
+    if (qn < 2)
+      return qn ? Deflate_queue : Inflate_queue;
+
+    Features drv(_cfg_header->driver_features_map[0]);
+    unsigned idx = 2;
+    if (drv.stats_vq())
+      {
+        if (qn == idx)
+          return Stats_queue;
+        ++idx;
+      }
+
+    if (drv.page_reporting() && qn == idx)
+      return Reporting_queue;
+
+    return No_queue;
+  }
+
+  /**
+   * Release a range of guest RAM given up by the guest.
+   */
+  void release(l4_uint64_t addr, l4_uint64_t size)
+  {
+    long res = _ram->release(_vm_task, Vmm::Guest_addr(addr), size);
+    if (res < 0)
+      Dbg(Dbg::Dev, Dbg::Warn, "balloon")
+        .printf("Cannot release [0x%llx-0x%llx]: %ld\n",
+                addr, addr + size - 1, res);
+  }
+
+  /**
+   * Process the page frame lists of the inflate or deflate queue.
+   *
+   * Adjacent pages of inflate requests are released at once.
+   */
+  unsigned handle_balloon(Virtio::Virtqueue *q, bool inflate,
+                          Virtio::Event_set *ev)
+  {
+    unsigned frames = 0;
+
+    while (q->ready())
+      {
+        auto r = q->next_avail();
+        if (!r)
+          break;
+
+        Request_processor rp;
+        Payload p;
+        rp.start(this, r, &p);
+
+        l4_uint64_t run_start = 0, run_size = 0;
+        for (;;)
+          {
+            l4_uint32_t pfn;
+            for (l4_size_t offs = 0;
+                 p.iov.copy_out(&pfn, offs, sizeof(pfn)) == sizeof(pfn);
+                 offs += sizeof(pfn))
+              {
+                if (!inflate)
+                  {
+                    ++_deflated;
+                    continue;
+                  }
+
+                ++_inflated;
+                l4_uint64_t addr = (l4_uint64_t)pfn << Pfn_shift;
+                if (run_size && run_start + run_size == addr)
+                  {
+                    run_size += 1UL << Pfn_shift;
+                    continue;
+                  }
+
+                if (run_size)
+                  release(run_start, run_size);
+                run_start = addr;
+                run_size = 1UL << Pfn_shift;
+              }
+
+            if (!rp.has_more())
+              break;
+            rp.next(this, &p);
+          }
+
+        if (run_size)
+          release(run_start, run_size);
+
+        q->consumed(r);
+        ++frames;
+        if (!q->no_notify_guest())
+          {
+            _irq_status_shadow |= 1;
+            ev->set(q->config.driver_notify_index);
+          }
+      }
+
+    return frames;
+  }
+
+  /**
+   * Release the free pages reported by the guest.
+   *
+   * The buffers describe the free memory itself, so they are only used as
+   * guest-physical ranges and never accessed.
+   */
+  unsigned handle_reporting(Virtio::Virtqueue *q, Virtio::Event_set *ev)
+  {
+    unsigned frames = 0;
+
+    while (q->ready())
+      {
+        auto r = q->next_avail();
+        if (!r)
+          break;
+
+        Request_processor rp;
+        Guest_buffer b;
+        rp.start(this, r, &b);
+        for (;;)
+          {
+            release(b.addr, b.len);
+            _reported += b.len >> Pfn_shift;
+
+            if (!rp.has_more())
+              break;
+            rp.next(this, &b);
+          }
+
+        q->consumed(r);
+        ++frames;
+        if (!q->no_notify_guest())
+          {
+            _irq_status_shadow |= 1;
+            ev->set(q->config.driver_notify_index);
+          }
+      }
+
+    return frames;
+  }
+
+  /**
+   * Read the statistics from the buffer of the guest and keep the buffer.
+   */
+  void handle_stats(Virtio::Virtqueue *q)
+  {
+    if (!q->ready())
+      return;
+
+    auto r = q->next_avail();
+    if (!r)
+      return;
+
+    Request_processor rp;
+    Payload p;
+    rp.start(this, r, &p);
+
+    Stat s;
+    for (l4_size_t offs = 0;
+         p.iov.copy_out(&s, offs, sizeof(s)) == sizeof(s);
+         offs += sizeof(s))
+      if (s.tag < Num_stats)
+        {
+          _stats[s.tag] = s.val;
+          _stats_valid |= 1U << s.tag;
+        }
+
+    _stats_req = r;
+    _stats_queue = q;
+  }
+
+  /**
+   * Return the statistics buffer to the guest, which makes the guest send
+   * fresh statistics.
+   */
+  void request_stats()
+  {
+    if (!_stats_req)
+      return;
+
+    auto *q = _stats_queue;
+    q->consumed(_stats_req);
+    _stats_req = L4virtio::Svr::Virtqueue::Request();
+
+    _irq_status_shadow |= 1;
+    dev()->set_irq_status(_irq_status_shadow);
+    dev()->event_connector()->send_event(q->config.driver_notify_index);
+  }
+
+  DEV *dev() { return static_cast<DEV *>(this); }
+
+  Vmm::Vm_ram *_ram;
+  L4::Cap<L4::Task> _vm_task;
+  Virtio::Virtqueue _vqs[Num_queues];
+  /// Statistics buffer held back until the next update is requested.
+  L4virtio::Svr::Virtqueue::Request _stats_req;
+  Virtio::Virtqueue *_stats_queue = nullptr;
+  l4_uint64_t _stats[Num_stats] = {};
+  unsigned _stats_valid = 0;
+  unsigned long _inflated = 0;
+  unsigned long _deflated = 0;
+  unsigned long _reported = 0;
+};
+
+class Virtio_balloon_mmio
+: public Virtio_balloon<Virtio_balloon_mmio>,
+  public Vmm::Ro_ds_mapper_t<Virtio_balloon_mmio>,
+  public Virtio::Mmio_connector<Virtio_balloon_mmio>
+{
+public:
+  Virtio_balloon_mmio(Vmm::Vm_ram *ram, L4::Cap<L4::Task> vm_task)
+  : Virtio_balloon(ram, vm_task)
+  {}
+
+  Virtio::Event_connector_irq *event_connector() { return &_evcon; }
+
+private:
+  Virtio::Event_connector_irq _evcon;
+};
+
+}
@@ -22,6 +22,9 @@ struct F : Factory
       return nullptr;
 
     auto c = make_device<Virtio_console_mmio>(devs->ram().get(), cap);
+    if (c->init_ports(node) < 0)
+      return nullptr;
+
     if (c->init_irqs(devs, node) < 0)
       return nullptr;
 
@@ -13,6 +13,12 @@
 #include "irq.h"
 #include "virtio_dev.h"
 #include "virtio_event_connector.h"
+#include "vcon_output.h"
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
 
 #include <l4/sys/cxx/ipc_epiface>
 #include <l4/cxx/type_traits>
@@ -23,28 +29,93 @@
 
 namespace Vdev {
 
+/**
+ * Virtio console device.
+ *
+ * Port 0 is the console and is connected to the Vcon passed to the
+ * constructor. Further ports can be added with init_ports(). With more than
+ * one port, the device offers the multiport feature and announces the
+ * ports to the driver via the control queues.
+ */
 template <typename DEV>
-class Virtio_console
-: public Virtio::Dev,
-  public L4::Irqep_t<Virtio_console<DEV> >
+class Virtio_console : public Virtio::Dev
 {
+public:
+  /**
+   * Set of the events of all queues.
+   *
+   * Wider than the default set, so that consoles with many ports can use
+   * more than 64 queues.
+   */
+  typedef Virtio::Event_set_t<128> Event_set;
+
+private:
   typedef L4virtio::Svr::Virtqueue::Desc Desc;
   typedef L4virtio::Svr::Request_processor Request_processor;
 
   struct Payload
   {
-    char *data;
-    unsigned len;
+    Vmm::Host_iovec iov;
     bool writable;
   };
 
   enum
   {
-    Console_queue_num = 2,
     Console_queue_length = 0x100,
+    Ctrl_rx_queue = 2,
+    Ctrl_tx_queue = 3,
+    // Leave the event set room for the control queues.
+    Max_ports = (Event_set::Max_events - 2) / 2,
+  };
+
+  /// Control events, see virtio 1.0 cs4, section 5.3.6.2.
+  enum Ctrl_event : l4_uint16_t
+  {
+    Device_ready = 0,
+    Device_add = 1,
+    Port_ready = 3,
+    Console_port = 4,
+    Port_open = 6,
+    Port_name = 7,
+  };
+
+  struct Ctrl_msg
+  {
+    l4_uint32_t id;
+    l4_uint16_t event;
+    l4_uint16_t value;
+  };
+
+  /// Device-specific configuration, located at offset 0x100 of the config page.
+  struct Console_config
+  {
+    l4_uint16_t cols;
+    l4_uint16_t rows;
+    l4_uint32_t max_nr_ports;
+    l4_uint32_t emerg_wr;
   };
 
-  Virtio::Virtqueue _vqs[Console_queue_num];
+  struct Port : public L4::Irqep_t<Port>
+  {
+    Port(Virtio_console *console, unsigned idx, L4::Cap<L4::Vcon> con,
+         char const *name, unsigned name_len)
+    : console(console), idx(idx), con(con), out(con)
+    {
+      if (name_len >= sizeof(this->name))
+        name_len = sizeof(this->name) - 1;
+      memcpy(this->name, name, name_len);
+      this->name[name_len] = '\0';
+    }
+
+    void handle_irq()
+    { console->handle_port_irq(idx); }
+
+    Virtio_console *console;
+    unsigned idx;
+    L4::Cap<L4::Vcon> con;
+    Vcon_output out;
+    char name[32];
+  };
 
 public:
   struct Features : Virtio::Dev::Features
@@ -58,16 +129,14 @@ public:
   };
 
   Virtio_console(Vmm::Vm_ram *iommu, L4::Cap<L4::Vcon> con)
-  : Virtio::Dev(iommu, 0x44, L4VIRTIO_ID_CONSOLE),
-    _con(con)
+  : Virtio::Dev(iommu, 0x44, L4VIRTIO_ID_CONSOLE)
   {
     Features feat(0);
     feat.ring_indirect_desc() = true;
     _cfg_header->dev_features_map[0] = feat.raw;
-    _cfg_header->num_queues = Console_queue_num;
 
-    for (auto &q : _vqs)
-      q.config.num_max = Console_queue_length;
+    add_port(con, "", 0);
+    alloc_queues();
 
     l4_vcon_attr_t attr;
     if (l4_error(con->get_attr(&attr)) != L4_EOK)
@@ -83,6 +152,76 @@ public:
     L4Re::chksys(con->set_attr(&attr), "console set_attr");
   }
 
+  /**
+   * Number of ports configured in the device tree, including the console.
+   */
+  static unsigned dt_num_ports(Vdev::Dt_node const &node)
+  {
+    int n = node.stringlist_count("l4vmm,ports");
+    return n > 0 ? 1 + n : 1;
+  }
+
+  /**
+   * Number of virtqueues needed for the given number of ports.
+   */
+  static unsigned num_queues(unsigned ports)
+  { return ports > 1 ? 2 * ports + 2 : 2; }
+
+  /**
+   * Set up the additional ports and the output handling from the device
+   * tree.
+   *
+   * `l4vmm,ports` lists the names of the Vcon capabilities of the
+   * additional ports. Each name is announced to the driver as port name.
+   * `l4vmm,output-thread` moves the output to the Vcons into separate
+   * threads.
+   *
+   * Call this before the device is made visible to the guest.
+   */
+  int init_ports(Vdev::Dt_node const &node)
+  {
+    int n = node.stringlist_count("l4vmm,ports");
+    for (int i = 0; i < n; ++i)
+      {
+        int len;
+        char const *name = node.stringlist_get("l4vmm,ports", i, &len);
+        if (!name)
+          return -L4_EINVAL;
+
+        auto con = L4Re::Env::env()->get_cap<L4::Vcon>(name, len);
+        if (!con.is_valid())
+          {
+            Err().printf("%s: l4vmm,ports: capability %.*s is invalid.\n",
+                         node.get_name(), len, name);
+            return -L4_EINVAL;
+          }
+
+        if (_ports.size() >= Max_ports)
+          {
+            Err().printf("%s: too many console ports, maximum is %d.\n",
+                         node.get_name(), Max_ports);
+            return -L4_ERANGE;
+          }
+
+        add_port(con, name, len);
+      }
+
+    if (_ports.size() > 1)
+      {
+        Features feat(_cfg_header->dev_features_map[0]);
+        feat.console_multiport() = true;
+        _cfg_header->dev_features_map[0] = feat.raw;
+        console_config()->max_nr_ports = _ports.size();
+        alloc_queues();
+      }
+
+    if (node.has_prop("l4vmm,output-thread"))
+      for (auto &p : _ports)
+        p->out.start_thread("vcon out");
+
+    return 0;
+  }
+
   void virtio_queue_ready(unsigned ready)
   {
     auto *q = current_virtqueue();
@@ -104,9 +243,7 @@ public:
         if (!num || (num & (num - 1)) || num > qc->num_max)
           return;
 
-        q->init_queue(dev()->template devaddr_to_virt<void>(qc->desc_addr),
-                      dev()->template devaddr_to_virt<void>(qc->avail_addr),
-                      dev()->template devaddr_to_virt<void>(qc->used_addr));
+        dev()->attach_queue(q);
         qc->ready = 1;
       }
   }
@@ -116,20 +253,94 @@ public:
 
   void reset() override
   {
-    for (auto &q : _vqs)
+    for (unsigned i = 0; i < _num_queues; ++i)
       {
-        q.disable();
-        q.config.num_max = Console_queue_length;
+        _vqs[i].disable();
+        _vqs[i].config.num_max = Console_queue_length;
       }
+
+    _ctrl_pending.clear();
   }
 
-  void virtio_queue_notify(unsigned)
+  void virtio_queue_notify(unsigned qn)
   {
-    Virtio::Event_set ev;
+    Event_set ev;
+    unsigned frames = 0;
+    // Control messages are awaited by the driver, deliver them immediately.
+    bool queue_dry = true;
+
+    if (qn == Ctrl_tx_queue && multiport())
+      frames += handle_control(&ev);
+    else if (qn == Ctrl_rx_queue && multiport())
+      frames += send_control(&ev);
+    else if (qn < _num_queues)
+      {
+        unsigned port = queue_port(qn);
+        frames += handle_input(port, &ev);
+        unsigned out = handle_output(port, &ev);
+        frames += out;
+        queue_dry = port_dry(port, out);
+      }
+    else
+      {
+        queue_dry = false;
+        for (unsigned p = 0; p < _ports.size(); ++p)
+          {
+            frames += handle_input(p, &ev);
+            unsigned out = handle_output(p, &ev);
+            frames += out;
+            queue_dry |= port_dry(p, out);
+          }
+      }
 
-    handle_input(&ev);
-    int const q_idx = 1;
-    auto *q = &_vqs[q_idx];
+    if (_cfg_header->irq_status != _irq_status_shadow)
+      dev()->set_irq_status(_irq_status_shadow);
+
+    dev()->event_connector()->send_events(cxx::move(ev), frames, queue_dry);
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *, Payload *p)
+  {
+    devaddr_to_iov(desc.addr.get(), desc.len, &p->iov);
+    p->writable = desc.flags.write();
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *,
+                 Desc const **table)
+  {
+    *table = devaddr_to_virt<Desc const>(desc.addr.get(), sizeof(Desc));
+  }
+
+  /**
+   * Check whether the guest has to process the events of a port before the
+   * device can make further progress.
+   *
+   * \param port       Port whose queues were processed.
+   * \param tx_frames  Number of buffers taken from the transmit queue.
+   *
+   * \return True if the receive queue has no buffers left or the guest
+   *         filled the whole transmit queue and waits for its completion.
+   */
+  bool port_dry(unsigned port, unsigned tx_frames)
+  {
+    auto *rx = &_vqs[rx_queue(port)];
+    auto *tx = &_vqs[tx_queue(port)];
+    return !rx->ready() || !rx->desc_avail() || tx_frames >= tx->config.num;
+  }
+
+  /**
+   * Move all pending output of a port into its Vcon.
+   *
+   * The data of all available buffers is gathered in the staging buffer of
+   * the port, which is written out once at the end.
+   *
+   * \return Number of buffers returned to the guest.
+   */
+  unsigned handle_output(unsigned port, Event_set *ev)
+  {
+    auto *q = &_vqs[tx_queue(port)];
+    auto &out = _ports[port]->out;
+    unsigned frames = 0;
 
     while (q->ready())
       {
@@ -141,51 +352,40 @@ public:
         Request_processor rp;
         Payload p;
         rp.start(this, r, &p);
-        while (p.len)
+        write_payload(&out, p);
+        while (rp.has_more())
           {
-            long rsz = _con->write(p.data, p.len);
-            if (rsz < 0)
-              break;
-            p.data += rsz;
-            p.len  -= rsz;
+            rp.next(this, &p);
+            write_payload(&out, p);
           }
 
         q->consumed(r);
+        ++frames;
         if (!q->no_notify_guest())
           {
             _irq_status_shadow |= 1;
-            ev.set(q->config.driver_notify_index);
+            ev->set(q->config.driver_notify_index);
           }
       }
 
-    if (_cfg_header->irq_status != _irq_status_shadow)
-      dev()->set_irq_status(_irq_status_shadow);
-
-    dev()->event_connector()->send_events(cxx::move(ev));
+    out.flush();
+    return frames;
   }
 
-  void load_desc(Desc const &desc, Request_processor const *, Payload *p)
+  /**
+   * Move pending input from the Vcon of a port into its receive queue.
+   *
+   * \return Number of buffers handed to the guest.
+   */
+  unsigned handle_input(unsigned port, Event_set *ev)
   {
-    p->data = devaddr_to_virt<char>(desc.addr.get(), desc.len);
-    p->len = desc.len;
-    p->writable = desc.flags.write();
-  }
-
-  void load_desc(Desc const &desc, Request_processor const *,
-                 Desc const **table)
-  {
-    *table = devaddr_to_virt<Desc const>(desc.addr.get(), sizeof(Desc));
-  }
-
-
-  void handle_input(Virtio::Event_set *ev)
-  {
-    int const q_idx = 0;
-    auto *q = &_vqs[q_idx];
+    auto *q = &_vqs[rx_queue(port)];
+    auto con = _ports[port]->con;
+    unsigned frames = 0;
 
     while (1)
       {
-        int r = _con->read(NULL, 0);
+        int r = con->read(NULL, 0);
 
         if (r <= 0)
           break; // empty
@@ -195,7 +395,7 @@ public:
             // drop input
             do
               {
-                r = _con->read(NULL, L4_VCON_READ_SIZE);
+                r = con->read(NULL, L4_VCON_READ_SIZE);
               }
             while (r > L4_VCON_READ_SIZE);
             break;
@@ -216,15 +416,16 @@ public:
             break;
           }
 
-        r = _con->read(p.data, p.len);
+        r = read_payload(con, p);
         if (r < 0)
           {
             Err().printf("Virtio_console: read error: %d\n", r);
             break;
           }
 
-        unsigned size = (unsigned)r <= p.len ? (unsigned)r : p.len;
+        unsigned size = (unsigned)r <= p.iov.size ? (unsigned)r : p.iov.size;
         q->consumed(req, size);
+        ++frames;
 
         if (!q->no_notify_guest())
           {
@@ -232,25 +433,31 @@ public:
             ev->set(q->config.driver_notify_index);
           }
 
-        if ((unsigned)r <= p.len)
+        if ((unsigned)r <= p.iov.size)
           break;
       }
+
+    return frames;
   }
 
   void register_obj(L4::Registry_iface *registry)
   {
-    _con->bind(0, L4Re::chkcap(registry->register_irq_obj(this)));
+    for (auto &p : _ports)
+      p->con->bind(0, L4Re::chkcap(registry->register_irq_obj(p.get())));
   }
 
-  void handle_irq()
+  void handle_port_irq(unsigned port)
   {
-    Virtio::Event_set ev;
-    handle_input(&ev);
+    Event_set ev;
+    unsigned frames = handle_input(port, &ev);
 
     if (_cfg_header->irq_status != _irq_status_shadow)
       dev()->set_irq_status(_irq_status_shadow);
 
-    dev()->event_connector()->send_events(cxx::move(ev));
+    // Input may be held back as long as the guest has receive buffers left.
+    auto *q = &_vqs[rx_queue(port)];
+    dev()->event_connector()->send_events(cxx::move(ev), frames,
+                                          !q->ready() || !q->desc_avail());
   }
 
   void virtio_irq_ack(unsigned val)
@@ -264,13 +471,204 @@ public:
 
   Virtio::Virtqueue *virtqueue(unsigned qn) override
   {
-    if (qn >= Console_queue_num)
+    if (qn >= _num_queues)
       return nullptr;
 
     return &_vqs[qn];
   }
+
 private:
-  L4::Cap<L4::Vcon> _con;
+  bool multiport() const
+  { return _ports.size() > 1; }
+
+  static unsigned rx_queue(unsigned port)
+  { return port ? 2 * port + 2 : 0; }
+
+  static unsigned tx_queue(unsigned port)
+  { return port ? 2 * port + 3 : 1; }
+
+  static unsigned queue_port(unsigned qn)
+  { return qn < 2 ? 0 : (qn - 2) / 2; }
+
+  Console_config *console_config() const
+  {
+    return reinterpret_cast<Console_config *>(
+      reinterpret_cast<char *>(_cfg_header.get()) + 0x100);
+  }
+
+  void add_port(L4::Cap<L4::Vcon> con, char const *name, unsigned name_len)
+  {
+    _ports.emplace_back(new Port(this, _ports.size(), con, name, name_len));
+  }
+
+  void alloc_queues()
+  {
+    _num_queues = num_queues(_ports.size());
+    _vqs.reset(new Virtio::Virtqueue[_num_queues]);
+    _cfg_header->num_queues = _num_queues;
+
+    for (unsigned i = 0; i < _num_queues; ++i)
+      _vqs[i].config.num_max = Console_queue_length;
+  }
+
+  /**
+   * Process the control messages of the driver.
+   *
+   * \return Number of buffers returned to the guest.
+   */
+  unsigned handle_control(Event_set *ev)
+  {
+    auto *q = &_vqs[Ctrl_tx_queue];
+    unsigned frames = 0;
+
+    while (q->ready())
+      {
+        auto r = q->next_avail();
+
+        if (!r)
+          break;
+
+        Request_processor rp;
+        Payload p;
+        rp.start(this, r, &p);
+
+        Ctrl_msg msg;
+        if (p.iov.copy_out(&msg, 0, sizeof(msg)) == sizeof(msg))
+          control_event(msg);
+
+        q->consumed(r);
+        ++frames;
+        if (!q->no_notify_guest())
+          {
+            _irq_status_shadow |= 1;
+            ev->set(q->config.driver_notify_index);
+          }
+      }
+
+    return frames + send_control(ev);
+  }
+
+  void control_event(Ctrl_msg const &msg)
+  {
+    switch (msg.event)
+      {
+      case Device_ready:
+        if (msg.value != 1)
+          break;
+
+        for (unsigned i = 0; i < _ports.size(); ++i)
+          queue_control(i, Device_add, 0);
+        break;
+
+      case Port_ready:
+        if (msg.value != 1 || msg.id >= _ports.size())
+          break;
+
+        if (msg.id == 0)
+          queue_control(0, Console_port, 1);
+        else
+          queue_control(msg.id, Port_name, 0);
+
+        // The Vcon side of a port is always connected.
+        queue_control(msg.id, Port_open, 1);
+        break;
+
+      default:
+        // Port_open from the driver needs no action. Output to a port
+        // that is not open is just discarded by the driver.
+        break;
+      }
+  }
+
+  static void write_payload(Vcon_output *out, Payload const &p)
+  {
+    for (unsigned i = 0; i < p.iov.num; ++i)
+      out->write(p.iov.span[i].addr, p.iov.span[i].size);
+  }
+
+  /**
+   * Read input from a Vcon into a receive buffer.
+   *
+   * \return Number of bytes available in the Vcon before the last read. A
+   *         value larger than the buffer indicates that more input is
+   *         pending. A negative value is an error.
+   */
+  static int read_payload(L4::Cap<L4::Vcon> con, Payload const &p)
+  {
+    if (!p.iov.num)
+      return con->read(NULL, 0);
+
+    int done = 0;
+    for (unsigned i = 0; i < p.iov.num; ++i)
+      {
+        auto const &span = p.iov.span[i];
+        int r = con->read(span.addr, span.size);
+        if (r < 0)
+          return done ? done : r;
+
+        if ((unsigned)r <= span.size || i + 1 == p.iov.num)
+          return done + r;
+
+        done += span.size;
+      }
+
+    return done;
+  }
+
+  void queue_control(l4_uint32_t id, l4_uint16_t event, l4_uint16_t value)
+  { _ctrl_pending.push_back(Ctrl_msg{id, event, value}); }
+
+  /**
+   * Move pending control messages into the control receive queue.
+   *
+   * \return Number of buffers handed to the guest.
+   */
+  unsigned send_control(Event_set *ev)
+  {
+    auto *q = &_vqs[Ctrl_rx_queue];
+    unsigned frames = 0;
+
+    while (!_ctrl_pending.empty() && q->ready())
+      {
+        auto r = q->next_avail();
+
+        if (!r)
+          break;
+
+        Request_processor rp;
+        Payload p;
+        rp.start(this, r, &p);
+
+        Ctrl_msg const &msg = _ctrl_pending.front();
+        unsigned size = 0;
+        if (p.writable && p.iov.size >= sizeof(msg))
+          {
+            size = p.iov.copy_in(0, &msg, sizeof(msg));
+
+            if (msg.event == Port_name)
+              {
+                char const *name = _ports[msg.id]->name;
+                size += p.iov.copy_in(size, name, strlen(name));
+              }
+          }
+
+        _ctrl_pending.pop_front();
+        q->consumed(r, size);
+        ++frames;
+        if (!q->no_notify_guest())
+          {
+            _irq_status_shadow |= 1;
+            ev->set(q->config.driver_notify_index);
+          }
+      }
+
+    return frames;
+  }
+
+  std::vector<std::unique_ptr<Port>> _ports;
+  std::unique_ptr<Virtio::Virtqueue[]> _vqs;
+  unsigned _num_queues = 0;
+  std::deque<Ctrl_msg> _ctrl_pending;
 
   DEV *dev() { return static_cast<DEV *>(this); }
 };
@@ -21,21 +21,35 @@
 class Virtio_console_pci
 : public Vdev::Virtio_console<Virtio_console_pci>,
   public Vdev::Virtio_device_pci<Virtio_console_pci>,
-  public Virtio::Pci_connector<Virtio_console_pci>
+  public Virtio::Pci_connector<Virtio_console_pci,
+                               Vdev::Virtio_console<Virtio_console_pci>
+                                 ::Event_set::Max_events>
 {
+  // One MSI-X vector for each queue and one for configuration changes. The
+  // table must fit into the page in front of the PBA.
+  static_assert(Virtio_console::Event_set::Max_events + 1
+                  <= L4_PAGESIZE / sizeof(Vdev::Msix_table_entry),
+                "MSI-X table holds a vector for each queue.");
+
 public:
   Virtio_console_pci(Vmm::Vm_ram *iommu, L4::Cap<L4::Vcon> con,
                      cxx::Ref_ptr<Gic::Msi_controller> distr,
                      unsigned num_msix_entries)
   : Virtio_console(iommu, con),
     Virtio_device_pci<Virtio_console_pci>(),
-    Virtio::Pci_connector<Virtio_console_pci>(),
+    Pci_connector(),
     _evcon(distr, num_msix_entries)
   {
   }
 
   Virtio::Event_connector_msix *event_connector() { return &_evcon; }
 
+  void save_state(Vmm::Snapshot_writer &) override
+  {
+    // The PCI configuration space and the MSI-X table are not saved.
+    L4Re::chksys(-L4_ENOSYS, "Snapshot of virtio PCI device.");
+  }
+
 private:
   Virtio::Event_connector_msix _evcon;
 };
@@ -78,8 +92,10 @@ struct F : Factory
     if (!(regs[0].flags & Dt_pci_flags_mmio32))
       L4Re::chksys(-L4_EINVAL, "First DT register entry is a MMIO(32) entry.");
 
-    if (!(regs[1].flags & Dt_pci_flags_io))
-      L4Re::chksys(-L4_EINVAL, "Second DT register entry is an IO entry.");
+    bool io_bar = regs[1].flags & Dt_pci_flags_io;
+    if (!io_bar && !(regs[1].flags & Dt_pci_flags_mmio32))
+      L4Re::chksys(-L4_EINVAL,
+                   "Second DT register entry is an IO or MMIO(32) entry.");
 
     auto *pci = dynamic_cast<Pci_bus_bridge *>(
       devs->device_from_node(node.parent_node()).get());
@@ -94,16 +110,25 @@ struct F : Factory
     Dbg().printf("Msi controller %p\n", msi_distr.get());
 
     auto vmm = devs->vmm();
-    int const num_msix = 5;
+    // One vector for each queue and one for configuration changes.
+    unsigned queues =
+      Virtio_console_pci::num_queues(Virtio_console_pci::dt_num_ports(node));
+    int const num_msix = queues + 1 > 5 ? queues + 1 : 5;
     auto console = make_device<Virtio_console_pci>(devs->ram().get(),
                                                    L4Re::Env::env()->log(),
                                                    msi_distr, num_msix);
+    if (console->init_ports(node) < 0)
+      return nullptr;
+
     if (console->init_irqs(devs, node) < 0)
       return nullptr;
 
-    vmm->register_io_device(Vmm::Io_region::ss(regs[1].base, regs[1].size), console);
+    if (io_bar)
+      vmm->register_io_device(Vmm::Io_region::ss(regs[1].base, regs[1].size), console);
     console->register_obj(vmm->registry());
     console->configure(regs, num_msix);
+    if (!io_bar)
+      console->register_mem_bar(vmm, regs[1].base);
     pci->register_device(console);
 
     info().printf("Console: %p\n", console.get());
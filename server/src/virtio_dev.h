@@ -27,6 +27,8 @@
 
 #include "device.h"
 #include "mem_access.h"
+#include "snapshot.h"
+#include "vcpu_ptr.h"
 #include "vm_ram.h"
 #include "virtio_qword.h"
 
@@ -45,33 +47,124 @@ public:
   void init_queue(void *desc, void *avail, void *used)
   { setup(config.num, desc, avail, used); }
 
+  /// Index of the next entry to take from the available ring.
+  l4_uint16_t current_avail() const
+  { return _current_avail; }
+
+  void set_current_avail(l4_uint16_t idx)
+  { _current_avail = idx; }
+
+  /// Size of the descriptor table in guest memory.
+  l4_size_t desc_ring_size() const
+  { return 16UL * config.num; }
+
+  /// Size of the available ring in guest memory, including used_event.
+  l4_size_t avail_ring_size() const
+  { return 6 + 2UL * config.num; }
+
+  /// Size of the used ring in guest memory, including avail_event.
+  l4_size_t used_ring_size() const
+  { return 6 + 8UL * config.num; }
 };
 
-struct Event_set
+/**
+ * Set of pending virtio events.
+ *
+ * \tparam MAX_EVENTS  Number of distinct event indices the set can hold.
+ *                     Devices with many queues (and thus many MSI-X vectors)
+ *                     need to instantiate a set that is large enough to hold
+ *                     all of their event indices.
+ *
+ * The set is a fixed-size bitmap. Iteration is done one 64-bit word at a
+ * time, empty words are skipped.
+ */
+template <unsigned MAX_EVENTS>
+class Event_set_t
 {
-  l4_uint64_t e = 0;
-  void reset() { e = 0; };
+  enum : unsigned
+  {
+    Word_bits = sizeof(l4_uint64_t) * 8,
+    Num_words = (MAX_EVENTS + Word_bits - 1) / Word_bits,
+  };
+
+  static_assert(MAX_EVENTS > 0, "Event set must hold at least one event.");
+  static_assert(MAX_EVENTS <= 0xffff, "Event indices are 16 bit values.");
+
+public:
+  enum : unsigned { Max_events = MAX_EVENTS };
+
+  void reset()
+  {
+    for (auto &w : _e)
+      w = 0;
+  }
+
+  /**
+   * Mark the event with index `index` as pending.
+   *
+   * Indices outside the capacity of the set are ignored. This includes
+   * the 'no vector' marker of the PCI transport.
+   */
   void set(l4_uint16_t index)
   {
-    if (index < sizeof(e) * 8)
-      e |= 1ULL << index;
+    if (index < MAX_EVENTS)
+      _e[index / Word_bits] |= 1ULL << (index % Word_bits);
+  }
+
+  bool empty() const
+  {
+    for (auto w : _e)
+      if (w)
+        return false;
+
+    return true;
   }
+
+  /**
+   * Call `func` with the index of each pending event in ascending order.
+   */
+  template <typename FUNC>
+  void foreach_event(FUNC &&func) const
+  {
+    for (unsigned i = 0; i < Num_words; ++i)
+      for (l4_uint64_t w = _e[i]; w; w &= w - 1)
+        func(static_cast<l4_uint16_t>(i * Word_bits + __builtin_ctzll(w)));
+  }
+
+private:
+  l4_uint64_t _e[Num_words] = {};
 };
 
+/// Default event set for devices with a small number of queues.
+typedef Event_set_t<64> Event_set;
+
+static_assert(Event_set_t<256>::Max_events == 256
+              && sizeof(Event_set_t<256>) == 256 / 8,
+              "An event set holds an event for each of 256 queues.");
+
 /**
  * Abstract interface for virtio event handling.
  *
+ * \tparam MAX_EVENTS  Capacity of the event set of the device, see
+ *                     Event_set_t.
+ *
  * \note This interface is currently just for the sake of documentation.
  */
+template <unsigned MAX_EVENTS = Event_set::Max_events>
 class Event_if
 {
 public:
+  typedef Event_set_t<MAX_EVENTS> Events;
+
   /**
    * Inject the given set of events into the VM.
    *
    * \param ev  Set of pending events to be injected into the guest.
+   *
+   * \note Connectors implement this as a template over the capacity of
+   *       the event set, so each device chooses its own capacity.
    */
-  virtual void send_events(Event_set &&ev) = 0;
+  virtual void send_events(Events &&ev) = 0;
 
   /**
    * Acknowledge via the virtio irq_ack register.
@@ -81,7 +174,10 @@ public:
   virtual void clear_events(unsigned mask) = 0;
 };
 
-class Dev : public Vdev::Device
+class Dev
+: public Vdev::Device,
+  public Vdev::Snapshot_state,
+  public Vmm::Ram_listener
 {
 public:
   typedef L4virtio::Svr::Dev_status Status;
@@ -127,6 +223,55 @@ public:
     _cfg_header->dev_features_map[1] = 1; // set VERSION 1 flag
 
     update_virtio_config();
+
+    if (_ram)
+      _ram->add_listener(this);
+  }
+
+  ~Dev()
+  {
+    if (_ram)
+      _ram->remove_listener(this);
+  }
+
+  /**
+   * The rings of ready queues must stay in guest RAM, as the device keeps
+   * pointers to them, see attach_queue().
+   */
+  bool ram_in_use(Vmm::Ram_ds const &r) override
+  {
+    auto in_region = [&r](l4_uint64_t addr, l4_size_t size)
+      {
+        return addr < r.vm_start().get() + r.size()
+               && r.vm_start().get() < addr + size;
+      };
+
+    Virtqueue *q;
+    for (unsigned i = 0; (q = virtqueue(i)); ++i)
+      if (q->ready()
+          && (in_region(q->config.desc_addr, q->desc_ring_size())
+              || in_region(q->config.avail_addr, q->avail_ring_size())
+              || in_region(q->config.used_addr, q->used_ring_size())))
+        return true;
+
+    return false;
+  }
+
+  /// The device updates the rings of ready queues through its pointers.
+  void ram_written(Vmm::Ram_ds const &,
+                   std::vector<Vmm::Region> *ranges) override
+  {
+    auto add = [ranges](l4_uint64_t addr, l4_size_t size)
+      { ranges->push_back(Vmm::Region::ss(Vmm::Guest_addr(addr), size)); };
+
+    Virtqueue *q;
+    for (unsigned i = 0; (q = virtqueue(i)); ++i)
+      if (q->ready())
+        {
+          add(q->config.desc_addr, q->desc_ring_size());
+          add(q->config.avail_addr, q->avail_ring_size());
+          add(q->config.used_addr, q->used_ring_size());
+        }
   }
 
   virtual Virtqueue *virtqueue(unsigned qn) = 0;
@@ -164,10 +309,83 @@ public:
       reset();
   }
 
+  /**
+   * Save the transport state of the device.
+   *
+   * The rings themselves are in guest memory. Devices with additional
+   * state must extend this.
+   */
+  void save_state(Vmm::Snapshot_writer &w) override
+  {
+    w.put(_cfg_header.get(), Config_ds_size);
+    w.put(_irq_status_shadow);
+    w.put(_config_event_index);
+
+    Virtqueue *q;
+    for (unsigned i = 0; (q = virtqueue(i)); ++i)
+      {
+        w.put(q->config);
+        w.put(q->current_avail());
+      }
+  }
+
+  void restore_state(Vmm::Snapshot_reader &r) override
+  {
+    r.get(_cfg_header.get(), Config_ds_size);
+    r.get(&_irq_status_shadow);
+    r.get(&_config_event_index);
+
+    Virtqueue *q;
+    for (unsigned i = 0; (q = virtqueue(i)); ++i)
+      {
+        l4_uint16_t avail;
+        r.get(&q->config);
+        r.get(&avail);
+
+        if (!q->config.ready)
+          continue;
+
+        attach_queue(q);
+        q->set_current_avail(avail);
+      }
+
+    update_virtio_config();
+  }
+
   template<typename T>
   T *devaddr_to_virt(l4_addr_t devaddr, l4_size_t len = 0) const
   { return _ram->guest2host<T *>(Vmm::Region::ss(Vmm::Guest_addr(devaddr), len)); }
 
+  /**
+   * Attach a virtqueue to its rings in guest memory.
+   *
+   * The rings are prepared for access by the VMM in their full size, so
+   * that copy-on-write and lazily filled RAM is resolved for all pages
+   * the rings occupy.
+   */
+  void attach_queue(Virtqueue *q) const
+  {
+    q->init_queue(devaddr_to_virt<void>(q->config.desc_addr,
+                                        q->desc_ring_size()),
+                  devaddr_to_virt<void>(q->config.avail_addr,
+                                        q->avail_ring_size()),
+                  devaddr_to_virt<void>(q->config.used_addr,
+                                        q->used_ring_size()));
+  }
+
+  /**
+   * Get the scatter list of a guest buffer.
+   *
+   * Unlike devaddr_to_virt(), the buffer may span several RAM regions.
+   * An exception is thrown if it is not completely in guest RAM.
+   */
+  void devaddr_to_iov(l4_addr_t devaddr, l4_size_t len,
+                      Vmm::Host_iovec *iov) const
+  {
+    L4Re::chksys(_ram->guest2host_iov(Vmm::Guest_addr(devaddr), len, iov),
+                 "Guest buffer in RAM");
+  }
+
 private:
   Vmm::Vm_ram *_ram;
 };
@@ -200,6 +418,25 @@ public:
     writeback_cache(&vcfg->irq_status);
   }
 
+  /**
+   * Handle a write to the queue notify register without decoding the
+   * whole instruction.
+   */
+  bool mmio_doorbell(unsigned reg, Vmm::Vcpu_ptr vcpu)
+  {
+    if (reg != 0x50)
+      return false;
+
+    auto m = vcpu.decode_doorbell();
+    if (m.access != Vmm::Mem_access::Store)
+      return false;
+
+    if (m.width >= Vmm::Mem_access::Wd32)
+      dev()->virtio_queue_notify(m.value);
+
+    return true;
+  }
+
   void write(unsigned reg, char size, l4_uint64_t value, unsigned)
   {
     auto *vcfg = dev()->virtio_cfg();
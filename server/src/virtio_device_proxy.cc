@@ -107,6 +107,16 @@ public:
     _vmm = devs->vmm();
   }
 
+  /// Kicks by the driver only need the address of the queue notify register.
+  bool mmio_doorbell(unsigned reg, Vmm::Vcpu_ptr)
+  {
+    if (reg != 0x50)
+      return false;
+
+    _kick_guest_irq->trigger();
+    return true;
+  }
+
   void write(unsigned reg, char width, l4_umword_t value, unsigned cpu_id)
   {
     (void) cpu_id;
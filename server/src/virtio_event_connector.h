@@ -7,12 +7,275 @@
  */
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <l4/re/env.h>
+#include <l4/sys/debugger.h>
+#include <l4/sys/kip.h>
+#include <pthread-l4.h>
+
+#include "guest.h"
 #include "irq.h"
 #include "irq_dt.h"
 #include "virtio_dev.h"
 
 namespace Virtio {
 
+/**
+ * Interrupt moderation (coalescing) for virtio event connectors.
+ *
+ * Events reported by a device are held back until either `max_frames`
+ * events have accumulated or the oldest pending event has waited for
+ * `max_delay_us` microseconds. A device requests immediate delivery when
+ * the queue it serves runs dry, i.e. when no further progress is possible
+ * without the guest processing the pending events.
+ *
+ * Each moderated connector has a thread that sleeps until the delay budget
+ * of its oldest pending event is used up. Interrupts are injected without
+ * the moderation lock held.
+ *
+ * Moderation is configured per device via the device tree properties
+ * `l4vmm,irq-coalesce-usecs` (required, enables moderation) and
+ * `l4vmm,irq-coalesce-frames` (optional, unlimited by default).
+ */
+class Event_moderation : public virtual Vdev::Dev_ref
+{
+public:
+  struct Stats
+  {
+    l4_uint64_t frames = 0;       ///< Events reported by the device
+    l4_uint64_t interrupts = 0;   ///< Interrupts delivered to the guest
+    l4_uint64_t flush_frames = 0; ///< Deliveries due to the frame limit
+    l4_uint64_t flush_timer = 0;  ///< Deliveries due to the delay budget
+    l4_uint64_t flush_dry = 0;    ///< Deliveries due to an empty queue
+  };
+
+  Event_moderation(char const *name, unsigned max_frames,
+                   unsigned max_delay_us)
+  : _max_frames(max_frames ? max_frames : -1U),
+    _max_delay_us(max_delay_us)
+  {
+    snprintf(_name, sizeof(_name), "%s", name);
+
+    _thread = std::thread(&Event_moderation::run, this);
+    l4_debugger_set_object_name(pthread_l4_cap(_thread.native_handle()),
+                                "irq moderation");
+
+    std::lock_guard<std::mutex> lock(registry_lock());
+    registry().push_back(this);
+  }
+
+  virtual ~Event_moderation()
+  {
+    detach();
+
+    std::lock_guard<std::mutex> lock(registry_lock());
+    auto &r = registry();
+    for (auto it = r.begin(); it != r.end(); ++it)
+      if (*it == this)
+        {
+          r.erase(it);
+          break;
+        }
+  }
+
+  /**
+   * Read the moderation parameters of a device from the device tree.
+   *
+   * \param      node          Device tree node of the device.
+   * \param[out] max_frames    Frame limit, 0 if unlimited.
+   * \param[out] max_delay_us  Delay budget in microseconds.
+   *
+   * \retval true   Moderation is configured for the device.
+   * \retval false  Events shall be delivered immediately.
+   */
+  static bool dt_config(Vdev::Dt_node const &node, unsigned *max_frames,
+                        unsigned *max_delay_us)
+  {
+    int sz;
+    auto const *usecs = node.get_prop<fdt32_t>("l4vmm,irq-coalesce-usecs", &sz);
+    if (!usecs || sz < 1 || fdt32_to_cpu(*usecs) == 0)
+      return false;
+
+    *max_delay_us = fdt32_to_cpu(*usecs);
+
+    auto const *frames = node.get_prop<fdt32_t>("l4vmm,irq-coalesce-frames",
+                                                &sz);
+    *max_frames = (frames && sz > 0) ? fdt32_to_cpu(*frames) : 0;
+
+    return true;
+  }
+
+  /**
+   * Submit new events for delivery.
+   *
+   * \param frames     Number of completed buffers the events stand for.
+   * \param queue_dry  True if the device has no further buffers available.
+   * \param record     Callback that records the pending events. It is
+   *                   called with the moderation lock held.
+   */
+  template <typename FUNC>
+  void submit(unsigned frames, bool queue_dry, FUNC &&record)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    record();
+
+    // Events always stand for at least one frame, otherwise they would
+    // never be delivered by the deadline thread.
+    if (!frames)
+      frames = 1;
+
+    auto now = clock();
+    bool arm = !_pending;
+    if (arm)
+      _first_pending = now;
+
+    _pending += frames;
+    _stats.frames += frames;
+
+    if (_pending >= _max_frames)
+      ++_stats.flush_frames;
+    else if (queue_dry)
+      ++_stats.flush_dry;
+    else if (now - _first_pending >= _max_delay_us)
+      ++_stats.flush_timer;
+    else
+      {
+        if (arm)
+          _deadline.notify_one();
+        return;
+      }
+
+    deliver(lock);
+  }
+
+  /**
+   * Stop all further deliveries.
+   *
+   * Must be called before the connector is destroyed because the deadline
+   * thread may still deliver events to it. Waits for a delivery of the
+   * deadline thread in progress.
+   */
+  void detach()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _pending = 0;
+      _detached = true;
+    }
+
+    _deadline.notify_one();
+    if (_thread.joinable())
+      _thread.join();
+  }
+
+  void show_stats(FILE *f) const
+  {
+    Stats s = _stats;
+    fprintf(f, "%-16s frames: %llu irqs: %llu flush(frames/timer/dry): "
+               "%llu/%llu/%llu [max %u frames, %u us]\n",
+            _name, s.frames, s.interrupts, s.flush_frames, s.flush_timer,
+            s.flush_dry, _max_frames == -1U ? 0 : _max_frames, _max_delay_us);
+  }
+
+  /// Print the counters of all moderated event connectors.
+  static void show_all_stats(FILE *f)
+  {
+    std::lock_guard<std::mutex> lock(registry_lock());
+    if (registry().empty())
+      fprintf(f, "No interrupt moderation configured.\n");
+
+    for (auto const *m : registry())
+      m->show_stats(f);
+  }
+
+private:
+  /**
+   * Deliver all pending events to the guest.
+   *
+   * Called without the moderation lock held. Events recorded concurrently
+   * may or may not be included.
+   */
+  virtual void flush() = 0;
+
+  /**
+   * Account for the delivery of all pending events and deliver them.
+   *
+   * \param lock  Lock of `_mutex`, released before the events are delivered.
+   */
+  void deliver(std::unique_lock<std::mutex> &lock)
+  {
+    bool detached = _detached;
+
+    ++_stats.interrupts;
+    _pending = 0;
+
+    lock.unlock();
+    if (!detached)
+      flush();
+  }
+
+  /// Deliver pending events once their delay budget is used up.
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_detached)
+      {
+        if (!_pending)
+          {
+            _deadline.wait(lock);
+            continue;
+          }
+
+        l4_cpu_time_t now = clock();
+        l4_cpu_time_t due = _first_pending + _max_delay_us;
+        if (now < due)
+          {
+            _deadline.wait_for(lock, std::chrono::microseconds(due - now));
+            continue;
+          }
+
+        ++_stats.flush_timer;
+        deliver(lock);
+        lock.lock();
+      }
+  }
+
+  static l4_cpu_time_t clock()
+  { return l4_kip_clock(l4re_kip()); }
+
+  static std::vector<Event_moderation *> &registry()
+  {
+    static std::vector<Event_moderation *> r;
+    return r;
+  }
+
+  static std::mutex &registry_lock()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  std::mutex _mutex;
+  /// Signalled when the first event is pending or on detach().
+  std::condition_variable _deadline;
+  std::thread _thread;
+  unsigned const _max_frames;
+  unsigned const _max_delay_us;
+  unsigned _pending = 0;
+  l4_cpu_time_t _first_pending = 0;
+  bool _detached = false;
+  Stats _stats;
+  char _name[24];
+};
+
 /**
  * This IRQ event connector supports a single IRQ for all events.
  *
@@ -23,16 +286,48 @@ namespace Virtio {
  */
 class Event_connector_irq
 {
+  class Moderation : public Event_moderation
+  {
+  public:
+    Moderation(Event_connector_irq *con, char const *name, unsigned frames,
+               unsigned usecs)
+    : Event_moderation(name, frames, usecs), _con(con)
+    {}
+
+  private:
+    void flush() override
+    { _con->_sink.inject(); }
+
+    Event_connector_irq *_con;
+  };
+
 public:
+  ~Event_connector_irq()
+  {
+    if (_moderation)
+      _moderation->detach();
+  }
+
   /**
    * Commit / send events marked in `ev` to the guest.
    *
-   * \param ev  Set of pending events to be injected into the guest.
+   * \param ev         Set of pending events to be injected into the guest.
+   * \param frames     Number of completed buffers the events stand for.
+   * \param queue_dry  The device cannot make progress until the guest
+   *                   processed the events. Only relevant with interrupt
+   *                   moderation, see Event_moderation.
    */
-  void send_events(Virtio::Event_set &&ev)
+  template <unsigned N>
+  void send_events(Virtio::Event_set_t<N> &&ev, unsigned frames = 1,
+                   bool queue_dry = true)
   {
-    if (ev.e)
-      _sink.inject();
+    if (!ev.empty())
+      {
+        if (_moderation)
+          _moderation->submit(frames, queue_dry, []() {});
+        else
+          _sink.inject();
+      }
 
     ev.reset();
   }
@@ -66,11 +361,20 @@ public:
       return -1;
 
     _sink.rebind(it.ic().get(), it.irq());
+
+    unsigned frames, usecs;
+    if (Event_moderation::dt_config(node, &frames, &usecs))
+      {
+        _moderation = Vdev::make_device<Moderation>(this, node.get_name(),
+                                                    frames, usecs);
+      }
+
     return 0;
   }
 
 private:
   Vmm::Irq_sink _sink;
+  cxx::Ref_ptr<Moderation> _moderation;
 };
 
 } // namespace Virtio
@@ -42,8 +42,7 @@ class Virtio_input
 
   struct Payload
   {
-    char *data;
-    unsigned len;
+    Vmm::Host_iovec iov;
     bool writable;
   };
 
@@ -131,9 +130,7 @@ public:
         if (!num || (num & (num - 1)) || num > qc->num_max)
           return;
 
-        q->init_queue(dev()->template devaddr_to_virt<void>(qc->desc_addr),
-                      dev()->template devaddr_to_virt<void>(qc->avail_addr),
-                      dev()->template devaddr_to_virt<void>(qc->used_addr));
+        dev()->attach_queue(q);
         qc->ready = 1;
       }
   }
@@ -149,8 +146,7 @@ public:
 
   void load_desc(Desc const &desc, Request_processor const *, Payload *p)
   {
-    p->data = devaddr_to_virt<char>(desc.addr.get(), desc.len);
-    p->len = desc.len;
+    devaddr_to_iov(desc.addr.get(), desc.len, &p->iov);
     p->writable = desc.flags.write();
   }
 
@@ -203,7 +199,7 @@ public:
         rp.start(this, req, &p);
 
         // Check consistency of buffer
-        if (!p.writable || p.len < sizeof(events[0]))
+        if (!p.writable || p.iov.size < sizeof(events[0]))
           {
             Dbg(Dbg::Dev, Dbg::Warn, "virtio")
               .printf("Virtio_input: buffer %s\n",
@@ -213,7 +209,7 @@ public:
             break;
           }
 
-        memcpy(p.data, &events[injected], sizeof(events[0]));
+        p.iov.copy_in(0, &events[injected], sizeof(events[0]));
         q->consumed(req, sizeof(events[0]));
       }
 
@@ -231,7 +227,8 @@ public:
 
         Virtio::Event_set ev;
         ev.set(q->config.driver_notify_index);
-        dev()->event_connector()->send_events(cxx::move(ev));
+        dev()->event_connector()->send_events(cxx::move(ev), injected,
+                                              !q->desc_avail());
       }
 
     return injected;
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+
+#include "virtio_mem.h"
+#include "device_factory.h"
+#include "guest.h"
+
+namespace {
+
+using namespace Vdev;
+
+struct F : Factory
+{
+  cxx::Ref_ptr<Device> create(Device_lookup *devs, Dt_node const &node) override
+  {
+    Dbg(Dbg::Dev, Dbg::Info).printf("Create virtual hotplug memory\n");
+
+    l4_uint64_t base, size;
+    if (node.get_reg_val(1, &base, &size) < 0)
+      {
+        Err().printf("%s: reg entry for hotplug memory window not found.\n",
+                     node.get_name());
+        return nullptr;
+      }
+
+    l4_uint64_t block_size = L4_SUPERPAGESIZE;
+    int sz;
+    auto const *prop = node.get_prop<fdt32_t>("l4vmm,block-size", &sz);
+    if (prop && sz > 0)
+      block_size = fdt32_to_cpu(prop[0]);
+
+    if (block_size < L4_PAGESIZE || (block_size & (block_size - 1))
+        || (base & (block_size - 1)) || !size || (size & (block_size - 1)))
+      {
+        Err().printf("%s: hotplug memory window not aligned to the block "
+                     "size 0x%llx.\n", node.get_name(), block_size);
+        return nullptr;
+      }
+
+    auto c = make_device<Virtio_mem_mmio>(devs->ram().get(),
+                                          devs->vmm()->vm_task(),
+                                          devs->vmm()->memmap(),
+                                          Vmm::Guest_addr(base), size,
+                                          block_size);
+    if (c->init_irqs(devs, node) < 0)
+      return nullptr;
+
+    devs->vmm()->register_mmio_device(c, node);
+    return c;
+  }
+};
+
+static F f;
+static Device_type t = { "virtio,mmio", "mem", &f };
+
+}
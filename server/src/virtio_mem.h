@@ -0,0 +1,561 @@
+/*
+ * Copyright (C) 2018 Kernkonzept GmbH.
+ *
+ * This file is distributed under the terms of the GNU General Public
+ * License, version 2.  Please see the COPYING-GPL-2 file for details.
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <l4/re/env>
+#include <l4/re/error_helper>
+#include <l4/re/mem_alloc>
+#include <l4/re/util/cap_alloc>
+#include <l4/sys/task>
+
+#include "debug.h"
+#include "instance_list.h"
+#include "mmio_device.h"
+#include "virtio_dev.h"
+#include "virtio_event_connector.h"
+#include "vm_memmap.h"
+
+namespace Vdev {
+
+/**
+ * Control interface of the hotplug memory devices, used by the monitor
+ * console.
+ */
+class Mem_hotplug_control : public Instance_list<Mem_hotplug_control>
+{
+public:
+  virtual ~Mem_hotplug_control() = default;
+
+  /// Print the plugged and requested memory.
+  virtual void show_state(FILE *f) = 0;
+
+  /**
+   * Change the size of the memory the guest shall plug.
+   *
+   * \param delta  Number of bytes to add to the requested size, negative
+   *               to ask the guest to unplug memory.
+   */
+  virtual void resize(long long delta) = 0;
+
+  static void show_all(FILE *f)
+  {
+    if (!foreach_instance([f](Mem_hotplug_control *m) { m->show_state(f); }))
+      fprintf(f, "No hotplug memory configured.\n");
+  }
+
+  static void resize_all(long long delta)
+  { foreach_instance([delta](Mem_hotplug_control *m) { m->resize(delta); }); }
+};
+
+/**
+ * Virtio memory device.
+ *
+ * The device offers a window of guest-physical memory whose blocks the
+ * guest plugs and unplugs on request of the host, see resize(). Each
+ * plugged block is backed by a dataspace of its own, which is added as
+ * RAM region to Vm_ram and freed again when the block is unplugged.
+ * Unplugged blocks are not accessible to the guest.
+ */
+template <typename DEV>
+class Virtio_mem : public Virtio::Dev, public Mem_hotplug_control
+{
+  typedef L4virtio::Svr::Virtqueue::Desc Desc;
+  typedef L4virtio::Svr::Request_processor Request_processor;
+
+  struct Payload
+  {
+    Vmm::Host_iovec iov;
+    bool writable;
+  };
+
+  enum
+  {
+    Virtio_id_mem = 24,
+    Mem_queue_length = 0x80,
+  };
+
+  /// Device-specific configuration, located at offset 0x100 of the config page.
+  struct Mem_config
+  {
+    l4_uint64_t block_size;
+    l4_uint16_t node_id;
+    l4_uint8_t padding[6];
+    l4_uint64_t addr;
+    l4_uint64_t region_size;
+    l4_uint64_t usable_region_size;
+    l4_uint64_t plugged_size;
+    l4_uint64_t requested_size;
+  };
+
+  enum Req_type : l4_uint16_t
+  {
+    Req_plug = 0,
+    Req_unplug = 1,
+    Req_unplug_all = 2,
+    Req_state = 3,
+  };
+
+  enum Resp_type : l4_uint16_t
+  {
+    Resp_ack = 0,
+    Resp_nack = 1,
+    Resp_busy = 2,
+    Resp_error = 3,
+  };
+
+  enum State : l4_uint16_t
+  {
+    State_plugged = 0,
+    State_unplugged = 1,
+    State_mixed = 2,
+  };
+
+  struct Mem_req
+  {
+    l4_uint16_t type;
+    l4_uint16_t padding[3];
+    l4_uint64_t addr;
+    l4_uint16_t nb_blocks;
+    l4_uint16_t padding2[3];
+  };
+
+  struct Mem_resp
+  {
+    l4_uint16_t type;
+    l4_uint16_t padding[3];
+    l4_uint16_t state;
+  };
+
+public:
+  struct Features : Virtio::Dev::Features
+  {
+    CXX_BITFIELD_MEMBER(0, 0, acpi_pxm, raw);
+    CXX_BITFIELD_MEMBER(1, 1, unplugged_inaccessible, raw);
+
+    explicit Features(l4_uint32_t v)
+    : Virtio::Dev::Features(v)
+    {}
+  };
+
+  /**
+   * Create a virtio memory device.
+   *
+   * \param ram         Guest RAM to add plugged blocks to.
+   * \param vm_task     Guest task plugged blocks are mapped to.
+   * \param memmap      Guest memory map to add plugged blocks to.
+   * \param addr        Guest-physical start of the window, aligned to
+   *                    `block_size`.
+   * \param size        Size of the window, a multiple of `block_size`.
+   * \param block_size  Size of the blocks, a power of two.
+   */
+  Virtio_mem(Vmm::Vm_ram *ram, L4::Cap<L4::Task> vm_task, Vmm::Vm_mem *memmap,
+             Vmm::Guest_addr addr, l4_size_t size, l4_size_t block_size)
+  : Virtio::Dev(ram, 0x44, Virtio_id_mem),
+    _ram(ram), _vm_task(vm_task), _memmap(memmap),
+    _blocks(size / block_size)
+  {
+    Features feat(0);
+    feat.unplugged_inaccessible() = true;
+    _cfg_header->dev_features_map[0] = feat.raw;
+    _cfg_header->num_queues = 1;
+    _vq.config.num_max = Mem_queue_length;
+
+    auto *cfg = mem_config();
+    cfg->block_size = block_size;
+    cfg->addr = addr.get();
+    cfg->region_size = size;
+    cfg->usable_region_size = size;
+    cfg->plugged_size = 0;
+    cfg->requested_size = 0;
+    update_virtio_config();
+  }
+
+  ~Virtio_mem()
+  {
+    for (unsigned i = 0; i < _blocks.size(); ++i)
+      if (_blocks[i].is_valid())
+        unplug_block(i, true);
+  }
+
+  int init_irqs(Vdev::Device_lookup *devs, Vdev::Dt_node const &self)
+  { return dev()->event_connector()->init_irqs(devs, self); }
+
+  void virtio_queue_ready(unsigned ready)
+  {
+    auto *q = current_virtqueue();
+    if (!q)
+      return;
+
+    auto *qc = &q->config;
+
+    if (ready == 0 && q->ready())
+      {
+        q->disable();
+        qc->ready = 0;
+      }
+    else if (ready == 1 && !q->ready())
+      {
+        qc->ready = 0;
+        l4_uint16_t num = qc->num;
+        // num must be: a power of two in range [1,num_max].
+        if (!num || (num & (num - 1)) || num > qc->num_max)
+          return;
+
+        dev()->attach_queue(q);
+        qc->ready = 1;
+      }
+  }
+
+  /// Plugged memory stays plugged, the driver unplugs it when it starts.
+  void reset() override
+  {
+    _vq.disable();
+    _vq.config.num_max = Mem_queue_length;
+  }
+
+  void virtio_queue_notify(unsigned qn)
+  {
+    if (qn != 0)
+      return;
+
+    Virtio::Event_set ev;
+    unsigned frames = 0;
+
+    while (_vq.ready())
+      {
+        auto r = _vq.next_avail();
+        if (!r)
+          break;
+
+        Request_processor rp;
+        Payload p, resp_p;
+        Mem_req req;
+        l4_size_t got = 0;
+        bool have_resp = false;
+
+        rp.start(this, r, &p);
+        for (;;)
+          {
+            if (!p.writable)
+              got += p.iov.copy_out(reinterpret_cast<char *>(&req) + got, 0,
+                                    sizeof(req) - got);
+            else if (!have_resp)
+              {
+                resp_p = p;
+                have_resp = true;
+              }
+
+            if (!rp.has_more())
+              break;
+            rp.next(this, &p);
+          }
+
+        Mem_resp resp;
+        memset(&resp, 0, sizeof(resp));
+        if (got == sizeof(req))
+          handle_request(req, &resp);
+        else
+          resp.type = Resp_error;
+
+        l4_uint32_t len = 0;
+        if (have_resp)
+          len = resp_p.iov.copy_in(0, &resp, sizeof(resp));
+
+        _vq.consumed(r, len);
+        ++frames;
+        if (!_vq.no_notify_guest())
+          {
+            _irq_status_shadow |= 1;
+            ev.set(_vq.config.driver_notify_index);
+          }
+      }
+
+    if (_cfg_header->irq_status != _irq_status_shadow)
+      dev()->set_irq_status(_irq_status_shadow);
+
+    dev()->event_connector()->send_events(cxx::move(ev), frames);
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *, Payload *p)
+  {
+    devaddr_to_iov(desc.addr.get(), desc.len, &p->iov);
+    p->writable = desc.flags.write();
+  }
+
+  void load_desc(Desc const &desc, Request_processor const *,
+                 Desc const **table)
+  {
+    *table = devaddr_to_virt<Desc const>(desc.addr.get(), sizeof(Desc));
+  }
+
+  void virtio_irq_ack(unsigned val)
+  {
+    _irq_status_shadow &= ~val;
+    if (_cfg_header->irq_status != _irq_status_shadow)
+      dev()->set_irq_status(_irq_status_shadow);
+
+    dev()->event_connector()->clear_events(val);
+  }
+
+  Virtio::Virtqueue *virtqueue(unsigned qn) override
+  { return qn == 0 ? &_vq : nullptr; }
+
+  // The plugged blocks are not part of the RAM configuration a snapshot
+  // is restored into.
+  void save_state(Vmm::Snapshot_writer &w) override
+  {
+    if (mem_config()->plugged_size)
+      L4Re::chksys(-L4_ENOSYS, "Snapshot of virtio-mem with plugged memory.");
+
+    Virtio::Dev::save_state(w);
+  }
+
+  void resize(long long delta) override
+  {
+    auto *cfg = mem_config();
+    long long size = (long long)cfg->requested_size + delta;
+    if (size < 0)
+      size = 0;
+    if ((l4_uint64_t)size > cfg->usable_region_size)
+      size = cfg->usable_region_size;
+
+    cfg->requested_size = size & ~(cfg->block_size - 1);
+    update_virtio_config();
+
+    _irq_status_shadow |= 2;
+    dev()->set_irq_status(_irq_status_shadow);
+    dev()->event_connector()->send_event(_config_event_index);
+  }
+
+  void show_state(FILE *f) override
+  {
+    auto const *cfg = mem_config();
+    fprintf(f, "Hotplug memory [%llx-%llx]: %llu of %llu MiB requested, "
+               "%llu MiB plugged\n",
+            cfg->addr, cfg->addr + cfg->region_size - 1,
+            cfg->requested_size >> 20, cfg->region_size >> 20,
+            cfg->plugged_size >> 20);
+  }
+
+private:
+  Mem_config *mem_config() const
+  {
+    return reinterpret_cast<Mem_config *>(
+      reinterpret_cast<char *>(_cfg_header.get()) + 0x100);
+  }
+
+  Vmm::Guest_addr block_addr(unsigned idx) const
+  {
+    auto const *cfg = mem_config();
+    return Vmm::Guest_addr(cfg->addr + idx * cfg->block_size);
+  }
+
+  /**
+   * Check that a request covers whole blocks of the usable region.
+   *
+   * \param[out] first  Index of the first block of the request.
+   */
+  bool valid_range(Mem_req const &req, unsigned *first) const
+  {
+    auto const *cfg = mem_config();
+    if (!req.nb_blocks || (req.addr & (cfg->block_size - 1))
+        || req.addr < cfg->addr)
+      return false;
+
+    l4_uint64_t offs = req.addr - cfg->addr;
+    if (offs + (l4_uint64_t)req.nb_blocks * cfg->block_size
+        > cfg->usable_region_size)
+      return false;
+
+    *first = offs / cfg->block_size;
+    return true;
+  }
+
+  void handle_request(Mem_req const &req, Mem_resp *resp)
+  {
+    auto *cfg = mem_config();
+    unsigned first = 0;
+
+    resp->type = Resp_ack;
+    switch (req.type)
+      {
+      case Req_plug:
+        if (!valid_range(req, &first)
+            || count_plugged(first, req.nb_blocks) != 0)
+          resp->type = Resp_error;
+        else if (cfg->plugged_size + req.nb_blocks * cfg->block_size
+                 > cfg->requested_size)
+          resp->type = Resp_nack;
+        else if (!plug_blocks(first, req.nb_blocks))
+          resp->type = Resp_nack;
+        break;
+
+      case Req_unplug:
+        if (!valid_range(req, &first)
+            || count_plugged(first, req.nb_blocks) != req.nb_blocks)
+          resp->type = Resp_error;
+        else if (!unplug_blocks(first, req.nb_blocks))
+          resp->type = Resp_busy;
+        break;
+
+      case Req_unplug_all:
+        if (!unplug_blocks(0, _blocks.size()))
+          resp->type = Resp_busy;
+        break;
+
+      case Req_state:
+        if (!valid_range(req, &first))
+          {
+            resp->type = Resp_error;
+            break;
+          }
+
+        {
+          unsigned n = count_plugged(first, req.nb_blocks);
+          resp->state = n == 0 ? State_unplugged
+                                : n == req.nb_blocks ? State_plugged
+                                                     : State_mixed;
+        }
+        break;
+
+      default:
+        resp->type = Resp_error;
+        break;
+      }
+
+    update_virtio_config();
+  }
+
+  unsigned count_plugged(unsigned first, unsigned num) const
+  {
+    unsigned n = 0;
+    for (unsigned i = first; i < first + num; ++i)
+      if (_blocks[i].is_valid())
+        ++n;
+
+    return n;
+  }
+
+  /**
+   * Back blocks with new memory and add them to the guest.
+   *
+   * \return False if there is not enough memory. No block is plugged then.
+   */
+  bool plug_blocks(unsigned first, unsigned num)
+  {
+    auto *cfg = mem_config();
+    auto *e = L4Re::Env::env();
+    unsigned long flags = (cfg->block_size & (L4_SUPERPAGESIZE - 1))
+                          ? 0 : L4Re::Mem_alloc::Super_pages;
+
+    for (unsigned i = first; i < first + num; ++i)
+      {
+        L4Re::Util::Unique_del_cap<L4Re::Dataspace> ds;
+        try
+          {
+            ds = L4Re::chkcap(L4Re::Util::make_unique_del_cap<L4Re::Dataspace>(),
+                              "Allocate capability for hotplug memory.");
+            L4Re::chksys(e->mem_alloc()->alloc(cfg->block_size, ds.get(),
+                                               flags),
+                         "Allocate hotplug memory.");
+            _ram->plug(_vm_task, ds.get(), block_addr(i), cfg->block_size,
+                       _memmap);
+          }
+        catch (L4::Runtime_error &err)
+          {
+            // A failed plug() leaves block i unplugged, its dataspace is
+            // freed with `ds`. Roll back the blocks plugged before. The
+            // guest has not been told about them, so they are not in use.
+            Err().printf("virtio-mem: %s: %s\n",
+                         err.extra_str() ? err.extra_str() : "", err.str());
+            for (unsigned j = first; j < i; ++j)
+              unplug_block(j, true);
+            return false;
+          }
+
+        _blocks[i] = cxx::move(ds);
+        cfg->plugged_size += cfg->block_size;
+      }
+
+    return true;
+  }
+
+  /**
+   * Remove the plugged blocks of a range from the guest.
+   *
+   * \return False if a block is still in use, for example by a virtio
+   *         proxy device or by the rings of a virtqueue. No block is
+   *         unplugged then.
+   */
+  bool unplug_blocks(unsigned first, unsigned num)
+  {
+    auto *cfg = mem_config();
+    for (unsigned i = first; i < first + num; ++i)
+      if (_blocks[i].is_valid()
+          && _ram->ram_in_use(block_addr(i), cfg->block_size))
+        return false;
+
+    for (unsigned i = first; i < first + num; ++i)
+      if (_blocks[i].is_valid())
+        unplug_block(i);
+
+    return true;
+  }
+
+  /**
+   * Remove a block from the guest and give its memory back.
+   *
+   * \param force  Remove the block even if it is still in use.
+   */
+  void unplug_block(unsigned idx, bool force = false)
+  {
+    auto *cfg = mem_config();
+    // Vm_ram frees the dataspace when the vCPUs are done with the block.
+    long err = _ram->unplug(_vm_task, block_addr(idx), cfg->block_size,
+                            _memmap, &_blocks[idx], force);
+    if (err < 0)
+      {
+        Err().printf("virtio-mem: cannot unplug block %u: %ld\n", idx, err);
+        return;
+      }
+
+    cfg->plugged_size -= cfg->block_size;
+  }
+
+  DEV *dev() { return static_cast<DEV *>(this); }
+
+  Vmm::Vm_ram *_ram;
+  L4::Cap<L4::Task> _vm_task;
+  Vmm::Vm_mem *_memmap;
+  Virtio::Virtqueue _vq;
+  /// Dataspaces of the plugged blocks, invalid for unplugged ones.
+  std::vector<L4Re::Util::Unique_del_cap<L4Re::Dataspace>> _blocks;
+};
+
+class Virtio_mem_mmio
+: public Virtio_mem<Virtio_mem_mmio>,
+  public Vmm::Ro_ds_mapper_t<Virtio_mem_mmio>,
+  public Virtio::Mmio_connector<Virtio_mem_mmio>
+{
+public:
+  Virtio_mem_mmio(Vmm::Vm_ram *ram, L4::Cap<L4::Task> vm_task,
+                  Vmm::Vm_mem *memmap, Vmm::Guest_addr addr, l4_size_t size,
+                  l4_size_t block_size)
+  : Virtio_mem(ram, vm_task, memmap, addr, size, block_size)
+  {}
+
+  Virtio::Event_connector_irq *event_connector() { return &_evcon; }
+
+private:
+  Virtio::Event_connector_irq _evcon;
+};
+
+}
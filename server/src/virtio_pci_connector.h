@@ -7,8 +7,10 @@
  */
 #pragma once
 
+#include "guest.h"
 #include "pci_virtio_device.h"
 #include "mem_access.h"
+#include "mmio_device.h"
 #include "io_device.h"
 #include "virtio_dev.h"
 #include "virtio_qword.h"
@@ -19,18 +21,133 @@ namespace Virtio {
 /**
  * Connecting instance between the Virtio world and the PCI transport world.
  *
- * \tparam DEV  The derived class.
+ * \tparam DEV         The derived class.
+ * \tparam MAX_QUEUES  Maximum number of virtqueues of the device. This
+ *                     must not exceed the capacity of the event set used by
+ *                     the device, `DEV::Event_set`.
  */
-template<typename DEV>
+template<typename DEV, unsigned MAX_QUEUES = Virtio::Event_set::Max_events>
 class Pci_connector : public Vmm::Io_device
 {
+  class Common_cfg_region;
+  class Device_cfg_region;
+  class Notify_region;
+
 public:
+  Pci_connector()
+  {
+    static_assert(MAX_QUEUES <= DEV::Event_set::Max_events,
+                  "Event set of the device holds an event per queue.");
+  }
+
   void io_in(unsigned port, Vmm::Mem_access::Width wd, l4_uint32_t *value) override
   {
-    auto vcfg = dev()->virtio_cfg();
     l4_uint32_t result = 0;
 
+    if (port < sizeof(Vdev::Virtio_pci_common_cfg))
+      result = common_cfg_read(port, wd);
+    else if (port == Vdev::Virtio_pci_io_isr_offset)
+      result = isr_read();
+    else
+      dbg().printf("unknown port number accessed: %i\n", port);
+
+    *value &= result & ((1ULL << ((1U << wd) * 8)) - 1);
+
+    trace().printf("In port(width) %i(%i) : 0x%x\n", port, wd, *value);
+  }
+
+  void io_out(unsigned port, Vmm::Mem_access::Width wd, l4_uint32_t value) override
+  {
+    trace().printf("OUT port(width) %i(%i) = 0x%x\n", port, wd, value);
+
     switch(port)
+      {
+      case Vdev::Virtio_pci_io_notify_offset:
+        // queue notify: length depends on cap values set
+        dev()->virtio_queue_notify(value);
+        break;
+
+      case Vdev::Virtio_pci_io_isr_offset: // ISR status
+        if (!dev()->msix_enabled())
+          dbg().printf("ISR status access for legacy IRQ -- NOT implemented\n");
+        break;
+
+      default:
+        if (port < sizeof(Vdev::Virtio_pci_common_cfg))
+          common_cfg_write(port, wd, value);
+        else
+          dbg().printf("unknown port number accessed: %i\n", port);
+      }
+  }
+
+  /**
+   * Register the virtio structures of a memory BAR with the guest.
+   *
+   * \param vmm   Guest the device belongs to.
+   * \param base  Guest-physical address of the memory BAR.
+   *
+   * The common configuration and the device-specific configuration are
+   * mapped read-only into the guest, so only writes to them trap. The ISR
+   * status traps, as reading it acknowledges the interrupt. Queue
+   * notifications go to a write-only region with a separate doorbell per
+   * queue, which is handled without decoding the faulting instruction.
+   *
+   * Call this after configure().
+   */
+  void register_mem_bar(Vmm::Guest *vmm, l4_uint64_t base)
+  {
+    l4_size_t cfg_size = dev()->mapped_mmio_size();
+    auto *vcfg = dev()->virtio_cfg();
+    unsigned num_queues = vcfg->num_queues ? vcfg->num_queues : 1;
+
+    _common_cfg = Vdev::make_device<Common_cfg_region>(this);
+    update_common_cfg();
+
+    // The common configuration and the ISR status page behind it.
+    vmm->add_mmio_device(
+      Vmm::Region::ss(Vmm::Guest_addr(base + Vdev::Virtio_pci_mem_common_cfg_offset),
+                      Vdev::Virtio_pci_mem_dev_cfg_offset),
+      _common_cfg);
+    vmm->add_mmio_device(
+      Vmm::Region::ss(Vmm::Guest_addr(base + Vdev::Virtio_pci_mem_dev_cfg_offset),
+                      cfg_size),
+      Vdev::make_device<Device_cfg_region>(this));
+    vmm->add_mmio_device(
+      Vmm::Region::ss(Vmm::Guest_addr(base
+                                      + Vdev::virtio_pci_mem_notify_offset(cfg_size)),
+                      num_queues * Vdev::Virtio_pci_notify_off_multiplier),
+      Vdev::make_device<Notify_region>(this));
+  }
+
+  void set_irq_status(int val)
+  {
+    // Only necessary in case of legacy IRQ, but a check if legacy IRQs are
+    // used would be more expensive than just setting it either way.
+    dev()->virtio_cfg()->irq_status = val;
+
+    // Device status and config generation may have been changed by the
+    // device as well, so refresh the whole page.
+    if (_common_cfg)
+      update_common_cfg();
+  }
+
+private:
+  /// Read the ISR status, which acknowledges the interrupts it reports.
+  l4_uint32_t isr_read()
+  {
+    l4_uint32_t isr = dev()->virtio_cfg()->irq_status;
+    if (isr)
+      dev()->virtio_irq_ack(isr);
+
+    return isr & 0xff;
+  }
+
+  l4_uint32_t common_cfg_read(unsigned reg, Vmm::Mem_access::Width wd)
+  {
+    auto vcfg = dev()->virtio_cfg();
+    l4_uint32_t result = 0;
+
+    switch(reg)
       {
       case 0: // device feature select
         result = vcfg->dev_features_sel;
@@ -91,8 +208,7 @@ public:
       case 26: // queue_msix_vector
         {
           auto sel = vcfg->queue_sel;
-          if (sel < (sizeof(_virtqueue_msix_index)
-                     / sizeof(_virtqueue_msix_index[0])))
+          if (sel < MAX_QUEUES)
             result = dev()->msix_enabled() ? _virtqueue_msix_index[sel] : 0;
           break;
         }
@@ -105,7 +221,9 @@ public:
         }
 
       case 30: // RO queue_notify_off
-        // Read as 0.
+        // Each queue has its own doorbell in the notification region. The
+        // IO BAR uses a multiplier of 0 and thus a single notify port.
+        result = vcfg->queue_sel;
         break;
 
       case 32: // queue_desc[31:0]
@@ -114,12 +232,12 @@ public:
           if (wd == Vmm::Mem_access::Wd32)
             {
               auto *qc = dev()->current_virtqueue_config();
-              int i = port == 32 ? 0 : 1;
+              int i = reg == 32 ? 0 : 1;
               result = qc ? ((Virtio::Qword *)(&qc->desc_addr))->w[i] : -1;
             }
           else
-            dbg().printf("Invalid width access to port %i with width %i\n",
-                         port, wd);
+            dbg().printf("Invalid width access to register %i with width %i\n",
+                         reg, wd);
           break;
         }
 
@@ -129,12 +247,12 @@ public:
           if (wd == Vmm::Mem_access::Wd32)
             {
               auto *qc = dev()->current_virtqueue_config();
-              int i = port == 40 ? 0 : 1;
+              int i = reg == 40 ? 0 : 1;
               result = qc ? ((Virtio::Qword *)(&qc->avail_addr))->w[i] : -1;
             }
           else
-            dbg().printf("Invalid width access to port %i with width %i\n",
-                         port, wd);
+            dbg().printf("Invalid width access to register %i with width %i\n",
+                         reg, wd);
           break;
         }
 
@@ -144,31 +262,28 @@ public:
           if (wd == Vmm::Mem_access::Wd32)
             {
               auto *qc = dev()->current_virtqueue_config();
-              int i = port == 48 ? 0 : 1;
+              int i = reg == 48 ? 0 : 1;
               result = qc ? ((Virtio::Qword *)(&qc->used_addr))->w[i] : -1;
             }
           else
-            dbg().printf("Invalid width access to port %i with width %i\n",
-                         port, wd);
+            dbg().printf("Invalid width access to register %i with width %i\n",
+                         reg, wd);
           break;
         }
 
       default:
-        dbg().printf("unknown port number accessed: %i\n", port);
+        dbg().printf("unknown common config register accessed: %i\n", reg);
       }
 
-    *value &= result & ((1ULL << ((1U << wd) * 8)) - 1);
-
-    trace().printf("In port(width) %i(%i) : 0x%x\n", port, wd, *value);
+    return result;
   }
 
-  void io_out(unsigned port, Vmm::Mem_access::Width wd, l4_uint32_t value) override
+  void common_cfg_write(unsigned reg, Vmm::Mem_access::Width wd,
+                        l4_uint32_t value)
   {
     auto vcfg = dev()->virtio_cfg();
 
-    trace().printf("OUT port(width) %i(%i) = 0x%x\n", port, wd, value);
-
-    switch(port)
+    switch(reg)
       {
       case 0: // device feature select
         vcfg->dev_features_sel = value;
@@ -212,8 +327,7 @@ public:
         {
           dbg().printf("\tqueue_msix_vector set %i\n", value);
           auto sel = vcfg->queue_sel;
-          if (sel < (sizeof(_virtqueue_msix_index)
-                     / sizeof(_virtqueue_msix_index[0])))
+          if (sel < MAX_QUEUES)
             _virtqueue_msix_index[sel] = value;
           break;
         }
@@ -225,8 +339,7 @@ public:
             if (qc)
               {
                 auto sel = vcfg->queue_sel;
-                if (sel < (sizeof(_virtqueue_msix_index)
-                           / sizeof(_virtqueue_msix_index[0])))
+                if (sel < MAX_QUEUES)
                   qc->driver_notify_index = _virtqueue_msix_index[sel];
               }
           }
@@ -240,13 +353,13 @@ public:
           if (wd == Vmm::Mem_access::Wd32)
             {
               auto *qc = dev()->current_virtqueue_config();
-              int i = port == 32 ? 0 : 1;
+              int i = reg == 32 ? 0 : 1;
               if (qc)
                 ((Virtio::Qword *)(&qc->desc_addr))->w[i] = value;
             }
           else
-            dbg().printf("Invalid width access to port %i with width %i\n",
-                         port, wd);
+            dbg().printf("Invalid width access to register %i with width %i\n",
+                         reg, wd);
           break;
         }
 
@@ -256,13 +369,13 @@ public:
           if (wd == Vmm::Mem_access::Wd32)
             {
               auto *qc = dev()->current_virtqueue_config();
-              int i = port == 40 ? 0 : 1;
+              int i = reg == 40 ? 0 : 1;
               if (qc)
                 ((Virtio::Qword *)(&qc->avail_addr))->w[i] = value;
             }
           else
-            dbg().printf("Invalid width access to port %i with width %i\n",
-                         port, wd);
+            dbg().printf("Invalid width access to register %i with width %i\n",
+                         reg, wd);
           break;
         }
 
@@ -272,45 +385,186 @@ public:
           if (wd == Vmm::Mem_access::Wd32)
             {
               auto *qc = dev()->current_virtqueue_config();
-              int i = port == 48 ? 0 : 1;
+              int i = reg == 48 ? 0 : 1;
               if (qc)
                 ((Virtio::Qword *)(&qc->used_addr))->w[i] = value;
             }
           else
-            dbg().printf("Invalid width access to port %i with width %i\n",
-                         port, wd);
+            dbg().printf("Invalid width access to register %i with width %i\n",
+                         reg, wd);
           break;
         }
 
-      case 56: // queue notify: length depends on cap values set
-        dev()->virtio_queue_notify(value);
-        break;
-
-      case 58: // ISR status
-        if (!dev()->msix_enabled())
-          dbg().printf("ISR status access for legacy IRQ -- NOT implemented\n");
-        break;
-
-      default: dbg().printf("unknown port number accessed: %i\n", port);
+      default:
+        dbg().printf("unknown common config register accessed: %i\n", reg);
       }
   }
 
-  void set_irq_status(int val)
+  /**
+   * Rewrite the read-mapped common configuration from the virtio
+   * configuration of the device.
+   *
+   * The guest may read the page meanwhile. Each register is stored in one
+   * piece, and the device status is stored last, so that a driver seeing
+   * a new status, e.g. a completed reset, also sees the registers that
+   * changed with it.
+   */
+  void update_common_cfg()
   {
-    // Only necessary in case of legacy IRQ, but a check if legacy IRQs are
-    // used would be more expensive than just setting it either way.
-    dev()->virtio_cfg()->irq_status = val;
+    auto w = Vmm::Mem_access::Wd32;
+    auto h = Vmm::Mem_access::Wd16;
+    auto b = Vmm::Mem_access::Wd8;
+    static struct { unsigned reg; Vmm::Mem_access::Width wd; } const regs[] =
+    {
+      { 0, w }, { 4, w }, { 8, w }, { 12, w }, { 16, h }, { 18, h },
+      { 21, b }, { 22, h }, { 24, h }, { 26, h }, { 28, h }, { 30, h },
+      { 32, w }, { 36, w }, { 40, w }, { 44, w }, { 48, w }, { 52, w },
+      { 20, b }, // device status
+    };
+
+    l4_addr_t base = reinterpret_cast<l4_addr_t>(_common_cfg->common_cfg());
+    for (auto const &r : regs)
+      {
+        l4_uint32_t v = common_cfg_read(r.reg, r.wd);
+        l4_addr_t a = base + r.reg;
+        switch (r.wd)
+          {
+          case Vmm::Mem_access::Wd8:
+            __atomic_store_n(reinterpret_cast<l4_uint8_t *>(a), v,
+                             __ATOMIC_RELEASE);
+            break;
+          case Vmm::Mem_access::Wd16:
+            __atomic_store_n(reinterpret_cast<l4_uint16_t *>(a), v,
+                             __ATOMIC_RELEASE);
+            break;
+          default:
+            __atomic_store_n(reinterpret_cast<l4_uint32_t *>(a), v,
+                             __ATOMIC_RELEASE);
+            break;
+          }
+      }
   }
 
-private:
   DEV *dev() { return static_cast<DEV *>(this); }
   DEV const *dev() const { return static_cast<DEV const *>(this); }
 
   static Dbg trace() { return Dbg(Dbg::Dev, Dbg::Trace, "PCI con"); }
   static Dbg dbg() { return Dbg(Dbg::Dev, Dbg::Warn, "PCI con"); }
 
+  /**
+   * Common configuration and ISR status of a memory BAR.
+   *
+   * The first page is a read-mapped shadow of the virtio configuration of
+   * the device and gets rewritten after every write access of the guest.
+   * The ISR status on the second page is not mapped, so that reading it
+   * traps and acknowledges the interrupt.
+   */
+  class Common_cfg_region
+  : public Vmm::Read_mapped_mmio_device_t<Common_cfg_region,
+                                          Vdev::Virtio_pci_common_cfg>
+  {
+  public:
+    explicit Common_cfg_region(Pci_connector *con)
+    : Vmm::Read_mapped_mmio_device_t<Common_cfg_region,
+                                     Vdev::Virtio_pci_common_cfg>(L4_PAGESIZE),
+      _con(con)
+    {}
+
+    l4_uint64_t read(unsigned reg, char size, unsigned cpu_id)
+    {
+      if (reg < this->mapped_mmio_size())
+        return Vmm::Ro_ds_mapper_t<Common_cfg_region>::read(reg, size, cpu_id);
+
+      if (reg == Vdev::Virtio_pci_mem_isr_offset)
+        return _con->isr_read();
+
+      return 0;
+    }
+
+    void write(unsigned reg, char size, l4_uint64_t value, unsigned)
+    {
+      trace().printf("common cfg write %i(%i) = 0x%llx\n", reg, size, value);
+
+      // The ISR status is read-only.
+      if (reg >= sizeof(Vdev::Virtio_pci_common_cfg))
+        return;
+
+      _con->common_cfg_write(reg, static_cast<Vmm::Mem_access::Width>(size),
+                             value);
+      _con->update_common_cfg();
+    }
+
+    Vdev::Virtio_pci_common_cfg *common_cfg() const
+    { return this->mmio_local_addr(); }
+
+  private:
+    Pci_connector *_con;
+  };
+
+  /**
+   * Read-mapped configuration page of the device in a memory BAR.
+   *
+   * The device-specific configuration is read directly from the
+   * configuration page of the device. Writes are forwarded to the device.
+   */
+  class Device_cfg_region : public Vmm::Ro_ds_mapper_t<Device_cfg_region>
+  {
+  public:
+    explicit Device_cfg_region(Pci_connector *con) : _con(con) {}
+
+    void write(unsigned reg, char size, l4_uint64_t value, unsigned)
+    {
+      if (L4_UNLIKELY(reg < Vdev::Virtio_pci_mem_dev_cfg_start))
+        return;
+
+      if (L4_UNLIKELY((reg + (1U << size)) > mapped_mmio_size()))
+        return;
+
+      l4_addr_t a = reinterpret_cast<l4_addr_t>(mmio_local_addr()) + reg;
+      if (Vmm::Mem_access::write_width(a, value, size) == L4_EOK)
+        _con->dev()->virtio_device_config_written(
+          reg - Vdev::Virtio_pci_mem_dev_cfg_start);
+    }
+
+    l4virtio_config_hdr_t *mmio_local_addr() const
+    { return _con->dev()->mmio_local_addr(); }
+
+    l4_size_t mapped_mmio_size() const
+    { return _con->dev()->mapped_mmio_size(); }
+
+    L4::Cap<L4Re::Dataspace> mmio_ds() const
+    { return _con->dev()->mmio_ds(); }
+
+    bool mmio_doorbell(unsigned, Vmm::Vcpu_ptr)
+    { return false; }
+
+  private:
+    Pci_connector *_con;
+  };
+
+  /**
+   * Write-only notification region of a memory BAR.
+   *
+   * The queue is identified by the doorbell address alone.
+   */
+  class Notify_region : public Vmm::Mmio_doorbell_t<Notify_region>
+  {
+  public:
+    explicit Notify_region(Pci_connector *con) : _con(con) {}
+
+    void doorbell(unsigned reg, unsigned)
+    {
+      _con->dev()->virtio_queue_notify(
+        reg / Vdev::Virtio_pci_notify_off_multiplier);
+    }
+
+  private:
+    Pci_connector *_con;
+  };
+
   unsigned _msi_table_idx_config = ::Vdev::Virtio_msix_no_vector;
-  l4_uint16_t _virtqueue_msix_index[sizeof(Virtio::Event_set) * 8];
+  l4_uint16_t _virtqueue_msix_index[MAX_QUEUES];
+  cxx::Ref_ptr<Common_cfg_region> _common_cfg;
 }; // Pci_connector
 
 } // namespace Virtio
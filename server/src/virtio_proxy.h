@@ -25,6 +25,7 @@
 #include "irq.h"
 #include "guest.h"
 #include "mmio_device.h"
+#include "snapshot.h"
 #include "virtio_event_connector.h"
 #include "vm_ram.h"
 
@@ -218,8 +219,14 @@ namespace Vdev {
 template <typename DEV>
 class Virtio_proxy
 : public L4::Irqep_t<Virtio_proxy<DEV>>,
-  public Device
+  public Device,
+  public Snapshot_state,
+  public Vmm::Ram_listener
 {
+public:
+  /// Set of the events of all queues.
+  typedef Virtio::Event_set Event_set;
+
 private:
   /**
    * Number of no-notify queue.
@@ -237,17 +244,39 @@ public:
                unsigned nnq_id, Vmm::Vm_ram *ram)
   : _nnq_id(nnq_id), _dev(device, config_size)
   {
-    ram->foreach_region([this](Vmm::Ram_ds const &r)
-      {
-        L4Re::chksys(_dev.register_ds(r.ds(), r.ds_offset(), r.size(),
-                                      r.vm_start().get()),
-                     "Registering RAM for virtio proxy.");
-      });
+    ram->foreach_region([this](Vmm::Ram_ds const &r) { ram_added(r); });
+    ram->add_listener(this);
+  }
+
+  void ram_added(Vmm::Ram_ds const &r) override
+  {
+    L4Re::chksys(_dev.register_ds(r.ds(), r.ds_offset(), r.size(),
+                                  r.vm_start().get()),
+                 "Registering RAM for virtio proxy.");
   }
 
+  /**
+   * The virtio protocol cannot unregister memory from the external device,
+   * so RAM registered with it is never given back.
+   */
+  bool ram_in_use(Vmm::Ram_ds const &) override
+  { return true; }
+
+  /// The external device may write to all RAM registered with it.
+  void ram_written(Vmm::Ram_ds const &r,
+                   std::vector<Vmm::Region> *ranges) override
+  { ranges->push_back(Vmm::Region::ss(r.vm_start(), r.size())); }
+
   int init_irqs(Vdev::Device_lookup *devs, Vdev::Dt_node const &self)
   { return dev()->event_connector()->init_irqs(devs, self); }
 
+  // The state of the device lives in the external virtio server.
+  void save_state(Vmm::Snapshot_writer &) override
+  { L4Re::chksys(-L4_ENOSYS, "Snapshot of virtio proxy device."); }
+
+  void restore_state(Vmm::Snapshot_reader &) override
+  { L4Re::chksys(-L4_ENOSYS, "Restore of virtio proxy device."); }
+
   void register_irq(L4::Registry_iface *registry)
   {
     L4::Cap<L4::Irq> guest_irq = L4Re::chkcap(registry->register_irq_obj(this),
@@ -261,7 +290,7 @@ public:
 
   void handle_irq()
   {
-    Virtio::Event_set ev;
+    Event_set ev;
     // FIXME: our L4 transport supports just a single IRQ, so trigger event 1
     //        for all queues until we implemented per-queue events.
     //        And use event index 0 for config events.
@@ -276,7 +305,9 @@ public:
     if (_dev.device_config()->irq_status != _irq_status_shadow)
       dev()->set_irq_status(_irq_status_shadow);
 
-    dev()->event_connector()->send_events(cxx::move(ev));
+    // The queue state is only known to the external device, so events
+    // are always subject to interrupt moderation if configured.
+    dev()->event_connector()->send_events(cxx::move(ev), 1, false);
   }
 
   void virtio_irq_ack(unsigned val)
@@ -112,8 +112,10 @@ struct F : Factory
     if (!(regs[0].flags & Dt_pci_flags_mmio32))
       L4Re::chksys(-L4_EINVAL, "First DT register entry is a MMIO(32) entry.");
 
-    if (!(regs[1].flags & Dt_pci_flags_io))
-      L4Re::chksys(-L4_EINVAL, "Second DT register entry is an IO entry.");
+    bool io_bar = regs[1].flags & Dt_pci_flags_io;
+    if (!io_bar && !(regs[1].flags & Dt_pci_flags_mmio32))
+      L4Re::chksys(-L4_EINVAL,
+                   "Second DT register entry is an IO or MMIO(32) entry.");
 
     l4_uint64_t dummy, cfgsz;
     int res = node.get_reg_val(2, &dummy, &cfgsz);
@@ -147,11 +149,13 @@ struct F : Factory
       make_device<Virtio_proxy_pci>(cap, cfgsz, nnq_id, devs->ram().get(),
                                     msi_distr, num_msix);
 
-    if (regs[1].flags & Dt_pci_flags_io)
+    if (io_bar)
       vmm->register_io_device(Vmm::Io_region::ss(regs[1].base, regs[1].size), proxy);
 
     proxy->register_irq(devs->vmm()->registry());
     proxy->configure(regs, num_msix);
+    if (!io_bar)
+      proxy->register_mem_bar(vmm, regs[1].base);
     pci->register_device(proxy);
 
     return proxy;
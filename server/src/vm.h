@@ -72,6 +72,14 @@ public:
                   cxx::Ref_ptr<Vdev::Device> dev) override
   { _devices.add(node, dev); }
 
+  /**
+   * Call `func` with the device tree path and the device of each device
+   * created from the device tree.
+   */
+  template <typename FUNC>
+  void foreach_device(FUNC &&func) const
+  { _devices.foreach_device(func); }
+
   /**
    * Find MSI parent of node.
    *
@@ -7,6 +7,8 @@
  * License, version 2.  Please see the COPYING-GPL-2 file for details.
  */
 
+#include <mutex>
+
 #include "debug.h"
 #include "vm_memmap.h"
 
@@ -27,6 +29,8 @@ void
 Vmm::Vm_mem::add_mmio_device(Vmm::Region const &region,
                         cxx::Ref_ptr<Vmm::Mmio_device> const &dev)
 {
+  std::lock_guard<Rw_lock> lock(_lock);
+
   if (count(region) == 0)
     {
       insert(std::make_pair(region, dev));
@@ -67,3 +71,31 @@ Vmm::Vm_mem::add_mmio_device(Vmm::Region const &region,
   insert(std::make_pair(region, dev));
 }
 
+
+bool
+Vmm::Vm_mem::remove_mmio_device(Vmm::Region const &region,
+                                Vmm::Mmio_device const *dev)
+{
+  std::lock_guard<Rw_lock> lock(_lock);
+
+  auto it = find(region);
+  if (it == end() || it->first.start != region.start
+      || it->first.end != region.end || it->second.get() != dev)
+    return false;
+
+  erase(it);
+  return true;
+}
+
+cxx::Ref_ptr<Vmm::Mmio_device>
+Vmm::Vm_mem::find_device(Vmm::Guest_addr addr, Vmm::Region *region) const
+{
+  Rw_lock::Shared_guard lock(_lock);
+
+  auto it = find(Region(addr));
+  if (it == end())
+    return nullptr;
+
+  *region = it->first;
+  return it->second;
+}
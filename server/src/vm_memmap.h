@@ -12,16 +12,56 @@
 #include <l4/sys/l4int.h>
 #include <map>
 
+#include "grace_period.h"
 #include "mmio_device.h"
 #include "mem_types.h"
+#include "rw_lock.h"
 
 namespace Vmm {
 
+/**
+ * Memory map of the guest.
+ *
+ * Devices may be added and removed while vCPUs look up the map. These
+ * operations and find_device() are serialized; the remaining methods of the
+ * map may only be used while the VM is set up.
+ *
+ * vCPUs handle exits in a reader section of grace_period(). Memory removed
+ * from the map must be kept until the sections that may still use it ended.
+ */
 class Vm_mem : public std::map<Region, cxx::Ref_ptr<Vmm::Mmio_device>>
 {
 public:
   void add_mmio_device(Region const &region,
                        cxx::Ref_ptr<Vmm::Mmio_device> const &dev);
+
+  /**
+   * Remove a device from the map.
+   *
+   * \param region  Region the device was added for.
+   * \param dev     Device to remove.
+   *
+   * \return True if `dev` was registered for `region` and is removed.
+   */
+  bool remove_mmio_device(Region const &region, Vmm::Mmio_device const *dev);
+
+  /**
+   * Find the device handling a guest-physical address.
+   *
+   * \param      addr    Guest-physical address.
+   * \param[out] region  Region of the device.
+   *
+   * \return The device or nullptr if there is none at `addr`.
+   */
+  cxx::Ref_ptr<Vmm::Mmio_device> find_device(Guest_addr addr,
+                                             Region *region) const;
+
+  Grace_period &grace_period()
+  { return _grace_period; }
+
+private:
+  mutable Rw_lock _lock;
+  Grace_period _grace_period;
 };
 
 } // namespace
@@ -6,17 +6,29 @@
  * License, version 2.  Please see the COPYING-GPL-2 file for details.
  */
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 #include <l4/cxx/minmax>
 #include <l4/re/env>
 #include <l4/re/error_helper>
+#include <l4/re/mem_alloc>
+#include <l4/re/util/cap_alloc>
+#include <l4/re/util/env_ns>
 #include <l4/sys/cache.h>
 #include <l4/l4re_vfs/backend>
+#include <pthread-l4.h>
 
 #include "debug.h"
 #include "vm_memmap.h"
 #include "vm_ram.h"
 #include "device_factory.h"
 
+static Dbg warn(Dbg::Core, Dbg::Warn, "ram");
+static Dbg info(Dbg::Core, Dbg::Info, "ram");
+static Dbg trace(Dbg::Core, Dbg::Trace, "ram");
+
 namespace {
 
 class Auto_fd
@@ -38,11 +50,86 @@ private:
   int _fd;
 };
 
+/**
+ * Copies the contents of a RAM region from a dataspace on first access.
+ *
+ * The region is filled in superpage-sized chunks. Once all chunks are
+ * filled, the hook returns immediately.
+ */
+class Lazy_fill : public Vmm::Ram_access_hook
+{
+  enum : unsigned long
+  {
+    Chunk_shift = L4_SUPERPAGESHIFT,
+    Bits_per_word = sizeof(l4_umword_t) * 8,
+  };
+
+public:
+  Lazy_fill(L4::Cap<L4Re::Dataspace> src, l4_addr_t src_offset,
+            L4::Cap<L4Re::Dataspace> dst, l4_addr_t dst_offset,
+            l4_size_t size)
+  : _src(src), _dst(dst), _src_offset(src_offset), _dst_offset(dst_offset),
+    _size(size),
+    _missing((size + (1UL << Chunk_shift) - 1) >> Chunk_shift),
+    _filled((_missing + Bits_per_word - 1) / Bits_per_word)
+  {}
+
+  void prepare_access(l4_addr_t offset, l4_size_t size) override
+  {
+    if (__atomic_load_n(&_missing, __ATOMIC_ACQUIRE) == 0)
+      return;
+
+    if (!size)
+      size = 1;
+
+    unsigned long last =
+      cxx::min<l4_addr_t>(offset + size - 1, _size - 1) >> Chunk_shift;
+    for (unsigned long c = offset >> Chunk_shift; c <= last; ++c)
+      if (!is_filled(c))
+        fill(c);
+  }
+
+private:
+  bool is_filled(unsigned long chunk) const
+  {
+    return __atomic_load_n(&_filled[chunk / Bits_per_word], __ATOMIC_ACQUIRE)
+           & (1UL << (chunk % Bits_per_word));
+  }
+
+  void fill(unsigned long chunk)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (is_filled(chunk))
+      return;
+
+    l4_addr_t offs = chunk << Chunk_shift;
+    l4_size_t n = cxx::min<l4_size_t>(1UL << Chunk_shift, _size - offs);
+
+    trace.printf("fill: chunk %lu (0x%zx bytes)\n", chunk, n);
+    L4Re::chksys(_dst->copy_in(_dst_offset + offs, _src, _src_offset + offs, n),
+                 "Restoring guest RAM.");
+
+    __atomic_or_fetch(&_filled[chunk / Bits_per_word],
+                      1UL << (chunk % Bits_per_word), __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&_missing, 1, __ATOMIC_RELEASE);
+  }
+
+  L4::Cap<L4Re::Dataspace> _src;
+  L4::Cap<L4Re::Dataspace> _dst;
+  l4_addr_t _src_offset;
+  l4_addr_t _dst_offset;
+  l4_size_t _size;
+  /// Number of chunks not filled yet.
+  unsigned long _missing;
+  /// Bitmap of the filled chunks.
+  std::vector<l4_umword_t> _filled;
+  std::mutex _lock;
+};
+
 }
 
-static Dbg warn(Dbg::Core, Dbg::Warn, "ram");
-static Dbg info(Dbg::Core, Dbg::Info, "ram");
-static Dbg trace(Dbg::Core, Dbg::Trace, "ram");
+__thread Vmm::Vm_ram::Lookup_cache Vmm::Vm_ram::_last_hit;
 
 bool
 Vmm::Ram_free_list::reserve_fixed(Vmm::Guest_addr start, l4_size_t size)
@@ -140,16 +227,507 @@ Vmm::Vm_ram::add_memory_region(L4::Cap<L4Re::Dataspace> ds, Vmm::Guest_addr base
 {
   Ram_ds r(ds, size, ds_offset);
 
-  if (r.setup(baseaddr) < 0)
+  if (r.setup(baseaddr, _populate == Populate::Eager) < 0)
     return -1;
 
-  auto dsdev = Vdev::make_device<Ds_handler>(ds, r.local_start(), r.size(),
-                                             ds_offset);
-  memmap->add_mmio_device(Region::ss(r.vm_start(), r.size()), std::move(dsdev));
+  try
+    {
+      auto dsdev = Vdev::make_device<Ds_handler>(ds, r.local_start(),
+                                                 r.size(), ds_offset);
+      dsdev->set_map_eager(_populate == Populate::Eager);
+      dsdev->set_prefault_window(_prefault_shift);
+
+      std::lock_guard<Rw_lock> lock(_lock);
+      // Nothing may fail once the region is in the memory map.
+      _regions.reserve(_regions.size() + 1);
+      _handlers.reserve(_regions.size() + 1);
+      _sorted.reserve(_regions.size() + 1);
+      memmap->add_mmio_device(Region::ss(r.vm_start(), r.size()), dsdev);
+
+      _regions.push_back(std::move(r));
+      _handlers.push_back(dsdev);
+      sort_regions();
+
+      return _regions.size() - 1;
+    }
+  catch (...)
+    {
+      r.detach();
+      throw;
+    }
+}
+
+void
+Vmm::Vm_ram::load_file(L4::Cap<L4Re::Dataspace> const &file,
+                       Vmm::Guest_addr addr, l4_size_t sz) const
+{
+  info.printf("load: @ 0x%lx\n", addr.get());
+  if (!file)
+    L4Re::chksys(-L4_EINVAL);
 
-  _regions.push_back(std::move(r));
+  copy_from_ds(file, 0, addr, sz);
+}
+
+void
+Vmm::Vm_ram::copy_from_ds(L4::Cap<L4Re::Dataspace> ds, l4_addr_t offset,
+                          Vmm::Guest_addr gp_addr, l4_size_t size) const
+{
+  if (!is_ram(gp_addr, size))
+    {
+      Err().printf("Data does not fit into RAM. "
+                   "(Copying to [0x%lx - 0x%lx])\n",
+                   gp_addr.get(), gp_addr.get() + size);
+      L4Re::chksys(-L4_EINVAL,
+                   "Target address outside RAM while copying data to guest.");
+    }
+
+  while (size)
+    {
+      Rw_lock::Shared_guard lock(_lock);
+      auto *r = lookup(gp_addr);
+      if (!r)
+        L4Re::chksys(-L4_ERANGE, "Guest RAM removed while copying data.");
+
+      l4_addr_t roffs = gp_addr - r->vm_start();
+      l4_size_t n = cxx::min<l4_size_t>(size, r->size() - roffs);
+
+      trace.printf("copy in: to 0x%lx-0x%lx\n",
+                   gp_addr.get(), gp_addr.get() + n);
+
+      host_access(r, gp_addr, n);
+
+      L4Re::chksys(r->ds()->copy_in(r->ds_offset() + roffs, ds, offset, n),
+                   "Copying from dataspace into guest RAM.");
+
+      gp_addr = gp_addr + n;
+      offset += n;
+      size -= n;
+    }
+}
+
+void
+Vmm::Vm_ram::copy_to_ds(L4::Cap<L4Re::Dataspace> ds, l4_addr_t offset,
+                        Vmm::Guest_addr gp_addr, l4_size_t size) const
+{
+  if (!is_ram(gp_addr, size))
+    L4Re::chksys(-L4_EINVAL,
+                 "Source address outside RAM while copying data from guest.");
+
+  while (size)
+    {
+      Rw_lock::Shared_guard lock(_lock);
+      auto *r = lookup(gp_addr);
+      if (!r)
+        L4Re::chksys(-L4_ERANGE, "Guest RAM removed while copying data.");
+
+      l4_addr_t roffs = gp_addr - r->vm_start();
+      l4_size_t n = cxx::min<l4_size_t>(size, r->size() - roffs);
+
+      trace.printf("copy out: from 0x%lx-0x%lx\n",
+                   gp_addr.get(), gp_addr.get() + n);
+
+      // Copying must not unshare copy-on-write pages or dirty the range.
+      if (r->access_hook())
+        r->access_hook()->copy_out(ds, offset, r->ds(), r->ds_offset(),
+                                   roffs, n);
+      else
+        L4Re::chksys(ds->copy_in(offset, r->ds(), r->ds_offset() + roffs, n),
+                     "Copying guest RAM into dataspace.");
+
+      gp_addr = gp_addr + n;
+      offset += n;
+      size -= n;
+    }
+}
+
+void
+Vmm::Vm_ram::restore_region(L4::Cap<L4Re::Dataspace> ds, l4_addr_t offset,
+                            Vmm::Guest_addr start, l4_size_t size,
+                            Vm_mem *memmap, bool shared)
+{
+  long ridx = -1;
+  for (unsigned i = 0; i < _regions.size(); ++i)
+    {
+      auto const &r = _regions[i];
+      if (r.vm_start() == start && r.size() == size)
+        ridx = i;
+      else if (start < r.vm_start() + r.size() && r.vm_start() < start + size)
+        L4Re::chksys(-L4_EINVAL, "RAM configuration does not match snapshot.");
+    }
+
+  if (ridx < 0)
+    {
+      // Memory that is not part of the configured RAM, for example a ram
+      // disk that was mapped copy-on-write into the original VM.
+      auto extra = L4Re::chkcap(L4Re::Util::make_unique_del_cap<L4Re::Dataspace>(),
+                                "Allocate capability for restored RAM.");
+      L4Re::chksys(L4Re::Env::env()->mem_alloc()->alloc(size, extra.get()),
+                   "Allocate memory for restored RAM.");
+
+      ridx = add_memory_region(extra.get(), start, 0, size, memmap);
+      if (ridx < 0)
+        L4Re::chksys(-L4_ENOMEM, "Setting up restored RAM region.");
+
+      _extra_ds.push_back(cxx::move(extra));
+    }
+
+  info.printf("restore: [0x%lx-0x%lx] %s\n",
+              start.get(), start.get() + size - 1,
+              shared ? "copy-on-write" : "on demand");
+
+  auto &r = _regions[ridx];
+  if (r.access_hook())
+    {
+      // Copy-on-write regions cannot be filled on demand.
+      copy_from_ds(ds, offset, start, size);
+      return;
+    }
+
+  if (shared)
+    {
+      // The RAM dataspace of the region becomes the private store of the
+      // copy-on-write region. The caller keeps `ds` alive.
+      auto dsdev = Vdev::make_device<Cow_ds_handler>(ds, offset, size,
+                                                     r.local_start(), size);
+      auto it = memmap->find(Region::ss(start, size));
+      if (it == memmap->end() || it->second.get() != _handlers[ridx].get())
+        L4Re::chksys(-L4_EINVAL, "RAM region not found in memory map.");
+      memmap->erase(it);
+      memmap->add_mmio_device(Region::ss(start, size), dsdev);
+
+      r.set_access_hook(dsdev.get());
+      _handlers[ridx] = nullptr;
+      return;
+    }
+
+  auto *fill = new Lazy_fill(ds, offset, r.ds(), r.ds_offset(), size);
+  _fills.emplace_back(fill);
+  r.set_access_hook(fill);
+  _handlers[ridx]->set_access_hook(fill);
+}
+
+void
+Vmm::Vm_ram::plug(L4::Cap<L4::Task> vm_task, L4::Cap<L4Re::Dataspace> ds,
+                  Vmm::Guest_addr start, l4_size_t size, Vm_mem *memmap)
+{
+  {
+    std::lock_guard<Rw_lock> lock(_lock);
+    reclaim(memmap);
+  }
+
+  long idx = add_memory_region(ds, start, 0, size, memmap);
+  if (idx < 0)
+    L4Re::chksys(-L4_ENOMEM, "Setting up hot-plugged RAM region.");
+
+  try
+    {
+      Rw_lock::Shared_guard lock(_lock);
+      for (auto *l : _listeners)
+        l->ram_added(_regions[idx]);
+    }
+  catch (...)
+    {
+      // Listeners informed before keep the dataspace until they drop it.
+      // The caller frees it, but the guest does not know the region yet.
+      remove_region(vm_task, start, size, memmap, nullptr, true);
+      throw;
+    }
+
+  info.printf("plug: [0x%lx-0x%lx]\n", start.get(), start.get() + size - 1);
+}
+
+long
+Vmm::Vm_ram::unplug(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr start,
+                    l4_size_t size, Vm_mem *memmap,
+                    L4Re::Util::Unique_del_cap<L4Re::Dataspace> *ds,
+                    bool force)
+{
+  return remove_region(vm_task, start, size, memmap, ds, force);
+}
+
+bool
+Vmm::Vm_ram::ram_in_use(Vmm::Guest_addr start, l4_size_t size) const
+{
+  Rw_lock::Shared_guard lock(_lock);
+  for (auto const &r : _regions)
+    if (r.vm_start() == start && r.size() == size)
+      return in_use(r);
+
+  return false;
+}
 
-  return _regions.size() - 1;
+bool
+Vmm::Vm_ram::in_use(Ram_ds const &r) const
+{
+  Region region = Region::ss(r.vm_start(), r.size());
+  for (auto const &p : _pins)
+    if (!(p < region) && !(region < p))
+      return true;
+
+  for (auto *l : _listeners)
+    if (l->ram_in_use(r))
+      return true;
+
+  return false;
+}
+
+void
+Vmm::Vm_ram::ram_written(Ram_ds const &r, std::vector<Region> *ranges) const
+{
+  Region region = Region::ss(r.vm_start(), r.size());
+  for (auto const &p : _pins)
+    ranges->push_back(p);
+
+  for (auto *l : _listeners)
+    l->ram_written(r, ranges);
+
+  // Drop what lies outside the region and clip the rest.
+  auto it = std::remove_if(ranges->begin(), ranges->end(),
+                           [&region](Region const &w)
+                             { return w < region || region < w; });
+  ranges->erase(it, ranges->end());
+  for (auto &w : *ranges)
+    {
+      if (w.start < region.start)
+        w.start = region.start;
+      if (region.end < w.end)
+        w.end = region.end;
+    }
+}
+
+long
+Vmm::Vm_ram::remove_region(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr start,
+                           l4_size_t size, Vm_mem *memmap,
+                           L4Re::Util::Unique_del_cap<L4Re::Dataspace> *ds,
+                           bool force)
+{
+  std::lock_guard<Rw_lock> lock(_lock);
+  for (unsigned i = 0; i < _regions.size(); ++i)
+    {
+      auto &r = _regions[i];
+      if (r.vm_start() != start || r.size() != size || !_handlers[i])
+        continue;
+
+      if (!force && in_use(r))
+        return -L4_EBUSY;
+
+      memmap->remove_mmio_device(Region::ss(start, size), _handlers[i].get());
+      _handlers[i]->remove();
+      Mmio_device::unmap_guest_range(vm_task, start, size, L4_FPAGE_RWX);
+
+      // vCPUs may still access the region through the handler, the dirty
+      // log or pointers they got from the region list before.
+      std::unique_ptr<Dirty_log> log;
+      if (i < _dirty_logs.size())
+        log = std::move(_dirty_logs[i]);
+      L4Re::Util::Unique_del_cap<L4Re::Dataspace> owned;
+      if (ds)
+        owned = cxx::move(*ds);
+      _retired.push_back(Retired_region{std::move(r), std::move(_handlers[i]),
+                                        std::move(log), cxx::move(owned),
+                                        vm_task,
+                                        memmap->grace_period().retire()});
+
+      _regions.erase(_regions.begin() + i);
+      _handlers.erase(_handlers.begin() + i);
+      if (i < _dirty_logs.size())
+        _dirty_logs.erase(_dirty_logs.begin() + i);
+      sort_regions();
+
+      reclaim(memmap);
+
+      info.printf("unplug: [0x%lx-0x%lx]\n",
+                  start.get(), start.get() + size - 1);
+      return L4_EOK;
+    }
+
+  return -L4_ENOENT;
+}
+
+void
+Vmm::Vm_ram::reclaim(Vm_mem *memmap)
+{
+  auto &gp = memmap->grace_period();
+  for (auto it = _retired.begin(); it != _retired.end();)
+    {
+      if (!gp.expired(it->token))
+        {
+          ++it;
+          continue;
+        }
+
+      // A vCPU may have mapped the region again before it saw the removal.
+      Mmio_device::unmap_guest_range(it->vm_task, it->region.vm_start(),
+                                     it->region.size(), L4_FPAGE_RWX);
+      it->region.detach();
+      it = _retired.erase(it);
+    }
+}
+
+long
+Vmm::Vm_ram::release(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr addr,
+                     l4_size_t size)
+{
+  if ((addr.get() | size) & ~L4_PAGEMASK)
+    return -L4_EINVAL;
+
+  Rw_lock::Shared_guard lock(_lock);
+  auto const *r = find_region(addr, size);
+  if (!r)
+    return -L4_ERANGE;
+
+  // Copy-on-write regions share their pages with other VMs.
+  if (!_handlers[r - _regions.data()])
+    return -L4_EINVAL;
+
+  trace.printf("release [0x%lx-0x%lx]\n", addr.get(), addr.get() + size - 1);
+
+  Mmio_device::unmap_guest_range(vm_task, addr, size, L4_FPAGE_RWX);
+  return r->ds()->clear(r->ds_offset() + (addr - r->vm_start()), size);
+}
+
+void
+Vmm::Vm_ram::start_dirty_log(L4::Cap<L4::Task> vm_task)
+{
+  std::lock_guard<Rw_lock> lock(_lock);
+  _dirty_logs.resize(_regions.size());
+  for (unsigned i = 0; i < _regions.size(); ++i)
+    {
+      // Copy-on-write regions have no handler that could log writes.
+      if (!_handlers[i] || _dirty_logs[i])
+        continue;
+
+      auto &r = _regions[i];
+      _dirty_logs[i].reset(new Dirty_log(vm_task, r.vm_start(), r.size(),
+                                         r.access_hook()));
+      r.set_access_hook(_dirty_logs[i].get());
+      _handlers[i]->set_dirty_log(_dirty_logs[i].get());
+    }
+
+  for (auto const &log : _dirty_logs)
+    if (log)
+      log->start();
+
+  _dirty_log_active = true;
+  info.printf("Dirty logging started.\n");
+}
+
+void
+Vmm::Vm_ram::stop_dirty_log()
+{
+  Rw_lock::Shared_guard lock(_lock);
+  for (auto const &log : _dirty_logs)
+    if (log)
+      log->stop();
+
+  _dirty_log_active = false;
+  info.printf("Dirty logging stopped.\n");
+}
+
+void
+Vmm::Vm_ram::refine_dirty_log(Vmm::Guest_addr addr, l4_size_t size)
+{
+  Rw_lock::Shared_guard lock(_lock);
+  for (unsigned i = 0; i < _dirty_logs.size(); ++i)
+    {
+      auto const &r = _regions[i];
+      if (!_dirty_logs[i] || addr >= r.vm_start() + r.size()
+          || r.vm_start() >= addr + size)
+        continue;
+
+      Vmm::Guest_addr s = cxx::max(addr, r.vm_start());
+      Vmm::Guest_addr e = cxx::min(addr + size, r.vm_start() + r.size());
+      _dirty_logs[i]->refine(s - r.vm_start(), e - s);
+    }
+}
+
+void
+Vmm::Vm_ram::populate(L4::Cap<L4::Task> vm_task)
+{
+  if (_populate != Populate::Parallel)
+    return;
+
+  // Work is handed out in chunks, so that threads finishing early help
+  // with larger regions. Chunks are superpage aligned to keep the
+  // mappings large.
+  enum : l4_size_t { Chunk_size = 64UL << 20 };
+
+  struct Chunk
+  {
+    unsigned region;
+    l4_addr_t offset;
+    l4_size_t size;
+  };
+
+  std::vector<Chunk> chunks;
+  for (unsigned i = 0; i < _regions.size(); ++i)
+    if (_handlers[i])
+      for (l4_addr_t offs = 0; offs < _regions[i].size(); offs += Chunk_size)
+        chunks.push_back(Chunk{i, offs,
+                               cxx::min<l4_size_t>(Chunk_size,
+                                                   _regions[i].size() - offs)});
+
+  std::atomic<unsigned> next(0);
+  std::atomic<long> error(L4_EOK);
+  auto worker = [&]()
+    {
+      for (unsigned c = next++; c < chunks.size(); c = next++)
+        {
+          auto const &ch = chunks[c];
+          long res = _handlers[ch.region]->map_part(
+                       vm_task, _regions[ch.region].vm_start() + ch.offset,
+                       ch.offset, ch.size);
+          if (res < 0)
+            error = res;
+        }
+    };
+
+  // One thread for each online physical CPU. The main thread is one of
+  // them and stays where it is.
+  l4_umword_t max_cpus;
+  l4_sched_cpu_set_t cs = l4_sched_cpu_set(0, 0);
+  auto sched = L4Re::Env::env()->scheduler();
+  if (l4_error(sched->info(&max_cpus, &cs)) < 0)
+    cs.map = 1;
+
+  std::vector<std::thread> threads;
+  l4_umword_t cpus = cs.map & (cs.map - 1); // all but the first CPU
+  while (cpus && threads.size() + 1 < chunks.size())
+    {
+      unsigned cpu = __builtin_ctzl(cpus);
+      cpus &= cpus - 1;
+
+      threads.emplace_back(worker);
+
+      l4_sched_param_t sp = l4_sched_param(2);
+      sp.affinity = l4_sched_cpu_set(cpu, 0);
+      sched->run_thread(Pthread::L4::cap(threads.back().native_handle()), sp);
+    }
+
+  info.printf("Populating RAM with %zu threads\n", threads.size() + 1);
+
+  // The main thread takes part as well.
+  worker();
+
+  for (auto &t : threads)
+    t.join();
+
+  L4Re::chksys(error.load(), "Populating guest RAM.");
+}
+
+void
+Vmm::Vm_ram::sort_regions()
+{
+  // Adding a region may move the existing ones, so rebuild the index.
+  _sorted.clear();
+  for (auto const &r : _regions)
+    _sorted.push_back(&r);
+
+  std::sort(_sorted.begin(), _sorted.end(),
+            [](Ram_ds const *a, Ram_ds const *b)
+              { return a->vm_start() < b->vm_start(); });
+
+  ++_generation;
 }
 
 
@@ -336,18 +914,76 @@ Vmm::Vm_ram::setup_default_region(Vdev::Host_dt const &dt, Vm_mem *memmap,
   if (ridx < 0)
     L4Re::chksys(-L4_ENOMEM, "Setting up RAM region.");
 
-  if (dt.valid())
-    {
-      auto const &r = _regions[ridx];
-      // "memory@" + 64bit hex address + '\0'
-      char buf[7 + 16 + 1];
-      std::snprintf(buf, sizeof(buf), "memory@%lx", r.vm_start().get());
+  add_memory_node(dt, _regions[ridx]);
+}
 
-      auto node = dt.get().first_node().add_subnode(buf);
-      node.setprop_string("device_type", "memory");
-      node.set_reg_val(r.vm_start().get(), r.size());
+void
+Vmm::Vm_ram::add_memory_node(Vdev::Host_dt const &dt, Ram_ds const &r)
+{
+  if (!dt.valid())
+    return;
 
-      if (r.has_phys_addr())
-        r.dt_append_dmaprop(node);
-    }
+  // "memory@" + 64bit hex address + '\0'
+  char buf[7 + 16 + 1];
+  std::snprintf(buf, sizeof(buf), "memory@%lx", r.vm_start().get());
+
+  auto node = dt.get().first_node().add_subnode(buf);
+  node.setprop_string("device_type", "memory");
+  node.set_reg_val(r.vm_start().get(), r.size());
+
+  if (r.has_phys_addr())
+    r.dt_append_dmaprop(node);
+}
+
+void
+Vmm::Vm_ram::map_file_cow(char const *name, Vm_mem *memmap,
+                          Vdev::Host_dt const &dt, Vmm::Guest_addr *start,
+                          l4_size_t *size)
+{
+  L4Re::Util::Unique_cap<L4Re::Dataspace>
+    rom(L4Re::chkcap(L4Re::Util::Env_ns().query<L4Re::Dataspace>(name),
+                     "Find file dataspace for copy-on-write mapping."));
+
+  l4_size_t rom_size = rom->size();
+  l4_size_t region_size = l4_round_size(rom_size, L4_SUPERPAGESHIFT);
+
+  // Place the region behind all RAM and all device regions that follow it.
+  Vmm::Guest_addr addr(0);
+  for (auto const &r : _regions)
+    if (r.vm_start() + r.size() > addr)
+      addr = r.vm_start() + r.size();
+
+  addr = Vmm::Guest_addr(l4_round_size(addr.get(), L4_SUPERPAGESHIFT));
+  for (auto it = memmap->find(Region::ss(addr, region_size));
+       it != memmap->end();
+       it = memmap->find(Region::ss(addr, region_size)))
+    addr = Vmm::Guest_addr(l4_round_size(it->first.end.get() + 1,
+                                         L4_SUPERPAGESHIFT));
+
+  auto priv = L4Re::Util::make_unique_cap<L4Re::Dataspace>();
+  L4Re::chkcap(priv, "Allocate capability for copy-on-write dataspace.");
+  L4Re::chksys(L4Re::Env::env()->mem_alloc()->alloc(region_size, priv.get()),
+               "Allocate private memory of copy-on-write region.");
+
+  Ram_ds r(priv.get(), region_size, 0);
+  L4Re::chksys(r.setup(addr, false), "Setting up copy-on-write region.");
+
+  auto dsdev = Vdev::make_device<Cow_ds_handler>(rom.get(), 0, rom_size,
+                                                 r.local_start(), r.size());
+  r.set_access_hook(dsdev.get());
+  memmap->add_mmio_device(Region::ss(r.vm_start(), r.size()), dsdev);
+
+  add_memory_node(dt, r);
+
+  info.printf("map: %s -> 0x%lx (copy-on-write)\n", name, addr.get());
+
+  std::lock_guard<Rw_lock> lock(_lock);
+  _regions.push_back(std::move(r));
+  _handlers.push_back(nullptr);
+  _cow_ds.push_back(cxx::move(rom));
+  _cow_ds.push_back(cxx::move(priv));
+  sort_regions();
+
+  *start = addr;
+  *size = rom_size;
 }
@@ -15,16 +15,24 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <l4/l4virtio/virtqueue>
+#include <l4/re/util/unique_cap>
 
 #include "device.h"
+#include "dirty_log.h"
+#include "ds_cow_mapper.h"
 #include "ds_mmio_mapper.h"
 #include "host_dt.h"
 #include "mem_types.h"
 #include "ram_ds.h"
+#include "rw_lock.h"
 #include "vm_memmap.h"
 
 class Vm_mem;
@@ -59,16 +67,184 @@ private:
   std::vector<Region> _freelist;
 };
 
+/**
+ * A piece of guest RAM that is contiguous in the VMM address space.
+ */
+struct Host_span
+{
+  char *addr;
+  l4_size_t size;
+};
+
+/**
+ * Scatter list of a guest buffer that spans several RAM regions.
+ *
+ * The spans are in the order of the guest-physical addresses they map.
+ */
+struct Host_iovec
+{
+  enum { Max_spans = 4 };
+
+  Host_span span[Max_spans];
+  unsigned num = 0;
+  /// Total size of all spans.
+  l4_size_t size = 0;
+
+  /**
+   * Copy data into the buffer.
+   *
+   * \param offset  Offset into the buffer where to start copying.
+   * \param src     Data to copy.
+   * \param len     Number of bytes to copy.
+   *
+   * \return Number of bytes copied, which is less than `len` when the end
+   *         of the buffer is reached.
+   */
+  l4_size_t copy_in(l4_size_t offset, void const *src, l4_size_t len) const
+  {
+    auto const *s = static_cast<char const *>(src);
+    l4_size_t done = 0;
+
+    for (unsigned i = 0; i < num && done < len; ++i)
+      {
+        if (offset >= span[i].size)
+          {
+            offset -= span[i].size;
+            continue;
+          }
+
+        l4_size_t n = span[i].size - offset;
+        if (n > len - done)
+          n = len - done;
+
+        memcpy(span[i].addr + offset, s + done, n);
+        done += n;
+        offset = 0;
+      }
+
+    return done;
+  }
+
+  /**
+   * Copy data out of the buffer.
+   *
+   * \param dst     Destination of the copy.
+   * \param offset  Offset into the buffer where to start copying.
+   * \param len     Number of bytes to copy.
+   *
+   * \return Number of bytes copied, which is less than `len` when the end
+   *         of the buffer is reached.
+   */
+  l4_size_t copy_out(void *dst, l4_size_t offset, l4_size_t len) const
+  {
+    auto *d = static_cast<char *>(dst);
+    l4_size_t done = 0;
+
+    for (unsigned i = 0; i < num && done < len; ++i)
+      {
+        if (offset >= span[i].size)
+          {
+            offset -= span[i].size;
+            continue;
+          }
+
+        l4_size_t n = span[i].size - offset;
+        if (n > len - done)
+          n = len - done;
+
+        memcpy(d + done, span[i].addr + offset, n);
+        done += n;
+        offset = 0;
+      }
+
+    return done;
+  }
+};
+
+/**
+ * Interface for devices that share guest RAM with third parties or keep
+ * pointers into it.
+ */
+struct Ram_listener
+{
+  /// Called after a RAM region has been added while the VM is running.
+  virtual void ram_added(Ram_ds const &) {}
+
+  /**
+   * Check whether the listener still uses a RAM region.
+   *
+   * RAM in use is not removed while the VM is running.
+   */
+  virtual bool ram_in_use(Ram_ds const &) { return false; }
+
+  /**
+   * Report the parts of a RAM region the listener may write to without
+   * translating their address again.
+   *
+   * Called with the RAM region and the list of guest-physical ranges to
+   * append to. The ranges are reported dirty in every round of dirty logging.
+   */
+  virtual void ram_written(Ram_ds const &, std::vector<Region> *) {}
+};
+
 /**
  * The memory device which manages the RAM available to the guest.
+ *
+ * Translations from guest-physical to VMM-virtual addresses are done with a
+ * binary search over the RAM regions sorted by their guest-physical start
+ * address. The region found last is cached per thread, so that consecutive
+ * lookups of a device or vCPU usually hit the same region without a search.
+ *
+ * RAM may be added and removed while the VM runs. Lookups hold the region
+ * list shared, changes of the list hold it exclusively. Removed RAM stays
+ * attached to the VMM until the vCPUs that may still use pointers into it
+ * handled their exits, see Vm_mem::grace_period().
  */
 class Vm_ram : public Vdev::Device
 {
 public:
+  /**
+   * How the guest RAM is mapped into the guest before it starts.
+   */
+  enum class Populate
+  {
+    /// Map all RAM from the main thread (default).
+    Eager,
+    /// Map all RAM from worker threads, one for each physical CPU.
+    Parallel,
+    /// Map RAM when the guest first accesses it.
+    Lazy,
+  };
+
   Vm_ram(l4_addr_t boot_offset)
   : _boot_offset(boot_offset)
   {}
 
+  /**
+   * Configure how RAM is populated.
+   *
+   * \param mode            Population strategy.
+   * \param prefault_shift  log2 of the area mapped on a guest fault,
+   *                        0 to map the largest possible page only.
+   *
+   * Must be called before the RAM is set up.
+   */
+  void set_populate(Populate mode, unsigned char prefault_shift)
+  {
+    _populate = mode;
+    _prefault_shift = prefault_shift;
+  }
+
+  /**
+   * Map the guest RAM according to the population strategy.
+   *
+   * \param vm_task  Guest task to map the RAM to.
+   *
+   * Only does work in `Populate::Parallel` mode. Eagerly populated RAM is
+   * mapped by Generic_guest::map_eager(), lazily populated RAM on demand.
+   */
+  void populate(L4::Cap<L4::Task> vm_task);
+
   /**
    * Load the contents of the given dataspace into guest RAM.
    *
@@ -77,23 +253,23 @@ public:
    * \param sz    Number of bytes to copy.
    */
   void load_file(L4::Cap<L4Re::Dataspace> const &file,
-                 Vmm::Guest_addr addr, l4_size_t sz) const
-  {
-    auto *r = find_region(addr, 0);
-    assert(r);
-
-    r->load_file(file, addr, sz);
-  }
+                 Vmm::Guest_addr addr, l4_size_t sz) const;
 
   /**
    * Get a VMM-virtual pointer from a guest-physical address.
+   *
+   * An exception is thrown if the address is not in RAM. Use the variant
+   * taking a Region to check the size of the accessed object as well.
    */
   template <typename T>
-  T guest2host(Vmm::Guest_addr p) const noexcept
+  T guest2host(Vmm::Guest_addr p) const
   {
+    Rw_lock::Shared_guard lock(_lock);
     auto *r = find_region(p, 0);
-    assert(r);
+    if (!r)
+      L4Re::chksys(-L4_ERANGE, "Guest address outside RAM region");
 
+    host_access(r, p, 0);
     return reinterpret_cast<T>(r->guest2host(p));
   }
 
@@ -106,11 +282,158 @@ public:
   template <typename T>
   T guest2host(Region region) const
   {
-    auto *r = find_region(region.start, region.end - region.start + 1);
+    l4_size_t size = region.end - region.start + 1;
+    Host_span span = host_span(region.start, size);
+    if (span.size < size)
+      L4Re::chksys(-L4_ERANGE, "Guest address outside RAM region");
+
+    return reinterpret_cast<T>(span.addr);
+  }
+
+  /**
+   * Translate the beginning of a guest-physical range into VMM-virtual memory.
+   *
+   * \param addr  Guest-physical start address of the range.
+   * \param size  Size of the range in bytes.
+   *
+   * \return The part of the range starting at `addr` that is contiguous in
+   *         the VMM. It is shorter than `size` if the range continues beyond
+   *         the end of the RAM region containing `addr`.
+   *
+   * An exception is thrown if `addr` is not in RAM.
+   */
+  Host_span host_span(Vmm::Guest_addr addr, l4_size_t size) const
+  {
+    Rw_lock::Shared_guard lock(_lock);
+    auto *r = lookup(addr);
     if (!r)
       L4Re::chksys(-L4_ERANGE, "Guest address outside RAM region");
 
-    return reinterpret_cast<T>(r->guest2host(region.start));
+    l4_size_t avail = r->size() - (addr - r->vm_start());
+    if (size > avail)
+      size = avail;
+
+    host_access(r, addr, size);
+    return Host_span{reinterpret_cast<char *>(r->guest2host(addr)), size};
+  }
+
+  /**
+   * Call `func` with each VMM-virtual span of a guest-physical range.
+   *
+   * The range may span several adjacent RAM regions. It is checked
+   * completely before the first span is handed out, so an exception for
+   * a range that is not fully backed by RAM leaves no partial result.
+   */
+  template <typename FUNC>
+  void foreach_span(Vmm::Guest_addr addr, l4_size_t size, FUNC &&func) const
+  {
+    if (!is_ram(addr, size))
+      L4Re::chksys(-L4_ERANGE, "Guest address outside RAM region");
+
+    while (size)
+      {
+        Host_span span = host_span(addr, size);
+        func(span);
+        addr = addr + span.size;
+        size -= span.size;
+      }
+  }
+
+  /**
+   * Get the scatter list of a guest-physical range.
+   *
+   * \param      addr  Guest-physical start address of the range.
+   * \param      size  Size of the range in bytes.
+   * \param[out] iov   Spans making up the range.
+   *
+   * \retval L4_EOK      Success.
+   * \retval -L4_ERANGE  The range is not completely backed by RAM.
+   * \retval -L4_ENOMEM  The range spans more than Host_iovec::Max_spans
+   *                     RAM regions.
+   */
+  int guest2host_iov(Vmm::Guest_addr addr, l4_size_t size,
+                     Host_iovec *iov) const
+  {
+    Rw_lock::Shared_guard lock(_lock);
+    iov->num = 0;
+    iov->size = size;
+
+    while (size)
+      {
+        if (iov->num == Host_iovec::Max_spans)
+          return -L4_ENOMEM;
+
+        auto *r = lookup(addr);
+        if (!r)
+          return -L4_ERANGE;
+
+        l4_size_t avail = r->size() - (addr - r->vm_start());
+        l4_size_t n = size < avail ? size : avail;
+        host_access(r, addr, n);
+        iov->span[iov->num++] =
+          Host_span{reinterpret_cast<char *>(r->guest2host(addr)), n};
+
+        addr = addr + n;
+        size -= n;
+      }
+
+    return L4_EOK;
+  }
+
+  /**
+   * Copy data into guest RAM.
+   *
+   * The target range may span several adjacent RAM regions. An exception is
+   * thrown if it is not completely backed by RAM.
+   */
+  void copy_to_guest(Vmm::Guest_addr dst, void const *src, l4_size_t size) const
+  {
+    auto const *s = static_cast<char const *>(src);
+    foreach_span(dst, size, [&s](Host_span span)
+      {
+        memcpy(span.addr, s, span.size);
+        s += span.size;
+      });
+  }
+
+  /**
+   * Copy data out of guest RAM.
+   *
+   * The source range may span several adjacent RAM regions. An exception is
+   * thrown if it is not completely backed by RAM.
+   */
+  void copy_from_guest(void *dst, Vmm::Guest_addr src, l4_size_t size) const
+  {
+    auto *d = static_cast<char *>(dst);
+    foreach_span(src, size, [&d](Host_span span)
+      {
+        memcpy(d, span.addr, span.size);
+        d += span.size;
+      });
+  }
+
+  /**
+   * Check whether a guest-physical range is completely backed by RAM.
+   *
+   * The range may span several adjacent RAM regions.
+   */
+  bool is_ram(Vmm::Guest_addr addr, l4_size_t size) const
+  {
+    Rw_lock::Shared_guard lock(_lock);
+    do
+      {
+        auto *r = lookup(addr);
+        if (!r)
+          return false;
+
+        l4_size_t avail = r->size() - (addr - r->vm_start());
+        if (size <= avail)
+          return true;
+
+        addr = addr + avail;
+        size -= avail;
+      }
+    while (true);
   }
 
   /**
@@ -130,6 +453,24 @@ public:
   Ram_free_list setup_from_device_tree(Vdev::Host_dt const &dt, Vm_mem *memmap,
                                        Vmm::Guest_addr default_address);
 
+  /**
+   * Map a file into guest RAM without copying it.
+   *
+   * \param      name    Name of the file. It must be backed by a dataspace.
+   * \param      memmap  Guest memory map where to register the new region.
+   * \param      dt      Device tree to add a memory node for the region to.
+   *                     May be invalid.
+   * \param[out] start   Guest-physical address of the file.
+   * \param[out] size    Size of the file.
+   *
+   * The file is placed in a new RAM region behind all existing RAM that is
+   * backed copy-on-write by the dataspace of the file. Memory is only
+   * allocated for pages the guest writes to.
+   */
+  void map_file_cow(char const *name, Vm_mem *memmap,
+                    Vdev::Host_dt const &dt, Vmm::Guest_addr *start,
+                    l4_size_t *size);
+
   /**
    * Move the device tree into guest RAM.
    *
@@ -157,39 +498,305 @@ public:
     return Vmm::Guest_addr(p - _boot_offset);
   }
 
+  /**
+   * Copy the contents of a dataspace into guest RAM.
+   *
+   * \param ds       Dataspace to copy from.
+   * \param offset   Offset into `ds` where to start copying.
+   * \param gp_addr  Guest-physical target address.
+   * \param size     Number of bytes to copy.
+   *
+   * The target range may span several adjacent RAM regions. The data is
+   * copied by the dataspace manager, so no copy is made in the VMM.
+   */
   void copy_from_ds(L4::Cap<L4Re::Dataspace> ds, l4_addr_t offset,
-                    Vmm::Guest_addr gp_addr, l4_size_t size) const
+                    Vmm::Guest_addr gp_addr, l4_size_t size) const;
+
+  /**
+   * Copy guest RAM into a dataspace.
+   *
+   * \param ds       Dataspace to copy to.
+   * \param offset   Offset into `ds` where to start copying.
+   * \param gp_addr  Guest-physical source address.
+   * \param size     Number of bytes to copy.
+   *
+   * The source range may span several adjacent RAM regions. As with
+   * copy_from_ds(), the data is copied by the dataspace manager.
+   */
+  void copy_to_ds(L4::Cap<L4Re::Dataspace> ds, l4_addr_t offset,
+                  Vmm::Guest_addr gp_addr, l4_size_t size) const;
+
+  /**
+   * Fill a RAM region from a dataspace on demand.
+   *
+   * \param ds      Dataspace with the contents of the region.
+   * \param offset  Page-aligned offset of the contents in `ds`.
+   * \param start   Guest-physical start address of the region.
+   * \param size    Size of the region.
+   * \param memmap  Guest memory map of the region.
+   * \param shared  Map the contents copy-on-write instead of copying them.
+   *
+   * The contents are copied in superpage-sized chunks when the guest or
+   * the VMM accesses them for the first time. With `shared`, `ds` is
+   * mapped read-only into the guest instead and a page is only copied
+   * into the RAM dataspace of the region when the guest writes to it.
+   * If there is no RAM region at exactly this location, new memory is
+   * allocated for it.
+   */
+  void restore_region(L4::Cap<L4Re::Dataspace> ds, l4_addr_t offset,
+                      Vmm::Guest_addr start, l4_size_t size, Vm_mem *memmap,
+                      bool shared);
+
+  /**
+   * Add RAM to the running VM.
+   *
+   * \param vm_task  Guest task the RAM is mapped to.
+   * \param ds       Dataspace backing the new RAM.
+   * \param start    Guest-physical start address of the RAM.
+   * \param size     Size of the RAM, at most the size of `ds`.
+   * \param memmap   Guest memory map to add the RAM to.
+   *
+   * The RAM is mapped into the guest on demand. All listeners are
+   * informed about the new region. Throws if the RAM overlaps with
+   * other memory of the guest or a listener fails. The RAM is not added
+   * then.
+   */
+  void plug(L4::Cap<L4::Task> vm_task, L4::Cap<L4Re::Dataspace> ds,
+            Vmm::Guest_addr start, l4_size_t size, Vm_mem *memmap);
+
+  /**
+   * Remove RAM added with plug() from the running VM.
+   *
+   * \param vm_task  Guest task the RAM is mapped to.
+   * \param start    Guest-physical start address of the RAM.
+   * \param size     Size of the RAM.
+   * \param memmap   Guest memory map to remove the RAM from.
+   * \param ds       Dataspace backing the RAM. It is taken over on success.
+   * \param force    Remove the RAM even if it is still in use.
+   *
+   * \retval L4_EOK      The RAM is unmapped from the guest.
+   * \retval -L4_ENOENT  There is no such RAM region.
+   * \retval -L4_EBUSY   The RAM is still in use, see ram_in_use().
+   *
+   * vCPUs that looked up the RAM before may still access it. The RAM stays
+   * attached to the VMM and `ds` is kept until they are done, see
+   * Vm_mem::grace_period(). Only with `force`, third parties may keep their
+   * access to the dataspace until they drop it.
+   */
+  long unplug(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr start,
+              l4_size_t size, Vm_mem *memmap,
+              L4Re::Util::Unique_del_cap<L4Re::Dataspace> *ds,
+              bool force = false);
+
+  /**
+   * Check whether RAM added with plug() is still in use by a listener or
+   * pinned by the VMM.
+   *
+   * \param start  Guest-physical start address of the RAM.
+   * \param size   Size of the RAM.
+   */
+  bool ram_in_use(Vmm::Guest_addr start, l4_size_t size) const;
+
+  /**
+   * Keep a range of RAM from being unplugged.
+   *
+   * \param addr  Guest-physical start address of the range.
+   * \param size  Size of the range.
+   *
+   * For pointers into guest RAM that the VMM keeps beyond the handling of
+   * a single exit. The range does not have to be RAM (yet). Ranges are
+   * counted, each pin() must be undone with an unpin() of the same range.
+   * See also Ram_pin.
+   */
+  void pin(Vmm::Guest_addr addr, l4_size_t size) const
   {
-    auto *r = find_region(gp_addr, size);
+    std::lock_guard<Rw_lock> lock(_lock);
+    _pins.push_back(Region::ss(addr, size));
+  }
 
-    // XXX cannot handle copying into consecutive DS at the moment
-    if (!r)
-      L4Re::chksys(-L4_EINVAL, "Target address outside RAM while copying data to guest.");
+  /// Undo pin().
+  void unpin(Vmm::Guest_addr addr, l4_size_t size) const
+  {
+    std::lock_guard<Rw_lock> lock(_lock);
+    Region pin = Region::ss(addr, size);
+    auto it = std::find_if(_pins.begin(), _pins.end(),
+                           [&pin](Region const &r)
+                             { return r.start == pin.start && r.end == pin.end; });
+    assert(it != _pins.end());
+    _pins.erase(it);
+  }
 
-    L4Re::chksys(r->ds()->copy_in(gp_addr.get() - r->vm_start().get(),
-                                  ds, offset, size),
-                 "Copying from dataspace into guest RAM.");
+  void add_listener(Ram_listener *l)
+  {
+    std::lock_guard<Rw_lock> lock(_lock);
+    _listeners.push_back(l);
+  }
+
+  void remove_listener(Ram_listener *l)
+  {
+    std::lock_guard<Rw_lock> lock(_lock);
+    _listeners.erase(std::remove(_listeners.begin(), _listeners.end(), l),
+                     _listeners.end());
   }
 
+  /**
+   * Give the memory backing a range of guest RAM back to its provider.
+   *
+   * \param vm_task  Guest task the RAM is mapped to.
+   * \param addr     Page-aligned guest-physical start address of the range.
+   * \param size     Page-aligned size of the range.
+   *
+   * \retval L4_EOK     The range is unmapped from the guest and cleared.
+   * \retval -L4_EINVAL The range is not page-aligned or in a copy-on-write
+   *                    region.
+   * \retval -L4_ERANGE The range is not within a single RAM region.
+   * \retval <0         Error clearing the dataspace.
+   *
+   * The range is cleared in the RAM dataspace, which allows the provider
+   * to free the memory. When the guest accesses the range again, it is
+   * faulted in as fresh, zeroed memory.
+   */
+  long release(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr addr,
+               l4_size_t size);
+
   template<typename FUNC>
   void foreach_region(FUNC &&func) const
   {
+    Rw_lock::Shared_guard lock(_lock);
     for (auto const &r : _regions)
       func(r);
   }
 
+  /**
+   * Start logging guest writes to RAM.
+   *
+   * \param vm_task  Guest task the RAM is mapped to.
+   *
+   * All regions but copy-on-write ones are logged. Clears the logs of a
+   * previous round.
+   */
+  void start_dirty_log(L4::Cap<L4::Task> vm_task);
+
+  /**
+   * Stop logging guest writes to RAM.
+   */
+  void stop_dirty_log();
+
+  bool dirty_log_active() const
+  { return _dirty_log_active; }
+
+  /**
+   * Log writes to a range of guest RAM with page granularity.
+   *
+   * \param addr  Guest-physical start address of the range.
+   * \param size  Size of the range.
+   */
+  void refine_dirty_log(Vmm::Guest_addr addr, l4_size_t size);
+
+  /**
+   * Fetch and clear the dirty logs of all logged regions.
+   *
+   * \param func  Called as func(region, log, chunks, pages) for every
+   *              logged region with the bitmaps of the dirty chunks and
+   *              the dirty pages, see Dirty_log::fetch_and_clear().
+   *
+   * Pinned RAM and RAM that listeners write through pointers they keep is
+   * always reported dirty, as the VMM writes it behind the log's back.
+   */
+  template<typename FUNC>
+  void fetch_dirty_log(FUNC &&func)
+  {
+    Rw_lock::Shared_guard lock(_lock);
+    std::vector<l4_umword_t> chunks, pages;
+    std::vector<Region> written;
+    for (unsigned i = 0; i < _dirty_logs.size(); ++i)
+      if (_dirty_logs[i])
+        {
+          auto const &r = _regions[i];
+          written.clear();
+          ram_written(r, &written);
+          for (auto const &w : written)
+            _dirty_logs[i]->mark_dirty(w.start - r.vm_start(),
+                                       w.end - w.start + 1);
+
+          _dirty_logs[i]->fetch_and_clear(&chunks, &pages);
+          func(_regions[i], *_dirty_logs[i], chunks, pages);
+        }
+  }
+
 private:
+  /**
+   * Last region found by lookup() in the current thread.
+   *
+   * The cache is only valid for the RAM and the generation of the region
+   * list it was filled for.
+   */
+  struct Lookup_cache
+  {
+    Vm_ram const *ram;
+    unsigned generation;
+    Ram_ds const *region;
+  };
+
+  static __thread Lookup_cache _last_hit;
+
+  /**
+   * Find the region that contains the given guest-physical address.
+   *
+   * Must be called with _lock held.
+   */
+  Ram_ds const *lookup(Vmm::Guest_addr addr) const
+  {
+    Lookup_cache &c = _last_hit;
+    if (c.ram == this && c.generation == _generation
+        && addr >= c.region->vm_start()
+        && addr - c.region->vm_start() < c.region->size())
+      return c.region;
+
+    auto it = std::upper_bound(_sorted.begin(), _sorted.end(), addr,
+                               [](Vmm::Guest_addr a, Ram_ds const *r)
+                                 { return a < r->vm_start(); });
+    if (it == _sorted.begin())
+      return nullptr;
+
+    Ram_ds const *r = *(--it);
+    if (addr - r->vm_start() >= r->size())
+      return nullptr;
+
+    c.ram = this;
+    c.generation = _generation;
+    c.region = r;
+
+    return r;
+  }
+
+  /**
+   * Prepare an access of the VMM to a range of a region.
+   */
+  static void host_access(Ram_ds const *r, Vmm::Guest_addr addr,
+                          l4_size_t size)
+  {
+    if (L4_UNLIKELY(r->access_hook() != nullptr))
+      r->access_hook()->prepare_access(addr - r->vm_start(), size);
+  }
+
+  /// Like lookup(), but the region must contain `size` bytes from `addr`.
   Ram_ds const *find_region(Vmm::Guest_addr addr, l4_size_t size) const
   {
-    for (auto const &r : _regions)
-      {
-        if (addr >= r.vm_start() && addr - r.vm_start() + size <= r.size())
-          return &r;
-      }
+    auto *r = lookup(addr);
+    if (r && addr - r->vm_start() + size <= r->size())
+      return r;
 
     return nullptr;
   }
 
+  /**
+   * Rebuild the lookup index of the regions.
+   *
+   * Must be called with _lock held exclusively.
+   */
+  void sort_regions();
+
   /**
    * Add a new RAM region.
    *
@@ -200,17 +807,140 @@ private:
    * \param memap     Geust memory map where to register the new region.
    *
    * \return Index into _regions of the newly added region.
+   *
+   * Throws if the region cannot be added to the memory map. Nothing is
+   * added then.
    */
   l4_size_t add_memory_region(L4::Cap<L4Re::Dataspace> ds,
                               Vmm::Guest_addr baseaddr, l4_addr_t ds_offset,
                               l4_size_t size, Vm_mem *memmap);
 
+  /**
+   * Check whether a region is used by a listener or pinned.
+   *
+   * Must be called with _lock held.
+   */
+  bool in_use(Ram_ds const &r) const;
+
+  /**
+   * Get the parts of a region that are pinned or that listeners write to,
+   * clipped to the region.
+   *
+   * Must be called with _lock held.
+   */
+  void ram_written(Ram_ds const &r, std::vector<Region> *ranges) const;
+
+  /**
+   * Remove a RAM region from the guest.
+   *
+   * \param ds     Dataspace of the region to take over. May be nullptr if
+   *               the caller keeps it.
+   * \param force  Remove the region even if it is in use.
+   *
+   * \retval L4_EOK      The region is removed.
+   * \retval -L4_ENOENT  There is no such RAM region.
+   * \retval -L4_EBUSY   The region is in use.
+   *
+   * The region is detached from the VMM later, by reclaim().
+   */
+  long remove_region(L4::Cap<L4::Task> vm_task, Vmm::Guest_addr start,
+                     l4_size_t size, Vm_mem *memmap,
+                     L4Re::Util::Unique_del_cap<L4Re::Dataspace> *ds,
+                     bool force);
+
+  /**
+   * Detach the removed regions that vCPUs cannot access anymore.
+   *
+   * Must be called with _lock held exclusively.
+   */
+  void reclaim(Vm_mem *memmap);
+
   long add_from_dt_node(Vm_mem *memmap, bool *found, Vdev::Dt_node const &node);
   void setup_default_region(Vdev::Host_dt const &dt, Vm_mem *memmap,
                             Vmm::Guest_addr baseaddr);
+  void add_memory_node(Vdev::Host_dt const &dt, Ram_ds const &r);
 
   std::vector<Vmm::Ram_ds> _regions;
+  /// Memory map handlers of the regions, in the same order as `_regions`.
+  std::vector<cxx::Ref_ptr<Ds_handler>> _handlers;
+  /// RAM regions in ascending order of their guest-physical address.
+  std::vector<Vmm::Ram_ds const *> _sorted;
+  /// Memory allocated for restored regions that the configuration lacks.
+  std::vector<L4Re::Util::Unique_del_cap<L4Re::Dataspace>> _extra_ds;
+  /// Hooks filling restored regions.
+  std::vector<std::unique_ptr<Ram_access_hook>> _fills;
+  /// Dataspaces of copy-on-write regions created by map_file_cow().
+  std::vector<L4Re::Util::Unique_cap<L4Re::Dataspace>> _cow_ds;
+  /**
+   * Write logs of the regions, in the same order as `_regions`.
+   *
+   * Logs are kept once created, as vCPUs may still use them when logging
+   * is stopped.
+   */
+  std::vector<std::unique_ptr<Dirty_log>> _dirty_logs;
+
+  /// A region removed from the guest that vCPUs may still access.
+  struct Retired_region
+  {
+    Ram_ds region;
+    cxx::Ref_ptr<Ds_handler> handler;
+    std::unique_ptr<Dirty_log> log;
+    L4Re::Util::Unique_del_cap<L4Re::Dataspace> ds;
+    L4::Cap<L4::Task> vm_task;
+    /// Token of Vm_mem::grace_period() for the removal.
+    l4_umword_t token;
+  };
+
+  /// Removed regions waiting for reclaim().
+  std::vector<Retired_region> _retired;
+  /// Ranges pinned with pin().
+  mutable std::vector<Region> _pins;
+  bool _dirty_log_active = false;
+  /// Devices to inform about RAM added and removed at runtime.
+  std::vector<Ram_listener *> _listeners;
+  /// Incremented whenever the region list changes.
+  unsigned _generation = 0;
+  /// Protects the region list and the lists kept in the same order.
+  mutable Rw_lock _lock;
+  Populate _populate = Populate::Eager;
+  unsigned char _prefault_shift = 0;
   l4_addr_t _boot_offset;
 };
 
+/**
+ * A range of guest RAM pinned with Vm_ram::pin() for the lifetime of the
+ * object.
+ */
+class Ram_pin
+{
+public:
+  Ram_pin() = default;
+  ~Ram_pin() { reset(); }
+
+  Ram_pin(Ram_pin const &) = delete;
+  Ram_pin &operator = (Ram_pin const &) = delete;
+
+  /// Pin a new range, releasing the one pinned before.
+  void set(Vm_ram const *ram, Vmm::Guest_addr addr, l4_size_t size)
+  {
+    reset();
+    ram->pin(addr, size);
+    _ram = ram;
+    _addr = addr;
+    _size = size;
+  }
+
+  void reset()
+  {
+    if (_ram)
+      _ram->unpin(_addr, _size);
+    _ram = nullptr;
+  }
+
+private:
+  Vm_ram const *_ram = nullptr;
+  Vmm::Guest_addr _addr;
+  l4_size_t _size = 0;
+};
+
 }
@@ -5,8 +5,16 @@
  * This file is distributed under the terms of the GNU General Public
  * License, version 2.  Please see the COPYING-GPL-2 file for details.
  */
+#pragma once
+
+#include <mutex>
+
+#include <l4/re/env>
 
 #include "debug.h"
+#include "snapshot.h"
+#include "vcon_output.h"
+#include "vm_ram.h"
 
 namespace Vmm {
 
@@ -42,4 +50,181 @@ private:
   unsigned _early_print_pos;
 };
 
+/**
+ * Paravirtual console channel of a guest.
+ *
+ * The guest registers a ring in its memory with a hypercall and writes its
+ * output there. A doorbell hypercall makes the VMM write everything added
+ * since the last doorbell to the log in bulk, so that output costs one VM
+ * exit per buffer instead of one per character.
+ *
+ * The ring consists of a header with two free-running indices followed by
+ * the data area. The guest advances `head` after writing data, the VMM
+ * advances `tail` after consuming it.
+ */
+class Guest_console_ring
+{
+  struct Header
+  {
+    l4_uint32_t head;
+    l4_uint32_t tail;
+  };
+
+  enum : l4_uint64_t
+  {
+    Max_size = 1 << 20,
+  };
+
+public:
+  Guest_console_ring() : _out(L4Re::Env::env()->log()) {}
+
+  void set_ram(Vm_ram const *ram)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ram = ram;
+    map();
+  }
+
+  /**
+   * Register the ring of the guest.
+   *
+   * \param addr  Guest-physical address of the ring header.
+   * \param size  Size of the data area following the header. Must be a
+   *              power of two. A size of 0 unregisters the ring.
+   *
+   * \retval L4_EOK     The ring was registered.
+   * \retval -L4_EINVAL The ring is not in guest RAM or has an invalid size.
+   */
+  long setup(l4_uint64_t addr, l4_uint64_t size)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _addr = addr;
+    _size = 0;
+    _hdr = nullptr;
+    _pin.reset();
+
+    if (size == 0)
+      return L4_EOK;
+
+    if (size > Max_size || (size & (size - 1)))
+      return -L4_EINVAL;
+
+    _size = size;
+    _tail = 0;
+    if (!map())
+      {
+        _size = 0;
+        return -L4_EINVAL;
+      }
+
+    _hdr->tail = _tail;
+    return L4_EOK;
+  }
+
+  /**
+   * Write the data added to the ring to the log.
+   *
+   * \return Number of bytes written or -L4_EINVAL if no ring is registered
+   *         or the indices of the ring are inconsistent.
+   */
+  long doorbell()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_hdr)
+      return -L4_EINVAL;
+
+    l4_uint32_t head = __atomic_load_n(&_hdr->head, __ATOMIC_ACQUIRE);
+    l4_uint32_t avail = head - _tail;
+    if (avail > _size)
+      {
+        Dbg(Dbg::Guest, Dbg::Warn, "GUEST")
+          .printf("Console ring overrun (head %u, tail %u); data dropped\n",
+                  head, _tail);
+        publish_tail(head);
+        return -L4_EINVAL;
+      }
+
+    char const *data = reinterpret_cast<char const *>(_hdr + 1);
+    l4_uint32_t off = _tail & (_size - 1);
+    l4_uint32_t n = avail < _size - off ? avail : _size - off;
+
+    _out.write(data + off, n);
+    if (avail > n)
+      _out.write(data, avail - n);
+    _out.flush();
+
+    publish_tail(head);
+    return avail;
+  }
+
+  void save_state(Snapshot_writer &w)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    w.put(_addr);
+    w.put(_size);
+    w.put(_tail);
+  }
+
+  void restore_state(Snapshot_reader &r)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    r.get(&_addr);
+    r.get(&_size);
+    r.get(&_tail);
+    // The ring is mapped when the RAM is set.
+    _hdr = nullptr;
+    _pin.reset();
+  }
+
+private:
+  /// Look up the registered ring in guest RAM.
+  bool map()
+  {
+    _hdr = nullptr;
+    _pin.reset();
+    if (!_ram || !_size)
+      return false;
+
+    l4_size_t len = sizeof(Header) + _size;
+    // Pinned before the lookup, so that the RAM cannot go meanwhile.
+    _pin.set(_ram, Guest_addr(_addr), len);
+    if (!_ram->is_ram(Guest_addr(_addr), len))
+      {
+        _pin.reset();
+        return false;
+      }
+
+    try
+      {
+        _hdr = _ram->guest2host<Header *>(Region::ss(Guest_addr(_addr), len));
+      }
+    catch (L4::Runtime_error const &)
+      {
+        // The ring spans several RAM regions.
+        _pin.reset();
+        return false;
+      }
+
+    return true;
+  }
+
+  void publish_tail(l4_uint32_t tail)
+  {
+    _tail = tail;
+    __atomic_store_n(&_hdr->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  std::mutex _mutex;
+  Vdev::Vcon_output _out;
+  Vm_ram const *_ram = nullptr;
+  Header *_hdr = nullptr;
+  /// Keeps the RAM of the ring plugged while it is registered.
+  Ram_pin _pin;
+  l4_uint64_t _addr = 0;
+  l4_uint64_t _size = 0;
+  l4_uint32_t _tail = 0;
+};
+
 } // namespace